@@ -0,0 +1,85 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+
+// Heap allocation counters, fed by the replacement operator new in main.cpp.
+// The render loops are expected to leave them alone once warmed up.
+struct AllocCounters
+{
+    long long allocations;
+    long long bytes;
+};
+
+inline AllocCounters& threadAllocCounters()
+{
+    static thread_local AllocCounters counters = { 0, 0 };
+    return counters;
+}
+
+inline std::atomic<long long>& totalAllocations()
+{
+    static std::atomic<long long> count(0);
+    return count;
+}
+
+inline void countAllocation(size_t bytes)
+{
+    AllocCounters& counters = threadAllocCounters();
+    counters.allocations++;
+    counters.bytes += bytes;
+    totalAllocations()++;
+}
+
+// Bump allocator for per-frame scratch memory. Everything allocated from it is
+// released at once by resetArena at the end of the frame. Requests that do not fit
+// take a heap block of their own, and the next reset grows the arena to the peak
+// so that the following frames fit.
+struct FrameArena
+{
+    std::vector<char> block;
+    std::vector<std::vector<char> > overflow;
+    size_t used;
+    size_t peak;             // Most bytes a single frame asked for
+    int overflows;           // Requests that did not fit, over the arena's lifetime
+
+    FrameArena() : used(0), peak(0), overflows(0) {}
+};
+
+static const size_t ARENA_ALIGNMENT = 16;
+
+inline void *arenaAlloc(FrameArena& arena, size_t bytes)
+{
+    bytes = (bytes + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    arena.used += bytes;
+    arena.peak = std::max(arena.peak, arena.used);
+    if(arena.used <= arena.block.size())
+        return &arena.block[arena.used - bytes];
+
+    arena.overflows++;
+    arena.overflow.push_back(std::vector<char>(bytes));
+    return &arena.overflow.back()[0];
+}
+
+// Uninitialized storage for n objects of a trivially constructible type
+template<typename T>
+inline T *arenaArray(FrameArena& arena, size_t n)
+{
+    return (T *)arenaAlloc(arena, n * sizeof(T));
+}
+
+inline void resetArena(FrameArena& arena)
+{
+    if(!arena.overflow.empty())
+    {
+        arena.overflow.clear();
+        arena.block.resize(arena.peak);
+    }
+    arena.used = 0;
+}
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "denoise.h"
+#include "framecache.h"
+#include "image.h"
+#include "raster.h"
+#include "scene.h"
+#include "tracer.h"
+
+// Headless render of frames firstFrame to lastFrame of the animation into numbered PPMs.
+// Every frame depends only on its index and the frames before it in the run, so the
+// output does not depend on the thread count. Frames found in the frame cache are read
+// back and only denoised. Temporal renders go one frame at a time and copy the pixels the
+// moving spheres leave alone from the frames before, which gives the same images. So do
+// irradiance cache renders, which keep the records of the frames before and only drop
+// those near the moving sphere.
+struct AnimationParams
+{
+    int firstFrame;
+    int lastFrame;
+    const char *pattern;     // printf pattern taking the frame index, like frame%04d.ppm, NULL to write none
+    int numThreads;
+    int denoiseIterations;
+    bool hybrid;             // Rasterize the primary hits, see raster.h
+    bool tileLists;          // Test primary rays against per screen tile object lists
+    int bounceFactor;        // Trace the bounce light at 1 / bounceFactor of the resolution, 1 for full
+    int bounceMaterials;     // Material types traced at low resolution, see BounceBuffer
+    bool pinThreads;         // Pin the threads of each slot to cores of their own
+    TreeletCache *treelets;  // Particles of ACCEL_STREAM, shared by the slots, NULL otherwise
+    float irradianceError;   // Error tolerance of the irradiance cache, 0 for the flat ambient term
+    int shadowMapSize;       // Face size of the static shadow maps, 0 to trace every shadow ray
+    FrameCache *frameCache;  // Finished frames by content, NULL to trace every frame
+    FrameCacheSettings frameCacheSettings;
+    bool temporal;           // Trace only the pixels the moving spheres change, see temporal.h
+    bool inOrder;            // Render the frames one at a time, as temporal and irradiance cache frames are
+};
+
+// Frames 0 to 0 of the plain tracer on every core, kept in memory only
+inline AnimationParams defaultAnimationParams()
+{
+    AnimationParams params;
+    params.firstFrame = 0;
+    params.lastFrame = 0;
+    params.pattern = NULL;
+    params.numThreads = std::max(1u, std::thread::hardware_concurrency());
+    params.denoiseIterations = 0;
+    params.hybrid = false;
+    params.tileLists = false;
+    params.bounceFactor = 1;
+    params.bounceMaterials = BOUNCE_DEFAULT_MATERIALS;
+    params.pinThreads = false;
+    params.treelets = NULL;
+    params.irradianceError = 0.0f;
+    params.shadowMapSize = 0;
+    params.frameCache = NULL;
+    params.frameCacheSettings = FrameCacheSettings();
+    params.temporal = false;
+    params.inOrder = false;
+    return params;
+}
+
+// How the threads are split between frames in flight and tiles within a frame. Whole
+// frames in parallel scale best, so a frame only gets several threads when there are
+// fewer frames than threads.
+struct AnimationSplit
+{
+    int concurrentFrames;
+    std::vector<int> threadsPerSlot;
+};
+
+inline AnimationSplit chooseAnimationSplit(int numFrames, int numThreads)
+{
+    AnimationSplit split;
+    numThreads = std::max(1, numThreads);
+    split.concurrentFrames = std::max(1, std::min(numFrames, numThreads));
+    for(int i = 0; i < split.concurrentFrames; i++)
+        split.threadsPerSlot.push_back(numThreads / split.concurrentFrames + (i < numThreads % split.concurrentFrames ? 1 : 0));
+    return split;
+}
+
+inline bool renderAnimation(const Scene& scene, const AnimationParams& params)
+{
+    typedef std::chrono::steady_clock Clock;
+    int numFrames = params.lastFrame - params.firstFrame + 1;
+    // Temporal and irradiance cache frames build on the one before, so they are rendered in order
+    bool inOrder = params.inOrder || params.temporal || params.irradianceError > 0.0f;
+    AnimationSplit split = chooseAnimationSplit(inOrder ? 1 : numFrames, params.numThreads);
+    printf("Rendering frames %d to %d, %d at a time with %d to %d threads each\n",
+           params.firstFrame, params.lastFrame, split.concurrentFrames,
+           split.threadsPerSlot.back(), split.threadsPerSlot.front());
+
+    // The particles do not move, so every frame reuses these acceleration structures
+    Clock::time_point start = Clock::now();
+    Tracer base;
+    initTracer(base, scene, params.numThreads);
+    base.treelets = params.treelets;
+
+    std::atomic<int> nextFrame(params.firstFrame);
+    std::atomic<bool> ok(true);
+    std::atomic<long long> steadyAllocations(0);
+    std::vector<std::thread> slots;
+    for(int slot = 0, firstCore = 0; slot < split.concurrentFrames; slot++)
+    {
+        int numThreads = split.threadsPerSlot[slot];
+        int slotCore = params.pinThreads ? firstCore : -1;
+        firstCore += numThreads;
+        slots.push_back(std::thread([&, numThreads, slotCore]()
+        {
+            Image img(IMAGE_WIDTH, IMAGE_HEIGHT);
+            GBuffer gbuffer;
+            if(params.denoiseIterations > 0)
+                gbuffer = GBuffer(IMAGE_WIDTH, IMAGE_HEIGHT);
+            DenoiseParams denoise = defaultDenoiseParams();
+            denoise.iterations = params.denoiseIterations;
+            FrameArena arena;
+            HitBuffer primaryHits;
+            ScreenTiles screenTiles;
+            BounceBuffer bounces;
+            IrradianceCache irradiance;
+            std::vector<Sphere> previousSpheres;
+            ShadowMaps shadows;
+            TemporalHistory history;
+            MotionBounds motion;
+
+            // Copied once per slot, a frame only rewrites the sphere array in place
+            Scene frameScene = scene;
+            Tracer tracer = base;
+            tracer.scene = &frameScene;
+            TilePool pool(numThreads, slotCore);
+            tracer.pool = &pool;
+            if(params.hybrid || tracer.treelets)
+            {
+                primaryHits = HitBuffer(IMAGE_WIDTH, IMAGE_HEIGHT);
+                tracer.primaryHits = &primaryHits;
+            }
+            if(params.tileLists)
+                tracer.screenTiles = &screenTiles;
+            if(params.bounceFactor > 1)
+            {
+                bounces = BounceBuffer(IMAGE_WIDTH, IMAGE_HEIGHT, params.bounceFactor, params.bounceMaterials);
+                tracer.bounces = &bounces;
+            }
+            if(params.irradianceError > 0.0f)
+            {
+                irradiance.error = params.irradianceError;
+                tracer.irradiance = &irradiance;
+            }
+            if(params.shadowMapSize > 0)
+            {
+                shadows.size = params.shadowMapSize;
+                tracer.shadows = &shadows;
+            }
+            if(params.temporal)
+                tracer.motion = &motion;
+            bool warm = false;
+
+            for(int frame = nextFrame++; frame <= params.lastFrame && ok; frame = nextFrame++)
+            {
+                Clock::time_point frameStart = Clock::now();
+                frameScene.spheres = scene.spheres;
+                animateScene(frameScene, frame);
+
+                GBuffer *frameGBuffer = params.denoiseIterations > 0 ? &gbuffer : NULL;
+                uint64_t frameKey = 0;
+                bool cached = false;
+                long long reused = -1;
+                if(params.frameCache)
+                {
+                    frameKey = frameCacheKey(frameScene, params.frameCacheSettings);
+                    cached = lookupFrame(*params.frameCache, frameKey, img, frameGBuffer);
+                }
+                // Allocations of the render and the denoiser, on this thread and the pool's.
+                // The frame cache and the file output go to disk anyway and are left out,
+                // as are irradiance records past the most the cache has held.
+                long long poolAllocations = pool.allocations;
+                long long allocations = threadAllocCounters().allocations;
+                long long frameAllocations = 0;
+                if(!cached)
+                {
+                    TraceStats stats;
+                    // Only dynamic spheres move, so the maps are cast on the slot's first frame
+                    if(tracer.shadows)
+                        updateShadowMaps(tracer, shadows, numThreads);
+                    if(params.hybrid)
+                        rasterizePrimaryHits(tracer, primaryHits, numThreads);
+                    else if(tracer.treelets)
+                        streamPrimaryHits(tracer, primaryHits, numThreads, &stats);
+                    else if(params.tileLists)
+                        buildScreenTiles(screenTiles, frameScene, IMAGE_WIDTH, IMAGE_HEIGHT, SCREEN_TILE_SIZE);
+                    if(tracer.irradiance)
+                    {
+                        if(!previousSpheres.empty())
+                            invalidateIrradiance(irradiance, previousSpheres, frameScene.spheres);
+                        fillIrradianceCache(tracer, irradiance, IMAGE_WIDTH, IMAGE_HEIGHT, numThreads, &stats);
+                        previousSpheres = frameScene.spheres;
+                    }
+                    if(params.bounceFactor > 1)
+                        renderBounces(tracer, bounces, IMAGE_WIDTH, IMAGE_HEIGHT, numThreads, &stats);
+                    if(params.temporal)
+                    {
+                        updateMotionBounds(motion, scene.spheres, frame);
+                        renderTemporal(tracer, history, frame, img, numThreads, frameGBuffer != NULL, &stats);
+                        if(frameGBuffer)
+                            frameGBuffer = &history.gbuffer;
+                        reused = stats.pixelsReused;
+                    }else
+                        renderImage(tracer, img, numThreads, frameGBuffer, &stats);
+                    frameAllocations += threadAllocCounters().allocations - allocations;
+                    if(params.frameCache)
+                        storeFrame(*params.frameCache, frameKey, img, frameGBuffer);
+                    allocations = threadAllocCounters().allocations;
+                }else
+                    history.valid = false;
+                if(params.denoiseIterations > 0)
+                    denoiseAtrous(img, *frameGBuffer, denoise, numThreads, &arena, &pool);
+                resetArena(arena);
+                frameAllocations += threadAllocCounters().allocations - allocations + pool.allocations - poolAllocations;
+                if(tracer.irradiance && !cached)
+                    frameAllocations -= irradiance.stats.allocations;
+                // A slot's first rendered frame sizes its buffers
+                if(warm)
+                    steadyAllocations += frameAllocations;
+                warm = warm || !cached;
+
+                if(params.pattern)
+                {
+                    char path[1024];
+                    snprintf(path, sizeof(path), params.pattern, frame);
+                    if(!writePPM(path, img))
+                        ok = false;
+                }
+                printf("Frame %d: %.2f ms, %lld heap allocations%s", frame,
+                       std::chrono::duration<double, std::milli>(Clock::now() - frameStart).count(),
+                       frameAllocations, cached ? ", from the frame cache" : "");
+                if(reused >= 0)
+                    printf(", %.1f%% of the pixels traced", 100.0 * (1.0 - (double)reused / (img.width * img.height)));
+                printf("\n");
+                if(tracer.irradiance)
+                    printIrradianceCacheStats(irradiance);
+                if(tracer.shadows)
+                    printShadowMapStats(shadows);
+            }
+        }));
+    }
+    for(size_t i = 0; i < slots.size(); i++)
+        slots[i].join();
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    printf("%d frames in %.2f s, %.2f frames/s\n", numFrames, seconds, numFrames / seconds);
+
+    // Past the first frame of each slot, rendering and denoising must not allocate
+    if(steadyAllocations > 0)
+    {
+        fprintf(stderr, "%lld heap allocations in the render loops after warm-up\n", (long long)steadyAllocations);
+        return false;
+    }
+    return ok;
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <vector>
+#include "ray.h"
+
+struct BVHNode
+{
+    Vec3 bmin;
+    Vec3 bmax;
+    int first;               // Leaf: first entry in BVH::indices. Interior: index of the right child, the left child follows the node
+    int count;               // Number of spheres in a leaf, 0 for interior nodes
+};
+
+// Bounding volume hierarchy over equal-radius spheres, split at the median of the longest axis
+struct BVH
+{
+    std::vector<BVHNode> nodes;
+    std::vector<int> indices;
+};
+
+static const int BVH_LEAF_SIZE = 4;
+static const int BVH_MAX_DEPTH = 64;
+
+inline int buildBVHNode(BVH& bvh, const std::vector<Vec3>& centers, float radius, int begin, int end, int depth)
+{
+    int nodeIndex = (int)bvh.nodes.size();
+    bvh.nodes.push_back(BVHNode());
+
+    Vec3 bmin = centers[bvh.indices[begin]];
+    Vec3 bmax = bmin;
+    for(int k = begin + 1; k < end; k++)
+    {
+        const Vec3& c = centers[bvh.indices[k]];
+        for(int j = 0; j < 3; j++)
+        {
+            bmin[j] = std::min(bmin[j], c[j]);
+            bmax[j] = std::max(bmax[j], c[j]);
+        }
+    }
+    Vec3 extent = bmax - bmin;
+    bvh.nodes[nodeIndex].bmin = bmin - Vec3(radius);
+    bvh.nodes[nodeIndex].bmax = bmax + Vec3(radius);
+
+    if(end - begin <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1)
+    {
+        bvh.nodes[nodeIndex].first = begin;
+        bvh.nodes[nodeIndex].count = end - begin;
+        return nodeIndex;
+    }
+
+    int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+    int mid = (begin + end) / 2;
+    std::nth_element(bvh.indices.begin() + begin, bvh.indices.begin() + mid, bvh.indices.begin() + end,
+                     [&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+
+    buildBVHNode(bvh, centers, radius, begin, mid, depth + 1);
+    int right = buildBVHNode(bvh, centers, radius, mid, end, depth + 1);
+    bvh.nodes[nodeIndex].first = right;
+    bvh.nodes[nodeIndex].count = 0;
+    return nodeIndex;
+}
+
+inline void buildBVH(BVH& bvh, const std::vector<Vec3>& centers, float radius)
+{
+    bvh.nodes.clear();
+    bvh.indices.resize(centers.size());
+    for(size_t i = 0; i < centers.size(); i++)
+        bvh.indices[i] = (int)i;
+
+    if(!centers.empty())
+    {
+        // Median splits stop at BVH_LEAF_SIZE, so every leaf holds at least two spheres
+        // and n spheres need at most n - 1 nodes. The build never reallocates.
+        bvh.nodes.reserve(std::max<size_t>(1, centers.size() - 1));
+        buildBVHNode(bvh, centers, radius, 0, (int)centers.size(), 0);
+    }
+}
+
+// Traverses the tree of nodes[0] for the closest sphere hit before tHit, updating tHit and
+// index. Leaves hold entries of indices, or of centers directly if indices is NULL, as in the
+// treelets of stream.h. With anyHit set it stops at the first hit. The nodes visited and
+// spheres tested are added to cost if given.
+inline bool bvhTraverse(const BVHNode *nodes, const int *indices, const Vec3 *centers, float radius,
+                        const Ray& r, const Vec3& invDir, bool anyHit, float& tHit, int& index, TraversalCost *cost = NULL)
+{
+    int stack[BVH_MAX_DEPTH];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    bool found = false;
+    while(stackSize > 0)
+    {
+        int nodeIndex = stack[--stackSize];
+        const BVHNode& node = nodes[nodeIndex];
+        if(cost)
+            cost->nodeVisits++;
+        float t0 = MIN_T;
+        float t1 = tHit;
+        if(!clipRayToBox(r, invDir, node.bmin, node.bmax, t0, t1))
+            continue;
+
+        if(node.count > 0)
+        {
+            for(int k = node.first; k < node.first + node.count; k++)
+            {
+                int i = indices ? indices[k] : k;
+                if(cost)
+                    cost->primitiveTests++;
+                float t = sphereHitT(centers[i], radius, r);
+                if(t < tHit)
+                {
+                    tHit = t;
+                    index = i;
+                    found = true;
+                    if(anyHit)
+                        return true;
+                }
+            }
+        }else
+        {
+            stack[stackSize++] = node.first;
+            stack[stackSize++] = nodeIndex + 1;
+        }
+    }
+    return found;
+}
+
+// Returns the closest sphere hit before tMax. With anyHit set it stops at the first hit.
+// The nodes visited and spheres tested are added to cost if given.
+inline bool bvhIntersect(const BVH& bvh, const std::vector<Vec3>& centers, float radius,
+                         const Ray& r, float tMax, bool anyHit, float& tHit, int& index, TraversalCost *cost = NULL)
+{
+    tHit = tMax;
+    index = -1;
+    if(bvh.nodes.empty())
+        return false;
+    return bvhTraverse(&bvh.nodes[0], &bvh.indices[0], &centers[0], radius, r, safeInverse(r.direction),
+                       anyHit, tHit, index, cost);
+}
+
+#endif
@@ -0,0 +1,405 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "bvh.h"
+#include "scene.h"
+
+// Compact encodings of a scene for the bandwidth bound loops. Objects already share
+// materials by ID, see buildMaterialTable; the table itself packs to 12 bytes an entry:
+// the color in RGB9E5, the coefficients in unorm8 and the index of refraction in half
+// floats. Particle centers are 16 bit fixed point in a frame spanning the cloud, which
+// the scene is snapped to so that every tracer and accelerator sees the same spheres.
+// The CPU BVH stores each node's children in one node, their boxes in 8 bits relative
+// to the parent's box, and the particle centers of its leaves in leaf order. Decoding
+// mirrors unpackMaterial and particleCenter in basicFragSrc.
+
+static const int COMPACT_CENTER_MAX = 65535;
+static const int COMPACT_BOX_MAX = 255;
+
+struct PackedMaterial
+{
+    uint32_t color;          // RGB9E5
+    uint32_t coefficients;   // ka, kd, ks, kt as unorm8, ka in the low byte
+    uint32_t iorType;        // ior as a half float in the low 16 bits, matType above
+};
+
+inline uint16_t packHalf(float f)
+{
+    uint16_t sign = f < 0.0f ? 0x8000 : 0;
+    f = std::min(fabsf(f), 65504.0f);
+    int e;
+    float m = frexpf(f, &e);             // f = m * 2^e with m in [0.5, 1)
+    if(f == 0.0f || e < -13)
+        return sign | (uint16_t)lrintf(ldexpf(f, 24));
+    int mantissa = (int)lrintf(ldexpf(m, 11));
+    if(mantissa == 2048)
+    {
+        mantissa = 1024;
+        e++;
+    }
+    if(e + 14 > 30)
+        return sign | 0x7bff;
+    return sign | (uint16_t)((e + 14) << 10 | (mantissa - 1024));
+}
+
+inline float unpackHalf(uint16_t h)
+{
+    float m = (float)(h & 0x3ff);
+    int e = h >> 10 & 0x1f;
+    float v = e == 0 ? ldexpf(m, -24) : ldexpf(m + 1024.0f, e - 25);
+    return h & 0x8000 ? -v : v;
+}
+
+// Three 9 bit mantissas sharing a 5 bit exponent, as in EXT_texture_shared_exponent
+inline uint32_t packRGB9E5(const Vec3& color)
+{
+    const float maxValue = 511.0f / 512.0f * 65536.0f;
+    float c[3];
+    for(int i = 0; i < 3; i++)
+        c[i] = std::max(0.0f, std::min(color[i], maxValue));
+    float maxc = std::max(c[0], std::max(c[1], c[2]));
+    int e;
+    frexpf(maxc, &e);
+    int exponent = std::max(-15, e) + 15;
+    float denom = ldexpf(1.0f, exponent - 24);
+    if(floorf(maxc / denom + 0.5f) == 512.0f)
+    {
+        exponent++;
+        denom *= 2.0f;
+    }
+    uint32_t packed = (uint32_t)exponent << 27;
+    for(int i = 0; i < 3; i++)
+        packed |= (uint32_t)floorf(c[i] / denom + 0.5f) << (9 * i);
+    return packed;
+}
+
+inline Vec3 unpackRGB9E5(uint32_t packed)
+{
+    float scale = ldexpf(1.0f, (int)(packed >> 27) - 24);
+    return Vec3((float)(packed & 0x1ff), (float)(packed >> 9 & 0x1ff), (float)(packed >> 18 & 0x1ff)) * scale;
+}
+
+inline uint32_t packUnorm8(float v)
+{
+    return (uint32_t)lrintf(std::max(0.0f, std::min(v, 1.0f)) * 255.0f);
+}
+
+inline float unpackUnorm8(uint32_t v)
+{
+    return (float)(v & 0xff) * (1.0f / 255.0f);
+}
+
+// Coefficients above 1 are clamped, none of the scenes use them
+inline PackedMaterial packMaterial(const Material& mat)
+{
+    PackedMaterial p;
+    p.color = packRGB9E5(mat.color);
+    p.coefficients = packUnorm8(mat.ka) | packUnorm8(mat.kd) << 8 | packUnorm8(mat.ks) << 16 | packUnorm8(mat.kt) << 24;
+    p.iorType = packHalf(mat.ior) | (uint32_t)mat.matType << 16;
+    return p;
+}
+
+inline Material unpackMaterial(const PackedMaterial& p)
+{
+    Material mat;
+    mat.ka = unpackUnorm8(p.coefficients);
+    mat.kd = unpackUnorm8(p.coefficients >> 8);
+    mat.ks = unpackUnorm8(p.coefficients >> 16);
+    mat.kt = unpackUnorm8(p.coefficients >> 24);
+    mat.ior = unpackHalf((uint16_t)(p.iorType & 0xffff));
+    mat.color = unpackRGB9E5(p.color);
+    mat.matType = (int)(p.iorType >> 16);
+    return mat;
+}
+
+inline void packMaterialTable(const std::vector<Material>& materials, std::vector<PackedMaterial>& packed)
+{
+    packed.resize(materials.size());
+    for(size_t i = 0; i < materials.size(); i++)
+        packed[i] = packMaterial(materials[i]);
+}
+
+inline uint16_t packParticleCoordinate(const Scene& scene, float v, int axis)
+{
+    if(scene.particleStep[axis] <= 0.0f)
+        return 0;
+    long q = lrintf((v - scene.particleOrigin[axis]) / scene.particleStep[axis]);
+    return (uint16_t)std::max(0L, std::min(q, (long)COMPACT_CENTER_MAX));
+}
+
+inline float unpackParticleCoordinate(const Scene& scene, uint16_t q, int axis)
+{
+    return scene.particleOrigin[axis] + scene.particleStep[axis] * (float)q;
+}
+
+// Marks scene compact and snaps its particles to the 16 bit frame over their bounds
+inline void compactScene(Scene& scene)
+{
+    scene.compact = true;
+    if(scene.particles.empty())
+        return;
+    Vec3 bmin = scene.particles[0];
+    Vec3 bmax = bmin;
+    for(size_t i = 1; i < scene.particles.size(); i++)
+    {
+        for(int j = 0; j < 3; j++)
+        {
+            bmin[j] = std::min(bmin[j], scene.particles[i][j]);
+            bmax[j] = std::max(bmax[j], scene.particles[i][j]);
+        }
+    }
+    scene.particleOrigin = bmin;
+    scene.particleStep = (bmax - bmin) * (1.0f / COMPACT_CENTER_MAX);
+    for(size_t i = 0; i < scene.particles.size(); i++)
+    {
+        for(int j = 0; j < 3; j++)
+            scene.particles[i][j] = unpackParticleCoordinate(scene, packParticleCoordinate(scene, scene.particles[i][j], j), j);
+    }
+}
+
+// Two children per node, each a node or a leaf. A leaf child covers count entries of
+// CompactBVH::centers starting at child.
+struct QuantizedBVHNode
+{
+    uint8_t lo[2][3];        // Child boxes in 255ths of this node's box, rounded outward
+    uint8_t hi[2][3];
+    uint8_t count[2];        // Particles of a leaf child, 0 for a node
+    int32_t child[2];        // Node index or first center, -1 for no child
+};
+
+struct CompactBVH
+{
+    std::vector<QuantizedBVHNode> nodes;
+    std::vector<uint16_t> centers;       // Three coordinates per particle, in leaf order
+    std::vector<int> indices;            // Scene particle of each center
+    Vec3 bmin, bmax;                     // Box of nodes[0]
+    Vec3 origin, step;                   // The particle frame of the scene
+};
+
+// The box decoding and child framing the traversal uses, so that the encoder rounds
+// against exactly the values it will see
+inline float dequantizeBound(float lo, float step, int q)
+{
+    return lo + step * (float)q;
+}
+
+inline Vec3 boxStep(const Vec3& lo, const Vec3& hi)
+{
+    return (hi - lo) * (1.0f / COMPACT_BOX_MAX);
+}
+
+inline uint8_t quantizeLower(float v, float lo, float step)
+{
+    if(step <= 0.0f)
+        return 0;
+    int q = std::max(0, std::min((int)floorf((v - lo) / step), COMPACT_BOX_MAX));
+    while(q > 0 && dequantizeBound(lo, step, q) > v)
+        q--;
+    return (uint8_t)q;
+}
+
+inline uint8_t quantizeUpper(float v, float lo, float step)
+{
+    if(step <= 0.0f)
+        return 0;
+    int q = std::max(0, std::min((int)ceilf((v - lo) / step), COMPACT_BOX_MAX));
+    while(q < COMPACT_BOX_MAX && dequantizeBound(lo, step, q) < v)
+        q++;
+    return (uint8_t)q;
+}
+
+// Encodes the children of interior node n of bvh into a new node whose box starts at lo
+// and has the given step. Returns the index of the new node.
+inline int compactBVHNode(CompactBVH& out, const BVH& bvh, const std::vector<Vec3>& particles, int n,
+                          const Vec3& lo, const Vec3& step)
+{
+    int index = (int)out.nodes.size();
+    out.nodes.push_back(QuantizedBVHNode());
+    const BVHNode& node = bvh.nodes[n];
+    int children[2] = { n + 1, node.first };
+    bool leafRoot = node.count > 0;
+    for(int c = 0; c < 2; c++)
+    {
+        // A root that is a leaf becomes the only child of a node spanning it
+        if(leafRoot && c == 1)
+        {
+            out.nodes[index].child[c] = -1;
+            out.nodes[index].count[c] = 0;
+            continue;
+        }
+        const BVHNode& child = leafRoot ? node : bvh.nodes[children[c]];
+        Vec3 clo, chi;
+        for(int j = 0; j < 3; j++)
+        {
+            uint8_t qlo = quantizeLower(child.bmin[j], lo[j], step[j]);
+            uint8_t qhi = quantizeUpper(child.bmax[j], lo[j], step[j]);
+            out.nodes[index].lo[c][j] = qlo;
+            out.nodes[index].hi[c][j] = qhi;
+            clo[j] = dequantizeBound(lo[j], step[j], qlo);
+            chi[j] = dequantizeBound(lo[j], step[j], qhi);
+        }
+
+        int ref;
+        if(child.count > 0)
+        {
+            // Median splits keep leaves at BVH_LEAF_SIZE, far below the 8 bit count
+            ref = (int)out.indices.size();
+            for(int k = child.first; k < child.first + child.count; k++)
+            {
+                int i = bvh.indices[k];
+                out.indices.push_back(i);
+                for(int j = 0; j < 3; j++)
+                {
+                    float q = out.step[j] > 0.0f ? (particles[i][j] - out.origin[j]) / out.step[j] : 0.0f;
+                    out.centers.push_back((uint16_t)std::max(0L, std::min(lrintf(q), (long)COMPACT_CENTER_MAX)));
+                }
+            }
+            out.nodes[index].count[c] = (uint8_t)child.count;
+        }else
+        {
+            // The recursion grows nodes, so the reference is only written back after it
+            ref = compactBVHNode(out, bvh, particles, children[c], clo, boxStep(clo, chi));
+            out.nodes[index].count[c] = 0;
+        }
+        out.nodes[index].child[c] = ref;
+    }
+    return index;
+}
+
+// Compacts bvh, built over the snapped particles of a compact scene
+inline void buildCompactBVH(CompactBVH& out, const BVH& bvh, const Scene& scene)
+{
+    out.nodes.clear();
+    out.centers.clear();
+    out.indices.clear();
+    out.origin = scene.particleOrigin;
+    out.step = scene.particleStep;
+    if(bvh.nodes.empty())
+        return;
+    out.bmin = bvh.nodes[0].bmin;
+    out.bmax = bvh.nodes[0].bmax;
+    out.nodes.reserve(bvh.nodes.size() / 2 + 1);
+    out.centers.reserve(3 * scene.particles.size());
+    out.indices.reserve(scene.particles.size());
+    compactBVHNode(out, bvh, scene.particles, 0, out.bmin, boxStep(out.bmin, out.bmax));
+}
+
+inline Vec3 compactCenter(const CompactBVH& bvh, int entry)
+{
+    const uint16_t *q = &bvh.centers[3 * entry];
+    return Vec3(bvh.origin[0] + bvh.step[0] * (float)q[0], bvh.origin[1] + bvh.step[1] * (float)q[1],
+                bvh.origin[2] + bvh.step[2] * (float)q[2]);
+}
+
+// bvhIntersect over a compact BVH. Each stack entry carries the frame its node's children
+// are quantized in, already put in ray distance: a bound q along axis j is hit at
+// base[j] + scale[j] * q, one multiply-add instead of a decode and a slab test. Child
+// boxes are tested before they are pushed and the nearer child is visited first.
+inline bool compactBVHIntersect(const CompactBVH& bvh, float radius, const Ray& r, float tMax, bool anyHit,
+                                float& tHit, int& index, TraversalCost *cost = NULL)
+{
+    tHit = tMax;
+    index = -1;
+    if(bvh.nodes.empty())
+        return false;
+    Vec3 invDir = safeInverse(r.direction);
+    float t0 = MIN_T;
+    float t1 = tHit;
+    if(cost)
+        cost->nodeVisits++;
+    if(!clipRayToBox(r, invDir, bvh.bmin, bvh.bmax, t0, t1))
+        return false;
+
+    struct Entry
+    {
+        int node;
+        float tNear;         // Where the ray enters the node's box
+        Vec3 base;
+        Vec3 scale;
+    };
+    Entry stack[BVH_MAX_DEPTH];
+    int stackSize = 0;
+    stack[stackSize].node = 0;
+    stack[stackSize].tNear = t0;
+    stack[stackSize].base = mult(bvh.bmin - r.origin, invDir);
+    stack[stackSize].scale = mult(boxStep(bvh.bmin, bvh.bmax), invDir);
+    stackSize++;
+
+    bool found = false;
+    while(stackSize > 0)
+    {
+        Entry e = stack[--stackSize];
+        if(e.tNear > tHit)
+            continue;
+        const QuantizedBVHNode& node = bvh.nodes[e.node];
+        Vec3 tLo[2], tHi[2];
+        float tNear[2];
+        bool hit[2];
+        for(int c = 0; c < 2; c++)
+        {
+            hit[c] = false;
+            if(node.child[c] < 0)
+                continue;
+            if(cost)
+                cost->nodeVisits++;
+            float tn = MIN_T;
+            float tf = tHit;
+            for(int j = 0; j < 3; j++)
+            {
+                tLo[c][j] = e.base[j] + e.scale[j] * (float)node.lo[c][j];
+                tHi[c][j] = e.base[j] + e.scale[j] * (float)node.hi[c][j];
+                tn = std::max(tn, std::min(tLo[c][j], tHi[c][j]));
+                tf = std::min(tf, std::max(tLo[c][j], tHi[c][j]));
+            }
+            tNear[c] = tn;
+            hit[c] = tn <= tf;
+        }
+
+        int first = hit[0] && hit[1] && tNear[1] < tNear[0] ? 1 : 0;
+        // Leaves are tested right away, nearer first; nodes are pushed farther first
+        for(int k = 0; k < 2; k++)
+        {
+            int c = k == 0 ? first : 1 - first;
+            if(!hit[c] || node.count[c] == 0)
+                continue;
+            for(int entry = node.child[c]; entry < node.child[c] + node.count[c]; entry++)
+            {
+                if(cost)
+                    cost->primitiveTests++;
+                float t = sphereHitT(compactCenter(bvh, entry), radius, r);
+                if(t < tHit)
+                {
+                    tHit = t;
+                    index = bvh.indices[entry];
+                    found = true;
+                    if(anyHit)
+                        return true;
+                }
+            }
+        }
+        for(int k = 0; k < 2; k++)
+        {
+            int c = k == 0 ? 1 - first : first;
+            if(!hit[c] || node.count[c] > 0 || tNear[c] > tHit)
+                continue;
+            stack[stackSize].node = node.child[c];
+            stack[stackSize].tNear = tNear[c];
+            stack[stackSize].base = tLo[c];
+            stack[stackSize].scale = (tHi[c] - tLo[c]) * (1.0f / COMPACT_BOX_MAX);
+            stackSize++;
+        }
+    }
+    return found;
+}
+
+inline size_t compactBVHBytes(const CompactBVH& bvh)
+{
+    return bvh.nodes.size() * sizeof(QuantizedBVHNode) + bvh.centers.size() * sizeof(uint16_t) +
+           bvh.indices.size() * sizeof(int);
+}
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <math.h>
+#include <memory>
+#include <vector>
+#include "alloc.h"
+#include "image.h"
+#include "scheduler.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Each iteration applies
+// a 5x5 B3 spline kernel with holes of 2^i pixels, weighted down across color, normal,
+// depth and albedo edges. atrousFragSrc in shaders.h implements the same filter.
+struct DenoiseParams
+{
+    int iterations;
+    float sigmaColor;        // Halved every iteration
+    float sigmaNormal;
+    float sigmaDepth;        // Relative to the depth of the center pixel
+    float sigmaAlbedo;
+};
+
+inline DenoiseParams defaultDenoiseParams()
+{
+    DenoiseParams params;
+    params.iterations = 5;
+    params.sigmaColor = 0.6f;
+    params.sigmaNormal = 0.3f;
+    params.sigmaDepth = 0.05f;
+    params.sigmaAlbedo = 0.1f;
+    return params;
+}
+
+static const float ATROUS_KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// Everything one pass reads. Color is planar like the G-buffer.
+struct AtrousPass
+{
+    const GBuffer *gbuffer;
+    const float *src[3];
+    float *dst[3];
+    int stepWidth;
+    float invSigmaColor2;
+    float invSigmaNormal2;
+    float invSigmaDepth;
+    float invSigmaAlbedo2;
+};
+
+// Exponent of the edge-stopping weight between pixels p and q
+inline float atrousExponent(const AtrousPass& pass, int p, int q)
+{
+    const GBuffer& g = *pass.gbuffer;
+    float dc = 0.0f, dn = 0.0f, da = 0.0f;
+    for(int j = 0; j < 3; j++)
+    {
+        float c = pass.src[j][p] - pass.src[j][q];
+        float n = g.normal[j][p] - g.normal[j][q];
+        float a = g.albedo[j][p] - g.albedo[j][q];
+        dc += c * c;
+        dn += n * n;
+        da += a * a;
+    }
+    float dz = fabsf(g.depth[p] - g.depth[q]) / std::max(g.depth[p], 1e-3f);
+    return dc * pass.invSigmaColor2 + dn * pass.invSigmaNormal2 + dz * pass.invSigmaDepth + da * pass.invSigmaAlbedo2;
+}
+
+inline void atrousPixel(const AtrousPass& pass, int x, int y)
+{
+    const GBuffer& g = *pass.gbuffer;
+    int p = y * g.width + x;
+    float sum[3] = { 0.0f, 0.0f, 0.0f };
+    float wsum = 0.0f;
+    for(int j = 0; j < 5; j++)
+    {
+        int qy = std::max(0, std::min(y + (j - 2) * pass.stepWidth, g.height - 1));
+        for(int i = 0; i < 5; i++)
+        {
+            int qx = std::max(0, std::min(x + (i - 2) * pass.stepWidth, g.width - 1));
+            int q = qy * g.width + qx;
+            float w = ATROUS_KERNEL[i] * ATROUS_KERNEL[j] * expf(-atrousExponent(pass, p, q));
+            for(int k = 0; k < 3; k++)
+                sum[k] += w * pass.src[k][q];
+            wsum += w;
+        }
+    }
+    for(int k = 0; k < 3; k++)
+        pass.dst[k][p] = sum[k] / wsum;
+}
+
+#ifdef __SSE2__
+// exp(x) for x <= 0, from 2^x = 2^floor(x) * 2^frac(x) with a degree 5 polynomial for the fraction
+inline __m128 expNeg_ps(__m128 x)
+{
+    x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+    __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+    __m128i ti = _mm_cvttps_epi32(t);
+    __m128 fi = _mm_cvtepi32_ps(ti);
+    // Truncation rounds toward zero, step down for negative non-integers
+    __m128 adjust = _mm_and_ps(_mm_cmplt_ps(t, fi), _mm_set1_ps(1.0f));
+    fi = _mm_sub_ps(fi, adjust);
+    ti = _mm_cvtps_epi32(fi);
+    __m128 f = _mm_sub_ps(t, fi);
+
+    __m128 p = _mm_set1_ps(1.8775767e-3f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(8.9893397e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5826318e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4015361e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9315308e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.9999994e-1f));
+
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(ti, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+// Four horizontally adjacent pixels starting at x. All taps must be inside the row.
+inline void atrousPixel4(const AtrousPass& pass, int x, int y)
+{
+    const GBuffer& g = *pass.gbuffer;
+    int p = y * g.width + x;
+
+    __m128 pc[3], pn[3], pa[3];
+    for(int k = 0; k < 3; k++)
+    {
+        pc[k] = _mm_loadu_ps(pass.src[k] + p);
+        pn[k] = _mm_loadu_ps(&g.normal[k][p]);
+        pa[k] = _mm_loadu_ps(&g.albedo[k][p]);
+    }
+    __m128 pz = _mm_loadu_ps(&g.depth[p]);
+    __m128 invZ = _mm_div_ps(_mm_set1_ps(pass.invSigmaDepth), _mm_max_ps(pz, _mm_set1_ps(1e-3f)));
+    __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    __m128 sum[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    __m128 wsum = _mm_setzero_ps();
+    for(int j = 0; j < 5; j++)
+    {
+        int qy = std::max(0, std::min(y + (j - 2) * pass.stepWidth, g.height - 1));
+        for(int i = 0; i < 5; i++)
+        {
+            int q = qy * g.width + x + (i - 2) * pass.stepWidth;
+            __m128 qc[3];
+            __m128 dc = _mm_setzero_ps(), dn = _mm_setzero_ps(), da = _mm_setzero_ps();
+            for(int k = 0; k < 3; k++)
+            {
+                qc[k] = _mm_loadu_ps(pass.src[k] + q);
+                __m128 c = _mm_sub_ps(pc[k], qc[k]);
+                __m128 n = _mm_sub_ps(pn[k], _mm_loadu_ps(&g.normal[k][q]));
+                __m128 a = _mm_sub_ps(pa[k], _mm_loadu_ps(&g.albedo[k][q]));
+                dc = _mm_add_ps(dc, _mm_mul_ps(c, c));
+                dn = _mm_add_ps(dn, _mm_mul_ps(n, n));
+                da = _mm_add_ps(da, _mm_mul_ps(a, a));
+            }
+            __m128 dz = _mm_and_ps(_mm_sub_ps(pz, _mm_loadu_ps(&g.depth[q])), absMask);
+
+            __m128 e = _mm_mul_ps(dc, _mm_set1_ps(pass.invSigmaColor2));
+            e = _mm_add_ps(e, _mm_mul_ps(dn, _mm_set1_ps(pass.invSigmaNormal2)));
+            e = _mm_add_ps(e, _mm_mul_ps(dz, invZ));
+            e = _mm_add_ps(e, _mm_mul_ps(da, _mm_set1_ps(pass.invSigmaAlbedo2)));
+            __m128 w = _mm_mul_ps(_mm_set1_ps(ATROUS_KERNEL[i] * ATROUS_KERNEL[j]), expNeg_ps(_mm_sub_ps(_mm_setzero_ps(), e)));
+
+            for(int k = 0; k < 3; k++)
+                sum[k] = _mm_add_ps(sum[k], _mm_mul_ps(w, qc[k]));
+            wsum = _mm_add_ps(wsum, w);
+        }
+    }
+    for(int k = 0; k < 3; k++)
+        _mm_storeu_ps(pass.dst[k] + p, _mm_div_ps(sum[k], wsum));
+}
+#endif
+
+inline void atrousRows(const AtrousPass& pass, int y0, int y1)
+{
+    const int width = pass.gbuffer->width;
+    const int border = 2 * pass.stepWidth;
+    for(int y = y0; y < y1; y++)
+    {
+        int x = 0;
+#ifdef __SSE2__
+        for(; x < border && x < width; x++)
+            atrousPixel(pass, x, y);
+        for(; x + 3 + border < width; x += 4)
+            atrousPixel4(pass, x, y);
+#endif
+        for(; x < width; x++)
+            atrousPixel(pass, x, y);
+    }
+}
+
+// Filters img in place, guided by gbuffer, in bands of rows on pool or on numThreads
+// workers of its own. The ping-pong planes come from arena when one is given, so that a
+// caller resetting it every frame and passing its pool does not allocate.
+inline void denoiseAtrous(Image& img, const GBuffer& gbuffer, const DenoiseParams& params, int numThreads,
+                          FrameArena *arena = NULL, TilePool *pool = NULL)
+{
+    FrameArena localArena;
+    if(!arena)
+        arena = &localArena;
+
+    const int n = img.width * img.height;
+    float *planes[2][3];
+    for(int k = 0; k < 3; k++)
+    {
+        planes[0][k] = arenaArray<float>(*arena, n);
+        planes[1][k] = arenaArray<float>(*arena, n);
+        for(int i = 0; i < n; i++)
+            planes[0][k][i] = img.data[3 * i + k];
+    }
+
+    std::unique_ptr<TilePool> localPool;
+    TilePool& bandPool = poolOrLocal(pool, std::max(1, std::min(numThreads, img.height)), localPool);
+    int numBands = (img.height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+    int src = 0;
+    for(int it = 0; it < params.iterations; it++)
+    {
+        AtrousPass pass;
+        pass.gbuffer = &gbuffer;
+        for(int k = 0; k < 3; k++)
+        {
+            pass.src[k] = planes[src][k];
+            pass.dst[k] = planes[1 - src][k];
+        }
+        float sigmaColor = params.sigmaColor / (float)(1 << it);
+        pass.stepWidth = 1 << it;
+        pass.invSigmaColor2 = 1.0f / (sigmaColor * sigmaColor);
+        pass.invSigmaNormal2 = 1.0f / (params.sigmaNormal * params.sigmaNormal);
+        pass.invSigmaDepth = 1.0f / params.sigmaDepth;
+        pass.invSigmaAlbedo2 = 1.0f / (params.sigmaAlbedo * params.sigmaAlbedo);
+
+        auto rows = [&](int y0, int y1) { atrousRows(pass, y0, y1); };
+        runBands(bandPool, img.height, numBands, rows);
+        src = 1 - src;
+    }
+
+    for(int k = 0; k < 3; k++)
+        for(int i = 0; i < n; i++)
+            img.data[3 * i + k] = planes[src][k][i];
+}
+
+#endif
@@ -0,0 +1,403 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+// Renders a CPU frame across worker processes. The coordinator sends each worker the
+// scene once, then hands out tiles on demand and assembles the pixels that come back.
+// Each worker keeps DISTRIBUTED_TILES_IN_FLIGHT tiles queued so it never waits on the
+// network. When the tile queue runs dry, an idle worker steals the last queued tile of
+// the busiest worker, which is told to cancel it. Workers may join at any time.
+
+#include "net.h"
+
+#ifdef NET_SUPPORTED
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include "image.h"
+#include "scene.h"
+#include "tracer.h"
+
+static const int DISTRIBUTED_TILES_IN_FLIGHT = 2;
+
+enum MessageType
+{
+    MSG_SCENE = 1,           // Coordinator to worker: serialized Scene
+    MSG_TILE = 2,            // Coordinator to worker: TileMessage
+    MSG_CANCEL = 3,          // Coordinator to worker: int32 tile id, the tile was stolen
+    MSG_PIXELS = 4,          // Worker to coordinator: int32 tile id, then w * h RGB floats
+    MSG_DONE = 5             // Coordinator to worker: frame complete, exit
+};
+
+struct TileMessage
+{
+    int32_t id;
+    int32_t x, y, w, h;
+    int32_t width, height;   // Size of the whole image
+};
+
+struct DistributedTile
+{
+    TileMessage msg;
+    bool done;
+};
+
+struct DistributedWorker
+{
+    int fd;
+    std::deque<int> inFlight;    // Tile ids in the order they were sent
+    int tiles;                   // Tiles whose pixels were used
+    int stolen;                  // Tiles this worker took from another one
+    int wasted;                  // Tiles rendered after someone else finished them
+    long long pixels;
+    std::chrono::steady_clock::time_point joined;
+    double seconds;              // From joining to its last result
+};
+
+// Sends an int32 tile id message
+inline bool sendTileId(int fd, uint32_t type, int id)
+{
+    int32_t id32 = id;
+    return sendMessage(fd, type, &id32, sizeof(id32));
+}
+
+// Connects to the coordinator at address and renders tiles until told to stop, on
+// numThreads threads pinned to the first cores with pinThreads
+inline int runWorker(const char *address, int numThreads, bool pinThreads = false)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int fd = connectSocket(address);
+    if(fd < 0)
+        return -1;
+
+    uint32_t type;
+    std::vector<char> payload;
+    Scene scene;
+    if(!recvMessage(fd, type, payload) || type != MSG_SCENE)
+    {
+        fprintf(stderr, "Worker: expected a scene from %s\n", address);
+        close(fd);
+        return -1;
+    }
+    ByteReader reader(payload.data(), payload.size());
+    if(!readScene(reader, scene))
+    {
+        fprintf(stderr, "Worker: truncated scene\n");
+        close(fd);
+        return -1;
+    }
+    TilePool pool(numThreads, pinThreads ? 0 : -1);
+    Tracer tracer;
+    initTracer(tracer, scene, numThreads, &pool);
+
+    std::deque<TileMessage> queue;
+    std::vector<char> result;
+    bool done = false;
+    while(!done)
+    {
+        // Block only when there is nothing to render, otherwise pick up pending
+        // tiles and cancellations first so that a stolen tile is not rendered twice
+        pollfd pfd = { fd, POLLIN, 0 };
+        while(queue.empty() || poll(&pfd, 1, 0) > 0)
+        {
+            if(!recvMessage(fd, type, payload))
+            {
+                fprintf(stderr, "Worker: lost the coordinator\n");
+                close(fd);
+                return -1;
+            }
+            if(type == MSG_TILE && payload.size() == sizeof(TileMessage))
+            {
+                TileMessage tile;
+                memcpy(&tile, payload.data(), sizeof(tile));
+                queue.push_back(tile);
+            }
+            else if(type == MSG_CANCEL && payload.size() == sizeof(int32_t))
+            {
+                int32_t id;
+                memcpy(&id, payload.data(), sizeof(id));
+                for(size_t i = 0; i < queue.size(); i++)
+                {
+                    if(queue[i].id == id)
+                    {
+                        queue.erase(queue.begin() + i);
+                        break;
+                    }
+                }
+            }
+            else if(type == MSG_DONE)
+            {
+                done = true;
+                break;
+            }
+        }
+        if(done || queue.empty())
+            continue;
+
+        TileMessage tile = queue.front();
+        queue.pop_front();
+        result.resize(sizeof(int32_t) + 3 * sizeof(float) * tile.w * tile.h);
+        memcpy(&result[0], &tile.id, sizeof(int32_t));
+        renderTile(tracer, tile.x, tile.y, tile.w, tile.h, tile.width, tile.height,
+                   (float *)&result[sizeof(int32_t)], numThreads);
+        if(!sendMessage(fd, MSG_PIXELS, result.data(), (uint32_t)result.size()))
+        {
+            fprintf(stderr, "Worker: lost the coordinator\n");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// Starts a local worker process running this program
+inline pid_t spawnWorker(const char *program, const char *address, int numThreads)
+{
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        char threads[16];
+        snprintf(threads, sizeof(threads), "%d", numThreads);
+        execlp(program, program, "--worker", address, "--threads", threads, (char *)NULL);
+        fprintf(stderr, "Could not start worker %s: %s\n", program, strerror(errno));
+        _exit(127);
+    }
+    if(pid < 0)
+        fprintf(stderr, "Could not fork a worker: %s\n", strerror(errno));
+    return pid;
+}
+
+inline void printWorkerStats(const std::vector<DistributedWorker>& workers)
+{
+    printf("Worker  Tiles  Stolen  Wasted  Seconds  Mpixels/s\n");
+    for(size_t i = 0; i < workers.size(); i++)
+    {
+        const DistributedWorker& w = workers[i];
+        printf("%6d  %5d  %6d  %6d  %7.2f  %9.3f\n", (int)i, w.tiles, w.stolen, w.wasted, w.seconds,
+               w.seconds > 0.0 ? w.pixels / w.seconds * 1e-6 : 0.0);
+    }
+}
+
+// Renders scene into img on the workers that connect to address. numSpawn local
+// workers with threadsPerWorker threads each are started first. Returns false if
+// the socket could not be opened or the frame could not be finished.
+inline bool renderDistributed(const Scene& scene, Image& img, const char *address, int tileSize,
+                              int numSpawn, const char *program, int threadsPerWorker)
+{
+    typedef std::chrono::steady_clock Clock;
+    signal(SIGPIPE, SIG_IGN);
+    int listenFd = listenSocket(address);
+    if(listenFd < 0)
+        return false;
+    fcntl(listenFd, F_SETFD, FD_CLOEXEC);
+
+    ByteWriter sceneData;
+    writeScene(sceneData, scene);
+
+    std::vector<DistributedTile> tiles;
+    for(int y = 0; y < img.height; y += tileSize)
+    {
+        for(int x = 0; x < img.width; x += tileSize)
+        {
+            DistributedTile tile;
+            tile.msg.id = (int32_t)tiles.size();
+            tile.msg.x = x;
+            tile.msg.y = y;
+            tile.msg.w = std::min(tileSize, img.width - x);
+            tile.msg.h = std::min(tileSize, img.height - y);
+            tile.msg.width = img.width;
+            tile.msg.height = img.height;
+            tile.done = false;
+            tiles.push_back(tile);
+        }
+    }
+    std::deque<int> pending;
+    for(size_t i = 0; i < tiles.size(); i++)
+        pending.push_back((int)i);
+
+    std::vector<pid_t> children;
+    for(int i = 0; i < numSpawn; i++)
+    {
+        pid_t pid = spawnWorker(program, address, threadsPerWorker);
+        if(pid > 0)
+            children.push_back(pid);
+    }
+    printf("Rendering %d tiles, waiting for workers on %s\n", (int)tiles.size(), address);
+
+    std::vector<DistributedWorker> workers;
+    std::vector<int> active;     // Indices into workers that are still connected
+    int remaining = (int)tiles.size();
+    std::vector<char> payload;
+    std::vector<pollfd> pfds;
+    while(remaining > 0)
+    {
+        // Top up every worker, steal for the idle ones once the queue is empty
+        for(size_t a = 0; a < active.size(); a++)
+        {
+            DistributedWorker& w = workers[active[a]];
+            while((int)w.inFlight.size() < DISTRIBUTED_TILES_IN_FLIGHT && !pending.empty())
+            {
+                int id = pending.front();
+                pending.pop_front();
+                if(tiles[id].done)
+                    continue;
+                w.inFlight.push_back(id);
+                sendMessage(w.fd, MSG_TILE, &tiles[id].msg, sizeof(TileMessage));
+            }
+            if(!w.inFlight.empty() || !pending.empty())
+                continue;
+
+            int victim = -1;
+            for(size_t b = 0; b < active.size(); b++)
+            {
+                size_t queued = workers[active[b]].inFlight.size();
+                if(queued > 1 && (victim < 0 || queued > workers[victim].inFlight.size()))
+                    victim = active[b];
+            }
+            if(victim < 0)
+                continue;
+            int id = workers[victim].inFlight.back();
+            workers[victim].inFlight.pop_back();
+            sendTileId(workers[victim].fd, MSG_CANCEL, id);
+            w.inFlight.push_back(id);
+            w.stolen++;
+            sendMessage(w.fd, MSG_TILE, &tiles[id].msg, sizeof(TileMessage));
+        }
+
+        pfds.clear();
+        pollfd listenPfd = { listenFd, POLLIN, 0 };
+        pfds.push_back(listenPfd);
+        for(size_t a = 0; a < active.size(); a++)
+        {
+            pollfd pfd = { workers[active[a]].fd, POLLIN, 0 };
+            pfds.push_back(pfd);
+        }
+        // Without workers, wake up now and then to notice spawned ones that died
+        int timeout = active.empty() && !children.empty() ? 500 : -1;
+        int ready = poll(&pfds[0], pfds.size(), timeout);
+        if(ready < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if(ready == 0)
+        {
+            for(size_t i = 0; i < children.size(); i++)
+            {
+                if(children[i] > 0 && waitpid(children[i], NULL, WNOHANG) == children[i])
+                    children[i] = -1;
+            }
+            if(std::count(children.begin(), children.end(), -1) == (int)children.size())
+            {
+                fprintf(stderr, "All local workers exited\n");
+                break;
+            }
+            continue;
+        }
+
+        // A worker accepted below was not polled yet, it has no pollfd to look at
+        int polled = (int)active.size();
+        if(pfds[0].revents & POLLIN)
+        {
+            int fd = accept(listenFd, NULL, NULL);
+            if(fd >= 0)
+            {
+                if(!isUnixAddress(address))
+                    setNoDelay(fd);
+                if(sendMessage(fd, MSG_SCENE, sceneData.data.data(), (uint32_t)sceneData.data.size()))
+                {
+                    DistributedWorker w;
+                    w.fd = fd;
+                    w.tiles = w.stolen = w.wasted = 0;
+                    w.pixels = 0;
+                    w.joined = Clock::now();
+                    w.seconds = 0.0;
+                    active.push_back((int)workers.size());
+                    workers.push_back(w);
+                }else
+                    close(fd);
+            }
+        }
+
+        // Walk backwards so that dropping a worker keeps the remaining pollfds aligned
+        for(int a = polled - 1; a >= 0; a--)
+        {
+            if(!(pfds[a + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            DistributedWorker& w = workers[active[a]];
+            uint32_t type;
+            if(!recvMessage(w.fd, type, payload))
+            {
+                // Hand its unfinished tiles to the others
+                fprintf(stderr, "Worker %d disconnected\n", active[a]);
+                for(size_t i = 0; i < w.inFlight.size(); i++)
+                    pending.push_front(w.inFlight[i]);
+                w.inFlight.clear();
+                close(w.fd);
+                active.erase(active.begin() + a);
+                continue;
+            }
+            if(type != MSG_PIXELS || payload.size() < sizeof(int32_t))
+                continue;
+            int32_t id;
+            memcpy(&id, payload.data(), sizeof(id));
+            if(id < 0 || id >= (int)tiles.size())
+                continue;
+            const TileMessage& t = tiles[id].msg;
+            if(payload.size() != sizeof(int32_t) + 3 * sizeof(float) * t.w * t.h)
+                continue;
+
+            for(size_t i = 0; i < w.inFlight.size(); i++)
+            {
+                if(w.inFlight[i] == id)
+                {
+                    w.inFlight.erase(w.inFlight.begin() + i);
+                    break;
+                }
+            }
+            w.seconds = std::chrono::duration<double>(Clock::now() - w.joined).count();
+            if(tiles[id].done)
+            {
+                w.wasted++;
+                continue;
+            }
+
+            const float *src = (const float *)&payload[sizeof(int32_t)];
+            for(int y = 0; y < t.h; y++)
+                memcpy(&img.data[3 * ((t.y + y) * img.width + t.x)], src + 3 * y * t.w, 3 * sizeof(float) * t.w);
+            tiles[id].done = true;
+            remaining--;
+            w.tiles++;
+            w.pixels += t.w * t.h;
+        }
+    }
+
+    for(size_t a = 0; a < active.size(); a++)
+    {
+        sendMessage(workers[active[a]].fd, MSG_DONE, NULL, 0);
+        close(workers[active[a]].fd);
+    }
+    close(listenFd);
+    if(isUnixAddress(address))
+        unlink(address + 5);
+    for(size_t i = 0; i < children.size(); i++)
+    {
+        if(children[i] > 0)
+            waitpid(children[i], NULL, 0);
+    }
+
+    printWorkerStats(workers);
+    return remaining == 0;
+}
+
+#endif
+
+#endif
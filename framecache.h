@@ -0,0 +1,291 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+#include "image.h"
+#include "scene.h"
+#include "serialize.h"
+
+// Finished CPU frames on local disk, addressed by a hash of everything that went into
+// them: the serialized scene, the tracer source and the options that pick a code path
+// or change the image. A request that hashes to a stored frame is answered by reading
+// the file back instead of tracing. Entries are one file each, named after the key,
+// and written under a temporary name then renamed, so processes sharing a directory
+// never read a partial frame. Each hit touches its file, and a store evicts the files
+// touched longest ago, to the second, until the directory fits the size cap.
+//
+// The frame is stored before denoising, along with its G-buffer when the request
+// denoises it, so that requests differing only in --denoise share one entry.
+
+static const uint32_t FRAME_CACHE_MAGIC = 0x434d5246;      // "FRMC"
+static const uint32_t FRAME_CACHE_VERSION = 1;             // Bump when the tracer changes its output
+static const char *FRAME_CACHE_SUFFIX = ".frame";
+
+// What the image depends on besides the scene. A new field needs a case in
+// testFrameCacheKey in tests.cpp.
+struct FrameCacheSettings
+{
+    int width;
+    int height;
+    const char *shaderSource;    // The tracer the CPU kernels mirror
+    bool hybrid;
+    bool tileLists;
+    int bounceFactor;
+    int bounceMaterials;
+    float irradianceError;
+    int shadowMapSize;
+    int heatmap;                 // Metric shown instead of the image, -1 for none
+    float heatmapScale;
+};
+
+struct FrameCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    int32_t width;
+    int32_t height;
+    uint32_t hasGBuffer;         // Normal, depth and albedo planes follow the image
+    uint32_t padding;
+};
+
+struct FrameCacheStats
+{
+    std::atomic<int> hits;
+    std::atomic<int> misses;
+    std::atomic<int> stores;
+    std::atomic<int> evictions;
+
+    FrameCacheStats() : hits(0), misses(0), stores(0), evictions(0) {}
+};
+
+struct FrameCache
+{
+    std::string dir;
+    uint64_t maxBytes;
+    std::mutex trimMutex;        // One eviction pass at a time among the threads of a process
+    FrameCacheStats stats;
+
+    FrameCache() : maxBytes(1024ull << 20) {}
+};
+
+// 64 bit FNV-1a, stable across runs and machines of the same byte order
+inline uint64_t hashBytes(const void *data, size_t size, uint64_t h = 14695981039346656037ull)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for(size_t i = 0; i < size; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+inline uint64_t frameCacheKey(const Scene& scene, const FrameCacheSettings& settings)
+{
+    ByteWriter w;
+    w.put(FRAME_CACHE_VERSION);
+    writeScene(w, scene);
+    w.putString(settings.shaderSource);
+    w.put((int32_t)settings.width);
+    w.put((int32_t)settings.height);
+    w.put((uint8_t)settings.hybrid);
+    w.put((uint8_t)settings.tileLists);
+    w.put((int32_t)settings.bounceFactor);
+    w.put((int32_t)(settings.bounceFactor > 1 ? settings.bounceMaterials : 0));
+    w.put(settings.irradianceError);
+    w.put((int32_t)settings.shadowMapSize);
+    w.put((int32_t)settings.heatmap);
+    w.put(settings.heatmap >= 0 ? settings.heatmapScale : 0.0f);
+    return hashBytes(&w.data[0], w.data.size());
+}
+
+inline std::string frameCachePath(const FrameCache& cache, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+    return cache.dir + "/" + name + FRAME_CACHE_SUFFIX;
+}
+
+inline void writeFramePlanes(FILE *f, const GBuffer& gbuffer)
+{
+    size_t n = gbuffer.depth.size();
+    for(int i = 0; i < 3; i++)
+        fwrite(&gbuffer.normal[i][0], sizeof(float), n, f);
+    fwrite(&gbuffer.depth[0], sizeof(float), n, f);
+    for(int i = 0; i < 3; i++)
+        fwrite(&gbuffer.albedo[i][0], sizeof(float), n, f);
+}
+
+inline bool readFramePlanes(FILE *f, GBuffer& gbuffer)
+{
+    size_t n = gbuffer.depth.size();
+    bool ok = true;
+    for(int i = 0; i < 3; i++)
+        ok = ok && fread(&gbuffer.normal[i][0], sizeof(float), n, f) == n;
+    ok = ok && fread(&gbuffer.depth[0], sizeof(float), n, f) == n;
+    for(int i = 0; i < 3; i++)
+        ok = ok && fread(&gbuffer.albedo[i][0], sizeof(float), n, f) == n;
+    return ok;
+}
+
+// Whether the directory exists or could be created
+inline bool openFrameCache(FrameCache& cache, const char *dir, uint64_t maxBytes)
+{
+#ifndef _WIN32
+    cache.dir = dir;
+    cache.maxBytes = maxBytes;
+    struct stat st;
+    if(stat(dir, &st) == 0 ? S_ISDIR(st.st_mode) : mkdir(dir, 0777) == 0)
+        return true;
+    fprintf(stderr, "Could not use %s as the frame cache\n", dir);
+    return false;
+#else
+    fprintf(stderr, "The frame cache is not supported on this platform\n");
+    return false;
+#endif
+}
+
+// Reads the frame of key into img, which must have the size it was stored at, and its
+// G-buffer into gbuffer if given. A frame stored without one is a miss for a request
+// that needs it.
+inline bool lookupFrame(FrameCache& cache, uint64_t key, Image& img, GBuffer *gbuffer)
+{
+    std::string path = frameCachePath(cache, key);
+    FILE *f = fopen(path.c_str(), "rb");
+    bool ok = f != NULL;
+    if(f)
+    {
+        FrameCacheHeader header;
+        ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == FRAME_CACHE_MAGIC &&
+             header.version == FRAME_CACHE_VERSION && header.key == key && header.width == img.width &&
+             header.height == img.height && (header.hasGBuffer || !gbuffer);
+        ok = ok && fread(&img.data[0], sizeof(float), img.data.size(), f) == img.data.size();
+        if(ok && gbuffer)
+            ok = gbuffer->width == img.width && gbuffer->height == img.height && readFramePlanes(f, *gbuffer);
+        fclose(f);
+    }
+    if(!ok)
+    {
+        cache.stats.misses++;
+        return false;
+    }
+#ifndef _WIN32
+    utime(path.c_str(), NULL);
+#endif
+    cache.stats.hits++;
+    return true;
+}
+
+// Deletes the least recently used frames until the directory holds at most maxBytes
+inline void trimFrameCache(FrameCache& cache)
+{
+#ifndef _WIN32
+    struct Entry
+    {
+        std::string path;
+        time_t used;
+        uint64_t bytes;
+    };
+    std::lock_guard<std::mutex> lock(cache.trimMutex);
+    DIR *d = opendir(cache.dir.c_str());
+    if(!d)
+        return;
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    size_t suffix = strlen(FRAME_CACHE_SUFFIX);
+    for(struct dirent *e = readdir(d); e; e = readdir(d))
+    {
+        size_t length = strlen(e->d_name);
+        if(length <= suffix || strcmp(e->d_name + length - suffix, FRAME_CACHE_SUFFIX) != 0)
+            continue;
+        Entry entry;
+        entry.path = cache.dir + "/" + e->d_name;
+        struct stat st;
+        if(stat(entry.path.c_str(), &st) != 0)
+            continue;
+        entry.used = st.st_mtime;
+        entry.bytes = (uint64_t)st.st_size;
+        total += entry.bytes;
+        entries.push_back(entry);
+    }
+    closedir(d);
+    if(total <= cache.maxBytes)
+        return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    for(size_t i = 0; i < entries.size() && total > cache.maxBytes; i++)
+    {
+        if(unlink(entries[i].path.c_str()) != 0)
+            continue;
+        total -= entries[i].bytes;
+        cache.stats.evictions++;
+    }
+#endif
+}
+
+// Stores img under key, with gbuffer if given, and trims the cache to its cap
+inline bool storeFrame(FrameCache& cache, uint64_t key, const Image& img, const GBuffer *gbuffer)
+{
+#ifndef _WIN32
+    int pid = (int)getpid();
+#else
+    int pid = 0;
+#endif
+    // Unique among the processes and the animation slots writing at the same time
+    std::string path = frameCachePath(cache, key);
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%d.%p.tmp", pid, (const void *)&img);
+    std::string temp = path + suffix;
+    FILE *f = fopen(temp.c_str(), "wb");
+    if(!f)
+    {
+        fprintf(stderr, "Could not open %s for writing.\n", temp.c_str());
+        return false;
+    }
+    FrameCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FRAME_CACHE_MAGIC;
+    header.version = FRAME_CACHE_VERSION;
+    header.key = key;
+    header.width = img.width;
+    header.height = img.height;
+    header.hasGBuffer = gbuffer != NULL;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(&img.data[0], sizeof(float), img.data.size(), f) == img.data.size();
+    if(ok && gbuffer)
+        writeFramePlanes(f, *gbuffer);
+    ok = !ferror(f) && ok;
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+    if(!ok)
+    {
+        remove(temp.c_str());
+        fprintf(stderr, "Could not store frame %016llx in the frame cache\n", (unsigned long long)key);
+        return false;
+    }
+    cache.stats.stores++;
+    trimFrameCache(cache);
+    return true;
+}
+
+inline void printFrameCacheStats(const FrameCache& cache)
+{
+    printf("frame cache: %d hits, %d misses, %d stored, %d evicted\n", cache.stats.hits.load(),
+           cache.stats.misses.load(), cache.stats.stores.load(), cache.stats.evictions.load());
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef FRAMEWRITER_H
+#define FRAMEWRITER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Streams RGBA8 frames, rows bottom to top as glReadPixels returns them, to disk or a
+// pipe on a thread of its own. Frames are written top row first as RGB: binary PPMs,
+// or headerless rgb24 for piping into a video encoder. A fixed set of frame buffers
+// cycles between the render thread and the writer, so recording does not allocate.
+static const int FRAME_WRITER_BUFFERS = 4;
+
+struct FrameWriter
+{
+    const char *path;        // "-" for stdout, a printf pattern with %d for one file per frame
+    bool ppm;                // PPM frames, raw rgb24 otherwise
+    int width;
+    int height;
+    FILE *stream;            // Shared output unless path is a pattern
+
+    std::vector<std::vector<unsigned char> > buffers;
+    std::deque<int> queue;   // Filled buffers in frame order
+    std::deque<int> free;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread thread;
+    bool closing;
+    bool failed;
+
+    int framesWritten;
+    int stalls;              // Times the render thread had to wait for a free buffer
+};
+
+inline bool isFramePattern(const char *path)
+{
+    return strchr(path, '%') != NULL;
+}
+
+inline bool writeFrame(FrameWriter& writer, const std::vector<unsigned char>& rgba, std::vector<unsigned char>& row, int index)
+{
+    FILE *f = writer.stream;
+    if(isFramePattern(writer.path))
+    {
+        char name[1024];
+        snprintf(name, sizeof(name), writer.path, index);
+        f = fopen(name, "wb");
+        if(!f)
+        {
+            fprintf(stderr, "Could not open %s for writing.\n", name);
+            return false;
+        }
+    }
+
+    bool ok = true;
+    if(writer.ppm)
+        ok = fprintf(f, "P6\n%d %d\n255\n", writer.width, writer.height) > 0;
+    for(int y = writer.height - 1; y >= 0 && ok; y--)
+    {
+        const unsigned char *p = &rgba[4 * y * writer.width];
+        for(int x = 0; x < writer.width; x++)
+        {
+            row[3 * x + 0] = p[4 * x + 0];
+            row[3 * x + 1] = p[4 * x + 1];
+            row[3 * x + 2] = p[4 * x + 2];
+        }
+        ok = fwrite(&row[0], 1, row.size(), f) == row.size();
+    }
+
+    if(f != writer.stream)
+        fclose(f);
+    else
+        fflush(f);
+    return ok;
+}
+
+inline void frameWriterThread(FrameWriter *writer)
+{
+    std::vector<unsigned char> row(3 * writer->width);
+    std::unique_lock<std::mutex> lock(writer->mutex);
+    while(true)
+    {
+        writer->cond.wait(lock, [writer]() { return !writer->queue.empty() || writer->closing; });
+        if(writer->queue.empty())
+            break;
+        int index = writer->queue.front();
+        writer->queue.pop_front();
+
+        lock.unlock();
+        bool ok = writeFrame(*writer, writer->buffers[index], row, writer->framesWritten);
+        lock.lock();
+
+        if(!ok && !writer->failed)
+        {
+            fprintf(stderr, "Writing frame %d to %s failed, recording stopped\n", writer->framesWritten, writer->path);
+            writer->failed = true;
+        }
+        if(ok)
+            writer->framesWritten++;
+        writer->free.push_back(index);
+        writer->cond.notify_all();
+    }
+}
+
+inline bool openFrameWriter(FrameWriter& writer, const char *path, bool ppm, int width, int height)
+{
+    writer.path = path;
+    writer.ppm = ppm;
+    writer.width = width;
+    writer.height = height;
+    writer.stream = NULL;
+    if(strcmp(path, "-") == 0)
+        writer.stream = stdout;
+    else if(!isFramePattern(path))
+    {
+        writer.stream = fopen(path, "wb");
+        if(!writer.stream)
+        {
+            fprintf(stderr, "Could not open %s for writing.\n", path);
+            return false;
+        }
+    }
+
+    writer.buffers.resize(FRAME_WRITER_BUFFERS);
+    for(int i = 0; i < FRAME_WRITER_BUFFERS; i++)
+    {
+        writer.buffers[i].resize(4 * width * height);
+        writer.free.push_back(i);
+    }
+    writer.closing = false;
+    writer.failed = false;
+    writer.framesWritten = 0;
+    writer.stalls = 0;
+    writer.thread = std::thread(frameWriterThread, &writer);
+    return true;
+}
+
+// Returns a free frame buffer of width * height RGBA pixels, -1 once writing failed
+inline int acquireFrameBuffer(FrameWriter& writer)
+{
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    if(writer.free.empty())
+        writer.stalls++;
+    writer.cond.wait(lock, [&writer]() { return !writer.free.empty() || writer.failed; });
+    if(writer.failed)
+        return -1;
+    int index = writer.free.front();
+    writer.free.pop_front();
+    return index;
+}
+
+inline void submitFrameBuffer(FrameWriter& writer, int index)
+{
+    std::lock_guard<std::mutex> lock(writer.mutex);
+    writer.queue.push_back(index);
+    writer.cond.notify_all();
+}
+
+// Writes out the queued frames and stops the thread
+inline void closeFrameWriter(FrameWriter& writer)
+{
+    {
+        std::lock_guard<std::mutex> lock(writer.mutex);
+        writer.closing = true;
+        writer.cond.notify_all();
+    }
+    writer.thread.join();
+    if(writer.stream && writer.stream != stdout)
+        fclose(writer.stream);
+    writer.stream = NULL;
+}
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <math.h>
+#include <memory>
+#include <vector>
+#include "ray.h"
+#include "scheduler.h"
+
+// Uniform grid over equal-radius spheres. Every sphere is referenced by each cell
+// its bounding box overlaps; a cell is never smaller than a sphere, so that is at most 8 cells.
+struct UniformGrid
+{
+    Vec3 bmin;
+    Vec3 bmax;
+    Vec3 cellSize;
+    int res[3];
+    std::vector<int> cellStart;  // numCells + 1 offsets into indices
+    std::vector<int> indices;    // Sphere indices sorted by cell
+};
+
+inline int gridNumCells(const UniformGrid& grid)
+{
+    return grid.res[0] * grid.res[1] * grid.res[2];
+}
+
+inline int gridCellIndex(const UniformGrid& grid, int x, int y, int z)
+{
+    return x + grid.res[0] * (y + grid.res[1] * z);
+}
+
+// Range of cells overlapped by the bounding box of the sphere at center
+inline void gridCellRange(const UniformGrid& grid, const Vec3& center, float radius, int lo[3], int hi[3])
+{
+    for(int i = 0; i < 3; i++)
+    {
+        lo[i] = (int)((center[i] - radius - grid.bmin[i]) / grid.cellSize[i]);
+        hi[i] = (int)((center[i] + radius - grid.bmin[i]) / grid.cellSize[i]);
+        lo[i] = std::max(0, std::min(lo[i], grid.res[i] - 1));
+        hi[i] = std::max(0, std::min(hi[i], grid.res[i] - 1));
+    }
+}
+
+// Builds the grid in linear time with a counting sort. Each slice of the spheres is
+// counted and later scattered as one band on pool, or on numThreads workers of its own,
+// so the result does not depend on numThreads.
+inline void buildGrid(UniformGrid& grid, const std::vector<Vec3>& centers, float radius, int numThreads,
+                      TilePool *pool = NULL)
+{
+    const int n = (int)centers.size();
+    const int numSlices = std::max(1, std::min(numThreads, n / 4096 + 1));
+
+    grid.bmin = Vec3(0.0f);
+    grid.bmax = Vec3(0.0f);
+    if(n > 0)
+    {
+        grid.bmin = grid.bmax = centers[0];
+        for(int i = 1; i < n; i++)
+        {
+            for(int j = 0; j < 3; j++)
+            {
+                grid.bmin[j] = std::min(grid.bmin[j], centers[i][j]);
+                grid.bmax[j] = std::max(grid.bmax[j], centers[i][j]);
+            }
+        }
+    }
+    grid.bmin -= Vec3(radius);
+    grid.bmax += Vec3(radius);
+
+    // About two cells per sphere, but no cell smaller than a sphere
+    Vec3 extent = grid.bmax - grid.bmin;
+    float volume = std::max(extent[0] * extent[1] * extent[2], 1e-12f);
+    float cellsPerUnit = cbrtf(2.0f * std::max(n, 1) / volume);
+    for(int i = 0; i < 3; i++)
+    {
+        int res = (int)(extent[i] * cellsPerUnit);
+        res = std::min(res, (int)(extent[i] / (2.0f * radius + 1e-6f)));
+        grid.res[i] = std::max(1, std::min(res, 512));
+        grid.cellSize[i] = std::max(extent[i], 1e-6f) / grid.res[i];
+    }
+
+    const int numCells = gridNumCells(grid);
+    std::vector<std::vector<int> > counts(numSlices, std::vector<int>(numCells, 0));
+    std::unique_ptr<TilePool> localPool;
+    if(numSlices > 1)
+        pool = &poolOrLocal(pool, numThreads, localPool);
+
+    // Pass 1: per slice histogram of cell references
+    auto countSlices = [&](int first, int last)
+    {
+        for(int t = first; t < last; t++)
+        {
+            int begin = (int)((long long)n * t / numSlices);
+            int end = (int)((long long)n * (t + 1) / numSlices);
+            int lo[3], hi[3];
+            for(int i = begin; i < end; i++)
+            {
+                gridCellRange(grid, centers[i], radius, lo, hi);
+                for(int z = lo[2]; z <= hi[2]; z++)
+                    for(int y = lo[1]; y <= hi[1]; y++)
+                        for(int x = lo[0]; x <= hi[0]; x++)
+                            counts[t][gridCellIndex(grid, x, y, z)]++;
+            }
+        }
+    };
+    if(numSlices > 1)
+        runBands(*pool, numSlices, numSlices, countSlices);
+    else
+        countSlices(0, 1);
+
+    // Exclusive prefix sum, cell major and slice minor, turns the counts into write offsets
+    grid.cellStart.resize(numCells + 1);
+    int offset = 0;
+    for(int c = 0; c < numCells; c++)
+    {
+        grid.cellStart[c] = offset;
+        for(int t = 0; t < numSlices; t++)
+        {
+            int count = counts[t][c];
+            counts[t][c] = offset;
+            offset += count;
+        }
+    }
+    grid.cellStart[numCells] = offset;
+    grid.indices.resize(offset);
+
+    // Pass 2: scatter
+    auto scatterSlices = [&](int first, int last)
+    {
+        for(int t = first; t < last; t++)
+        {
+            int begin = (int)((long long)n * t / numSlices);
+            int end = (int)((long long)n * (t + 1) / numSlices);
+            int lo[3], hi[3];
+            for(int i = begin; i < end; i++)
+            {
+                gridCellRange(grid, centers[i], radius, lo, hi);
+                for(int z = lo[2]; z <= hi[2]; z++)
+                    for(int y = lo[1]; y <= hi[1]; y++)
+                        for(int x = lo[0]; x <= hi[0]; x++)
+                            grid.indices[counts[t][gridCellIndex(grid, x, y, z)]++] = i;
+            }
+        }
+    };
+    if(numSlices > 1)
+        runBands(*pool, numSlices, numSlices, scatterSlices);
+    else
+        scatterSlices(0, 1);
+}
+
+// Walks the cells pierced by the ray with 3D-DDA and returns the closest sphere hit
+// before tMax. With anyHit set it stops at the first hit, for shadow rays. The cells
+// visited and spheres tested are added to cost if given.
+inline bool gridIntersect(const UniformGrid& grid, const std::vector<Vec3>& centers, float radius,
+                          const Ray& r, float tMax, bool anyHit, float& tHit, int& index, TraversalCost *cost = NULL)
+{
+    if(grid.indices.empty())
+        return false;
+
+    Vec3 invDir = safeInverse(r.direction);
+    float tEnter = MIN_T;
+    float tExit = tMax;
+    if(!clipRayToBox(r, invDir, grid.bmin, grid.bmax, tEnter, tExit))
+        return false;
+
+    int cell[3], step[3];
+    float tNext[3], tDelta[3];
+    Vec3 p = r.origin + r.direction * tEnter;
+    for(int i = 0; i < 3; i++)
+    {
+        cell[i] = (int)((p[i] - grid.bmin[i]) / grid.cellSize[i]);
+        cell[i] = std::max(0, std::min(cell[i], grid.res[i] - 1));
+        step[i] = invDir[i] < 0.0f ? -1 : 1;
+        float boundary = grid.bmin[i] + (cell[i] + (step[i] > 0 ? 1 : 0)) * grid.cellSize[i];
+        tNext[i] = (boundary - r.origin[i]) * invDir[i];
+        tDelta[i] = grid.cellSize[i] * fabsf(invDir[i]);
+    }
+
+    tHit = tMax;
+    index = -1;
+    for(;;)
+    {
+        int c = gridCellIndex(grid, cell[0], cell[1], cell[2]);
+        if(cost)
+            cost->nodeVisits++;
+        for(int k = grid.cellStart[c]; k < grid.cellStart[c + 1]; k++)
+        {
+            int i = grid.indices[k];
+            if(cost)
+                cost->primitiveTests++;
+            float t = sphereHitT(centers[i], radius, r);
+            if(t < tHit)
+            {
+                tHit = t;
+                index = i;
+                if(anyHit)
+                    return true;
+            }
+        }
+
+        // A hit inside the current cell can't be beaten by any later cell
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        if(tHit <= tNext[axis] || tNext[axis] > tExit)
+            break;
+
+        cell[axis] += step[axis];
+        if(cell[axis] < 0 || cell[axis] >= grid.res[axis])
+            break;
+        tNext[axis] += tDelta[axis];
+    }
+    return index >= 0;
+}
+
+#endif
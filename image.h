@@ -0,0 +1,201 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+#include "vec.h"
+
+// Linear RGB float image. Rows run bottom to top, like gl_FragCoord and glReadPixels.
+struct Image
+{
+    int width;
+    int height;
+    std::vector<float> data;
+
+    Image() : width(0), height(0) {}
+    Image(int w, int h) : width(w), height(h), data(3 * w * h, 0.0f) {}
+
+    void set(int x, int y, const Vec3& c)
+    {
+        float *p = &data[3 * (y * width + x)];
+        p[0] = c[0];
+        p[1] = c[1];
+        p[2] = c[2];
+    }
+
+    Vec3 get(int x, int y) const
+    {
+        const float *p = &data[3 * (y * width + x)];
+        return Vec3(p[0], p[1], p[2]);
+    }
+};
+
+// Features of the primary hit for each pixel, stored as separate planes.
+// Rows run bottom to top like Image. Pixels that hit nothing get depth MAX_DEPTH.
+struct GBuffer
+{
+    int width;
+    int height;
+    std::vector<float> normal[3];
+    std::vector<float> depth;
+    std::vector<float> albedo[3];
+
+    GBuffer() : width(0), height(0) {}
+    GBuffer(int w, int h) : width(w), height(h), depth(w * h, 0.0f)
+    {
+        for(int i = 0; i < 3; i++)
+        {
+            normal[i].assign(w * h, 0.0f);
+            albedo[i].assign(w * h, 0.0f);
+        }
+    }
+
+    void set(int x, int y, const Vec3& n, float d, const Vec3& a)
+    {
+        int i = y * width + x;
+        for(int j = 0; j < 3; j++)
+        {
+            normal[j][i] = n[j];
+            albedo[j][i] = a[j];
+        }
+        depth[i] = d;
+    }
+};
+
+// Per pixel work counters of the tracers, shown as heatmaps
+enum CostMetric
+{
+    COST_INTERSECTIONS = 0,  // Ray-primitive intersection tests
+    COST_SHADOW_RAYS = 1,
+    COST_BOUNCES = 2,        // Secondary rays traced
+    COST_NODE_VISITS = 3,    // Grid cells or BVH nodes visited
+    COST_METRICS = 4
+};
+
+// Command line names, and the counts at the top of the heatmap ramp by default
+static const char *COST_METRIC_NAMES[COST_METRICS] = { "intersections", "shadow", "bounces", "nodes" };
+static const float COST_METRIC_SCALES[COST_METRICS] = { 64.0f, 16.0f, 8.0f, 64.0f };
+
+// COST_METRICS floats per pixel, laid out like the RGBA32F outCost target of basicFragSrc.
+// Rows run bottom to top like Image.
+struct CostBuffer
+{
+    int width;
+    int height;
+    std::vector<float> data;
+
+    CostBuffer() : width(0), height(0) {}
+    CostBuffer(int w, int h) : width(w), height(h), data(COST_METRICS * w * h, 0.0f) {}
+
+    float *at(int x, int y)
+    {
+        return &data[COST_METRICS * (y * width + x)];
+    }
+};
+
+// Blue to red ramp for t in [0, 1], the same as heatColor in basicFragSrc
+inline Vec3 heatColor(float t)
+{
+    t = std::max(0.0f, std::min(t, 1.0f));
+    return Vec3(std::max(0.0f, std::min(1.5f - fabsf(4.0f * t - 3.0f), 1.0f)),
+                std::max(0.0f, std::min(1.5f - fabsf(4.0f * t - 2.0f), 1.0f)),
+                std::max(0.0f, std::min(1.5f - fabsf(4.0f * t - 1.0f), 1.0f)));
+}
+
+// False color image of one metric, scale maps to the top of the ramp
+inline void heatmapImage(const CostBuffer& cost, int metric, float scale, Image& img)
+{
+    img = Image(cost.width, cost.height);
+    for(int i = 0; i < cost.width * cost.height; i++)
+    {
+        Vec3 c = heatColor(cost.data[COST_METRICS * i + metric] / scale);
+        img.data[3 * i + 0] = c[0];
+        img.data[3 * i + 1] = c[1];
+        img.data[3 * i + 2] = c[2];
+    }
+}
+
+// Samples taken for each pixel by adaptive sampling. Rows run bottom to top like Image.
+struct SampleMap
+{
+    int width;
+    int height;
+    std::vector<float> data;
+
+    SampleMap() : width(0), height(0) {}
+    SampleMap(int w, int h) : width(w), height(h), data(w * h, 0.0f) {}
+
+    float& at(int x, int y)
+    {
+        return data[y * width + x];
+    }
+};
+
+// Writes every stride-th float of data as a greyscale PFM. PFM rows run bottom to top already.
+inline bool writePFMPlane(const char *path, int width, int height, const float *data, int stride)
+{
+    FILE *f = fopen(path, "wb");
+    if(!f)
+    {
+        fprintf(stderr, "Could not open %s for writing.\n", path);
+        return false;
+    }
+
+    // A negative scale marks little-endian data
+    const uint16_t one = 1;
+    fprintf(f, "Pf\n%d %d\n%s\n", width, height, *(const uint8_t *)&one ? "-1.0" : "1.0");
+    std::vector<float> row(width);
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+            row[x] = data[stride * (y * width + x)];
+        fwrite(&row[0], sizeof(float), row.size(), f);
+    }
+    fclose(f);
+    return true;
+}
+
+// Writes one metric as a greyscale PFM
+inline bool writePFM(const char *path, const CostBuffer& cost, int metric)
+{
+    return writePFMPlane(path, cost.width, cost.height, &cost.data[metric], COST_METRICS);
+}
+
+inline bool writePFM(const char *path, const SampleMap& samples)
+{
+    return writePFMPlane(path, samples.width, samples.height, &samples.data[0], 1);
+}
+
+inline unsigned char toByte(float f)
+{
+    f = f < 0.0f ? 0.0f : (f > 1.0f ? 1.0f : f);
+    return (unsigned char)(f * 255.0f + 0.5f);
+}
+
+// Writes a binary PPM, top row first
+inline bool writePPM(const char *path, const Image& img)
+{
+    FILE *f = fopen(path, "wb");
+    if(!f)
+    {
+        fprintf(stderr, "Could not open %s for writing.\n", path);
+        return false;
+    }
+
+    fprintf(f, "P6\n%d %d\n255\n", img.width, img.height);
+    std::vector<unsigned char> row(3 * img.width);
+    for(int y = img.height - 1; y >= 0; y--)
+    {
+        const float *p = &img.data[3 * y * img.width];
+        for(int i = 0; i < 3 * img.width; i++)
+            row[i] = toByte(p[i]);
+        fwrite(&row[0], 1, row.size(), f);
+    }
+    fclose(f);
+    return true;
+}
+
+#endif
@@ -0,0 +1,268 @@
+#ifndef IRRADIANCE_H
+#define IRRADIANCE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "alloc.h"
+#include "scene.h"
+#include "vec.h"
+
+// Irradiance cache (Ward, Rubinstein and Clear 1988) for the diffuse light that reaches
+// a surface off the other surfaces. Irradiance is gathered over the hemisphere at sparse
+// points only and interpolated in between, each record extrapolated to the lookup point
+// by its rotational and translational gradients (Ward and Heckbert 1992). The records
+// live in a hash grid with one level per power of two cell size, a record in the level
+// whose cells are at least as wide as its area of influence, which keeps lookups at one
+// cell per level. Gathering the records is in tracer.h, see fillIrradianceCache.
+
+static const int IRRADIANCE_THETA_STRATA = 8;
+static const int IRRADIANCE_PHI_STRATA = 24;
+static const float IRRADIANCE_MIN_PIXELS = 2.0f;            // Smallest and largest area of influence on screen
+static const float IRRADIANCE_MAX_PIXELS = 32.0f;
+static const float IRRADIANCE_RELAXED = 2.0f;               // Tolerance factor of the fallback lookup of the render
+static const float IRRADIANCE_INVALIDATION_RANGE = 8.0f;    // Records closer than this many radii to a moved sphere are dropped
+static const int IRRADIANCE_LEVELS = 64;                    // Cell sizes 2^-32 to 2^31
+static const int IRRADIANCE_STRIDES[] = { 32, 16, 8, 4 };   // Pixel spacing of the candidates of each fill pass
+
+struct IrradianceRecord
+{
+    Vec3 position;
+    Vec3 normal;
+    Vec3 irradiance;
+    Vec3 rotGradient[3];         // Per color channel
+    Vec3 transGradient[3];
+    float radius;                // Harmonic mean distance, bounded by the gradient and the pixel limits
+};
+
+// One record in one cell, chained from IrradianceCache::buckets
+struct IrradianceCell
+{
+    uint64_t key;
+    int record;
+    int next;
+};
+
+struct IrradianceCacheStats
+{
+    long long added;             // Records gathered by the last fill
+    long long invalidated;       // Records dropped before the last fill
+    long long allocations;       // Heap allocations since the last invalidation, by reserveIrradiance only
+
+    IrradianceCacheStats() : added(0), invalidated(0), allocations(0) {}
+};
+
+// An irradiance record gathered by fillIrradianceCache and the pixel it was gathered for
+struct IrradianceCandidate
+{
+    int pixel;
+    IrradianceRecord record;
+};
+
+struct IrradianceCache
+{
+    float error;                 // Ward's a, a record serves points with weight above 1 / error
+    std::vector<IrradianceRecord> records;
+    std::vector<int> buckets;    // Power of two number of chains, -1 terminated
+    std::vector<IrradianceCell> cells;
+    std::vector<IrradianceCandidate> candidates;   // Scratch of fillIrradianceCache
+    uint64_t levels;             // Bit l + 32 set if level l holds records
+    IrradianceCacheStats stats;
+
+    IrradianceCache() : error(0.2f), levels(0) {}
+};
+
+inline float irradianceCellSize(int level)
+{
+    return ldexpf(1.0f, level);
+}
+
+// Smallest level whose cells are at least twice the radius of influence, so that a record
+// overlaps at most two cells along each axis
+inline int irradianceLevel(float influence)
+{
+    int level = (int)ceilf(log2f(std::max(2.0f * influence, 1e-9f)));
+    return std::max(-IRRADIANCE_LEVELS / 2, std::min(level, IRRADIANCE_LEVELS / 2 - 1));
+}
+
+inline uint64_t irradianceCellKey(int level, int x, int y, int z)
+{
+    const int bias = 1 << 18;
+    return (uint64_t)(level + IRRADIANCE_LEVELS / 2) << 57 | (uint64_t)((x + bias) & 0x7ffff) << 38 |
+           (uint64_t)((y + bias) & 0x7ffff) << 19 | (uint64_t)((z + bias) & 0x7ffff);
+}
+
+inline int irradianceBucket(const IrradianceCache& cache, uint64_t key)
+{
+    return (int)((key * 0x9e3779b97f4a7c15ull) >> 32) & ((int)cache.buckets.size() - 1);
+}
+
+inline void linkIrradianceRecord(IrradianceCache& cache, int r)
+{
+    const IrradianceRecord& rec = cache.records[r];
+    float influence = cache.error * rec.radius;
+    int level = irradianceLevel(influence);
+    float size = irradianceCellSize(level);
+    int lo[3], hi[3];
+    for(int i = 0; i < 3; i++)
+    {
+        lo[i] = (int)floorf((rec.position[i] - influence) / size);
+        hi[i] = (int)floorf((rec.position[i] + influence) / size);
+    }
+    for(int z = lo[2]; z <= hi[2]; z++)
+    {
+        for(int y = lo[1]; y <= hi[1]; y++)
+        {
+            for(int x = lo[0]; x <= hi[0]; x++)
+            {
+                IrradianceCell cell;
+                cell.key = irradianceCellKey(level, x, y, z);
+                cell.record = r;
+                int b = irradianceBucket(cache, cell.key);
+                cell.next = cache.buckets[b];
+                cache.buckets[b] = (int)cache.cells.size();
+                cache.cells.push_back(cell);
+            }
+        }
+    }
+    cache.levels |= 1ull << (level + IRRADIANCE_LEVELS / 2);
+}
+
+// Rebuilds the hash grid from the records, with a chain for each of the up to 8 cells of
+// every record
+inline void rebuildIrradianceGrid(IrradianceCache& cache)
+{
+    size_t buckets = 64;
+    while(buckets < 8 * cache.records.size())
+        buckets *= 2;
+    cache.buckets.assign(buckets, -1);
+    cache.cells.clear();
+    cache.levels = 0;
+    for(size_t r = 0; r < cache.records.size(); r++)
+        linkIrradianceRecord(cache, (int)r);
+}
+
+// Grows the records and the grid to hold numRecords records and the candidates to hold
+// numCandidates, where that is past the most they held so far. Capacity is never given
+// back, so adding records below the peak, invalidating and rebuilding the grid do not
+// allocate, and only these allocations are in stats.allocations.
+inline void reserveIrradiance(IrradianceCache& cache, size_t numRecords, size_t numCandidates = 0)
+{
+    long long allocations = threadAllocCounters().allocations;
+    if(numRecords > cache.records.capacity())
+    {
+        numRecords = std::max(numRecords, 2 * cache.records.capacity());
+        size_t buckets = 64;
+        while(buckets < 8 * numRecords)
+            buckets *= 2;
+        cache.records.reserve(numRecords);
+        cache.cells.reserve(8 * numRecords);
+        cache.buckets.reserve(buckets);
+    }
+    cache.candidates.reserve(numCandidates);
+    cache.stats.allocations += threadAllocCounters().allocations - allocations;
+}
+
+// Adds rec, which must fit the capacity reserveIrradiance set aside
+inline void addIrradianceRecord(IrradianceCache& cache, const IrradianceRecord& rec)
+{
+    if(cache.buckets.empty() || cache.cells.size() >= cache.buckets.size())
+    {
+        cache.records.push_back(rec);
+        rebuildIrradianceGrid(cache);
+        return;
+    }
+    cache.records.push_back(rec);
+    linkIrradianceRecord(cache, (int)cache.records.size() - 1);
+}
+
+// Ward's weight of record rec at point p with normal n, 0 if the record lies in front of
+// p, where it would see other surroundings
+inline float irradianceWeight(const IrradianceRecord& rec, const Vec3& p, const Vec3& n)
+{
+    Vec3 d = p - rec.position;
+    if(dot(d, n + rec.normal) < -1e-3f * rec.radius)
+        return 0.0f;
+    float e = norm(d) / rec.radius + sqrtf(std::max(0.0f, 1.0f - dot(n, rec.normal)));
+    return e > 0.0f ? 1.0f / e : 1e9f;
+}
+
+// Irradiance at p with normal n, interpolated from the records that weigh more than
+// 1 / (relax * error). Past a relax of 1 only the records sharing a cell with p are
+// seen, which reach up to twice their area of influence. Returns false if none does.
+inline bool lookupIrradiance(const IrradianceCache& cache, const Vec3& p, const Vec3& n, Vec3& irradiance,
+                             float relax = 1.0f)
+{
+    if(cache.records.empty())
+        return false;
+    Vec3 sum(0.0f);
+    float wsum = 0.0f;
+    float tolerance = relax * cache.error;
+    float minWeight = 1.0f / tolerance;
+    for(int l = 0; l < IRRADIANCE_LEVELS; l++)
+    {
+        if(!(cache.levels & (1ull << l)))
+            continue;
+        int level = l - IRRADIANCE_LEVELS / 2;
+        float size = irradianceCellSize(level);
+        uint64_t key = irradianceCellKey(level, (int)floorf(p[0] / size), (int)floorf(p[1] / size), (int)floorf(p[2] / size));
+        for(int c = cache.buckets[irradianceBucket(cache, key)]; c >= 0; c = cache.cells[c].next)
+        {
+            const IrradianceCell& cell = cache.cells[c];
+            if(cell.key != key)
+                continue;
+            const IrradianceRecord& rec = cache.records[cell.record];
+            Vec3 offset = p - rec.position;
+            if(norm2(offset) >= tolerance * tolerance * rec.radius * rec.radius)
+                continue;
+            float w = irradianceWeight(rec, p, n);
+            if(w <= minWeight)
+                continue;
+            Vec3 rot = cross(rec.normal, n);
+            Vec3 e;
+            for(int i = 0; i < 3; i++)
+                e[i] = std::max(0.0f, rec.irradiance[i] + dot(rot, rec.rotGradient[i]) + dot(offset, rec.transGradient[i]));
+            sum += e * w;
+            wsum += w;
+        }
+    }
+    if(wsum <= 0.0f)
+        return false;
+    irradiance = sum / wsum;
+    return true;
+}
+
+// Drops the records a moved sphere may have changed: those it now covers or used to, and
+// those close enough for it to fill a noticeable part of their hemisphere
+inline void invalidateIrradiance(IrradianceCache& cache, const std::vector<Sphere>& before, const std::vector<Sphere>& after)
+{
+    cache.stats.allocations = 0;
+    size_t kept = 0;
+    for(size_t r = 0; r < cache.records.size(); r++)
+    {
+        const IrradianceRecord& rec = cache.records[r];
+        bool stale = false;
+        for(size_t i = 0; i < before.size() && i < after.size() && !stale; i++)
+        {
+            if(norm2(before[i].center - after[i].center) == 0.0f && before[i].radius == after[i].radius)
+                continue;
+            stale = norm(rec.position - before[i].center) < before[i].radius * IRRADIANCE_INVALIDATION_RANGE ||
+                    norm(rec.position - after[i].center) < after[i].radius * IRRADIANCE_INVALIDATION_RANGE;
+        }
+        if(!stale)
+            cache.records[kept++] = rec;
+    }
+    cache.stats.invalidated = (long long)(cache.records.size() - kept);
+    if(kept == cache.records.size())
+        return;
+    cache.records.resize(kept);
+    rebuildIrradianceGrid(cache);
+}
+
+inline void printIrradianceCacheStats(const IrradianceCache& cache)
+{
+    printf("irradiance cache: %d records, %lld added, %lld invalidated\n",
+           (int)cache.records.size(), cache.stats.added, cache.stats.invalidated);
+}
+
+#endif
@@ -1,5 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <chrono>
+#include <thread>
 #include <GL/glew.h>
  
 #if __GNUG__
@@ -8,8 +11,40 @@
 #   include <GL/glfw3.h>
 #endif
 
+#include "batch.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "framecache.h"
+#include "framewriter.h"
 #include "mat.h"
+#include "raster.h"
+#include "scene.h"
 #include "shaders.h"
+#include "snapshot.h"
+#include "temporal.h"
+#include "tracer.h"
+
+// Count every heap allocation for the telemetry in alloc.h. Kept out of line so that
+// GCC does not mistake the inlined malloc and free for mismatched new and delete.
+#if __GNUG__
+#   define NOINLINE __attribute__((noinline))
+#else
+#   define NOINLINE
+#endif
+
+NOINLINE void *operator new(size_t size)
+{
+    countAllocation(size);
+    void *p = malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+NOINLINE void operator delete(void *p) noexcept
+{
+    free(p);
+}
 
 static double g_framesPerSec = 60.0f;
 static double g_distancePerSec = 3.0f;
@@ -21,33 +56,131 @@ GLFWwindow *window;
 GLuint vao, vbo;
 GLuint shaderProgram;
 
-Vec4 sphere2Pos;
+// Buffer textures holding the particle layer
+GLuint particleTex[3], particleBuf[3];
 
-struct Material
-{
-    float ka;                // Ambient coefficient
-    float kd;                // Diffuse coefficient
-    float ks;                // Specular/Reflective coefficient
-    float kt;                // Transmission coefficient
-    float ior;               // Index of refraction
-    Vec3 color;              
-    int matType;             // Material type: 0 = Opaque non-reflective, 1 = reflective, 2 = transmissive
-};
+// Command line options
+static const char *g_sceneName = "default";
+static int g_numParticles = 20000;
+static float g_particleRadius = 0.03f;
+static int g_accel = ACCEL_GRID;
+static const char *g_streamFile = "particles.treelets";
+static int g_streamCacheMB = 256;
+static const char *g_cpuOutput = NULL;
+static bool g_benchAccel = false;
+static bool g_benchThreads = false;
+static bool g_checkAllocations = false;
+static bool g_pinThreads = false;
+static int g_numThreads = 0;
+static int g_tileSize = 0;
+static const char *g_coordinatorAddress = NULL;
+static const char *g_workerAddress = NULL;
+static int g_spawnWorkers = 0;
+static int g_tilesPerFrame = 4;
+static int g_denoiseIterations = 0;
+static int g_maxBounce = -1;
+static float g_throughputCutoff = -1.0f;
+static int g_rouletteDepth = -2;
+static bool g_stats = false;
+static int g_firstFrame = -1;
+static int g_lastFrame = -1;
+static const char *g_recordPath = NULL;
+static bool g_recordPPM = true;
+static int g_heatmap = -1;
+static float g_heatmapScale = 0.0f;
+static const char *g_heatmapPFM = NULL;
+static bool g_hybrid = false;
+static bool g_tileLists = false;
+static int g_bounceFactor = 1;
+static int g_bounceMaterials = BOUNCE_DEFAULT_MATERIALS;
+static int g_samplesPerPixel = 0;
+static int g_sampler = -1;
+static float g_lensRadius = -1.0f;
+static float g_focusDistance = -1.0f;
+static bool g_lightSampling = false;
+static bool g_progressive = false;
+static float g_adaptiveThreshold = -1.0f;
+static int g_maxSamples = 0;
+static const char *g_sampleMapPath = NULL;
+static bool g_compute = false;
+static float g_irradianceError = 0.0f;
+static int g_shadowMapSize = 0;
+static bool g_compact = false;
+static const char *g_frameCacheDir = NULL;
+static int g_frameCacheMB = 1024;
+static bool g_temporal = false;
 
-struct Sphere
-{
-    Vec3 center;             
-    float radius;
-    Material mat;
-};
+// Offscreen G-buffer the tracer renders into in tiled, denoised, stats and cost export
+// modes: color, normal + depth, albedo, path stats and per pixel cost. Finished tiles
+// stay in it between frames.
+static const int FRAME_TARGETS = 5;
+GLuint frameFbo, frameTex[FRAME_TARGETS];
+int nextTile = 0;
 
-struct Plane
-{
-    Vec3 point;
-    Vec3 normal;
-    Material mat;
+// Ping-pong targets of the a-trous denoiser
+GLuint denoiseProgram;
+GLuint denoiseFbo[2], denoiseTex[2];
+
+// Primary hits rasterized for the hybrid mode, read by basicFragSrc from texture unit 7
+GLuint rasterProgram;
+GLuint hitFbo, hitTex, hitDepth;
+Scene *displayedScene = NULL;        // Kept in step with the scene uniforms for the raster pass
+
+// Per screen tile object lists, rebuilt on the CPU whenever the scene moves
+ScreenTiles screenTiles;
+GLuint tileListTex[2], tileListBuf[2];
+
+// Low resolution bounce light: light + material type, normal + depth
+GLuint bounceFbo, bounceTex[2];
+int bounceWidth, bounceHeight;
+
+// Blue noise tile for the sampler, on texture unit 12
+GLuint blueNoiseTex;
+
+// Frames averaged into the frame target in progressive mode, since the scene last changed
+int progressiveFrames = 0;
+
+// Adaptive progressive accumulation, mean color + samples and luminance moments. Frames
+// read one pair from texture units 13 and 14 and write the other as attachments 5 and 6.
+static const int ACCUM_TARGETS = 2;
+GLuint accumTex[2][ACCUM_TARGETS];
+int accumWrite = 0;
+bool adaptive = false;
+
+// Temporal reuse in the window, see temporal.h. Pixels whose history is current are
+// discarded and keep what the frame target holds from the frame they were traced in.
+// Their motion mask and frame are ping-ponged through historyTex, written as attachment
+// 7 and read from texture unit 4, and each frame's copy starts out as the last one so the
+// discarded pixels carry theirs over. The moving spheres are on texture unit 5.
+static const int HISTORY_TARGET = FRAME_TARGETS + ACCUM_TARGETS;
+GLuint historyFbo[2], historyTex[2];
+int historyWrite = 0;
+bool historyValid = false;
+GLuint motionTex, motionBuf;
+MotionBounds motionBounds;
+std::vector<float> motionData;
+
+// Compute shader tracer of traceCompSrc, used instead of basicFragSrc with --compute when
+// the context has OpenGL 4.3. It writes the frame target through image units 0 to 6.
+static const int COMPUTE_GROUP_SIZE = 64;            // local_size_x of traceCompSrc
+static const int COMPUTE_PERSISTENT_GROUPS = 1024;   // Enough threads to fill a GPU, they loop until the queue is empty
+bool computeTracer = false;
+GLuint workQueueBuf;
+int computeBatchLimit = 1 << 30;                     // uBatchLimit, 1 where invocations can't run for long
+static const GLenum FRAME_IMAGE_FORMATS[FRAME_TARGETS + 2] = {
+    GL_RGBA32F, GL_RGBA32F, GL_RGBA8, GL_RGBA32UI, GL_RGBA32F, GL_RGBA32F, GL_RG32F
 };
 
+// Asynchronous readback of displayed frames for --record. glReadPixels goes into the next
+// pixel pack buffer of the ring, and a buffer is mapped only once its fence has signaled,
+// normally one or two frames later, so the copy never stalls the pipeline.
+static const int READBACK_RING_SIZE = 3;
+GLuint readbackPbo[READBACK_RING_SIZE];
+GLsync readbackFence[READBACK_RING_SIZE];
+int readbackHead = 0, readbackCount = 0;
+int readbackWaits = 0;       // Times the ring was full and had to wait for the oldest fence
+FrameWriter frameWriter;
+
 // Compile the shaders and link the program
 void readAndCompileShaders(const char *vs, const char *fs, GLuint *shaderProgram)
 {
@@ -84,7 +217,15 @@ void readAndCompileShaders(const char *vs, const char *fs, GLuint *shaderProgram
     *shaderProgram = glCreateProgram();
     glAttachShader(*shaderProgram, vertexShader);
     glAttachShader(*shaderProgram, fragmentShader);
+    glBindAttribLocation(*shaderProgram, 0, "aPosition");
     glBindFragDataLocation(*shaderProgram, 0, "outColor");
+    glBindFragDataLocation(*shaderProgram, 1, "outNormal");
+    glBindFragDataLocation(*shaderProgram, 2, "outAlbedo");
+    glBindFragDataLocation(*shaderProgram, 3, "outStats");
+    glBindFragDataLocation(*shaderProgram, 4, "outCost");
+    glBindFragDataLocation(*shaderProgram, 5, "outAccum");
+    glBindFragDataLocation(*shaderProgram, 6, "outMoments");
+    glBindFragDataLocation(*shaderProgram, 7, "outHistory");
     glLinkProgram(*shaderProgram);
 
     glGetProgramiv(*shaderProgram, GL_LINK_STATUS, &status);
@@ -99,6 +240,42 @@ void readAndCompileShaders(const char *vs, const char *fs, GLuint *shaderProgram
     glDeleteShader(fragmentShader);
 }
 
+// Compile and link a compute shader program. Returns false if either fails.
+bool compileComputeShader(const char *cs, GLuint *shaderProgram)
+{
+    GLuint computeShader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(computeShader, 1, &cs, NULL);
+    glCompileShader(computeShader);
+
+    GLint status;
+    GLchar infoLog[512];
+    glGetShaderiv(computeShader, GL_COMPILE_STATUS, &status);
+    if(status != GL_TRUE)
+    {
+        glGetShaderInfoLog(computeShader, 512, NULL, infoLog);
+        fprintf(stderr, "Compute shader compiled incorrectly.\n");
+        fprintf(stderr, "%s\n", infoLog);
+        glDeleteShader(computeShader);
+        return false;
+    }
+
+    *shaderProgram = glCreateProgram();
+    glAttachShader(*shaderProgram, computeShader);
+    glLinkProgram(*shaderProgram);
+    glDeleteShader(computeShader);
+
+    glGetProgramiv(*shaderProgram, GL_LINK_STATUS, &status);
+    if(status != GL_TRUE)
+    {
+        glGetProgramInfoLog(*shaderProgram, 512, NULL, infoLog);
+        fprintf(stderr, "Compute shader linked incorrectly.\n");
+        fprintf(stderr, "%s\n", infoLog);
+        glDeleteProgram(*shaderProgram);
+        return false;
+    }
+    return true;
+}
+
 // Specify the values of a light struct uniform in the fragment shader
 void setLight(GLuint shaderProgram, const char *lightName, Vec3 position, Vec3 color, float intensity)
 {
@@ -116,41 +293,41 @@ void setLight(GLuint shaderProgram, const char *lightName, Vec3 position, Vec3 c
     glUniform1f(glGetUniformLocation(shaderProgram, lightMember), intensity);
 }
 
-// Specify the values of a material struct in the fragment shader
-void setMaterial(GLuint shaderProgram, const char *objectName, Material mat)
+// Specify the values of a material struct in the fragment shader, an entry of uMaterials
+void setMaterial(GLuint shaderProgram, const char *materialName, Material mat)
 {
-    char objMatMember[30];
-    strcpy(objMatMember, objectName);
-    strcat(objMatMember, ".mat.ka");    
-    glUniform1f(glGetUniformLocation(shaderProgram, objMatMember), mat.ka);
+    char matMember[30];
+    strcpy(matMember, materialName);
+    strcat(matMember, ".ka");    
+    glUniform1f(glGetUniformLocation(shaderProgram, matMember), mat.ka);
 
-    strcpy(objMatMember, objectName);
-    strcat(objMatMember, ".mat.kd");    
-    glUniform1f(glGetUniformLocation(shaderProgram, objMatMember), mat.kd);
+    strcpy(matMember, materialName);
+    strcat(matMember, ".kd");    
+    glUniform1f(glGetUniformLocation(shaderProgram, matMember), mat.kd);
     
-    strcpy(objMatMember, objectName);
-    strcat(objMatMember, ".mat.ks");    
-    glUniform1f(glGetUniformLocation(shaderProgram, objMatMember), mat.ks);
+    strcpy(matMember, materialName);
+    strcat(matMember, ".ks");    
+    glUniform1f(glGetUniformLocation(shaderProgram, matMember), mat.ks);
 
-    strcpy(objMatMember, objectName);
-    strcat(objMatMember, ".mat.color");    
-    glUniform3f(glGetUniformLocation(shaderProgram, objMatMember), mat.color[0], mat.color[1], mat.color[2]);
+    strcpy(matMember, materialName);
+    strcat(matMember, ".color");    
+    glUniform3f(glGetUniformLocation(shaderProgram, matMember), mat.color[0], mat.color[1], mat.color[2]);
 
-    strcpy(objMatMember, objectName);    
-    strcat(objMatMember, ".mat.matType");
-    glUniform1i(glGetUniformLocation(shaderProgram, objMatMember), mat.matType);
+    strcpy(matMember, materialName);    
+    strcat(matMember, ".matType");
+    glUniform1i(glGetUniformLocation(shaderProgram, matMember), mat.matType);
 
-    strcpy(objMatMember, objectName);
-    strcat(objMatMember, ".mat.ior");
-    glUniform1f(glGetUniformLocation(shaderProgram, objMatMember), mat.ior);
+    strcpy(matMember, materialName);
+    strcat(matMember, ".ior");
+    glUniform1f(glGetUniformLocation(shaderProgram, matMember), mat.ior);
 
-    strcpy(objMatMember, objectName);
-    strcat(objMatMember, ".mat.kt");
-    glUniform1f(glGetUniformLocation(shaderProgram, objMatMember), mat.kt);    
+    strcpy(matMember, materialName);
+    strcat(matMember, ".kt");
+    glUniform1f(glGetUniformLocation(shaderProgram, matMember), mat.kt);    
 }
 
 // Specify the values of a plane struct in the fragment shader
-void setPlane(GLuint shaderProgram, const char *planeName, Vec3 point, Vec3 normal, Material mat, bool checkered)
+void setPlane(GLuint shaderProgram, const char *planeName, Vec3 point, Vec3 normal, int prim, bool checkered)
 {
     char planeMember[30];
     strcpy(planeMember, planeName);
@@ -165,11 +342,13 @@ void setPlane(GLuint shaderProgram, const char *planeName, Vec3 point, Vec3 norm
     strcat(planeMember, ".checkered");
     glUniform1i(glGetUniformLocation(shaderProgram, planeMember), checkered);
 
-    setMaterial(shaderProgram, planeName, mat);
+    strcpy(planeMember, planeName);
+    strcat(planeMember, ".prim");
+    glUniform1i(glGetUniformLocation(shaderProgram, planeMember), prim);
 }
 
 // Specify the values of a sphere struct in the fragment shader
-void setSphere(GLuint shaderProgram, const char *sphereName, Vec3 point, float radius, Material mat)
+void setSphere(GLuint shaderProgram, const char *sphereName, Vec3 point, float radius, int prim)
 {
     char sphereMember[30];
     strcpy(sphereMember, sphereName);
@@ -180,151 +359,815 @@ void setSphere(GLuint shaderProgram, const char *sphereName, Vec3 point, float r
     strcat(sphereMember, ".radius");
     glUniform1f(glGetUniformLocation(shaderProgram, sphereMember), radius);
 
-    setMaterial(shaderProgram, sphereName, mat);
+    strcpy(sphereMember, sphereName);
+    strcat(sphereMember, ".prim");
+    glUniform1i(glGetUniformLocation(shaderProgram, sphereMember), prim);
+}
+
+// Creates a buffer texture with the given contents and binds it to a texture unit
+void setBufferTexture(GLuint shaderProgram, const char *samplerName, int unit, GLuint tex, GLuint buf,
+                      GLenum format, const void *data, size_t size)
+{
+    glBindBuffer(GL_TEXTURE_BUFFER, buf);
+    glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_BUFFER, tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, buf);
+    glUniform1i(glGetUniformLocation(shaderProgram, samplerName), unit);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Uploads the particle layer and, for ACCEL_GRID, its uniform grid
+void setParticles(GLuint shaderProgram, const Scene& scene, const UniformGrid& grid)
+{
+    // Compact scenes store the centers in unorm16, 8 bytes a particle instead of 16
+    std::vector<float> particles;
+    std::vector<uint16_t> packedParticles;
+    if(scene.compact)
+    {
+        packedParticles.assign(4 * scene.particles.size() + 4, 0);
+        for(size_t i = 0; i < scene.particles.size(); i++)
+        {
+            for(int j = 0; j < 3; j++)
+                packedParticles[4 * i + j] = packParticleCoordinate(scene, scene.particles[i][j], j);
+        }
+        setBufferTexture(shaderProgram, "uParticleCenters", 1, particleTex[0], particleBuf[0], GL_RGBA16,
+                         &packedParticles[0], packedParticles.size() * sizeof(uint16_t));
+    }else
+    {
+        particles.assign(4 * scene.particles.size() + 4, 0.0f);
+        for(size_t i = 0; i < scene.particles.size(); i++)
+        {
+            for(int j = 0; j < 3; j++)
+                particles[4 * i + j] = scene.particles[i][j];
+            particles[4 * i + 3] = scene.particleRadius;
+        }
+        setBufferTexture(shaderProgram, "uParticleCenters", 1, particleTex[0], particleBuf[0], GL_RGBA32F,
+                         &particles[0], particles.size() * sizeof(float));
+    }
+
+    // Buffers are never empty so that the samplers always have a valid texture
+    std::vector<int> cellStart(grid.cellStart);
+    std::vector<int> indices(grid.indices);
+    cellStart.push_back(0);
+    indices.push_back(0);
+
+    setBufferTexture(shaderProgram, "uGridCells", 2, particleTex[1], particleBuf[1], GL_R32I,
+                     &cellStart[0], cellStart.size() * sizeof(int));
+    setBufferTexture(shaderProgram, "uGridIndices", 3, particleTex[2], particleBuf[2], GL_R32I,
+                     &indices[0], indices.size() * sizeof(int));
+
+    glUniform1i(glGetUniformLocation(shaderProgram, "uParticles.count"), (int)scene.particles.size());
+    glUniform1f(glGetUniformLocation(shaderProgram, "uParticles.radius"), scene.particleRadius);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uParticles.firstPrim"), particlePrimitive(scene, 0));
+    const Vec3& origin = scene.particleOrigin;
+    const Vec3& step = scene.particleStep;
+    glUniform3f(glGetUniformLocation(shaderProgram, "uParticles.origin"), origin[0], origin[1], origin[2]);
+    glUniform3f(glGetUniformLocation(shaderProgram, "uParticles.step"), step[0], step[1], step[2]);
+
+    // The shader has no BVH, it tests every particle instead
+    int accel = scene.accel == ACCEL_GRID ? ACCEL_GRID : ACCEL_NONE;
+    glUniform1i(glGetUniformLocation(shaderProgram, "uAccel"), accel);
+    glUniform3f(glGetUniformLocation(shaderProgram, "uGrid.bmin"), grid.bmin[0], grid.bmin[1], grid.bmin[2]);
+    glUniform3f(glGetUniformLocation(shaderProgram, "uGrid.cellSize"), grid.cellSize[0], grid.cellSize[1], grid.cellSize[2]);
+    glUniform3i(glGetUniformLocation(shaderProgram, "uGrid.res"), grid.res[0], grid.res[1], grid.res[2]);
 }
 
 // Sets up the scene
-void initScene()
+void initScene(const Scene& scene, const UniformGrid& grid)
 {
     // Set the number of ray bounces
-    glUniform1i(glGetUniformLocation(shaderProgram, "MAX_BOUNCE"), 4);
-    
-    //--------------------- Lights
-    // Light1
-    Vec3 point(-1.0f, 1.0f, 1.0f);
-    Vec3 color(1.0f, 1.0f, 1.0f);
-    float intensity = 2.0f;
-    setLight(shaderProgram, "uLight1", point, color, intensity);
-
-    // Light2
-    point = Vec3(1.0f, 2.0f, 0.0f);
-    color = Vec3(1.0f, 1.0f, 1.0f);
-    intensity = 0.5f;
-    setLight(shaderProgram, "uLight2", point, color, intensity);
-    
-    //--------------------- Spheres
-    // Sphere1
-    point = Vec3(0.0f, 0.0f, 0.0f);
-    //color = Vec3(0.5f, 0.0f, 0.0f);
-    color = Vec3(0.0f, 0.0f, 0.0f);
-    float radius = 0.3f;
-    Material mat;
-    mat.ka = 0.0f;
-    mat.kd = 0.0f;
-    //mat.ks = 1.0f;
-    mat.kt = 0.9f;
-    mat.color = color;
-    mat.matType = 2;
-    mat.ior = 1.5;
-    setSphere(shaderProgram, "uSphere1", point, radius, mat);
-
-    // Sphere2
-    point = Vec3(0.6f, 0.0f, 0.0f);
-    sphere2Pos = Vec4(point[0], point[1], point[2], 1.0f);
-    color = Vec3(0.35f, 0.3f, 0.2f);
-    radius = 0.2f;
-    mat.ka = 0.1f;
-    mat.kd = 0.8f;
-    mat.ks = 0.2f;
-    mat.color = color;
-    mat.matType = 1;
-    setSphere(shaderProgram, "uSphere2", point, radius, mat);
-    
-    // Sphere3
-    point = Vec3(0.0f, 0.61f, 0.0f);
-    //color = Vec3(0.5f, 0.0f, 0.0f);
-    color = Vec3(0.0f, 0.0f, 0.0f);
-    radius = 0.3f;
-    mat.ka = 0.0f;
-    mat.kd = 0.0f;
-    mat.ks = 0.9f;
-    mat.color = color;
-    mat.matType = 1;
-    setSphere(shaderProgram, "uSphere3", point, radius, mat);
-
-    //--------------------- Planes
-    // Plane1
-    point = Vec3(0.0f, 0.0f, -10.0f);
-    Vec3 normal(0.0f, 0.0f, 1.0f);
-    color = Vec3(1.0f, 1.0f, 1.0f);
-    mat.ka = 0.1f;
-    mat.kd = 0.6f;
-    mat.ks = 0.4f;
-    mat.color = color;
-    mat.matType = 0;
-    bool checkered = false;
-    setPlane(shaderProgram, "uPlane1", point, normal, mat, checkered);
-
-    // Plane2 left
-    point = Vec3(-4.0f, 0.0f, 0.0f);
-    normal = Vec3(1.0f, 0.0f, 0.0f);
-    color = Vec3(0.4f, 0.4f, 0.0f);
-    mat.ka = 0.1f;
-    mat.kd = 0.6f;
-    mat.ks = 0.4f;
-    mat.color = color;
-    mat.matType = 0;
-    checkered = false;            
-    setPlane(shaderProgram, "uPlane2", point, normal, mat, checkered);
-
-    // Plane3 right
-    point = Vec3(4.0f, 0.0f, 0.0f);
-    normal = Vec3(-1.0f, 0.0f, 0.0f);
-    color = Vec3(0.0f, 0.7f, 0.0f);
-    mat.ka = 0.1f;
-    mat.kd = 0.6f;
-    mat.ks = 0.4f;
-    mat.color = color;
-    mat.matType = 0;
-    checkered = false;            
-    setPlane(shaderProgram, "uPlane3", point, normal, mat, checkered);    
-    
+    glUniform1i(glGetUniformLocation(shaderProgram, "MAX_BOUNCE"), scene.maxBounce);
+    glUniform1f(glGetUniformLocation(shaderProgram, "THROUGHPUT_CUTOFF"), scene.throughputCutoff);
+    glUniform1i(glGetUniformLocation(shaderProgram, "ROULETTE_DEPTH"), scene.rouletteDepth);
 
-    // Plane4 back
-    point = Vec3(0.0f, 0.0f, 10.0f);
-    normal = Vec3(0.0f, 0.0f, -1.0f);
-    color = Vec3(0.0f, 0.0f, 0.4f);
-    mat.ka = 0.1f;
-    mat.kd = 0.6f;
-    mat.ks = 0.4f;
-    mat.color = color;
-    mat.matType = 0;
-    checkered = false;            
-    setPlane(shaderProgram, "uPlane4", point, normal, mat, checkered);    
-    
-    // Plane4 top
-    point = Vec3(0.0f, 4.0f, 0.0f);
-    normal = Vec3(0.0f, -1.0f, 0.0f);
-    color = Vec3(0.4f, 0.0f, 0.0f);
-    mat.ka = 0.1f;
-    mat.kd = 0.6f;
-    mat.ks = 0.4f;
-    mat.color = color;
-    mat.matType = 0;
-    checkered = false;            
-    setPlane(shaderProgram, "uPlane5", point, normal, mat, checkered);    
-    
-    // Plane4 bottom
-    point = Vec3(0.0f, -3.0f, 0.0f);
-    normal = Vec3(0.0f, 1.0f, 0.0f);
-    color = Vec3(1.0f, 1.0f, 1.0f);
-    mat.ka = 0.1f;
-    mat.kd = 0.6f;
-    mat.ks = 0.4f;
-    mat.color = color;
-    mat.matType = 1;
-    checkered = true;            
-    setPlane(shaderProgram, "uPlane6", point, normal, mat, checkered);    
+    for(size_t i = 0; i < scene.lights.size(); i++)
+    {
+        const Light& l = scene.lights[i];
+        setLight(shaderProgram, l.name, l.position, l.color, l.intensity);
+    }
+
+    for(size_t i = 0; i < scene.spheres.size(); i++)
+    {
+        const Sphere& s = scene.spheres[i];
+        setSphere(shaderProgram, s.name, s.center, s.radius, spherePrimitive(scene, (int)i));
+    }
+
+    for(size_t i = 0; i < scene.planes.size(); i++)
+    {
+        const Plane& p = scene.planes[i];
+        setPlane(shaderProgram, p.name, p.point, p.normal, (int)i, p.checkered);
+    }
+
+    // basicFragSrc sizes uMaterials for every object uniform it declares
+    std::vector<Material> materials;
+    buildMaterialTable(scene, materials);
+    for(size_t i = 0; i < materials.size(); i++)
+    {
+        char materialName[30];
+        snprintf(materialName, sizeof(materialName), "uMaterials[%d]", (int)i);
+        setMaterial(shaderProgram, materialName, materials[i]);
+    }
+
+    // Compact scenes read the materials from the packed table instead
+    std::vector<PackedMaterial> packed;
+    packMaterialTable(materials, packed);
+    for(size_t i = 0; i < packed.size(); i++)
+    {
+        char materialName[30];
+        snprintf(materialName, sizeof(materialName), "uMaterialCodes[%d]", (int)i);
+        glUniform3ui(glGetUniformLocation(shaderProgram, materialName), packed[i].color, packed[i].coefficients, packed[i].iorType);
+    }
+    glUniform1i(glGetUniformLocation(shaderProgram, "uCompact"), scene.compact);
+
+    setParticles(shaderProgram, scene, grid);
 }
 
-void draw_scene()
+// Creates a screen sized texture for an offscreen target
+GLuint createTargetTexture(GLenum internalFormat, GLenum format = GL_RGBA, GLenum type = GL_FLOAT,
+                           int width = IMAGE_WIDTH, int height = IMAGE_HEIGHT)
 {
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return tex;
+}
+
+// Creates the G-buffer the tracer renders into
+void initFrameTarget()
+{
+    // Half floats stop taking in new samples long before a progressive image converges, and
+    // would round the reused pixels of --temporal off what drawing to the window shows
+    frameTex[0] = createTargetTexture(g_progressive || computeTracer || g_temporal ? GL_RGBA32F : GL_RGBA16F);
+    frameTex[1] = createTargetTexture(GL_RGBA32F);
+    frameTex[2] = createTargetTexture(GL_RGBA8);
+    frameTex[3] = createTargetTexture(GL_RGBA32UI, GL_RGBA_INTEGER, GL_UNSIGNED_INT);
+    frameTex[4] = createTargetTexture(GL_RGBA32F);
+
+    glGenFramebuffers(1, &frameFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, frameFbo);
+    GLenum drawBuffers[FRAME_TARGETS + ACCUM_TARGETS];
+    for(int i = 0; i < FRAME_TARGETS; i++)
+    {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, frameTex[i], 0);
+        drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
+    }
+    int numTargets = FRAME_TARGETS;
+    if(adaptive)
+    {
+        for(int i = 0; i < 2; i++)
+        {
+            accumTex[i][0] = createTargetTexture(GL_RGBA32F);
+            accumTex[i][1] = createTargetTexture(GL_RG32F, GL_RG);
+        }
+        for(int i = 0; i < ACCUM_TARGETS; i++)
+        {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + FRAME_TARGETS + i, GL_TEXTURE_2D, accumTex[0][i], 0);
+            drawBuffers[FRAME_TARGETS + i] = GL_COLOR_ATTACHMENT0 + FRAME_TARGETS + i;
+        }
+        numTargets += ACCUM_TARGETS;
+    }
+    glDrawBuffers(numTargets, drawBuffers);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Frame buffer is incomplete.\n");
+
     glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Compiles the a-trous filter and creates its ping-pong targets
+void initDenoiser()
+{
+    readAndCompileShaders(basicVertSrc, atrousFragSrc, &denoiseProgram);
+    glUseProgram(denoiseProgram);
+
+    DenoiseParams params = defaultDenoiseParams();
+    glUniform1i(glGetUniformLocation(denoiseProgram, "uColor"), 4);
+    glUniform1i(glGetUniformLocation(denoiseProgram, "uNormalDepth"), 5);
+    glUniform1i(glGetUniformLocation(denoiseProgram, "uAlbedo"), 6);
+    glUniform1f(glGetUniformLocation(denoiseProgram, "uSigmaNormal"), params.sigmaNormal);
+    glUniform1f(glGetUniformLocation(denoiseProgram, "uSigmaDepth"), params.sigmaDepth);
+    glUniform1f(glGetUniformLocation(denoiseProgram, "uSigmaAlbedo"), params.sigmaAlbedo);
+
+    glGenFramebuffers(2, denoiseFbo);
+    for(int i = 0; i < 2; i++)
+    {
+        denoiseTex[i] = createTargetTexture(GL_RGBA16F);
+        glBindFramebuffer(GL_FRAMEBUFFER, denoiseFbo[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, denoiseTex[i], 0);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            fprintf(stderr, "Denoise framebuffer is incomplete.\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glUseProgram(shaderProgram);
+}
+
+// Runs the a-trous iterations over the G-buffer. Returns the framebuffer holding the result.
+GLuint runDenoiser()
+{
+    DenoiseParams params = defaultDenoiseParams();
+    glUseProgram(denoiseProgram);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D, frameTex[1]);
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_2D, frameTex[2]);
+
+    GLuint src = frameTex[0];
+    GLuint dst = frameFbo;
+    for(int i = 0; i < g_denoiseIterations; i++)
+    {
+        dst = denoiseFbo[i % 2];
+        glBindFramebuffer(GL_FRAMEBUFFER, dst);
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D, src);
+        glUniform1i(glGetUniformLocation(denoiseProgram, "uStepWidth"), 1 << i);
+        glUniform1f(glGetUniformLocation(denoiseProgram, "uSigmaColor"), params.sigmaColor / (float)(1 << i));
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        src = denoiseTex[i % 2];
+    }
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glUseProgram(shaderProgram);
+    return dst;
+}
+
+// Compiles the impostor shaders and creates the primary hit target with its float depth buffer
+void initHybrid()
+{
+    readAndCompileShaders(rasterVertSrc, rasterFragSrc, &rasterProgram);
+    glUseProgram(rasterProgram);
+    glUniform1i(glGetUniformLocation(rasterProgram, "uParticleCenters"), 1);
+
+    hitTex = createTargetTexture(GL_RGBA32F);
+    hitDepth = createTargetTexture(GL_DEPTH_COMPONENT32F, GL_DEPTH_COMPONENT);
+    glGenFramebuffers(1, &hitFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, hitFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hitTex, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, hitDepth, 0);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Primary hit framebuffer is incomplete.\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_2D, hitTex);
+    glActiveTexture(GL_TEXTURE0);
+
+    glUseProgram(shaderProgram);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uHybrid"), 1);
+}
+
+// Rasterizes the primary hits of the scene into hitTex. Objects are drawn in the order
+// intersectTest tests them and the depth test keeps the first of equally close hits.
+void drawPrimaryHits(const Scene& scene)
+{
+    glUseProgram(rasterProgram);
+    glBindFramebuffer(GL_FRAMEBUFFER, hitFbo);
+    const GLfloat miss[4] = { 100000.0f, -1.0f, 0.0f, 0.0f };
+    glClearBufferfv(GL_COLOR, 0, miss);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+
+    GLint kind = glGetUniformLocation(rasterProgram, "uKind");
+    GLint prim = glGetUniformLocation(rasterProgram, "uPrim");
+    glUniform1i(kind, 0);
+    for(size_t i = 0; i < scene.planes.size(); i++)
+    {
+        const Plane& p = scene.planes[i];
+        glUniform3f(glGetUniformLocation(rasterProgram, "uPoint"), p.point[0], p.point[1], p.point[2]);
+        glUniform3f(glGetUniformLocation(rasterProgram, "uNormal"), p.normal[0], p.normal[1], p.normal[2]);
+        glUniform1i(prim, (int)i);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+
+    glUniform1i(kind, 1);
+    for(size_t i = 0; i < scene.spheres.size(); i++)
+    {
+        const Sphere& s = scene.spheres[i];
+        glUniform3f(glGetUniformLocation(rasterProgram, "uCenter"), s.center[0], s.center[1], s.center[2]);
+        glUniform1f(glGetUniformLocation(rasterProgram, "uRadius"), s.radius);
+        glUniform1i(prim, spherePrimitive(scene, (int)i));
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+
+    if(!scene.particles.empty())
+    {
+        glUniform1i(kind, 2);
+        glUniform1f(glGetUniformLocation(rasterProgram, "uRadius"), scene.particleRadius);
+        glUniform1i(glGetUniformLocation(rasterProgram, "uCompact"), scene.compact);
+        glUniform3f(glGetUniformLocation(rasterProgram, "uParticleOrigin"),
+                    scene.particleOrigin[0], scene.particleOrigin[1], scene.particleOrigin[2]);
+        glUniform3f(glGetUniformLocation(rasterProgram, "uParticleStep"),
+                    scene.particleStep[0], scene.particleStep[1], scene.particleStep[2]);
+        glUniform1i(prim, particlePrimitive(scene, 0));
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)scene.particles.size());
+    }
+
+    glDisable(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glUseProgram(shaderProgram);
+}
+
+// Rebuilds the screen tile lists of the scene and uploads them to texture units 8 and 9
+void uploadScreenTiles(const Scene& scene)
+{
+    buildScreenTiles(screenTiles, scene, IMAGE_WIDTH, IMAGE_HEIGHT, SCREEN_TILE_SIZE);
+
+    // Never empty, so that the sampler always has a valid texture
+    if(screenTiles.prims.empty())
+        screenTiles.prims.push_back(0);
+    setBufferTexture(shaderProgram, "uTileStart", 8, tileListTex[0], tileListBuf[0], GL_R32I,
+                     &screenTiles.tileStart[0], screenTiles.tileStart.size() * sizeof(int));
+    setBufferTexture(shaderProgram, "uTilePrims", 9, tileListTex[1], tileListBuf[1], GL_R32I,
+                     &screenTiles.prims[0], screenTiles.prims.size() * sizeof(int));
+}
+
+void initTileLists()
+{
+    glGenTextures(2, tileListTex);
+    glGenBuffers(2, tileListBuf);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uTileLists"), 1);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uTileSize"), SCREEN_TILE_SIZE);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uTilesX"), (IMAGE_WIDTH + SCREEN_TILE_SIZE - 1) / SCREEN_TILE_SIZE);
+}
+
+// Creates the low resolution bounce target, read by basicFragSrc from texture units 10 and 11
+void initLowResBounces()
+{
+    bounceWidth = (IMAGE_WIDTH + g_bounceFactor - 1) / g_bounceFactor;
+    bounceHeight = (IMAGE_HEIGHT + g_bounceFactor - 1) / g_bounceFactor;
+    bounceTex[0] = createTargetTexture(computeTracer ? GL_RGBA32F : GL_RGBA16F, GL_RGBA, GL_FLOAT, bounceWidth, bounceHeight);
+    bounceTex[1] = createTargetTexture(GL_RGBA32F, GL_RGBA, GL_FLOAT, bounceWidth, bounceHeight);
+
+    glGenFramebuffers(1, &bounceFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, bounceFbo);
+    GLenum drawBuffers[2];
+    for(int i = 0; i < 2; i++)
+    {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, bounceTex[i], 0);
+        drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
+    }
+    glDrawBuffers(2, drawBuffers);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Bounce framebuffer is incomplete.\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    for(int i = 0; i < 2; i++)
+    {
+        glActiveTexture(GL_TEXTURE10 + i);
+        glBindTexture(GL_TEXTURE_2D, bounceTex[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    glUniform1i(glGetUniformLocation(shaderProgram, "uBounceFactor"), g_bounceFactor);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uBounceMaterials"), g_bounceMaterials);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uBouncePass"), 2);
+}
+
+// Creates the work queue of the compute tracer and binds the frame target to its image units
+void initComputeTracer()
+{
+    glGenBuffers(1, &workQueueBuf);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, workQueueBuf);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, workQueueBuf);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    for(int i = 0; i < FRAME_TARGETS; i++)
+        glBindImageTexture(i, frameTex[i], 0, GL_FALSE, 0, GL_READ_WRITE, FRAME_IMAGE_FORMATS[i]);
+    glUniform1f(glGetUniformLocation(shaderProgram, "uBlendWeight"), 1.0f);
+
+    // llvmpipe ends every loop of an invocation once the invocation as a whole has run
+    // 65535 loop iterations, which a persistent thread gets to within a few hundred
+    // pixels. There each invocation takes a single batch, with as many groups as it takes.
+    const char *renderer = (const char *)glGetString(GL_RENDERER);
+    if(renderer && strstr(renderer, "llvmpipe"))
+        computeBatchLimit = 1;
+    glUniform1i(glGetUniformLocation(shaderProgram, "uBatchLimit"), computeBatchLimit);
+}
+
+// Traces the pixels of a rect of the bound target. The fragment tracer draws the quad and
+// relies on the caller's scissor and viewport, the compute tracer dispatches its
+// persistent groups over the rect.
+void traceRect(int x, int y, int width, int height)
+{
+    if(!computeTracer)
+    {
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        return;
+    }
+
+    const GLuint zero = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, workQueueBuf);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), &zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glUniform4i(glGetUniformLocation(shaderProgram, "uTraceRect"), x, y, width, height);
+
+    // No more groups than there are batches to go around, and enough for all of them
+    // when an invocation only takes computeBatchLimit
+    int batches = ((width + 1) / 2) * ((height + 1) / 2);
+    int neededGroups = (batches + COMPUTE_GROUP_SIZE - 1) / COMPUTE_GROUP_SIZE;
+    int groups = std::min(COMPUTE_PERSISTENT_GROUPS, neededGroups);
+    if((long long)groups * COMPUTE_GROUP_SIZE * computeBatchLimit < batches)
+        groups = neededGroups;
+    glDispatchCompute(std::max(1, groups), 1, 1);
+    glMemoryBarrier(GL_ALL_BARRIER_BITS);
+}
+
+// Traces the bounce light of the frame at low resolution. The full resolution draws
+// that follow upsample it.
+void drawLowResBounces()
+{
+    GLint pass = glGetUniformLocation(shaderProgram, "uBouncePass");
+    glUniform1i(pass, 1);
+    if(computeTracer)
+    {
+        for(int i = 0; i < 2; i++)
+            glBindImageTexture(i, bounceTex[i], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        traceRect(0, 0, bounceWidth, bounceHeight);
+        for(int i = 0; i < 2; i++)
+            glBindImageTexture(i, frameTex[i], 0, GL_FALSE, 0, GL_READ_WRITE, FRAME_IMAGE_FORMATS[i]);
+    }else
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, bounceFbo);
+        glViewport(0, 0, bounceWidth, bounceHeight);
+        traceRect(0, 0, bounceWidth, bounceHeight);
+        glViewport(0, 0, IMAGE_WIDTH, IMAGE_HEIGHT);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    glUniform1i(pass, 2);
+}
+
+// Sets the sampling uniforms of the scene and uploads the blue noise tile if it is used
+void initSampling(const Scene& scene)
+{
+    glUniform1i(glGetUniformLocation(shaderProgram, "uSamples"), std::max(1, scene.samplesPerPixel));
+    glUniform1i(glGetUniformLocation(shaderProgram, "uSampleOffset"), 0);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uJitter"), jitterPixels(scene) || g_progressive);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uSampler"), scene.sampler);
+    glUniform1f(glGetUniformLocation(shaderProgram, "uLensRadius"), scene.lensRadius);
+    glUniform1f(glGetUniformLocation(shaderProgram, "uFocusDistance"), scene.focusDistance);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uLightSampling"), scene.lightSampling);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uAdaptive"), scene.adaptiveThreshold > 0.0f);
+    glUniform1f(glGetUniformLocation(shaderProgram, "uAdaptiveThreshold"), scene.adaptiveThreshold);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uMaxSamples"), std::max(scene.samplesPerPixel, scene.maxSamples));
+    if(scene.sampler != SAMPLER_BLUE_NOISE)
+        return;
+
+    glGenTextures(1, &blueNoiseTex);
+    glActiveTexture(GL_TEXTURE12);
+    glBindTexture(GL_TEXTURE_2D, blueNoiseTex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, BLUE_NOISE_SIZE, BLUE_NOISE_SIZE, 0, GL_RED, GL_FLOAT, &blueNoiseTile()[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Points the frame target at the accumulation pair written this frame and binds the other
+// pair, written the frame before, for reading
+void bindAccumulation()
+{
+    for(int i = 0; i < ACCUM_TARGETS; i++)
+    {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + FRAME_TARGETS + i, GL_TEXTURE_2D,
+                               accumTex[accumWrite][i], 0);
+        if(computeTracer)
+            glBindImageTexture(FRAME_TARGETS + i, accumTex[accumWrite][i], 0, GL_FALSE, 0, GL_WRITE_ONLY,
+                               FRAME_IMAGE_FORMATS[FRAME_TARGETS + i]);
+        glActiveTexture(GL_TEXTURE13 + i);
+        glBindTexture(GL_TEXTURE_2D, accumTex[1 - accumWrite][i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Creates the history pair and the motion buffer, and adds the history to the draw
+// buffers of the frame target
+void initTemporal()
+{
+    glGenFramebuffers(2, historyFbo);
+    for(int i = 0; i < 2; i++)
+    {
+        historyTex[i] = createTargetTexture(GL_RG32UI, GL_RG_INTEGER, GL_UNSIGNED_INT);
+        glBindFramebuffer(GL_FRAMEBUFFER, historyFbo[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, historyTex[i], 0);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, frameFbo);
+    GLenum drawBuffers[HISTORY_TARGET + 1];
+    for(int i = 0; i < HISTORY_TARGET; i++)
+        drawBuffers[i] = i < FRAME_TARGETS ? GL_COLOR_ATTACHMENT0 + i : GL_NONE;
+    drawBuffers[HISTORY_TARGET] = GL_COLOR_ATTACHMENT0 + HISTORY_TARGET;
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + HISTORY_TARGET, GL_TEXTURE_2D, historyTex[0], 0);
+    glDrawBuffers(HISTORY_TARGET + 1, drawBuffers);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Frame buffer is incomplete.\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenTextures(1, &motionTex);
+    glGenBuffers(1, &motionBuf);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uTemporal"), 1);
+}
+
+// Uploads the moving spheres of spheres, as built, from frame on
+void uploadMotionBounds(const std::vector<Sphere>& spheres, int frame)
+{
+    updateMotionBounds(motionBounds, spheres, frame);
+    motionData.clear();
+    for(size_t i = 0; i < motionBounds.centers.size(); i++)
+    {
+        const Vec3& c = motionBounds.centers[i];
+        motionData.insert(motionData.end(), {c[0], c[1], c[2], motionBounds.radii[i]});
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, motionBuf);
+    glBufferData(GL_TEXTURE_BUFFER, motionData.size() * sizeof(float), motionData.empty() ? NULL : &motionData[0],
+                 GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    const Vec3& b = motionBounds.boundCenter;
+    glUniform1i(glGetUniformLocation(shaderProgram, "uFrame"), frame);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uMotionCount"), (int)motionBounds.centers.size());
+    glUniform4f(glGetUniformLocation(shaderProgram, "uMotionBound"), b[0], b[1], b[2], motionBounds.boundRadius);
+}
+
+// Starts the history written this frame as a copy of the one written the frame before,
+// points the frame target at it and binds the other for reading. Leaves the frame target
+// bound.
+void bindTemporalHistory()
+{
+    if(historyValid)
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, historyFbo[1 - historyWrite]);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, historyFbo[historyWrite]);
+        glBlitFramebuffer(0, 0, IMAGE_WIDTH, IMAGE_HEIGHT, 0, 0, IMAGE_WIDTH, IMAGE_HEIGHT, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, frameFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + HISTORY_TARGET, GL_TEXTURE_2D,
+                           historyTex[historyWrite], 0);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uHistoryValid"), historyValid);
+
+    // The denoiser takes units 4 and 5 for its own targets
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D, historyTex[1 - historyWrite]);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_BUFFER, motionTex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, motionBuf);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Reads back the samples taken per pixel from the last finished adaptive frame
+SampleMap readSampleMap()
+{
+    std::vector<float> accum(4 * IMAGE_WIDTH * IMAGE_HEIGHT);
+    glBindTexture(GL_TEXTURE_2D, accumTex[1 - accumWrite][0]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &accum[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    SampleMap samples(IMAGE_WIDTH, IMAGE_HEIGHT);
+    for(size_t i = 0; i < samples.data.size(); i++)
+        samples.data[i] = accum[4 * i + 3];
+    return samples;
+}
+
+void printSampleCounts(const SampleMap& samples, int maxSamples)
+{
+    double total = 0.0;
+    int capped = 0;
+    for(size_t i = 0; i < samples.data.size(); i++)
+    {
+        total += samples.data[i];
+        if(samples.data[i] >= maxSamples)
+            capped++;
+    }
+    printf("%.2f samples per pixel on average, %.1f%% of the pixels at the limit of %d\n",
+           total / samples.data.size(), 100.0 * capped / samples.data.size(), maxSamples);
+}
+
+// Reads the per pixel cost target back into a buffer that is reused between calls
+const CostBuffer& readFrameCost()
+{
+    static CostBuffer cost(IMAGE_WIDTH, IMAGE_HEIGHT);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, frameFbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT4);
+    glReadPixels(0, 0, IMAGE_WIDTH, IMAGE_HEIGHT, GL_RGBA, GL_FLOAT, &cost.data[0]);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    return cost;
+}
+
+// Reads the ray tree stats of the frame target back and sums them up. The shader
+// counts per bounce in bytes, so bounces past the 4th all land in the 4th.
+TraceStats readFrameStats()
+{
+    // Kept between calls so the render loop does not allocate
+    static std::vector<GLuint> pixels(4 * IMAGE_WIDTH * IMAGE_HEIGHT);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, frameFbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT3);
+    glReadPixels(0, 0, IMAGE_WIDTH, IMAGE_HEIGHT, GL_RGBA_INTEGER, GL_UNSIGNED_INT, &pixels[0]);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+    TraceStats stats;
+    for(int i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++)
+    {
+        const GLuint *p = &pixels[4 * i];
+        for(int b = 0; b < 4; b++)
+        {
+            stats.traced[b] += (p[0] >> (8 * b)) & 255;
+            stats.culled[b] += (p[1] >> (8 * b)) & 255;
+            stats.roulette[b] += (p[2] >> (8 * b)) & 255;
+        }
+        stats.peakStack[std::min((int)(p[3] & 255), RAY_STACK_SIZE)]++;
+        stats.overflow += p[3] >> 8;
+    }
+
+    const CostBuffer& cost = readFrameCost();
+    for(int i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++)
+    {
+        const float *c = &cost.data[COST_METRICS * i];
+        stats.intersections += (long long)c[COST_INTERSECTIONS];
+        stats.shadowRays += (long long)c[COST_SHADOW_RAYS];
+        stats.nodeVisits += (long long)c[COST_NODE_VISITS];
+    }
+    return stats;
+}
+
+void initReadback()
+{
+    glGenBuffers(READBACK_RING_SIZE, readbackPbo);
+    for(int i = 0; i < READBACK_RING_SIZE; i++)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackPbo[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, 4 * IMAGE_WIDTH * IMAGE_HEIGHT, NULL, GL_STREAM_READ);
+        readbackFence[i] = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Maps the oldest readback and hands its pixels to the writer thread
+void retireReadback(bool wait)
+{
+    int tail = (readbackHead + READBACK_RING_SIZE - readbackCount) % READBACK_RING_SIZE;
+    GLenum status = glClientWaitSync(readbackFence[tail], 0, 0);
+    if(status == GL_TIMEOUT_EXPIRED)
+    {
+        if(!wait)
+            return;
+        readbackWaits++;
+        glClientWaitSync(readbackFence[tail], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    }
+    glDeleteSync(readbackFence[tail]);
+    readbackFence[tail] = 0;
+    readbackCount--;
+
+    int buffer = acquireFrameBuffer(frameWriter);
+    if(buffer < 0)
+        return;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackPbo[tail]);
+    const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4 * IMAGE_WIDTH * IMAGE_HEIGHT, GL_MAP_READ_BIT);
+    if(pixels)
+    {
+        memcpy(&frameWriter.buffers[buffer][0], pixels, 4 * IMAGE_WIDTH * IMAGE_HEIGHT);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    submitFrameBuffer(frameWriter, buffer);
+}
+
+// Starts reading back the frame in the back buffer. Call before the swap.
+void captureFrame()
+{
+    while(readbackCount > 0)
+    {
+        int count = readbackCount;
+        retireReadback(readbackCount == READBACK_RING_SIZE);
+        if(readbackCount == count)
+            break;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackPbo[readbackHead]);
+    glReadBuffer(GL_BACK);
+    glReadPixels(0, 0, IMAGE_WIDTH, IMAGE_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readbackFence[readbackHead] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readbackHead = (readbackHead + 1) % READBACK_RING_SIZE;
+    readbackCount++;
+}
+
+// Drains the ring and the writer thread
+void finishRecording()
+{
+    while(readbackCount > 0)
+        retireReadback(true);
+    closeFrameWriter(frameWriter);
+    glDeleteBuffers(READBACK_RING_SIZE, readbackPbo);
+    fprintf(stderr, "Recorded %d frames to %s, waited %d times on readback and %d times on the writer\n",
+            frameWriter.framesWritten, g_recordPath, readbackWaits, frameWriter.stalls);
+}
+
+// Renders the next g_tilesPerFrame tiles into the frame target, each as its own
+// scissored draw and submit. Returns true once the last tile of the frame is done.
+bool draw_tiles()
+{
+    int tilesX = (IMAGE_WIDTH + g_tileSize - 1) / g_tileSize;
+    int tilesY = (IMAGE_HEIGHT + g_tileSize - 1) / g_tileSize;
+    int numTiles = tilesX * tilesY;
+
+    glEnable(GL_SCISSOR_TEST);
+    for(int i = 0; i < g_tilesPerFrame && nextTile < numTiles; i++, nextTile++)
+    {
+        int x = (nextTile % tilesX) * g_tileSize;
+        int y = (nextTile / tilesX) * g_tileSize;
+        glScissor(x, y, g_tileSize, g_tileSize);
+        traceRect(x, y, std::min(g_tileSize, IMAGE_WIDTH - x), std::min(g_tileSize, IMAGE_HEIGHT - y));
+        glFlush();
+    }
+    glDisable(GL_SCISSOR_TEST);
+
+    if(nextTile < numTiles)
+        return false;
+    nextTile = 0;
+    return true;
+}
 
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+// Whether frames go through the offscreen frame target rather than straight to the window
+bool usesFrameTarget()
+{
+    return g_tileSize > 0 || g_denoiseIterations > 0 || g_stats || g_heatmapPFM || g_progressive || computeTracer ||
+           g_temporal;
+}
+
+// Draws a frame. Returns true when the frame is complete and the scene may advance.
+bool draw_scene()
+{
+    if(!usesFrameTarget())
+    {
+        glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+
+        if(g_recordPath)
+            captureFrame();
+        glfwSwapBuffers(window);
+        return true;
+    }
 
+    glBindFramebuffer(GL_FRAMEBUFFER, frameFbo);
+    if(g_temporal)
+        bindTemporalHistory();
+
+    // Progressive frames blend into the running mean of the color target, frame n with weight
+    // 1 / n. The compute tracer blends in the shader. Adaptive frames keep a mean of their
+    // own per pixel.
+    GLint blendWeight = glGetUniformLocation(shaderProgram, "uBlendWeight");
+    if(adaptive)
+        bindAccumulation();
+    else if(g_progressive && computeTracer)
+        glUniform1f(blendWeight, 1.0f / (progressiveFrames + 1));
+    else if(g_progressive)
+    {
+        glEnablei(GL_BLEND, 0);
+        glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+        glBlendColor(0.0f, 0.0f, 0.0f, 1.0f / (progressiveFrames + 1));
+    }
+    bool frameDone = true;
+    if(g_tileSize > 0)
+        frameDone = draw_tiles();
+    else
+        traceRect(0, 0, IMAGE_WIDTH, IMAGE_HEIGHT);
+    if(g_progressive && computeTracer)
+        glUniform1f(blendWeight, 1.0f);
+    else if(g_progressive && !adaptive)
+        glDisablei(GL_BLEND, 0);
+    if(adaptive && frameDone)
+        accumWrite = 1 - accumWrite;
+    if(g_temporal)
+    {
+        historyWrite = 1 - historyWrite;
+        historyValid = true;
+    }
+
+    // Present what is in the frame target, partial tiles included
+    GLuint result = frameFbo;
+    if(g_denoiseIterations > 0)
+        result = runDenoiser();
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, result);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, IMAGE_WIDTH, IMAGE_HEIGHT, 0, 0, IMAGE_WIDTH, IMAGE_HEIGHT, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Partial tiled frames are displayed but not recorded
+    if(g_recordPath && frameDone)
+        captureFrame();
     glfwSwapBuffers(window);
+    return frameDone;
 }
 
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -333,11 +1176,898 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
     {
         Vec3 point(-0.5f, 0.0f, -1.0f);
         glUniform3f(glGetUniformLocation(shaderProgram, "uSphere1.center"), point[0], point[1], point[2]);        
+        if(displayedScene)
+            displayedScene->spheres[0].center = point;
+        progressiveFrames = 0;
+        historyValid = false;
     }
 }
 
-int main()
+// Builds the scene selected on the command line
+Scene makeScene()
 {
+    Scene scene;
+    if(strcmp(g_sceneName, "particles") == 0)
+        scene = makeParticleScene(g_numParticles, g_particleRadius, g_accel);
+    else
+        scene = makeDefaultScene();
+
+    if(g_maxBounce >= 0)
+        scene.maxBounce = g_maxBounce;
+    if(g_throughputCutoff >= 0.0f)
+        scene.throughputCutoff = g_throughputCutoff;
+    if(g_rouletteDepth >= -1)
+        scene.rouletteDepth = g_rouletteDepth;
+    if(g_samplesPerPixel > 0)
+        scene.samplesPerPixel = g_samplesPerPixel;
+    if(g_sampler >= 0)
+        scene.sampler = g_sampler;
+    if(g_lensRadius >= 0.0f)
+        scene.lensRadius = g_lensRadius;
+    if(g_focusDistance > 0.0f)
+        scene.focusDistance = g_focusDistance;
+    if(g_lightSampling)
+        scene.lightSampling = true;
+    if(g_adaptiveThreshold >= 0.0f)
+        scene.adaptiveThreshold = g_adaptiveThreshold;
+    if(g_maxSamples > 0)
+        scene.maxSamples = g_maxSamples;
+    if(g_compact)
+        compactScene(scene);
+    return scene;
+}
+
+double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// What the --cpu frames depend on besides the scene, for --frame-cache
+FrameCacheSettings frameCacheSettings()
+{
+    FrameCacheSettings settings;
+    settings.width = IMAGE_WIDTH;
+    settings.height = IMAGE_HEIGHT;
+    settings.shaderSource = tracerSrc;
+    settings.hybrid = g_hybrid;
+    settings.tileLists = g_tileLists;
+    settings.bounceFactor = g_bounceFactor;
+    settings.bounceMaterials = g_bounceMaterials;
+    settings.irradianceError = g_irradianceError;
+    settings.shadowMapSize = g_shadowMapSize;
+    settings.heatmap = g_heatmap;
+    settings.heatmapScale = g_heatmapScale;
+    return settings;
+}
+
+// frameCacheSettings of a --coordinator frame. The workers trace the plain image at full
+// resolution whatever the options of the coordinator ask for, so its frames are keyed as
+// such and shared with local renders of that image.
+FrameCacheSettings distributedFrameCacheSettings()
+{
+    FrameCacheSettings settings = frameCacheSettings();
+    settings.hybrid = false;
+    settings.tileLists = false;
+    settings.bounceFactor = 1;
+    settings.irradianceError = 0.0f;
+    settings.shadowMapSize = 0;
+    settings.heatmap = -1;
+    return settings;
+}
+
+// Denoises the --cpu frame unless it shows a heatmap, on pool if given, then writes it out
+bool finishCPUFrame(Image& img, const GBuffer& gbuffer, TilePool *pool = NULL)
+{
+    if(g_heatmap < 0 && g_denoiseIterations > 0)
+    {
+        DenoiseParams params = defaultDenoiseParams();
+        params.iterations = g_denoiseIterations;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        denoiseAtrous(img, gbuffer, params, g_numThreads, NULL, pool);
+        printf("Denoised in %.2f ms\n", millisecondsSince(start));
+    }
+    return writePPM(g_cpuOutput, img);
+}
+
+// Opens the treelet file of --accel stream, writing it first if it is missing or holds
+// other particles, then drops the in-memory copy of the particles
+bool openParticleStream(Scene& scene, TreeletCache& cache)
+{
+    size_t capBytes = (size_t)g_streamCacheMB * 1024 * 1024;
+    bool ok = openTreeletFile(cache, g_streamFile, capBytes);
+    if(!ok || cache.header.numParticles != scene.particles.size() || cache.header.radius != scene.particleRadius)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        closeTreeletFile(cache);
+        if(!writeTreeletFile(g_streamFile, scene.particles, scene.particleRadius)
+           || !openTreeletFile(cache, g_streamFile, capBytes))
+            return false;
+        printf("Wrote %s in %.2f ms\n", g_streamFile, millisecondsSince(start));
+    }
+    std::vector<Vec3>().swap(scene.particles);
+    printf("Streaming %u particles in %u treelets from %s, %d slots of %.1f KB\n",
+           cache.header.numParticles, cache.header.numTreelets, g_streamFile, cache.numSlots, cache.slotBytes / 1024.0);
+    return true;
+}
+
+// Times the uniform grid build against the BVH build on the particle scene, compares the
+// size of the BVH with its compact encoding, then renders a small CPU frame with each to
+// compare traversal
+void benchAccel()
+{
+    const int runs = 5;
+    Scene scene = makeParticleScene(g_numParticles, g_particleRadius, ACCEL_NONE);
+    printf("%d particles, radius %g, %d threads\n", g_numParticles, g_particleRadius, g_numThreads);
+
+    // Workers started once, as in a render, so that the builds are timed without them
+    TilePool pool(g_numThreads, g_pinThreads ? 0 : -1);
+    UniformGrid grid;
+    double gridMs = 1e30;
+    for(int i = 0; i < runs; i++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        buildGrid(grid, scene.particles, scene.particleRadius, g_numThreads, &pool);
+        gridMs = std::min(gridMs, millisecondsSince(start));
+    }
+    printf("grid build: %8.2f ms  (%dx%dx%d cells, %d references)\n", gridMs,
+           grid.res[0], grid.res[1], grid.res[2], (int)grid.indices.size());
+
+    BVH bvh;
+    double bvhMs = 1e30;
+    for(int i = 0; i < runs; i++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        buildBVH(bvh, scene.particles, scene.particleRadius);
+        bvhMs = std::min(bvhMs, millisecondsSince(start));
+    }
+    printf("bvh build:  %8.2f ms  (%d nodes)\n", bvhMs, (int)bvh.nodes.size());
+
+    // The compact BVH is encoded from a BVH over the snapped particles
+    Scene compact = scene;
+    compactScene(compact);
+    BVH snapped;
+    buildBVH(snapped, compact.particles, compact.particleRadius);
+    CompactBVH compactBVH;
+    double compactMs = 1e30;
+    for(int i = 0; i < runs; i++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        buildCompactBVH(compactBVH, snapped, compact);
+        compactMs = std::min(compactMs, millisecondsSince(start));
+    }
+    printf("compaction: %8.2f ms  (%d nodes)\n", compactMs, (int)compactBVH.nodes.size());
+
+    size_t bvhBytes = bvh.nodes.size() * sizeof(BVHNode) + bvh.indices.size() * sizeof(int) +
+                      scene.particles.size() * sizeof(Vec3);
+    size_t compactBytes = compactBVHBytes(compactBVH);
+    printf("bvh size:   %8.2f MB  (nodes, indices and centers)\n", bvhBytes / (1024.0 * 1024.0));
+    printf("compact:    %8.2f MB  (%.2fx smaller)\n", compactBytes / (1024.0 * 1024.0), (double)bvhBytes / compactBytes);
+    printf("material:   %8d B   packed %d B\n", (int)sizeof(Material), (int)sizeof(PackedMaterial));
+    printf("gpu center: %8d B   packed %d B\n", (int)(4 * sizeof(float)), (int)(4 * sizeof(uint16_t)));
+
+    const Scene *scenes[] = { &scene, &scene, &compact };
+    const int accels[] = { ACCEL_GRID, ACCEL_BVH, ACCEL_BVH };
+    const char *names[] = { "grid", "bvh", "compact" };
+    double bvhFrameMs = 0;
+    for(int i = 0; i < 3; i++)
+    {
+        Scene frameScene = *scenes[i];
+        frameScene.accel = accels[i];
+        Tracer tracer;
+        initTracer(tracer, frameScene, g_numThreads, &pool);
+        Image img(IMAGE_WIDTH / 4, IMAGE_HEIGHT / 4);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        renderImage(tracer, img, g_numThreads);
+        double ms = millisecondsSince(start);
+        if(accels[i] == ACCEL_BVH && !frameScene.compact)
+            bvhFrameMs = ms;
+        printf("%s frame:%*s%8.2f ms  (%dx%d)", names[i], (int)(7 - strlen(names[i])), "", ms, img.width, img.height);
+        if(frameScene.compact)
+            printf("  %.2fx the bvh throughput", bvhFrameMs / ms);
+        printf("\n");
+    }
+}
+
+// Renders a few frames of the animation with each CPU feature in turn, one at a time and
+// kept in memory, and fails every feature whose frames allocate past the first. Returns
+// the number of those.
+int checkAllocations()
+{
+    const int numFrames = 4;
+    Scene scene = makeDefaultScene();
+    Scene grid = makeParticleScene(g_numParticles, g_particleRadius, ACCEL_GRID);
+    Scene bvh = makeParticleScene(g_numParticles, g_particleRadius, ACCEL_BVH);
+    Scene compact = bvh;
+    compactScene(compact);
+    Scene stream = makeParticleScene(g_numParticles, g_particleRadius, ACCEL_STREAM);
+    TreeletCache treelets;
+    if(!openParticleStream(stream, treelets))
+        return 1;
+
+    AnimationParams base = defaultAnimationParams();
+    base.lastFrame = numFrames - 1;
+    base.numThreads = g_numThreads;
+    base.inOrder = true;
+    std::vector<const char *> names;
+    std::vector<bool> passed;
+    auto check = [&](const char *name, const Scene& checkScene, const AnimationParams& params)
+    {
+        printf("Checking %s\n", name);
+        names.push_back(name);
+        passed.push_back(renderAnimation(checkScene, params));
+    };
+
+    AnimationParams params = base;
+    check("plain", scene, params);
+    params.denoiseIterations = 2;
+    check("denoise", scene, params);
+    params = base;
+    params.hybrid = true;
+    check("hybrid", scene, params);
+    params = base;
+    params.tileLists = true;
+    check("tile lists", scene, params);
+    params = base;
+    params.bounceFactor = 2;
+    check("bounce-res", scene, params);
+    params = base;
+    params.irradianceError = 0.3f;
+    check("irradiance cache", scene, params);
+    params = base;
+    params.shadowMapSize = 64;
+    check("shadow maps", scene, params);
+    params = base;
+    params.temporal = true;
+    params.denoiseIterations = 2;
+    check("temporal", scene, params);
+    params = base;
+    check("grid", grid, params);
+    check("bvh", bvh, params);
+    check("compact bvh", compact, params);
+    params.treelets = &treelets;
+    check("stream", stream, params);
+
+    int failed = 0;
+    for(size_t i = 0; i < names.size(); i++)
+    {
+        printf("%-18s %s\n", names[i], passed[i] ? "no allocations after the first frame" : "FAILED");
+        failed += passed[i] ? 0 : 1;
+    }
+    return failed;
+}
+
+// Renders a CPU frame on 1, 2, 4, ... up to --threads workers of the tile scheduler,
+// to see how close to linear it scales and where the workers sit idle
+void benchThreads()
+{
+    const int runs = 3;
+    Scene scene = makeScene();
+    Tracer tracer;
+    initTracer(tracer, scene, g_numThreads);
+    Image img(IMAGE_WIDTH / 2, IMAGE_HEIGHT / 2);
+    printf("%dx%d, %d threads%s\n", img.width, img.height, g_numThreads, g_pinThreads ? ", pinned" : "");
+    printf("threads          ms  speedup  efficiency    steals   idle\n");
+
+    double oneThreadMs = 0;
+    for(int numThreads = 1;; numThreads = std::min(2 * numThreads, g_numThreads))
+    {
+        TilePool pool(numThreads, g_pinThreads ? 0 : -1);
+        tracer.pool = &pool;
+        double ms = 1e30;
+        TraceStats best;
+        for(int i = 0; i < runs; i++)
+        {
+            TraceStats stats;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            renderImage(tracer, img, numThreads, NULL, &stats);
+            double runMs = millisecondsSince(start);
+            if(runMs < ms)
+            {
+                ms = runMs;
+                best = stats;
+            }
+        }
+        if(numThreads == 1)
+            oneThreadMs = ms;
+        const ScheduleStats& s = best.schedule;
+        printf("%7d %11.2f %8.2f %10.1f%% %9lld %5.1f%%\n", numThreads, ms, oneThreadMs / ms,
+               100.0 * oneThreadMs / (ms * numThreads), s.steals, 100.0 * s.idleMs / std::max(1e-9, s.busyMs + s.idleMs));
+        tracer.pool = NULL;
+        if(numThreads == g_numThreads)
+            break;
+    }
+}
+
+void printUsage()
+{
+    fprintf(stderr,
+            "Usage: glslraytracer [options]\n"
+            "  --scene default|particles  Scene to render\n"
+            "  --particles N              Number of particles in the particle scene\n"
+            "  --radius R                 Particle radius\n"
+            "  --accel none|grid|bvh|stream\n"
+            "                             Acceleration structure for the particles, stream\n"
+            "                             pages BVH treelets in from --stream-file (CPU only)\n"
+            "  --stream-file FILE         Treelet file of --accel stream, written if missing,\n"
+            "                             particles.treelets by default\n"
+            "  --stream-cache MB          Memory for resident treelets, 256 by default\n"
+            "  --cpu FILE.ppm             Render one frame with the CPU tracer and exit\n"
+            "  --frames N:M               With --cpu, render animation frames N to M into\n"
+            "                             FILE.ppm, a pattern like frame%%04d.ppm\n"
+            "  --bench-accel              Benchmark the grid build against the BVH build\n"
+            "  --bench-threads            Benchmark CPU frames on 1, 2, 4, ... threads\n"
+            "  --check-allocations        Render a few frames with each CPU feature and fail\n"
+            "                             if one allocates after the first frame\n"
+            "  --threads N                CPU threads, defaults to the number of cores\n"
+            "  --pin-threads              Pin each CPU render thread to a core of its own\n"
+            "  --tile-size N              Render the GL frame in NxN scissored tiles\n"
+            "  --tiles-per-frame N        Tiles submitted per displayed frame, 4 by default\n"
+            "  --denoise N                Run N a-trous denoiser iterations on each frame\n"
+            "  --bounces N                Maximum number of secondary bounces\n"
+            "  --cutoff T                 Stop paths whose throughput falls below T\n"
+            "  --roulette D               Russian roulette from bounce D on, -1 disables it\n"
+            "  --stats                    Print per bounce ray counts\n"
+            "  --coordinator ADDRESS      Render the --cpu frame on workers connecting to\n"
+            "                             host:port or unix:/path, in --tile-size tiles\n"
+            "  --spawn-workers N          Start N local workers for --coordinator\n"
+            "  --worker ADDRESS           Render tiles for the coordinator at ADDRESS\n"
+            "  --record PATH              Stream displayed frames to PATH, - for stdout,\n"
+            "                             or a pattern like frame%%04d.ppm for one file each\n"
+            "  --record-format ppm|raw    PPM frames or headerless rgb24, ppm by default\n"
+            "  --heatmap METRIC           Show the per pixel cost in false color instead of\n"
+            "                             the image: intersections, shadow, bounces or nodes\n"
+            "  --heatmap-scale N          Cost at the top of the color ramp\n"
+            "  --heatmap-pfm FILE.pfm     Write the cost of the last frame as a float image\n"
+            "  --hybrid                   Rasterize what the camera sees and trace only the\n"
+            "                             shadow, reflection and refraction rays\n"
+            "  --tile-lists               Test primary rays only against the objects whose\n"
+            "                             screen bounds touch their 16x16 pixel tile\n"
+            "  --bounce-res N             Trace reflections and refractions at 1/N of the\n"
+            "                             resolution and upsample them, N = 2 or 4\n"
+            "  --bounce-materials LIST    Material types traced at low resolution, a comma\n"
+            "                             separated list of reflective and transmissive\n"
+            "  --spp N                    Samples per pixel, jittered over the pixel\n"
+            "  --sampler NAME             Sample placement: random, sobol or bluenoise,\n"
+            "                             sobol by default\n"
+            "  --aperture R               Lens radius of a thin lens camera, 0 for a pinhole\n"
+            "  --focus D                  Distance of the plane in focus, 2 by default\n"
+            "  --light-sampling           Shade primary hits with one light picked per sample\n"
+            "  --progressive              Hold the GL scene still and average the frames\n"
+            "  --adaptive T               Take batches of --spp samples until the relative\n"
+            "                             error of a pixel falls below T, progressive on GL\n"
+            "  --max-spp N                Most samples of a pixel with --adaptive, 64 by default\n"
+            "  --sample-map FILE.pfm      Write the samples taken per pixel as a float image\n"
+            "  --compute                  Trace in an OpenGL 4.3 compute shader, falling back\n"
+            "                             to the fragment shader where 4.3 is missing\n"
+            "  --irradiance-cache A       Light diffuse surfaces off the other surfaces from an\n"
+            "                             irradiance cache with error tolerance A, like 0.2,\n"
+            "                             instead of the ambient term (CPU only)\n"
+            "  --shadow-maps N            Look up the shadows of the static objects in cube maps\n"
+            "                             with N x N faces, cast once per light (CPU only)\n"
+            "  --compact                  Quantize the materials, particle centers and BVH\n"
+            "                             boxes to cut the memory traffic of traversal\n"
+            "  --frame-cache DIR          Answer --cpu renders seen before from finished frames\n"
+            "                             kept in DIR, keyed by a hash of scene and options\n"
+            "  --frame-cache-size MB      Least recently used frames are evicted past this\n"
+            "                             size, 1024 by default\n"
+            "  --temporal                 Trace only the pixels whose rays the moving sphere\n"
+            "                             crosses and reuse the rest, in the window or the\n"
+            "                             --frames of --cpu\n");
+}
+
+bool parseArgs(int argc, char **argv)
+{
+    for(int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if(strcmp(arg, "--bench-accel") == 0)
+        {
+            g_benchAccel = true;
+            continue;
+        }
+        if(strcmp(arg, "--bench-threads") == 0)
+        {
+            g_benchThreads = true;
+            continue;
+        }
+        if(strcmp(arg, "--check-allocations") == 0)
+        {
+            g_checkAllocations = true;
+            continue;
+        }
+        if(strcmp(arg, "--pin-threads") == 0)
+        {
+            g_pinThreads = true;
+            continue;
+        }
+        if(strcmp(arg, "--stats") == 0)
+        {
+            g_stats = true;
+            continue;
+        }
+        if(strcmp(arg, "--compute") == 0)
+        {
+            g_compute = true;
+            continue;
+        }
+        if(strcmp(arg, "--temporal") == 0)
+        {
+            g_temporal = true;
+            continue;
+        }
+        if(strcmp(arg, "--compact") == 0)
+        {
+            g_compact = true;
+            continue;
+        }
+        if(strcmp(arg, "--hybrid") == 0)
+        {
+            g_hybrid = true;
+            continue;
+        }
+        if(strcmp(arg, "--tile-lists") == 0)
+        {
+            g_tileLists = true;
+            continue;
+        }
+        if(strcmp(arg, "--light-sampling") == 0)
+        {
+            g_lightSampling = true;
+            continue;
+        }
+        if(strcmp(arg, "--progressive") == 0)
+        {
+            g_progressive = true;
+            continue;
+        }
+
+        if(!value)
+            return false;
+        if(strcmp(arg, "--scene") == 0)
+            g_sceneName = value;
+        else if(strcmp(arg, "--particles") == 0)
+            g_numParticles = atoi(value);
+        else if(strcmp(arg, "--radius") == 0)
+            g_particleRadius = (float)atof(value);
+        else if(strcmp(arg, "--accel") == 0)
+        {
+            if(strcmp(value, "none") == 0)
+                g_accel = ACCEL_NONE;
+            else if(strcmp(value, "grid") == 0)
+                g_accel = ACCEL_GRID;
+            else if(strcmp(value, "bvh") == 0)
+                g_accel = ACCEL_BVH;
+            else if(strcmp(value, "stream") == 0)
+                g_accel = ACCEL_STREAM;
+            else
+                return false;
+        }
+        else if(strcmp(arg, "--stream-file") == 0)
+            g_streamFile = value;
+        else if(strcmp(arg, "--stream-cache") == 0)
+        {
+            g_streamCacheMB = atoi(value);
+            if(g_streamCacheMB < 1)
+                return false;
+        }
+        else if(strcmp(arg, "--cpu") == 0)
+            g_cpuOutput = value;
+        else if(strcmp(arg, "--frames") == 0)
+        {
+            int n = sscanf(value, "%d:%d", &g_firstFrame, &g_lastFrame);
+            if(n < 1 || g_firstFrame < 0)
+                return false;
+            if(n == 1)
+                g_lastFrame = g_firstFrame;
+            if(g_lastFrame < g_firstFrame)
+                return false;
+        }
+        else if(strcmp(arg, "--threads") == 0)
+            g_numThreads = atoi(value);
+        else if(strcmp(arg, "--tile-size") == 0)
+            g_tileSize = atoi(value);
+        else if(strcmp(arg, "--tiles-per-frame") == 0)
+            g_tilesPerFrame = std::max(1, atoi(value));
+        else if(strcmp(arg, "--denoise") == 0)
+            g_denoiseIterations = atoi(value);
+        else if(strcmp(arg, "--bounces") == 0)
+            g_maxBounce = atoi(value);
+        else if(strcmp(arg, "--cutoff") == 0)
+            g_throughputCutoff = (float)atof(value);
+        else if(strcmp(arg, "--roulette") == 0)
+            g_rouletteDepth = atoi(value);
+        else if(strcmp(arg, "--coordinator") == 0)
+            g_coordinatorAddress = value;
+        else if(strcmp(arg, "--spawn-workers") == 0)
+            g_spawnWorkers = atoi(value);
+        else if(strcmp(arg, "--worker") == 0)
+            g_workerAddress = value;
+        else if(strcmp(arg, "--heatmap") == 0)
+        {
+            g_heatmap = -1;
+            for(int m = 0; m < COST_METRICS; m++)
+            {
+                if(strcmp(value, COST_METRIC_NAMES[m]) == 0)
+                    g_heatmap = m;
+            }
+            if(g_heatmap < 0)
+                return false;
+        }
+        else if(strcmp(arg, "--heatmap-scale") == 0)
+            g_heatmapScale = (float)atof(value);
+        else if(strcmp(arg, "--heatmap-pfm") == 0)
+            g_heatmapPFM = value;
+        else if(strcmp(arg, "--bounce-res") == 0)
+        {
+            g_bounceFactor = atoi(value);
+            if(g_bounceFactor < 1)
+                return false;
+        }
+        else if(strcmp(arg, "--bounce-materials") == 0)
+        {
+            g_bounceMaterials = 0;
+            char list[256];
+            snprintf(list, sizeof(list), "%s", value);
+            for(char *name = strtok(list, ","); name; name = strtok(NULL, ","))
+            {
+                if(strcmp(name, "reflective") == 0)
+                    g_bounceMaterials |= 1 << 1;
+                else if(strcmp(name, "transmissive") == 0)
+                    g_bounceMaterials |= 1 << 2;
+                else
+                    return false;
+            }
+        }
+        else if(strcmp(arg, "--spp") == 0)
+        {
+            g_samplesPerPixel = atoi(value);
+            if(g_samplesPerPixel < 1)
+                return false;
+        }
+        else if(strcmp(arg, "--sampler") == 0)
+        {
+            g_sampler = -1;
+            for(int t = 0; t < SAMPLER_TYPES; t++)
+            {
+                if(strcmp(value, SAMPLER_NAMES[t]) == 0)
+                    g_sampler = t;
+            }
+            if(g_sampler < 0)
+                return false;
+        }
+        else if(strcmp(arg, "--aperture") == 0)
+            g_lensRadius = (float)atof(value);
+        else if(strcmp(arg, "--focus") == 0)
+            g_focusDistance = (float)atof(value);
+        else if(strcmp(arg, "--adaptive") == 0)
+            g_adaptiveThreshold = (float)atof(value);
+        else if(strcmp(arg, "--max-spp") == 0)
+        {
+            g_maxSamples = atoi(value);
+            if(g_maxSamples < 1)
+                return false;
+        }
+        else if(strcmp(arg, "--sample-map") == 0)
+            g_sampleMapPath = value;
+        else if(strcmp(arg, "--irradiance-cache") == 0)
+        {
+            g_irradianceError = (float)atof(value);
+            if(g_irradianceError <= 0.0f)
+                return false;
+        }
+        else if(strcmp(arg, "--shadow-maps") == 0)
+        {
+            g_shadowMapSize = atoi(value);
+            if(g_shadowMapSize < 1)
+                return false;
+        }
+        else if(strcmp(arg, "--frame-cache") == 0)
+            g_frameCacheDir = value;
+        else if(strcmp(arg, "--frame-cache-size") == 0)
+        {
+            g_frameCacheMB = atoi(value);
+            if(g_frameCacheMB < 1)
+                return false;
+        }
+        else if(strcmp(arg, "--record") == 0)
+            g_recordPath = value;
+        else if(strcmp(arg, "--record-format") == 0)
+        {
+            if(strcmp(value, "ppm") == 0)
+                g_recordPPM = true;
+            else if(strcmp(value, "raw") == 0)
+                g_recordPPM = false;
+            else
+                return false;
+        }
+        else
+            return false;
+        i++;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if(!parseArgs(argc, argv))
+    {
+        printUsage();
+        return -1;
+    }
+
+    if(g_numThreads <= 0)
+        g_numThreads = std::max(1u, std::thread::hardware_concurrency());
+    if(g_heatmap >= 0 && g_heatmapScale <= 0.0f)
+        g_heatmapScale = COST_METRIC_SCALES[g_heatmap];
+    // The float export without a heatmap on screen writes intersection tests
+    int costMetric = g_heatmap >= 0 ? g_heatmap : COST_INTERSECTIONS;
+
+    if(g_benchAccel)
+    {
+        benchAccel();
+        return 0;
+    }
+    if(g_benchThreads)
+    {
+        benchThreads();
+        return 0;
+    }
+    if(g_checkAllocations)
+        return checkAllocations() == 0 ? 0 : -1;
+
+    if(g_workerAddress)
+    {
+#ifdef NET_SUPPORTED
+        return runWorker(g_workerAddress, g_numThreads, g_pinThreads);
+#else
+        fprintf(stderr, "Distributed rendering is not supported on this platform\n");
+        return -1;
+#endif
+    }
+
+    Scene scene = makeScene();
+
+    // Streamed particles are only ever traced by the CPU tracer of this process
+    TreeletCache treelets;
+    if(scene.accel == ACCEL_STREAM)
+    {
+        if(!g_cpuOutput || g_coordinatorAddress || g_hybrid || g_tileLists || g_compact)
+        {
+            fprintf(stderr, "--accel stream needs --cpu and does not combine with --coordinator, --hybrid, --tile-lists or --compact\n");
+            return -1;
+        }
+        if(!openParticleStream(scene, treelets))
+            return -1;
+    }
+
+    if(g_irradianceError > 0.0f && (!g_cpuOutput || g_coordinatorAddress))
+    {
+        fprintf(stderr, "--irradiance-cache needs --cpu and does not combine with --coordinator\n");
+        return -1;
+    }
+
+    if(g_shadowMapSize > 0 && (!g_cpuOutput || g_coordinatorAddress))
+    {
+        fprintf(stderr, "--shadow-maps needs --cpu and does not combine with --coordinator\n");
+        return -1;
+    }
+
+    // The workers trace every pixel of a single frame in full and send back the shaded
+    // pixels only, without the G-buffer the denoiser needs or the cost of the heatmaps
+    if(g_coordinatorAddress && (g_denoiseIterations > 0 || g_firstFrame >= 0 || g_heatmap >= 0 || g_heatmapPFM ||
+                                g_bounceFactor > 1))
+    {
+        fprintf(stderr, "--coordinator does not combine with --denoise, --frames, --heatmap, --heatmap-pfm or --bounce-res\n");
+        return -1;
+    }
+
+    // Irradiance records and low resolution bounce light are shared between pixels, so a
+    // pixel could change without its own rays passing the moving sphere
+    if(g_temporal && ((g_cpuOutput && g_firstFrame < 0) || g_irradianceError > 0.0f || g_bounceFactor > 1))
+    {
+        fprintf(stderr, "--temporal needs --frames with --cpu and does not combine with --irradiance-cache or --bounce-res\n");
+        return -1;
+    }
+
+    // In the window the history is the frame target, which progressive frames blend into
+    // and tiled frames fill a part at a time. The compute tracer has no pixels to discard,
+    // and the heatmaps would show the cost of the frames the pixels were traced in.
+    if(g_temporal && !g_cpuOutput && (g_progressive || scene.adaptiveThreshold > 0.0f || g_tileSize > 0 || g_compute ||
+                                      g_heatmap >= 0 || g_heatmapPFM))
+    {
+        fprintf(stderr, "--temporal in the window does not combine with --progressive, --adaptive, --tile-size, --compute or the heatmaps\n");
+        return -1;
+    }
+
+    // Streamed particles are not in the serialized scene, and the float exports are not kept
+    FrameCache frameCache;
+    if(g_frameCacheDir)
+    {
+        if(!g_cpuOutput || scene.accel == ACCEL_STREAM || g_heatmapPFM || g_sampleMapPath)
+        {
+            fprintf(stderr, "--frame-cache needs --cpu and does not combine with --accel stream, --heatmap-pfm or --sample-map\n");
+            return -1;
+        }
+        // Animation frames lit from the irradiance cache depend on the frames before them
+        if(g_firstFrame >= 0 && g_irradianceError > 0.0f)
+        {
+            fprintf(stderr, "--frame-cache does not combine with --irradiance-cache in --frames renders\n");
+            return -1;
+        }
+        if(!openFrameCache(frameCache, g_frameCacheDir, (uint64_t)g_frameCacheMB << 20))
+            return -1;
+    }
+
+    if(g_coordinatorAddress)
+    {
+        if(!g_cpuOutput)
+        {
+            printUsage();
+            return -1;
+        }
+#ifdef NET_SUPPORTED
+        // Local workers share the cores of this machine
+        int threadsPerWorker = std::max(1, g_numThreads / std::max(1, g_spawnWorkers));
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        Image img(IMAGE_WIDTH, IMAGE_HEIGHT);
+        uint64_t frameKey = g_frameCacheDir ? frameCacheKey(scene, distributedFrameCacheSettings()) : 0;
+        if(g_frameCacheDir && lookupFrame(frameCache, frameKey, img, NULL))
+        {
+            printf("Read frame %016llx from the frame cache in %.2f ms\n", (unsigned long long)frameKey, millisecondsSince(start));
+            return writePPM(g_cpuOutput, img) ? 0 : -1;
+        }
+        if(!renderDistributed(scene, img, g_coordinatorAddress, g_tileSize > 0 ? g_tileSize : 64,
+                              g_spawnWorkers, argv[0], threadsPerWorker))
+            return -1;
+        printf("Rendered %dx%d in %.2f ms\n", img.width, img.height, millisecondsSince(start));
+        if(g_frameCacheDir)
+            storeFrame(frameCache, frameKey, img, NULL);
+        return writePPM(g_cpuOutput, img) ? 0 : -1;
+#else
+        fprintf(stderr, "Distributed rendering is not supported on this platform\n");
+        return -1;
+#endif
+    }
+
+    if(g_cpuOutput && g_firstFrame >= 0)
+    {
+        if(!strchr(g_cpuOutput, '%'))
+        {
+            fprintf(stderr, "--frames needs an output pattern like frame%%04d.ppm\n");
+            return -1;
+        }
+        AnimationParams params = defaultAnimationParams();
+        params.firstFrame = g_firstFrame;
+        params.lastFrame = g_lastFrame;
+        params.pattern = g_cpuOutput;
+        params.numThreads = g_numThreads;
+        params.denoiseIterations = g_denoiseIterations;
+        params.hybrid = g_hybrid;
+        params.tileLists = g_tileLists;
+        params.bounceFactor = g_bounceFactor;
+        params.bounceMaterials = g_bounceMaterials;
+        params.pinThreads = g_pinThreads;
+        params.treelets = scene.accel == ACCEL_STREAM ? &treelets : NULL;
+        params.irradianceError = g_irradianceError;
+        params.shadowMapSize = g_shadowMapSize;
+        params.frameCache = g_frameCacheDir ? &frameCache : NULL;
+        params.frameCacheSettings = frameCacheSettings();
+        params.temporal = g_temporal;
+        bool ok = renderAnimation(scene, params);
+        if(params.treelets && g_stats)
+            printTreeletCacheStats(treelets);
+        if(params.frameCache && g_stats)
+            printFrameCacheStats(frameCache);
+        return ok ? 0 : -1;
+    }
+
+    if(g_cpuOutput)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        Image img(IMAGE_WIDTH, IMAGE_HEIGHT);
+        GBuffer gbuffer(IMAGE_WIDTH, IMAGE_HEIGHT);
+        // Looked up before anything is built for the scene
+        uint64_t frameKey = g_frameCacheDir ? frameCacheKey(scene, frameCacheSettings()) : 0;
+        GBuffer *cachedGBuffer = g_heatmap < 0 && g_denoiseIterations > 0 ? &gbuffer : NULL;
+        if(g_frameCacheDir && lookupFrame(frameCache, frameKey, img, cachedGBuffer))
+        {
+            printf("Read frame %016llx from the frame cache in %.2f ms\n", (unsigned long long)frameKey, millisecondsSince(start));
+            if(g_stats)
+                printFrameCacheStats(frameCache);
+            return finishCPUFrame(img, gbuffer) ? 0 : -1;
+        }
+
+        TilePool pool(g_numThreads, g_pinThreads ? 0 : -1);
+        Tracer tracer;
+        initTracer(tracer, scene, g_numThreads, &pool);
+        TraceStats stats;
+        CostBuffer cost;
+        if(g_heatmap >= 0 || g_heatmapPFM)
+            cost = CostBuffer(IMAGE_WIDTH, IMAGE_HEIGHT);
+        HitBuffer primaryHits;
+        if(g_hybrid)
+        {
+            primaryHits = HitBuffer(IMAGE_WIDTH, IMAGE_HEIGHT);
+            std::chrono::steady_clock::time_point rasterStart = std::chrono::steady_clock::now();
+            rasterizePrimaryHits(tracer, primaryHits, g_numThreads);
+            printf("Rasterized primary hits in %.2f ms\n", millisecondsSince(rasterStart));
+            tracer.primaryHits = &primaryHits;
+        }
+        if(scene.accel == ACCEL_STREAM)
+        {
+            tracer.treelets = &treelets;
+            primaryHits = HitBuffer(IMAGE_WIDTH, IMAGE_HEIGHT);
+            std::chrono::steady_clock::time_point streamStart = std::chrono::steady_clock::now();
+            streamPrimaryHits(tracer, primaryHits, g_numThreads, &stats);
+            printf("Traced streamed primary hits in %.2f ms\n", millisecondsSince(streamStart));
+            tracer.primaryHits = &primaryHits;
+        }
+        ShadowMaps shadows;
+        if(g_shadowMapSize > 0)
+        {
+            shadows.size = g_shadowMapSize;
+            updateShadowMaps(tracer, shadows, g_numThreads);
+            printf("Cast %d shadow maps in %.2f ms\n", (int)shadows.maps.size(), shadows.stats.buildMs);
+            tracer.shadows = &shadows;
+        }
+        IrradianceCache irradiance;
+        if(g_irradianceError > 0.0f)
+        {
+            irradiance.error = g_irradianceError;
+            std::chrono::steady_clock::time_point fillStart = std::chrono::steady_clock::now();
+            fillIrradianceCache(tracer, irradiance, IMAGE_WIDTH, IMAGE_HEIGHT, g_numThreads, &stats);
+            printf("Gathered %d irradiance records in %.2f ms\n", (int)irradiance.records.size(), millisecondsSince(fillStart));
+            tracer.irradiance = &irradiance;
+        }
+        ScreenTiles screenTiles;
+        if(g_tileLists)
+        {
+            std::chrono::steady_clock::time_point binStart = std::chrono::steady_clock::now();
+            buildScreenTiles(screenTiles, scene, IMAGE_WIDTH, IMAGE_HEIGHT, SCREEN_TILE_SIZE);
+            printf("Binned %d tile list entries in %.2f ms\n", (int)screenTiles.prims.size(), millisecondsSince(binStart));
+            tracer.screenTiles = &screenTiles;
+        }
+        BounceBuffer bounces;
+        if(g_bounceFactor > 1)
+        {
+            bounces = BounceBuffer(IMAGE_WIDTH, IMAGE_HEIGHT, g_bounceFactor, g_bounceMaterials);
+            std::chrono::steady_clock::time_point bounceStart = std::chrono::steady_clock::now();
+            renderBounces(tracer, bounces, IMAGE_WIDTH, IMAGE_HEIGHT, g_numThreads, &stats);
+            printf("Traced %dx%d bounce light in %.2f ms\n", bounces.width, bounces.height, millisecondsSince(bounceStart));
+            tracer.bounces = &bounces;
+        }
+        SampleMap samples;
+        if(scene.adaptiveThreshold > 0.0f || g_sampleMapPath)
+            samples = SampleMap(IMAGE_WIDTH, IMAGE_HEIGHT);
+        renderImage(tracer, img, g_numThreads, &gbuffer, &stats, cost.width > 0 ? &cost : NULL,
+                    samples.width > 0 ? &samples : NULL);
+        printf("Rendered %dx%d in %.2f ms\n", img.width, img.height, millisecondsSince(start));
+        if(scene.adaptiveThreshold > 0.0f)
+            printSampleCounts(samples, std::max(scene.samplesPerPixel, scene.maxSamples));
+        if(g_sampleMapPath && !writePFM(g_sampleMapPath, samples))
+            return -1;
+        if(g_stats)
+            printTraceStats(stats, scene.maxBounce);
+        if(tracer.treelets && g_stats)
+            printTreeletCacheStats(treelets);
+        if(tracer.irradiance && g_stats)
+            printIrradianceCacheStats(irradiance);
+        if(tracer.shadows && g_stats)
+            printShadowMapStats(shadows);
+        if(g_heatmapPFM && !writePFM(g_heatmapPFM, cost, costMetric))
+            return -1;
+        if(g_heatmap >= 0)
+            heatmapImage(cost, g_heatmap, g_heatmapScale, img);
+        if(g_frameCacheDir)
+        {
+            storeFrame(frameCache, frameKey, img, cachedGBuffer);
+            if(g_stats)
+                printFrameCacheStats(frameCache);
+        }
+        return finishCPUFrame(img, gbuffer, &pool) ? 0 : -1;
+    }
+
     // -------------------------------- INIT ------------------------------- //
 
     // Init GLFW
@@ -346,15 +2076,21 @@ int main()
         return -1;
     }
     
-    // Create a rendering window with OpenGL 3.2 context
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+    // Create a rendering window with OpenGL 3.2 context, or 4.3 for the compute tracer
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, g_compute ? 4 : 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, g_compute ? 3 : 2);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 
     glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
 
-    window = glfwCreateWindow(1280, 960, "OpenGL", NULL, NULL);
+    window = glfwCreateWindow(IMAGE_WIDTH, IMAGE_HEIGHT, "OpenGL", NULL, NULL);
+    if(!window && g_compute)
+    {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+        window = glfwCreateWindow(IMAGE_WIDTH, IMAGE_HEIGHT, "OpenGL", NULL, NULL);
+    }
     //window = glfwCreateWindow((int)g_windowWidth, (int)g_windowHeight, "OpenGL", NULL, NULL);
     glfwMakeContextCurrent(window);
 
@@ -370,8 +2106,19 @@ int main()
     //glfwSetCursorPosCallback(window, cursorPosCallback);
     glfwSetKeyCallback(window, keyCallback);    
 
-    // Setup shaders
-    readAndCompileShaders(basicVertSrc, basicFragSrc, &shaderProgram);
+    // Setup shaders. The compute tracer takes every uniform of the fragment one.
+    if(g_compute)
+    {
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        if(major < 4 || (major == 4 && minor < 3))
+            fprintf(stderr, "OpenGL %d.%d has no compute shaders, using the fragment shader tracer\n", major, minor);
+        else if(!(computeTracer = compileComputeShader(traceCompSrc.c_str(), &shaderProgram)))
+            fprintf(stderr, "Using the fragment shader tracer\n");
+    }
+    if(!computeTracer)
+        readAndCompileShaders(basicVertSrc, basicFragSrc.c_str(), &shaderProgram);
     glUseProgram(shaderProgram);
 
     // The quad that covers the whole viewport
@@ -395,15 +2142,80 @@ int main()
 
 
     // Setup vertex attributes
-    GLint posAttrib = glGetAttribLocation(shaderProgram, "aPosition");
+    GLint posAttrib = 0;     // Bound by readAndCompileShaders
     glEnableVertexAttribArray(posAttrib);
     glVertexAttribPointer(posAttrib, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), 0);
 
-    initScene();
+    // The shader traverses the same grid as the CPU tracer
+    glGenTextures(3, particleTex);
+    glGenBuffers(3, particleBuf);
+    UniformGrid grid;
+    if(scene.accel == ACCEL_GRID)
+        buildGrid(grid, scene.particles, scene.particleRadius, g_numThreads);
+    initScene(scene, grid);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uHeatmap"), g_heatmap);
+    glUniform1f(glGetUniformLocation(shaderProgram, "uHeatmapScale"), g_heatmapScale);
+
+    // Samplers of different types may not share a unit, not even those of modes that are off
+    glUniform1i(glGetUniformLocation(shaderProgram, "uPrimaryHits"), 7);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uTileStart"), 8);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uTilePrims"), 9);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uBounceLight"), 10);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uBounceGeometry"), 11);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uBlueNoise"), 12);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uAccumColor"), 13);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uAccumMoments"), 14);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uHistory"), 4);
+    glUniform1i(glGetUniformLocation(shaderProgram, "uMotionSpheres"), 5);
+    initSampling(scene);
+
+    // Adaptive sampling on GL spreads the batches over progressive frames
+    adaptive = scene.adaptiveThreshold > 0.0f;
+    if(adaptive)
+        g_progressive = true;
+    if(usesFrameTarget())
+        initFrameTarget();
+    if(computeTracer)
+        initComputeTracer();
+    if(g_temporal)
+        initTemporal();
+    if(g_denoiseIterations > 0)
+        initDenoiser();
+    if(g_hybrid)
+        initHybrid();
+    if(g_tileLists)
+        initTileLists();
+    if(g_bounceFactor > 1)
+        initLowResBounces();
+    if(g_hybrid || g_tileLists)
+        displayedScene = &scene;
+    if(g_recordPath)
+    {
+        if(!openFrameWriter(frameWriter, g_recordPath, g_recordPPM, IMAGE_WIDTH, IMAGE_HEIGHT))
+            return -1;
+        initReadback();
+    }
+
+    // The simulation poses the next frame on a thread of its own while this one draws
+    std::vector<GLint> sphereCenters;
+    for(size_t i = 0; i < scene.spheres.size(); i++)
+    {
+        char sphereMember[30];
+        snprintf(sphereMember, sizeof(sphereMember), "%s.center", scene.spheres[i].name);
+        sphereCenters.push_back(glGetUniformLocation(shaderProgram, sphereMember));
+    }
+    std::vector<Sphere> builtSpheres = scene.spheres;
+    SnapshotBuffer snapshots(1);
+    std::thread simulation;
+    if(!g_progressive)
+        simulation = std::thread(runSimulation, std::ref(snapshots), scene.spheres, 1);
 
-    Mat4 rotation = Mat4::makeYRotation(3);
-    GLuint uSphere2Pos = glGetUniformLocation(shaderProgram, "uSphere2.center");
-    double currentTime, timeLastRender = 0;
+    GLuint uSampleOffset = glGetUniformLocation(shaderProgram, "uSampleOffset");
+    double currentTime, timeLastRender = 0, timeLastStats = 0;
+    long long allocationsLastStats = totalAllocations();
+    double traceMs = 0;          // Time spent in draw_scene since the last stats, to compare the tracers
+    int tracedFrames = 0;
+    bool frameDone = true;
 
     // Render loop
     while(!glfwWindowShouldClose(window))
@@ -412,11 +2224,83 @@ int main()
         if((currentTime - timeLastRender) >= g_timeBetweenFrames)
         {
             timeLastRender = currentTime;
-            sphere2Pos = rotation * sphere2Pos;
-            glUniform3f(uSphere2Pos, sphere2Pos[0], sphere2Pos[1], sphere2Pos[2]);
-            draw_scene();
+
+            // A tiled frame keeps the scene still until its last tile is drawn, progressive
+            // mode keeps it still for good and moves on to the next samples instead
+            if(frameDone)
+            {
+                if(g_progressive)
+                    glUniform1i(uSampleOffset, progressiveFrames * std::max(1, scene.samplesPerPixel));
+                else
+                {
+                    const SceneSnapshot& snapshot = acquireSnapshot(snapshots);
+                    applySnapshot(scene, snapshot);
+                    if(g_temporal)
+                        uploadMotionBounds(builtSpheres, snapshot.frame);
+                    for(size_t i = 0; i < scene.spheres.size(); i++)
+                    {
+                        const Vec3& c = scene.spheres[i].center;
+                        if(scene.spheres[i].dynamic)
+                            glUniform3f(sphereCenters[i], c[0], c[1], c[2]);
+                    }
+                }
+                if(g_hybrid)
+                    drawPrimaryHits(scene);
+                else if(g_tileLists)
+                    uploadScreenTiles(scene);
+                if(g_bounceFactor > 1)
+                    drawLowResBounces();
+            }
+            std::chrono::steady_clock::time_point traceStart = std::chrono::steady_clock::now();
+            frameDone = draw_scene();
+            if(g_stats && frameDone)
+            {
+                glFinish();
+                traceMs += millisecondsSince(traceStart);
+                tracedFrames++;
+            }
+            if(g_progressive && frameDone)
+            {
+                progressiveFrames++;
+                if((progressiveFrames & (progressiveFrames - 1)) == 0)
+                {
+                    if(adaptive)
+                    {
+                        printf("%d frames: ", progressiveFrames);
+                        printSampleCounts(readSampleMap(), std::max(scene.samplesPerPixel, scene.maxSamples));
+                    }else
+                        printf("%d samples per pixel\n", progressiveFrames * std::max(1, scene.samplesPerPixel));
+                }
+            }
+
+            if(g_stats && frameDone && currentTime - timeLastStats >= 1.0)
+            {
+                timeLastStats = currentTime;
+                TraceStats stats = readFrameStats();
+                stats.allocations = totalAllocations() - allocationsLastStats;
+                allocationsLastStats = totalAllocations();
+                printTraceStats(stats, scene.maxBounce);
+                printf("%s tracer: %.2f ms per frame\n", computeTracer ? "Compute" : "Fragment", traceMs / tracedFrames);
+                traceMs = 0;
+                tracedFrames = 0;
+            }
         }
         // Poll window events
         glfwPollEvents();
     }
+
+    if(simulation.joinable())
+    {
+        snapshots.quit = true;
+        simulation.join();
+        if(g_stats)
+            printSnapshotStats(snapshots);
+    }
+
+    if(g_recordPath)
+        finishRecording();
+    if(g_sampleMapPath && adaptive && !writePFM(g_sampleMapPath, readSampleMap()))
+        return -1;
+    if(g_heatmapPFM)
+        return writePFM(g_heatmapPFM, readFrameCost(), costMetric) ? 0 : -1;
 }
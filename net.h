@@ -0,0 +1,213 @@
+#ifndef NET_H
+#define NET_H
+
+// Blocking stream sockets and length-prefixed messages for the distributed renderer.
+// POSIX only. An address is either "unix:<path>" or "<host>:<port>" for TCP.
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#define NET_SUPPORTED 1
+
+static const uint32_t MAX_MESSAGE_SIZE = 1u << 30;
+
+inline bool isUnixAddress(const char *address)
+{
+    return strncmp(address, "unix:", 5) == 0;
+}
+
+inline bool makeUnixAddress(const char *address, sockaddr_un& addr)
+{
+    const char *path = address + 5;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+// Resolves "host:port", an empty host means any interface
+inline addrinfo *resolveTcpAddress(const char *address, bool passive)
+{
+    const char *colon = strrchr(address, ':');
+    if(!colon)
+    {
+        fprintf(stderr, "Bad address %s, expected host:port or unix:path\n", address);
+        return NULL;
+    }
+    std::string host(address, colon - address);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo *result = NULL;
+    int err = getaddrinfo(host.empty() ? NULL : host.c_str(), colon + 1, &hints, &result);
+    if(err != 0)
+    {
+        fprintf(stderr, "Could not resolve %s: %s\n", address, gai_strerror(err));
+        return NULL;
+    }
+    return result;
+}
+
+// Small tile requests must not wait for Nagle's algorithm
+inline void setNoDelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Returns the listening socket or -1
+inline int listenSocket(const char *address)
+{
+    if(isUnixAddress(address))
+    {
+        sockaddr_un addr;
+        if(!makeUnixAddress(address, addr))
+            return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(addr.sun_path);
+        if(fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0)
+        {
+            fprintf(stderr, "Could not listen on %s: %s\n", address, strerror(errno));
+            if(fd >= 0)
+                close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo *info = resolveTcpAddress(address, true);
+    if(!info)
+        return -1;
+    int fd = -1;
+    for(addrinfo *ai = info; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+    if(fd < 0)
+        fprintf(stderr, "Could not listen on %s: %s\n", address, strerror(errno));
+    return fd;
+}
+
+// Returns the connected socket or -1
+inline int connectSocket(const char *address)
+{
+    if(isUnixAddress(address))
+    {
+        sockaddr_un addr;
+        if(!makeUnixAddress(address, addr))
+            return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            fprintf(stderr, "Could not connect to %s: %s\n", address, strerror(errno));
+            if(fd >= 0)
+                close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo *info = resolveTcpAddress(address, false);
+    if(!info)
+        return -1;
+    int fd = -1;
+    for(addrinfo *ai = info; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0)
+            continue;
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            setNoDelay(fd);
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+    if(fd < 0)
+        fprintf(stderr, "Could not connect to %s: %s\n", address, strerror(errno));
+    return fd;
+}
+
+inline bool sendAll(int fd, const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while(size > 0)
+    {
+        ssize_t n = send(fd, p, size, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool recvAll(int fd, void *data, size_t size)
+{
+    char *p = (char *)data;
+    while(size > 0)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// A message is a type and a payload size followed by the payload
+inline bool sendMessage(int fd, uint32_t type, const void *data, uint32_t size)
+{
+    uint32_t header[2] = { type, size };
+    return sendAll(fd, header, sizeof(header)) && (size == 0 || sendAll(fd, data, size));
+}
+
+inline bool recvMessage(int fd, uint32_t& type, std::vector<char>& payload)
+{
+    uint32_t header[2];
+    if(!recvAll(fd, header, sizeof(header)) || header[1] > MAX_MESSAGE_SIZE)
+        return false;
+    type = header[0];
+    payload.resize(header[1]);
+    return header[1] == 0 || recvAll(fd, &payload[0], header[1]);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <math.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "tracer.h"
+
+// Rasterized primary visibility for the hybrid mode. Every object covers the pixels of
+// its screen bounds, is ray cast there and depth tested against the hits already in the
+// buffer, like the impostor quads of rasterVertSrc and rasterFragSrc. The tracer then
+// starts shading from the buffered hits instead of testing primary rays against the scene.
+// The same screen bounds also bin the objects into the per tile lists of ScreenTiles.
+
+// Screen bounds of a sphere for the camera of primaryRay, in its u, v coordinates and
+// clipped to the screen. Returns false if no primary ray can reach the sphere.
+inline bool sphereScreenBounds(const Vec3& center, float radius, float& u0, float& v0, float& u1, float& v1)
+{
+    // Primary rays run toward -z, a point at depth d = -q.z in front of the camera
+    // projects to u = 0.75 * q.x / d + 0.5, v = q.y / d + 0.5
+    Vec3 q = center - Vec3(0, 0, 2);
+    float zNear = -q[2] - radius;
+    float zFar = -q[2] + radius;
+    if(zFar <= 0.0f)
+        return false;
+
+    u0 = v0 = 0.0f;
+    u1 = v1 = 1.0f;
+    if(zNear > MIN_T)
+    {
+        // x / z over the box around the sphere peaks at its corners
+        float xMin = std::min((q[0] - radius) / zNear, (q[0] - radius) / zFar);
+        float xMax = std::max((q[0] + radius) / zNear, (q[0] + radius) / zFar);
+        float yMin = std::min((q[1] - radius) / zNear, (q[1] - radius) / zFar);
+        float yMax = std::max((q[1] + radius) / zNear, (q[1] + radius) / zFar);
+        u0 = std::max(u0, 0.75f * xMin + 0.5f);
+        u1 = std::min(u1, 0.75f * xMax + 0.5f);
+        v0 = std::max(v0, yMin + 0.5f);
+        v1 = std::min(v1, yMax + 0.5f);
+    }
+    return u0 <= u1 && v0 <= v1;
+}
+
+// Pixels a sphere may cover in a width x height image, inclusive. A pixel margin keeps
+// rounding from dropping the edge pixels. Returns false if the sphere can't be seen.
+inline bool spherePixelBounds(const Vec3& center, float radius, int width, int height,
+                              int& xMin, int& yMin, int& xMax, int& yMax)
+{
+    float u0, v0, u1, v1;
+    if(!sphereScreenBounds(center, radius, u0, v0, u1, v1))
+        return false;
+
+    xMin = std::max(0, (int)floorf(u0 * width) - 1);
+    xMax = std::min(width - 1, (int)ceilf(u1 * width) + 1);
+    yMin = std::max(0, (int)floorf(v0 * height) - 1);
+    yMax = std::min(height - 1, (int)ceilf(v1 * height) + 1);
+    return true;
+}
+
+// Depth tests one sphere over its screen bounds within rows [y0, y1)
+inline void rasterSphere(HitBuffer& hits, const Vec3& center, float radius, int prim, int y0, int y1)
+{
+    int xMin, yMin, xMax, yMax;
+    if(!spherePixelBounds(center, radius, hits.width, hits.height, xMin, yMin, xMax, yMax))
+        return;
+
+    yMin = std::max(yMin, y0);
+    yMax = std::min(yMax, y1 - 1);
+    for(int y = yMin; y <= yMax; y++)
+    {
+        for(int x = xMin; x <= xMax; x++)
+        {
+            Ray r = primaryRay((x + 0.5f) / hits.width, (y + 0.5f) / hits.height);
+            float t = sphereHitT(center, radius, r);
+            Hit& hit = hits.at(x, y);
+            if(t < hit.t)
+            {
+                hit.t = t;
+                hit.prim = prim;
+                hit.u = hit.v = 0.0f;
+            }
+        }
+    }
+}
+
+// Fills hits with the primary hit of every pixel. Objects go in the order intersectTest
+// tests them and only closer hits replace earlier ones, so the result is the same.
+inline void rasterizePrimaryHits(const Tracer& tracer, HitBuffer& hits, int numThreads)
+{
+    const Scene& scene = *tracer.scene;
+    std::unique_ptr<TilePool> localPool;
+    TilePool& pool = renderPool(tracer, numThreads, localPool);
+    // Bands of rows rather than tiles or interleaved rows, so that screen bounds clip well
+    // and every object is visited once per worker
+    auto band = [&](int y0, int y1)
+    {
+        Hit miss;
+        miss.t = MAX_DEPTH;
+        miss.prim = -1;
+        miss.u = miss.v = 0.0f;
+        std::fill(hits.data.begin() + y0 * hits.width, hits.data.begin() + y1 * hits.width, miss);
+
+        for(size_t i = 0; i < scene.planes.size(); i++)
+        {
+            for(int y = y0; y < y1; y++)
+            {
+                for(int x = 0; x < hits.width; x++)
+                {
+                    Ray r = primaryRay((x + 0.5f) / hits.width, (y + 0.5f) / hits.height);
+                    Hit tmp = planeIntersect(scene.planes[i], (int)i, r);
+                    if(tmp.t < hits.at(x, y).t)
+                        hits.at(x, y) = tmp;
+                }
+            }
+        }
+
+        for(size_t i = 0; i < scene.spheres.size(); i++)
+            rasterSphere(hits, scene.spheres[i].center, scene.spheres[i].radius, spherePrimitive(scene, (int)i), y0, y1);
+
+        for(size_t i = 0; i < scene.particles.size(); i++)
+            rasterSphere(hits, scene.particles[i], scene.particleRadius, particlePrimitive(scene, (int)i), y0, y1);
+    };
+    runBands(pool, hits.height, pool.numThreads, band);
+}
+
+// Adds prim to the tiles its screen bounds touch, or counts it there while the
+// offsets are being sized
+inline void addToScreenTiles(ScreenTiles& tiles, const Vec3& center, float radius, int prim,
+                             int width, int height, bool counting)
+{
+    int xMin, yMin, xMax, yMax;
+    if(!spherePixelBounds(center, radius, width, height, xMin, yMin, xMax, yMax))
+        return;
+
+    for(int ty = yMin / tiles.tileSize; ty <= yMax / tiles.tileSize; ty++)
+    {
+        for(int tx = xMin / tiles.tileSize; tx <= xMax / tiles.tileSize; tx++)
+        {
+            int tile = tx + tiles.tilesX * ty;
+            if(counting)
+                tiles.counts[tile]++;
+            else
+                tiles.prims[tiles.counts[tile]++] = prim;
+        }
+    }
+}
+
+// Bins the spheres and particles by the screen tiles their bounds touch, for the primary
+// rays of screenTileIntersect. Cheap enough to redo whenever an object moves, and the
+// vectors are reused, so a rebuild only allocates when the lists grow.
+inline void buildScreenTiles(ScreenTiles& tiles, const Scene& scene, int width, int height, int tileSize)
+{
+    tiles.tileSize = tileSize;
+    tiles.tilesX = (width + tileSize - 1) / tileSize;
+    tiles.tilesY = (height + tileSize - 1) / tileSize;
+    int numTiles = tiles.tilesX * tiles.tilesY;
+
+    // Count per tile, turn the counts into offsets, then fill in intersectTest order
+    tiles.counts.assign(numTiles, 0);
+    for(int pass = 0; pass < 2; pass++)
+    {
+        bool counting = pass == 0;
+        for(size_t i = 0; i < scene.spheres.size(); i++)
+            addToScreenTiles(tiles, scene.spheres[i].center, scene.spheres[i].radius, spherePrimitive(scene, (int)i),
+                             width, height, counting);
+        for(size_t i = 0; i < scene.particles.size(); i++)
+            addToScreenTiles(tiles, scene.particles[i], scene.particleRadius, particlePrimitive(scene, (int)i),
+                             width, height, counting);
+
+        if(counting)
+        {
+            tiles.tileStart.resize(numTiles + 1);
+            tiles.tileStart[0] = 0;
+            for(int t = 0; t < numTiles; t++)
+            {
+                tiles.tileStart[t + 1] = tiles.tileStart[t] + tiles.counts[t];
+                tiles.counts[t] = tiles.tileStart[t];
+            }
+            tiles.prims.resize(tiles.tileStart[numTiles]);
+        }
+    }
+}
+
+#endif
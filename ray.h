@@ -0,0 +1,76 @@
+#ifndef RAY_H
+#define RAY_H
+
+#include "vec.h"
+
+// Same constants as basicFragSrc
+static const float MAX_DEPTH = 100000.0f;
+static const float MIN_T = 0.0001f;
+
+struct Ray
+{
+    Vec3 origin;
+    Vec3 direction;
+};
+
+// Work done by one traversal of an acceleration structure, for the cost heatmaps
+struct TraversalCost
+{
+    int nodeVisits;          // Grid cells or BVH nodes
+    int primitiveTests;
+
+    TraversalCost() : nodeVisits(0), primitiveTests(0) {}
+};
+
+// Returns the nearest t > MIN_T at which the ray hits the sphere, or MAX_DEPTH
+inline float sphereHitT(const Vec3& center, float radius, const Ray& r)
+{
+    Vec3 tmp = r.origin - center;
+    float a = dot(r.direction, r.direction);
+    float b = 2.0f * dot(tmp, r.direction);
+    float c = dot(tmp, tmp) - radius * radius;
+    float disc = b * b - 4.0f * a * c;
+
+    if(disc < 0.0f)
+        return MAX_DEPTH;
+
+    float e = sqrtf(disc);
+    float denom = 2.0f * a;
+    float t = (-b - e) / denom;
+    if(t > MIN_T)
+        return t;
+
+    t = (-b + e) / denom;
+    if(t > MIN_T)
+        return t;
+
+    return MAX_DEPTH;
+}
+
+// Clips a ray against an axis aligned box. Returns false if [tMin, tMax] misses the box.
+inline bool clipRayToBox(const Ray& r, const Vec3& invDir, const Vec3& bmin, const Vec3& bmax, float& tMin, float& tMax)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        float tNear = (bmin[i] - r.origin[i]) * invDir[i];
+        float tFar = (bmax[i] - r.origin[i]) * invDir[i];
+        if(tNear > tFar)
+            std::swap(tNear, tFar);
+        tMin = tNear > tMin ? tNear : tMin;
+        tMax = tFar < tMax ? tFar : tMax;
+        if(tMin > tMax)
+            return false;
+    }
+    return true;
+}
+
+// Reciprocal of the ray direction, with zero components replaced by a huge value
+inline Vec3 safeInverse(const Vec3& d)
+{
+    Vec3 inv;
+    for(int i = 0; i < 3; i++)
+        inv[i] = fabsf(d[i]) > 1e-12f ? 1.0f / d[i] : (d[i] < 0.0f ? -1e30f : 1e30f);
+    return inv;
+}
+
+#endif
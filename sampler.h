@@ -0,0 +1,282 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include "vec.h"
+
+// Sample placement for pixel jitter, lens sampling and light selection. Every sample is
+// a function of the pixel, the sample index and the dimension alone, so the CPU tracer
+// and the sampler functions of basicFragSrc place them identically.
+enum SamplerType
+{
+    SAMPLER_RANDOM = 0,      // Independent hashed random numbers, the baseline
+    SAMPLER_SOBOL = 1,       // Owen scrambled Sobol points, shuffled per pixel
+    SAMPLER_BLUE_NOISE = 2   // A tiled blue noise dither array, rotated by the golden ratio per sample
+};
+
+static const int SAMPLER_TYPES = 3;
+static const char *const SAMPLER_NAMES[SAMPLER_TYPES] = { "random", "sobol", "bluenoise" };
+
+// Two dimensional sample streams of a pixel sample
+enum SampleDimension
+{
+    SAMPLE_PIXEL = 0,        // Position within the pixel
+    SAMPLE_LENS = 1,         // Position on the lens
+    SAMPLE_LIGHT = 2         // Light selection, x only
+};
+
+static const int BLUE_NOISE_SIZE = 64;
+static const float BLUE_NOISE_SIGMA = 1.5f;
+static const float GOLDEN_RATIO_FRACT = 0.618034f;
+
+// Wang hash, the same as hashInt in basicFragSrc
+inline uint32_t hashInt(uint32_t x)
+{
+    x = (x ^ 61u) ^ (x >> 16);
+    x *= 9u;
+    x = x ^ (x >> 4);
+    x *= 0x27d4eb2du;
+    x = x ^ (x >> 15);
+    return x;
+}
+
+inline uint32_t reverseBits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Second dimension of the Sobol sequence, the first is reverseBits(index)
+inline uint32_t sobolSecond(uint32_t index)
+{
+    uint32_t result = 0;
+    for(uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if(index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+// Hash based nested uniform scrambling, from Burley, "Practical Hash-based Owen
+// Scrambling" (JCGT 2020). Scrambling the index instead of a point shuffles the
+// sequence while keeping every power of two prefix stratified.
+inline uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+    x = reverseBits(x);
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1u;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return reverseBits(x);
+}
+
+// Adds or removes the Gaussian energy of pixel p of a toroidal dither pattern
+inline void splatBlueNoiseEnergy(std::vector<float>& energy, const std::vector<float>& kernel, int p, float sign)
+{
+    const int n = BLUE_NOISE_SIZE;
+    int px = p % n;
+    int py = p / n;
+    for(int y = 0; y < n; y++)
+    {
+        const float *row = &kernel[((y - py) & (n - 1)) * n];
+        for(int x = 0; x < n; x++)
+            energy[y * n + x] += sign * row[(x - px) & (n - 1)];
+    }
+}
+
+// The pixel of the given state with the highest energy, the tightest cluster, or the
+// one with the lowest, the largest void
+inline int blueNoiseExtreme(const std::vector<float>& energy, const std::vector<uint8_t>& pattern, uint8_t state, bool highest)
+{
+    int best = -1;
+    for(int i = 0; i < (int)energy.size(); i++)
+    {
+        if(pattern[i] != state)
+            continue;
+        if(best < 0 || (highest ? energy[i] > energy[best] : energy[i] < energy[best]))
+            best = i;
+    }
+    return best;
+}
+
+// Void-and-cluster dither array (Ulichney 1993): every pixel ranked by when it joins a
+// pattern that stays evenly spread, as values in (0, 1). Phase 3 of the method picks the
+// tightest cluster of zeros, which is the largest void of ones, so one loop does 2 and 3.
+inline std::vector<float> buildBlueNoise()
+{
+    const int n = BLUE_NOISE_SIZE;
+    const int count = n * n;
+    std::vector<float> kernel(count);
+    for(int y = 0; y < n; y++)
+    {
+        for(int x = 0; x < n; x++)
+        {
+            int dx = std::min(x, n - x);
+            int dy = std::min(y, n - y);
+            kernel[y * n + x] = expf(-(dx * dx + dy * dy) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+    }
+
+    // A tenth of the pixels at fixed seed random spots, then relaxed until the
+    // tightest cluster is also the largest void
+    std::vector<uint8_t> pattern(count, 0);
+    std::vector<float> energy(count, 0.0f);
+    int ones = count / 10;
+    uint32_t seed = 12345u;
+    for(int placed = 0; placed < ones;)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        int p = (int)((seed >> 8) % (uint32_t)count);
+        if(pattern[p])
+            continue;
+        pattern[p] = 1;
+        splatBlueNoiseEnergy(energy, kernel, p, 1.0f);
+        placed++;
+    }
+    for(int i = 0; i < count; i++)
+    {
+        int cluster = blueNoiseExtreme(energy, pattern, 1, true);
+        pattern[cluster] = 0;
+        splatBlueNoiseEnergy(energy, kernel, cluster, -1.0f);
+        int hole = blueNoiseExtreme(energy, pattern, 0, false);
+        pattern[hole] = 1;
+        splatBlueNoiseEnergy(energy, kernel, hole, 1.0f);
+        if(hole == cluster)
+            break;
+    }
+
+    std::vector<int> rank(count);
+    std::vector<uint8_t> initialPattern = pattern;
+    std::vector<float> initialEnergy = energy;
+    for(int r = ones - 1; r >= 0; r--)
+    {
+        int cluster = blueNoiseExtreme(energy, pattern, 1, true);
+        pattern[cluster] = 0;
+        splatBlueNoiseEnergy(energy, kernel, cluster, -1.0f);
+        rank[cluster] = r;
+    }
+
+    pattern = initialPattern;
+    energy = initialEnergy;
+    for(int r = ones; r < count; r++)
+    {
+        int hole = blueNoiseExtreme(energy, pattern, 0, false);
+        pattern[hole] = 1;
+        splatBlueNoiseEnergy(energy, kernel, hole, 1.0f);
+        rank[hole] = r;
+    }
+
+    std::vector<float> values(count);
+    for(int i = 0; i < count; i++)
+        values[i] = (rank[i] + 0.5f) / count;
+    return values;
+}
+
+// The BLUE_NOISE_SIZE^2 tile, built on first use and uploaded as uBlueNoise
+inline const std::vector<float>& blueNoiseTile()
+{
+    static const std::vector<float> tile = buildBlueNoise();
+    return tile;
+}
+
+// Component c of the 2D sample dim of pixel sample `sample`. width is that of the full
+// image, the random sampler hashes the pixel like pixelRandom.
+inline float sampleComponent(int sampler, int x, int y, int width, int sample, int dim, int c)
+{
+    uint32_t pixel = (uint32_t)(x + width * y);
+    if(sampler == SAMPLER_SOBOL)
+    {
+        uint32_t seed = hashInt(hashInt(pixel) ^ ((uint32_t)(dim + 1) * 0x9e3779b9u));
+        uint32_t index = owenScramble((uint32_t)sample, seed);
+        uint32_t bits = c == 0 ? reverseBits(index) : sobolSecond(index);
+        return (owenScramble(bits, hashInt(seed + 1u + (uint32_t)c)) >> 8) * (1.0f / 16777216.0f);
+    }
+    if(sampler == SAMPLER_BLUE_NOISE)
+    {
+        // Every component reads the tile at its own toroidal offset
+        const int n = BLUE_NOISE_SIZE;
+        uint32_t offset = hashInt((uint32_t)(2 * dim + c + 1));
+        int bx = (x + (int)(offset & (n - 1))) & (n - 1);
+        int by = (y + (int)((offset >> 8) & (n - 1))) & (n - 1);
+        float v = blueNoiseTile()[by * n + bx] + sample * GOLDEN_RATIO_FRACT;
+        return v - floorf(v);
+    }
+    return hashInt(hashInt(pixel) + 0x40000000u + (uint32_t)(6 * sample + 2 * dim + c)) * (1.0f / 4294967296.0f);
+}
+
+inline Vec2 sample2D(int sampler, int x, int y, int width, int sample, int dim)
+{
+    return Vec2(sampleComponent(sampler, x, y, width, sample, dim, 0),
+                sampleComponent(sampler, x, y, width, sample, dim, 1));
+}
+
+// Adaptive sampling: a pixel takes batches of samples until the standard error of its
+// mean luminance, relative to that luminance, falls below a threshold
+static const int ADAPTIVE_MIN_SAMPLES = 8;
+static const float ADAPTIVE_LUMINANCE_FLOOR = 0.1f;    // Darker pixels are held to the error allowed at this luminance
+
+inline float luminance(const Vec3& c)
+{
+    return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+// Running mean and sum of squared deviations of the sample luminances (Welford)
+struct SampleMoments
+{
+    int count;
+    float mean;
+    float m2;
+
+    SampleMoments() : count(0), mean(0.0f), m2(0.0f) {}
+};
+
+inline void addSample(SampleMoments& m, float x)
+{
+    m.count++;
+    float d = x - m.mean;
+    m.mean += d / m.count;
+    m.m2 += d * (x - m.mean);
+}
+
+// The same test as sampleErrorBelow in basicFragSrc. Pixels only stop after a power of two
+// batches, so that a stopped pixel never leaves a Sobol stratum half filled.
+inline bool sampleErrorBelow(const SampleMoments& m, int batch, float threshold)
+{
+    int batches = m.count / batch;
+    if(m.count < ADAPTIVE_MIN_SAMPLES || (batches & (batches - 1)) != 0)
+        return false;
+    float varianceOfMean = m.m2 / ((m.count - 1) * (float)m.count);
+    float allowed = threshold * std::max(m.mean, ADAPTIVE_LUMINANCE_FLOOR);
+    return varianceOfMean <= allowed * allowed;
+}
+
+// Maps the unit square onto the unit disk, keeping the strata of the sample points
+// (Shirley and Chiu, "A Low Distortion Map Between Disk and Square")
+inline Vec2 concentricDisk(const Vec2& u)
+{
+    float a = 2.0f * u[0] - 1.0f;
+    float b = 2.0f * u[1] - 1.0f;
+    if(a == 0.0f && b == 0.0f)
+        return Vec2(0.0f, 0.0f);
+
+    float r, phi;
+    if(fabsf(a) > fabsf(b))
+    {
+        r = a;
+        phi = (float)(PI / 4) * (b / a);
+    }else
+    {
+        r = b;
+        phi = (float)(PI / 2) - (float)(PI / 4) * (a / b);
+    }
+    return Vec2(r * cosf(phi), r * sinf(phi));
+}
+
+#endif
@@ -0,0 +1,430 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "sampler.h"
+#include "serialize.h"
+#include "vec.h"
+
+// Acceleration structure used for the particle layer of a scene
+enum AccelType
+{
+    ACCEL_NONE = 0,          // Test every particle
+    ACCEL_GRID = 1,          // Uniform grid, 3D-DDA traversal
+    ACCEL_BVH = 2,           // Bounding volume hierarchy (CPU only, the shader falls back to ACCEL_NONE)
+    ACCEL_STREAM = 3         // BVH treelets paged in from a file, see stream.h (CPU only)
+};
+
+struct Light
+{
+    const char *name;        // Uniform name in basicFragSrc
+    Vec3 position;
+    Vec3 color;
+    float intensity;
+};
+
+struct Material
+{
+    float ka;                // Ambient coefficient
+    float kd;                // Diffuse coefficient
+    float ks;                // Specular/Reflective coefficient
+    float kt;                // Transmission coefficient
+    float ior;               // Index of refraction
+    Vec3 color;
+    int matType;             // Material type: 0 = Opaque non-reflective, 1 = reflective, 2 = transmissive
+};
+
+struct Sphere
+{
+    const char *name;        // Uniform name in basicFragSrc
+    Vec3 center;
+    float radius;
+    Material mat;
+    bool dynamic;            // Moved by animateScene, so kept out of cached shadow maps
+};
+
+struct Plane
+{
+    const char *name;        // Uniform name in basicFragSrc
+    Vec3 point;
+    Vec3 normal;
+    Material mat;
+    bool checkered;
+};
+
+// Everything the tracers need to render a frame. The named objects map onto the
+// uniforms of basicFragSrc, the particles are equal-radius spheres sharing one material.
+struct Scene
+{
+    int maxBounce;
+    float throughputCutoff;  // Secondary rays weighted below this are culled
+    int rouletteDepth;       // First bounce whose rays may be killed by Russian roulette, -1 disables it
+    std::vector<Light> lights;
+    std::vector<Sphere> spheres;
+    std::vector<Plane> planes;
+
+    std::vector<Vec3> particles;
+    float particleRadius;
+    Material particleMat;
+    int accel;               // AccelType
+    bool compact;            // Quantized materials, particles and BVH, see compact.h
+    Vec3 particleOrigin;     // 16 bit frame the particles of a compact scene are snapped to
+    Vec3 particleStep;
+
+    // Sampling, see sampler.h. One sample with a pinhole camera traces the pixel center.
+    int samplesPerPixel;
+    int sampler;             // SamplerType
+    float lensRadius;        // Thin lens aperture, 0 for a pinhole camera
+    float focusDistance;     // Distance from the camera to the plane in focus
+    bool lightSampling;      // Shade primary hits with one light picked by intensity rather than all
+    float adaptiveThreshold; // Relative error at which a pixel stops taking batches of samplesPerPixel, 0 takes one batch
+    int maxSamples;          // Most samples of a pixel under adaptive sampling
+};
+
+inline Material makeMaterial(float ka, float kd, float ks, float kt, float ior, Vec3 color, int matType)
+{
+    Material mat;
+    mat.ka = ka;
+    mat.kd = kd;
+    mat.ks = ks;
+    mat.kt = kt;
+    mat.ior = ior;
+    mat.color = color;
+    mat.matType = matType;
+    return mat;
+}
+
+// Primitive IDs number the planes, then the spheres, then the particles. Hit records
+// carry only an ID, the material is looked up in the table of buildMaterialTable.
+inline int spherePrimitive(const Scene& scene, int i)
+{
+    return (int)scene.planes.size() + i;
+}
+
+inline int particlePrimitive(const Scene& scene, int i)
+{
+    return (int)(scene.planes.size() + scene.spheres.size()) + i;
+}
+
+// Index into the material table of a primitive, every particle shares the last entry
+inline int materialIndex(const Scene& scene, int prim)
+{
+    int particles = particlePrimitive(scene, 0);
+    return prim < particles ? prim : particles;
+}
+
+// One material per plane and per sphere, then the particle material
+inline void buildMaterialTable(const Scene& scene, std::vector<Material>& materials)
+{
+    materials.clear();
+    for(size_t i = 0; i < scene.planes.size(); i++)
+        materials.push_back(scene.planes[i].mat);
+    for(size_t i = 0; i < scene.spheres.size(); i++)
+        materials.push_back(scene.spheres[i].mat);
+    materials.push_back(scene.particleMat);
+}
+
+// The scene the program has always shown: a glass sphere, a reflective sphere
+// on top of it and an orbiting one, above a reflective checkered floor.
+inline Scene makeDefaultScene()
+{
+    Scene scene;
+
+    // Set the number of ray bounces
+    scene.maxBounce = 4;
+    scene.throughputCutoff = 0.002f;
+    scene.rouletteDepth = -1;
+
+    //--------------------- Lights
+    Light light;
+    light.name = "uLight1";
+    light.position = Vec3(-1.0f, 1.0f, 1.0f);
+    light.color = Vec3(1.0f, 1.0f, 1.0f);
+    light.intensity = 2.0f;
+    scene.lights.push_back(light);
+
+    light.name = "uLight2";
+    light.position = Vec3(1.0f, 2.0f, 0.0f);
+    light.color = Vec3(1.0f, 1.0f, 1.0f);
+    light.intensity = 0.5f;
+    scene.lights.push_back(light);
+
+    //--------------------- Spheres
+    Sphere sphere;
+    sphere.name = "uSphere1";
+    sphere.center = Vec3(0.0f, 0.0f, 0.0f);
+    sphere.radius = 0.3f;
+    sphere.mat = makeMaterial(0.0f, 0.0f, 0.0f, 0.9f, 1.5f, Vec3(0.0f, 0.0f, 0.0f), 2);
+    sphere.dynamic = false;
+    scene.spheres.push_back(sphere);
+
+    sphere.name = "uSphere2";
+    sphere.center = Vec3(0.6f, 0.0f, 0.0f);
+    sphere.radius = 0.2f;
+    sphere.mat = makeMaterial(0.1f, 0.8f, 0.2f, 0.9f, 1.5f, Vec3(0.35f, 0.3f, 0.2f), 1);
+    sphere.dynamic = true;
+    scene.spheres.push_back(sphere);
+
+    sphere.name = "uSphere3";
+    sphere.center = Vec3(0.0f, 0.61f, 0.0f);
+    sphere.radius = 0.3f;
+    sphere.mat = makeMaterial(0.0f, 0.0f, 0.9f, 0.9f, 1.5f, Vec3(0.0f, 0.0f, 0.0f), 1);
+    sphere.dynamic = false;
+    scene.spheres.push_back(sphere);
+
+    //--------------------- Planes
+    // The walls (uPlane1 to uPlane5) are disabled in basicFragSrc
+    /*
+    Plane wall;
+    wall.name = "uPlane1";
+    wall.point = Vec3(0.0f, 0.0f, -10.0f);
+    wall.normal = Vec3(0.0f, 0.0f, 1.0f);
+    wall.mat = makeMaterial(0.1f, 0.6f, 0.4f, 0.9f, 1.5f, Vec3(1.0f, 1.0f, 1.0f), 0);
+    wall.checkered = false;
+    scene.planes.push_back(wall);
+    */
+
+    // Plane6 bottom
+    Plane plane;
+    plane.name = "uPlane6";
+    plane.point = Vec3(0.0f, -3.0f, 0.0f);
+    plane.normal = Vec3(0.0f, 1.0f, 0.0f);
+    plane.mat = makeMaterial(0.1f, 0.6f, 0.4f, 0.9f, 1.5f, Vec3(1.0f, 1.0f, 1.0f), 1);
+    plane.checkered = true;
+    scene.planes.push_back(plane);
+
+    scene.particleRadius = 0.0f;
+    scene.particleMat = makeMaterial(0.0f, 0.0f, 0.0f, 0.0f, 1.0f, Vec3(0.0f), 0);
+    scene.accel = ACCEL_NONE;
+    scene.compact = false;
+    scene.particleOrigin = Vec3(0.0f);
+    scene.particleStep = Vec3(0.0f);
+
+    scene.samplesPerPixel = 1;
+    scene.sampler = SAMPLER_SOBOL;
+    scene.lensRadius = 0.0f;
+    scene.focusDistance = 2.0f;
+    scene.lightSampling = false;
+    scene.adaptiveThreshold = 0.0f;
+    scene.maxSamples = 64;
+
+    return scene;
+}
+
+// The default scene with a dense cloud of small diffuse spheres behind it
+inline Scene makeParticleScene(int numParticles, float radius, int accel)
+{
+    Scene scene = makeDefaultScene();
+    scene.particleRadius = radius;
+    scene.particleMat = makeMaterial(0.1f, 0.8f, 0.2f, 0.0f, 1.0f, Vec3(0.6f, 0.25f, 0.1f), 0);
+    scene.accel = accel;
+
+    // Fixed seed LCG so that every run and every backend sees the same cloud
+    uint32_t seed = 12345u;
+    Vec3 boxMin(-2.5f, -2.9f, -8.0f);
+    Vec3 boxMax(2.5f, 2.0f, -1.5f);
+    scene.particles.resize(numParticles);
+    for(int i = 0; i < numParticles; i++)
+    {
+        for(int j = 0; j < 3; j++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            float u = (seed >> 8) * (1.0f / 16777216.0f);
+            scene.particles[i][j] = boxMin[j] + u * (boxMax[j] - boxMin[j]);
+        }
+    }
+    return scene;
+}
+
+// Degrees uSphere2 orbits about the y axis per displayed frame
+static const float ORBIT_DEGREES_PER_FRAME = 3.0f;
+
+// Poses the spheres of a scene as built at the given frame of the animation the window
+// plays back. Frame 0 leaves them as they are, frame n has the dynamic ones, uSphere2,
+// turned n times.
+inline void animateSpheres(std::vector<Sphere>& spheres, int frame)
+{
+    for(size_t i = 0; i < spheres.size(); i++)
+    {
+        Sphere& s = spheres[i];
+        if(!s.dynamic)
+            continue;
+        double ang = (double)ORBIT_DEGREES_PER_FRAME * frame * 3.14159265358979323846 / 180.0;
+        float c = (float)cos(ang), sn = (float)sin(ang);
+        Vec3 p = s.center;
+        s.center = Vec3(c * p[0] + sn * p[2], p[1], -sn * p[0] + c * p[2]);
+    }
+}
+
+inline void animateScene(Scene& scene, int frame)
+{
+    animateSpheres(scene.spheres, frame);
+}
+
+inline void writeVec3(ByteWriter& w, const Vec3& v)
+{
+    for(int i = 0; i < 3; i++)
+        w.put(v[i]);
+}
+
+inline Vec3 readVec3(ByteReader& r)
+{
+    Vec3 v;
+    for(int i = 0; i < 3; i++)
+        v[i] = r.get<float>();
+    return v;
+}
+
+inline void writeMaterial(ByteWriter& w, const Material& mat)
+{
+    w.put(mat.ka);
+    w.put(mat.kd);
+    w.put(mat.ks);
+    w.put(mat.kt);
+    w.put(mat.ior);
+    writeVec3(w, mat.color);
+    w.put((int32_t)mat.matType);
+}
+
+inline Material readMaterial(ByteReader& r)
+{
+    Material mat;
+    mat.ka = r.get<float>();
+    mat.kd = r.get<float>();
+    mat.ks = r.get<float>();
+    mat.kt = r.get<float>();
+    mat.ior = r.get<float>();
+    mat.color = readVec3(r);
+    mat.matType = r.get<int32_t>();
+    return mat;
+}
+
+inline void writeScene(ByteWriter& w, const Scene& scene)
+{
+    w.put((int32_t)scene.maxBounce);
+    w.put(scene.throughputCutoff);
+    w.put((int32_t)scene.rouletteDepth);
+
+    w.put((uint32_t)scene.lights.size());
+    for(size_t i = 0; i < scene.lights.size(); i++)
+    {
+        const Light& l = scene.lights[i];
+        w.putString(l.name);
+        writeVec3(w, l.position);
+        writeVec3(w, l.color);
+        w.put(l.intensity);
+    }
+
+    w.put((uint32_t)scene.spheres.size());
+    for(size_t i = 0; i < scene.spheres.size(); i++)
+    {
+        const Sphere& s = scene.spheres[i];
+        w.putString(s.name);
+        writeVec3(w, s.center);
+        w.put(s.radius);
+        writeMaterial(w, s.mat);
+        w.put((uint8_t)s.dynamic);
+    }
+
+    w.put((uint32_t)scene.planes.size());
+    for(size_t i = 0; i < scene.planes.size(); i++)
+    {
+        const Plane& p = scene.planes[i];
+        w.putString(p.name);
+        writeVec3(w, p.point);
+        writeVec3(w, p.normal);
+        writeMaterial(w, p.mat);
+        w.put((uint8_t)p.checkered);
+    }
+
+    w.put((uint32_t)scene.particles.size());
+    if(!scene.particles.empty())
+        w.write(&scene.particles[0], scene.particles.size() * sizeof(Vec3));
+    w.put(scene.particleRadius);
+    writeMaterial(w, scene.particleMat);
+    w.put((int32_t)scene.accel);
+    w.put((uint8_t)scene.compact);
+    writeVec3(w, scene.particleOrigin);
+    writeVec3(w, scene.particleStep);
+
+    w.put((int32_t)scene.samplesPerPixel);
+    w.put((int32_t)scene.sampler);
+    w.put(scene.lensRadius);
+    w.put(scene.focusDistance);
+    w.put((uint8_t)scene.lightSampling);
+    w.put(scene.adaptiveThreshold);
+    w.put((int32_t)scene.maxSamples);
+}
+
+// Returns false if the data is truncated
+inline bool readScene(ByteReader& r, Scene& scene)
+{
+    scene = Scene();
+    scene.maxBounce = r.get<int32_t>();
+    scene.throughputCutoff = r.get<float>();
+    scene.rouletteDepth = r.get<int32_t>();
+
+    uint32_t count = r.get<uint32_t>();
+    for(uint32_t i = 0; i < count && r.ok; i++)
+    {
+        Light l;
+        l.name = internString(r.getString());
+        l.position = readVec3(r);
+        l.color = readVec3(r);
+        l.intensity = r.get<float>();
+        scene.lights.push_back(l);
+    }
+
+    count = r.get<uint32_t>();
+    for(uint32_t i = 0; i < count && r.ok; i++)
+    {
+        Sphere s;
+        s.name = internString(r.getString());
+        s.center = readVec3(r);
+        s.radius = r.get<float>();
+        s.mat = readMaterial(r);
+        s.dynamic = r.get<uint8_t>() != 0;
+        scene.spheres.push_back(s);
+    }
+
+    count = r.get<uint32_t>();
+    for(uint32_t i = 0; i < count && r.ok; i++)
+    {
+        Plane p;
+        p.name = internString(r.getString());
+        p.point = readVec3(r);
+        p.normal = readVec3(r);
+        p.mat = readMaterial(r);
+        p.checkered = r.get<uint8_t>() != 0;
+        scene.planes.push_back(p);
+    }
+
+    count = r.get<uint32_t>();
+    if(r.ok && (size_t)(r.end - r.p) >= count * sizeof(Vec3))
+    {
+        scene.particles.resize(count);
+        if(count > 0)
+            r.read(&scene.particles[0], count * sizeof(Vec3));
+    }else
+        r.ok = false;
+    scene.particleRadius = r.get<float>();
+    scene.particleMat = readMaterial(r);
+    scene.accel = r.get<int32_t>();
+    scene.compact = r.get<uint8_t>() != 0;
+    scene.particleOrigin = readVec3(r);
+    scene.particleStep = readVec3(r);
+
+    scene.samplesPerPixel = r.get<int32_t>();
+    scene.sampler = r.get<int32_t>();
+    scene.lensRadius = r.get<float>();
+    scene.focusDistance = r.get<float>();
+    scene.lightSampling = r.get<uint8_t>() != 0;
+    scene.adaptiveThreshold = r.get<float>();
+    scene.maxSamples = r.get<int32_t>();
+    return r.ok;
+}
+
+#endif
@@ -0,0 +1,331 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "alloc.h"
+
+// Work stealing tile scheduler for the CPU renders. The tiles of a frame are put in Morton
+// order, so that tiles next to each other, which see the same objects and grid cells, run
+// close together in time. Every worker starts on its own contiguous run of that order and
+// takes tiles off the front of it. A worker that runs dry steals the back half of another
+// worker's run, so a few expensive tiles, like those behind a glass sphere, no longer hold
+// up the whole frame the way they did with a fixed split of the rows.
+
+static const int CPU_TILE_SIZE = 16;
+
+// Pixels [x0, x1) x [y0, y1)
+struct ImageTile
+{
+    int x0, y0;
+    int x1, y1;
+};
+
+// Counters of the jobs run through a TilePool
+struct ScheduleStats
+{
+    long long tiles;
+    long long steals;            // Successful steals, each takes half of a run
+    long long failedSteals;      // Victims found empty
+    double busyMs;               // Time in tiles, summed over the workers
+    double idleMs;               // Time the workers spent stealing or waiting for the last tile
+
+    ScheduleStats() : tiles(0), steals(0), failedSteals(0), busyMs(0), idleMs(0) {}
+
+    void add(const ScheduleStats& other)
+    {
+        tiles += other.tiles;
+        steals += other.steals;
+        failedSteals += other.failedSteals;
+        busyMs += other.busyMs;
+        idleMs += other.idleMs;
+    }
+};
+
+// Spreads the low 16 bits of x to the even bits
+inline uint32_t spreadBits(uint32_t x)
+{
+    x &= 0xffffu;
+    x = (x | (x << 8)) & 0x00ff00ffu;
+    x = (x | (x << 4)) & 0x0f0f0f0fu;
+    x = (x | (x << 2)) & 0x33333333u;
+    x = (x | (x << 1)) & 0x55555555u;
+    return x;
+}
+
+// Interleaves the bits of x and y, both below 2^16
+inline uint32_t mortonCode(uint32_t x, uint32_t y)
+{
+    return spreadBits(x) | spreadBits(y) << 1;
+}
+
+inline bool mortonLess(const ImageTile& a, const ImageTile& b)
+{
+    return mortonCode(a.x0, a.y0) < mortonCode(b.x0, b.y0);
+}
+
+// The tileSize x tileSize tiles of the width x height rect at (x0, y0) in Morton order.
+// Reuses the vector, so a steady tile count does not allocate.
+inline void mortonTiles(int x0, int y0, int width, int height, int tileSize, std::vector<ImageTile>& tiles)
+{
+    tiles.clear();
+    for(int y = 0; y < height; y += tileSize)
+    {
+        for(int x = 0; x < width; x += tileSize)
+        {
+            ImageTile tile;
+            tile.x0 = x;
+            tile.y0 = y;
+            tile.x1 = std::min(x + tileSize, width);
+            tile.y1 = std::min(y + tileSize, height);
+            tiles.push_back(tile);
+        }
+    }
+    std::sort(tiles.begin(), tiles.end(), mortonLess);
+    for(size_t i = 0; i < tiles.size(); i++)
+    {
+        tiles[i].x0 += x0;
+        tiles[i].x1 += x0;
+        tiles[i].y0 += y0;
+        tiles[i].y1 += y0;
+    }
+}
+
+// Tile indices [begin, end) left to a worker, begin in the low and end in the high 32
+// bits so that the owner and the thieves can claim tiles with a single compare and swap.
+// Padded to a cache line of its own.
+struct WorkerRun
+{
+    std::atomic<uint64_t> range;
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+
+    WorkerRun() : range(0) {}
+};
+
+inline uint64_t packRun(uint32_t begin, uint32_t end)
+{
+    return (uint64_t)end << 32 | begin;
+}
+
+typedef void (*TileJob)(void *context, const ImageTile& tile);
+
+// Worker threads kept across frames. runTiles hands them a job and waits until it is done.
+struct TilePool
+{
+    int numThreads;
+    int firstCore;                       // Worker i runs on core firstCore + i, -1 to leave them unpinned
+    std::vector<std::thread> threads;
+    std::vector<WorkerRun> runs;
+    std::vector<ScheduleStats> workerStats;
+    std::vector<ImageTile> tiles;        // Of the current job, in Morton order
+
+    std::mutex mutex;
+    std::condition_variable startJob;
+    std::condition_variable jobDone;
+    int generation;                      // Bumped by every job
+    int working;                         // Workers still on the current job
+    bool quit;
+    TileJob job;
+    void *context;
+    std::atomic<long long> allocations;  // Heap allocations made by the jobs, over the pool's lifetime
+
+    TilePool(int numThreads, int firstCore = -1);
+    ~TilePool();
+};
+
+inline bool popTile(WorkerRun& run, uint32_t& tile)
+{
+    uint64_t r = run.range.load();
+    for(;;)
+    {
+        uint32_t begin = (uint32_t)r;
+        uint32_t end = (uint32_t)(r >> 32);
+        if(begin >= end)
+            return false;
+        if(run.range.compare_exchange_weak(r, packRun(begin + 1, end)))
+        {
+            tile = begin;
+            return true;
+        }
+    }
+}
+
+// Takes the back half of the first non empty run after worker w's, keeps its first tile
+// and makes the rest worker w's run. Nothing else writes an empty run, so the plain store
+// can't lose tiles.
+inline bool stealTiles(TilePool& pool, int w, uint32_t& tile, ScheduleStats& stats)
+{
+    for(int i = 1; i < pool.numThreads; i++)
+    {
+        WorkerRun& victim = pool.runs[(w + i) % pool.numThreads];
+        uint64_t r = victim.range.load();
+        for(;;)
+        {
+            uint32_t begin = (uint32_t)r;
+            uint32_t end = (uint32_t)(r >> 32);
+            if(begin >= end)
+            {
+                stats.failedSteals++;
+                break;
+            }
+            uint32_t mid = begin + (end - begin) / 2;
+            if(victim.range.compare_exchange_weak(r, packRun(begin, mid)))
+            {
+                pool.runs[w].range.store(packRun(mid + 1, end));
+                stats.steals++;
+                tile = mid;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+inline void pinToCore(std::thread& thread, int core)
+{
+#ifdef __linux__
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % cores, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+    (void)thread;
+    (void)core;
+#endif
+}
+
+inline void tileWorker(TilePool *pool, int w)
+{
+    typedef std::chrono::steady_clock Clock;
+    int generation = 0;
+    for(;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            while(!pool->quit && pool->generation == generation)
+                pool->startJob.wait(lock);
+            if(pool->quit)
+                return;
+            generation = pool->generation;
+        }
+
+        ScheduleStats stats;
+        uint32_t tile;
+        long long allocations = threadAllocCounters().allocations;
+        while(popTile(pool->runs[w], tile) || stealTiles(*pool, w, tile, stats))
+        {
+            Clock::time_point start = Clock::now();
+            pool->job(pool->context, pool->tiles[tile]);
+            stats.busyMs += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            stats.tiles++;
+        }
+        pool->workerStats[w] = stats;
+        pool->allocations += threadAllocCounters().allocations - allocations;
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if(--pool->working == 0)
+            pool->jobDone.notify_one();
+    }
+}
+
+inline TilePool::TilePool(int numThreads, int firstCore)
+    : numThreads(std::max(1, numThreads)), firstCore(firstCore), runs(this->numThreads),
+      workerStats(this->numThreads), generation(0), working(0), quit(false), job(NULL), context(NULL),
+      allocations(0)
+{
+    for(int w = 0; w < this->numThreads; w++)
+    {
+        threads.push_back(std::thread(tileWorker, this, w));
+        if(firstCore >= 0)
+            pinToCore(threads.back(), firstCore + w);
+    }
+}
+
+inline TilePool::~TilePool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    startJob.notify_all();
+    for(size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+}
+
+template<class F>
+inline void callTileJob(void *context, const ImageTile& tile)
+{
+    (*(F *)context)(tile);
+}
+
+// Calls fn(tile) for every tile of the width x height rect at (x0, y0) on the workers of
+// the pool, and adds the scheduling counters to stats. fn runs concurrently with itself.
+template<class F>
+inline void runTiles(TilePool& pool, int x0, int y0, int width, int height, int tileSize, F& fn,
+                     ScheduleStats *stats = NULL)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    mortonTiles(x0, y0, width, height, tileSize, pool.tiles);
+    uint32_t numTiles = (uint32_t)pool.tiles.size();
+    for(int w = 0; w < pool.numThreads; w++)
+        pool.runs[w].range.store(packRun((uint32_t)(numTiles * (uint64_t)w / pool.numThreads),
+                                         (uint32_t)(numTiles * (uint64_t)(w + 1) / pool.numThreads)));
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.job = callTileJob<F>;
+    pool.context = &fn;
+    pool.working = pool.numThreads;
+    pool.generation++;
+    pool.startJob.notify_all();
+    while(pool.working > 0)
+        pool.jobDone.wait(lock);
+
+    if(stats)
+    {
+        double wallMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        ScheduleStats total;
+        for(int w = 0; w < pool.numThreads; w++)
+            total.add(pool.workerStats[w]);
+        total.idleMs = std::max(0.0, wallMs * pool.numThreads - total.busyMs);
+        stats->add(total);
+    }
+}
+
+// Calls fn(begin, end) for each of numBands even bands of [0, count) on the workers of
+// the pool, for work that splits by rows or elements rather than by tiles. The bands
+// depend on numBands only, not on the size of the pool.
+template<class F>
+inline void runBands(TilePool& pool, int count, int numBands, F& fn)
+{
+    numBands = std::max(1, std::min(numBands, count));
+    auto band = [&](const ImageTile& tile)
+    {
+        for(int b = tile.y0; b < tile.y1; b++)
+            fn((int)((long long)count * b / numBands), (int)((long long)count * (b + 1) / numBands));
+    };
+    runTiles(pool, 0, 0, 1, numBands, 1, band);
+}
+
+// pool, or numThreads workers in local for the length of one call
+inline TilePool& poolOrLocal(TilePool *pool, int numThreads, std::unique_ptr<TilePool>& local)
+{
+    if(pool)
+        return *pool;
+    local.reset(new TilePool(numThreads));
+    return *local;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <set>
+#include <string>
+#include <vector>
+
+// Flat binary encoding in native byte order. Used to ship scenes to worker processes
+// on the same machine, so there is no versioning or endianness handling.
+struct ByteWriter
+{
+    std::vector<char> data;
+
+    void write(const void *src, size_t size)
+    {
+        const char *p = (const char *)src;
+        data.insert(data.end(), p, p + size);
+    }
+
+    template<typename T>
+    void put(const T& value)
+    {
+        write(&value, sizeof(T));
+    }
+
+    void putString(const char *s)
+    {
+        uint32_t length = s ? (uint32_t)strlen(s) : 0;
+        put(length);
+        write(s, length);
+    }
+};
+
+struct ByteReader
+{
+    const char *p;
+    const char *end;
+    bool ok;                 // Turns false, and stays false, once a read runs past the end
+
+    ByteReader(const void *data, size_t size) : p((const char *)data), end((const char *)data + size), ok(true) {}
+
+    void read(void *dst, size_t size)
+    {
+        if(!ok || (size_t)(end - p) < size)
+        {
+            ok = false;
+            memset(dst, 0, size);
+            return;
+        }
+        memcpy(dst, p, size);
+        p += size;
+    }
+
+    template<typename T>
+    T get()
+    {
+        T value;
+        read(&value, sizeof(T));
+        return value;
+    }
+
+    std::string getString()
+    {
+        uint32_t length = get<uint32_t>();
+        if(!ok || (size_t)(end - p) < length)
+        {
+            ok = false;
+            return std::string();
+        }
+        std::string s(p, length);
+        p += length;
+        return s;
+    }
+};
+
+// Returns a pointer to a copy of s that lives as long as the program,
+// for the const char * names of scene objects that were read back
+inline const char *internString(const std::string& s)
+{
+    static std::set<std::string> strings;
+    return strings.insert(s).first->c_str();
+}
+
+#endif
@@ -1,4 +1,7 @@
+#include <string>
+
 #define GLSL(src) "#version 150 core\n" #src
+#define GLSL_SOURCE(src) #src        // Without a version, for source shared between shaders
 
 const char* basicVertSrc = GLSL(
     in vec2 aPosition;
@@ -9,8 +12,10 @@ const char* basicVertSrc = GLSL(
     }
 );
 
-const char* basicFragSrc = GLSL(
-    out vec4 outColor;
+// The ray tracer of basicFragSrc and traceCompSrc. The shader around it declares the
+// out* variables, sets pixelCoord and calls tracePixel.
+const char* tracerSrc = GLSL_SOURCE(
+    vec2 pixelCoord;             // Window coordinates of the pixel center, gl_FragCoord.xy in a fragment shader
 
     float PI = 3.14159265359;
     float MAX_DEPTH = 100000;
@@ -18,6 +23,82 @@ const char* basicFragSrc = GLSL(
     vec3 BACKGROUND_COLOR = vec3(0.1, 0.1, 0.2);
 
     uniform int MAX_BOUNCE;
+    uniform float THROUGHPUT_CUTOFF;   // Secondary rays weighted below this are culled
+    uniform int ROULETTE_DEPTH;        // First bounce whose rays may be killed by Russian roulette, -1 disables it
+
+    // Ray tree counts for outStats. traced, culled and killed hold one byte per bounce,
+    // with bounces past the 4th counted in the last byte.
+    uint statsTraced = 0u;
+    uint statsCulled = 0u;
+    uint statsKilled = 0u;
+    int statsPeakStack = 0;
+    int statsOverflow = 0;
+    int rayCount = 0;
+
+    // Work counters for outCost
+    int costTests = 0;
+    int costShadowRays = 0;
+    int costBounces = 0;
+    int costNodes = 0;
+
+    uniform int uHeatmap;              // CostMetric shown in false color instead of the image, -1 for none
+    uniform float uHeatmapScale;       // Count at the top of the color ramp
+
+    uniform bool uHybrid;              // Take the primary hits from uPrimaryHits instead of tracing them
+    uniform sampler2D uPrimaryHits;    // Written by rasterFragSrc
+
+    // Per screen tile object lists for primary rays, see ScreenTiles in tracer.h
+    uniform bool uTileLists;
+    uniform int uTileSize;
+    uniform int uTilesX;
+    uniform isamplerBuffer uTileStart;       // tilesX * tilesY + 1 offsets into uTilePrims
+    uniform isamplerBuffer uTilePrims;       // Primitive IDs of the spheres and particles
+
+    // Bounce light at 1 / uBounceFactor of the resolution, see BounceBuffer in tracer.h
+    uniform int uBouncePass;           // 0 = trace every bounce, 1 = low resolution pass, 2 = upsample the low resolution light
+    uniform int uBounceFactor;
+    uniform int uBounceMaterials;      // Bit 1 << matType for each type traced at low resolution
+    uniform sampler2D uBounceLight;    // rgb = bounce light, a = matType of the primary hit, -1 where not traced
+    uniform sampler2D uBounceGeometry; // xyz = normal, w = distance of the primary hit
+    const float BOUNCE_SIGMA_NORMAL = 0.3;
+    const float BOUNCE_SIGMA_DEPTH = 0.05;
+    const float BOUNCE_MIN_WEIGHT = 1e-4;
+
+    // Sampling, see sampler.h
+    uniform int uSamples;              // Samples per pixel in this draw
+    uniform int uSampleOffset;         // Index of the first one, past the samples already accumulated
+    uniform bool uJitter;              // Spread the samples over the pixel instead of tracing its center
+    uniform int uSampler;              // SamplerType
+    uniform float uLensRadius;         // 0 for a pinhole camera
+    uniform float uFocusDistance;
+    uniform bool uLightSampling;       // Shade primary hits with one light picked by intensity
+    uniform sampler2D uBlueNoise;      // BLUE_NOISE_SIZE^2 dither array
+    const int SAMPLE_PIXEL = 0;
+    const int SAMPLE_LENS = 1;
+    const int SAMPLE_LIGHT = 2;
+
+    // Adaptive progressive sampling, tracePixel in tracer.h. Every frame a pixel whose error
+    // is still above uAdaptiveThreshold takes uSamples more samples on top of uAccumColor
+    // and uAccumMoments, the outAccum and outMoments of the frame before.
+    uniform bool uAdaptive;
+    uniform float uAdaptiveThreshold;
+    uniform int uMaxSamples;
+    uniform sampler2D uAccumColor;
+    uniform sampler2D uAccumMoments;
+    const int ADAPTIVE_MIN_SAMPLES = 8;
+    const float ADAPTIVE_LUMINANCE_FLOOR = 0.1;
+
+    // Temporal reuse, temporal.h. With uTemporal set every ray of the pixel is tested into
+    // motionMask against uMotionSpheres, the MotionBounds of frame uFrame: xyz = center,
+    // w = grown radius, TEMPORAL_LOOKAHEAD + 1 frame offsets per moving sphere.
+    uniform bool uTemporal;
+    uniform int uFrame;
+    uniform samplerBuffer uMotionSpheres;
+    uniform int uMotionCount;
+    uniform vec4 uMotionBound;         // Sphere around all of them
+    const int TEMPORAL_LOOKAHEAD = 31;
+    const float TEMPORAL_ROUNDING = 2e-3;
+    uint motionMask;
 
     struct ray{
         vec3 origin;
@@ -42,10 +123,17 @@ const char* basicFragSrc = GLSL(
         float ior;               // Index of refraction
     };
 
+    // Materials indexed by primitive ID, the table of buildMaterialTable in scene.h.
+    // One entry per plane and sphere uniform below, then the particle material.
+    const int MAX_MATERIALS = 10;
+    uniform material uMaterials[MAX_MATERIALS];
+    uniform bool uCompact;                 // Materials in uMaterialCodes and 16 bit particle centers, see compact.h
+    uniform uvec3 uMaterialCodes[MAX_MATERIALS];
+
     struct plane{
         vec3 point;              // A point that's on the plane
         vec3 normal;             // A unit vector that's perpendicular to the plane
-        material mat;
+        int prim;                // Primitive ID
         bool checkered;          // Flag for checker pattern
     };
     uniform plane uPlane1;
@@ -58,54 +146,70 @@ const char* basicFragSrc = GLSL(
     struct sphere{
         float radius;
         vec3 center;
-        material mat;
+        int prim;
     };
     uniform sphere uSphere1;
     uniform sphere uSphere2;
     uniform sphere uSphere3;
 
-    // Struct for ray-object intersection
+    // Particle layer: equal-radius spheres that share one material
+    struct grid{
+        vec3 bmin;               // Lower corner of the grid
+        vec3 cellSize;
+        ivec3 res;               // Number of cells along each axis
+    };
+    struct particleLayer{
+        int count;
+        float radius;
+        int firstPrim;           // Primitive ID of particle 0, the others follow
+        vec3 origin;             // Frame of the 16 bit centers of compact scenes
+        vec3 step;
+    };
+    uniform particleLayer uParticles;
+    uniform int uAccel;                    // 0 = test every particle, 1 = uniform grid
+    uniform grid uGrid;
+    uniform samplerBuffer uParticleCenters;
+    uniform isamplerBuffer uGridCells;     // numCells + 1 offsets into uGridIndices
+    uniform isamplerBuffer uGridIndices;   // Particle indices sorted by cell
+
+    // Closest hit of a ray. The normal and material are looked up by surfaceAt once
+    // the hit gets shaded. uv holds the world x and z of plane hits for the checker pattern.
+    struct hit{
+        float t;
+        int prim;
+        vec2 uv;
+    };
+
+    // A hit expanded for shading
     struct shadeRec{
         vec3 normal;                
         float t;
         material mat;
     };
 
-    shadeRec planeIntersect(plane p, ray r)
+    hit planeIntersect(plane p, ray r)
     {
-        shadeRec ret;
+        costTests++;
+        hit ret;
         float t = dot(p.point - r.origin, p.normal) / dot(r.direction, p.normal);
         if(t > MIN_T)
         {
+            vec3 hitPoint = r.origin + r.direction * t;
             ret.t = t;
-            ret.normal = p.normal;
-            ret.mat = p.mat;
-            if(p.checkered)
-            {
-                vec3 hitPoint = r.origin + r.direction * t;
-
-                int x = int(floor(hitPoint.x/2));
-                int z = int(floor(hitPoint.z/2));
-                
-                if(x % 2 == 0)
-                {
-                    if(z % 2 == 0)
-                        ret.mat.color = vec3(0, 0, 0);
-                }else
-                {
-                    if(z % 2 == 1)
-                        ret.mat.color = vec3(0, 0, 0);
-                }
-            }
+            ret.prim = p.prim;
+            ret.uv = hitPoint.xz;
         }else
             ret.t = MAX_DEPTH;
 
         return ret;
     }
     
-    shadeRec sphereIntersect(sphere s, ray r)
+    hit sphereIntersect(sphere s, ray r)
     {        
-        shadeRec ret;
+        costTests++;
+        hit ret;
+        ret.prim = s.prim;
+        ret.uv = vec2(0, 0);
 
         float t;
         vec3 tmp = r.origin - s.center;
@@ -127,8 +231,6 @@ const char* basicFragSrc = GLSL(
             if(t > MIN_T)
             {
                 ret.t = t;
-                ret.normal = normalize(tmp + t * r.direction);
-                ret.mat = s.mat;
                 return ret;
             }
 
@@ -136,10 +238,7 @@ const char* basicFragSrc = GLSL(
 
             if(t > MIN_T)
             {            
-             
                 ret.t = t;
-                ret.normal = normalize(tmp + t * r.direction);
-                ret.mat = s.mat;
                 return ret;
             }
 
@@ -149,104 +248,261 @@ const char* basicFragSrc = GLSL(
     }
 
 
-    shadeRec intersectTest(ray r)
+    // Center of particle i, decoded from unorm16 in compact scenes
+    vec3 particleCenter(int i)
+    {
+        vec3 c = texelFetch(uParticleCenters, i).xyz;
+        return uCompact ? uParticles.origin + uParticles.step * round(c * 65535.0) : c;
+    }
+
+    hit particleIntersect(int i, ray r)
+    {
+        sphere s;
+        s.center = particleCenter(i);
+        s.radius = uParticles.radius;
+        s.prim = uParticles.firstPrim + i;
+        return sphereIntersect(s, r);
+    }
+
+    // Walks the cells pierced by the ray with 3D-DDA and returns the closest particle hit
+    // before tMax. With anyHit set it stops at the first hit, for shadow rays.
+    hit gridIntersect(ray r, float tMax, bool anyHit)
+    {
+        hit ret;
+        ret.t = MAX_DEPTH;
+
+        vec3 d = r.direction;
+        d = vec3(abs(d.x) > 1e-12 ? d.x : 1e-12, abs(d.y) > 1e-12 ? d.y : 1e-12, abs(d.z) > 1e-12 ? d.z : 1e-12);
+        vec3 invDir = 1.0 / d;
+        vec3 bmax = uGrid.bmin + uGrid.cellSize * vec3(uGrid.res);
+        vec3 t0 = (uGrid.bmin - r.origin) * invDir;
+        vec3 t1 = (bmax - r.origin) * invDir;
+        vec3 tNear = min(t0, t1);
+        vec3 tFar = max(t0, t1);
+        float tEnter = max(max(tNear.x, tNear.y), max(tNear.z, MIN_T));
+        float tExit = min(min(tFar.x, tFar.y), min(tFar.z, tMax));
+        if(tEnter > tExit)
+            return ret;
+
+        vec3 p = r.origin + r.direction * tEnter;
+        ivec3 cell = clamp(ivec3(floor((p - uGrid.bmin) / uGrid.cellSize)), ivec3(0), uGrid.res - 1);
+        ivec3 stepDir = ivec3(sign(d));
+        vec3 tDelta = abs(uGrid.cellSize * invDir);
+        vec3 tNext = (uGrid.bmin + (vec3(cell) + step(0.0, d)) * uGrid.cellSize - r.origin) * invDir;
+
+        int maxSteps = uGrid.res.x + uGrid.res.y + uGrid.res.z;
+        for(int n = 0; n < maxSteps; n++)
+        {
+            int c = cell.x + uGrid.res.x * (cell.y + uGrid.res.y * cell.z);
+            costNodes++;
+            int last = texelFetch(uGridCells, c + 1).r;
+            for(int k = texelFetch(uGridCells, c).r; k < last; k++)
+            {
+                hit tmp = particleIntersect(texelFetch(uGridIndices, k).r, r);
+                if(tmp.t < ret.t && tmp.t < tMax)
+                {
+                    ret = tmp;
+                    if(anyHit)
+                        return ret;
+                }
+            }
+
+            // A hit inside the current cell can't be beaten by any later cell
+            float cellExit = min(tNext.x, min(tNext.y, tNext.z));
+            if(ret.t <= cellExit || cellExit > tExit)
+                return ret;
+
+            if(tNext.x <= tNext.y && tNext.x <= tNext.z)
+            {
+                cell.x += stepDir.x;
+                tNext.x += tDelta.x;
+            }else if(tNext.y <= tNext.z)
+            {
+                cell.y += stepDir.y;
+                tNext.y += tDelta.y;
+            }else
+            {
+                cell.z += stepDir.z;
+                tNext.z += tDelta.z;
+            }
+            if(any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, uGrid.res)))
+                return ret;
+        }
+        return ret;
+    }
+
+    // Closest particle hit before tMax
+    hit particlesIntersect(ray r, float tMax, bool anyHit)
+    {
+        if(uAccel == 1)
+            return gridIntersect(r, tMax, anyHit);
+
+        hit ret;
+        ret.t = MAX_DEPTH;
+        for(int i = 0; i < uParticles.count; i++)
+        {
+            hit tmp = particleIntersect(i, r);
+            if(tmp.t < ret.t && tmp.t < tMax)
+            {
+                ret = tmp;
+                if(anyHit)
+                    return ret;
+            }
+        }
+        return ret;
+    }
+
+    hit intersectTest(ray r)
     {
-        shadeRec ret;
+        hit ret;
         ret.t = MAX_DEPTH;
-        ret.normal = vec3(0, 0, 0);
-        ret.mat.kd = 0;
-        ret.mat.ka = 0;
-        ret.mat.ks = 0;
-        ret.mat.color = BACKGROUND_COLOR;
+        ret.prim = -1;
+        ret.uv = vec2(0, 0);
         
-        shadeRec tmp;
+        hit tmp;
         /*
         // front plane
         tmp = planeIntersect(uPlane1, r);
         if(tmp.t < ret.t)
         {
-            ret.t = tmp.t;
-            ret.normal = tmp.normal;
-            ret.mat = tmp.mat;
+            ret = tmp;
         }
         // left plane
         tmp = planeIntersect(uPlane2, r);
         if(tmp.t < ret.t)
         {
-            ret.t = tmp.t;
-            ret.normal = tmp.normal;
-            ret.mat = tmp.mat;
+            ret = tmp;
         }
         // right plane
         tmp = planeIntersect(uPlane3, r);
         if(tmp.t < ret.t)
         {
-            ret.t = tmp.t;
-            ret.normal = tmp.normal;
-            ret.mat = tmp.mat;
+            ret = tmp;
         }
         // back plane
         tmp = planeIntersect(uPlane4, r);
         if(tmp.t < ret.t)
         {
-            ret.t = tmp.t;
-            ret.normal = tmp.normal;
-            ret.mat = tmp.mat;
+            ret = tmp;
         }
         // top plane
         tmp = planeIntersect(uPlane5, r);
         if(tmp.t < ret.t)
         {
-            ret.t = tmp.t;
-            ret.normal = tmp.normal;
-            ret.mat = tmp.mat;
+            ret = tmp;
         }
         */
         // bottom plane
         tmp = planeIntersect(uPlane6, r);
         if(tmp.t < ret.t)
         {
-            ret.t = tmp.t;
-            ret.normal = tmp.normal;
-            ret.mat = tmp.mat;
-            //ret.mat.color = vec3(1, 1, 1);
+            ret = tmp;
         }        
 
         // Sphere1
         tmp = sphereIntersect(uSphere1, r);
         if(tmp.t < ret.t)
         {
-            ret.t = tmp.t;
-            ret.normal = tmp.normal;
-            ret.mat = tmp.mat;
+            ret = tmp;
         }
         
         // Sphere2
         tmp = sphereIntersect(uSphere2, r);
         if(tmp.t < ret.t)
         {
-            ret.t = tmp.t;
-            ret.normal = tmp.normal;
-            ret.mat = tmp.mat;
+            ret = tmp;
         }
 
         // Sphere3
         tmp = sphereIntersect(uSphere3, r);
         if(tmp.t < ret.t)
         {
-            ret.t = tmp.t;
-            ret.normal = tmp.normal;
-            ret.mat = tmp.mat;
+            ret = tmp;
+        }
+
+        // Particles
+        if(uParticles.count > 0)
+        {
+            tmp = particlesIntersect(r, ret.t, false);
+            if(tmp.t < ret.t)
+            {
+                ret = tmp;
+            }
         }
 
         return ret;
     }
 
+    // The sphere uniform with the given primitive ID
+    sphere sceneSphere(int prim)
+    {
+        if(prim == uSphere1.prim)
+            return uSphere1;
+        if(prim == uSphere2.prim)
+            return uSphere2;
+        return uSphere3;
+    }
+
+    // Closest hit of this pixel's primary ray. Only the planes and the objects listed for
+    // the pixel's screen tile are tested, secondary rays use intersectTest.
+    hit tileIntersect(ray r)
+    {
+        hit ret;
+        ret.t = MAX_DEPTH;
+        ret.prim = -1;
+        ret.uv = vec2(0, 0);
+
+        hit tmp = planeIntersect(uPlane6, r);
+        if(tmp.t < ret.t)
+            ret = tmp;
+
+        ivec2 tile = ivec2(pixelCoord) / uTileSize;
+        int t = tile.x + uTilesX * tile.y;
+        int last = texelFetch(uTileStart, t + 1).r;
+        for(int k = texelFetch(uTileStart, t).r; k < last; k++)
+        {
+            int prim = texelFetch(uTilePrims, k).r;
+            if(prim >= uParticles.firstPrim)
+                tmp = particleIntersect(prim - uParticles.firstPrim, r);
+            else
+                tmp = sphereIntersect(sceneSphere(prim), r);
+            if(tmp.t < ret.t)
+                ret = tmp;
+        }
+        return ret;
+    }
+
+    // Whether the part of r up to tMax comes within s.w of s.xyz, segmentNearSphere in
+    // temporal.h
+    bool segmentNearSphere(vec4 s, ray r, float tMax)
+    {
+        vec3 oc = s.xyz - r.origin;
+        float t = max(0.0, min(dot(oc, r.direction) / dot(r.direction, r.direction), tMax));
+        float reach = s.w + TEMPORAL_ROUNDING * (length(oc) + s.w);
+        vec3 d = oc - r.direction * t;
+        return dot(d, d) <= reach * reach;
+    }
+
+    // Adds the frame offsets at which a moving sphere comes near r to motionMask
+    void testMotion(ray r, float tMax)
+    {
+        if(!uTemporal || uMotionCount == 0 || !segmentNearSphere(uMotionBound, r, tMax))
+            return;
+        for(int i = 0; i < uMotionCount; i++)
+        {
+            uint bit = 1u << uint(i % (TEMPORAL_LOOKAHEAD + 1));
+            if((motionMask & bit) == 0u && segmentNearSphere(texelFetch(uMotionSpheres, i), r, tMax))
+                motionMask |= bit;
+        }
+    }
+
     bool shadowIntersectTest(ray r, vec3 lightPos)
     {
         float t_max = dot((lightPos - r.origin), r.direction);
+        costShadowRays++;
+        testMotion(r, t_max);
 
-        shadeRec tmp;
+        hit tmp;
         /*
         // front plane
         tmp = planeIntersect(uPlane1, r);
@@ -295,38 +551,115 @@ const char* basicFragSrc = GLSL(
         if(tmp.t < t_max)
             return true;        
 
+        // Particles
+        if(uParticles.count > 0)
+        {
+            tmp = particlesIntersect(r, t_max, true);
+            if(tmp.t < t_max)
+                return true;
+        }
+
         return false;        
     }
 
-    // Calculates the direct illumination component of a ray-object intersection
-    vec3 directIllum(shadeRec sr, ray r)
+    float unpackUnorm8(uint v)
     {
-        vec3 L = sr.mat.ka * sr.mat.color;
+        return float(v & 0xffu) * (1.0 / 255.0);
+    }
 
-        ray shadowRay;
-        vec3 reflectDir;
-        vec3 diffContrib;
-        vec3 specContrib;
-        shadowRay.origin = sr.t * r.direction + r.origin;
-        vec3 lightDir = normalize(uLight1.position - shadowRay.origin);
-        shadowRay.direction = lightDir;
-        diffContrib = sr.mat.kd * sr.mat.color / PI;
-        
-        if(!shadowIntersectTest(shadowRay, uLight1.position))
+    float unpackHalf(uint h)
+    {
+        float m = float(h & 0x3ffu);
+        int e = int(h >> 10 & 0x1fu);
+        float v = e == 0 ? m * exp2(-24.0) : (m + 1024.0) * exp2(float(e - 25));
+        return (h & 0x8000u) != 0u ? -v : v;
+    }
+
+    // The PackedMaterial of compact.h: RGB9E5 color, unorm8 coefficients, half float ior
+    material unpackMaterial(uvec3 code)
+    {
+        material mat;
+        mat.color = vec3(code.x & 0x1ffu, code.x >> 9 & 0x1ffu, code.x >> 18 & 0x1ffu) * exp2(float(int(code.x >> 27) - 24));
+        mat.ka = unpackUnorm8(code.y);
+        mat.kd = unpackUnorm8(code.y >> 8);
+        mat.ks = unpackUnorm8(code.y >> 16);
+        mat.kt = unpackUnorm8(code.y >> 24);
+        mat.ior = unpackHalf(code.z & 0xffffu);
+        mat.matType = int(code.z >> 16);
+        return mat;
+    }
+
+    // Expands a hit for shading: fetches the material from uMaterials, works out the
+    // normal and applies the checker pattern. Misses get the background color.
+    shadeRec surfaceAt(hit h, ray r)
+    {
+        shadeRec sr;
+        sr.t = h.t;
+        if(h.prim < 0)
         {
-            reflectDir = 2*dot(lightDir, sr.normal)*sr.normal - lightDir;        
-            specContrib = sr.mat.ks * pow(max(dot(-r.direction, reflectDir), 0), 5) * sr.mat.color;
-            L += (diffContrib + specContrib) * (uLight1.color * uLight1.intensity) * dot(sr.normal, lightDir);
+            sr.normal = vec3(0, 0, 0);
+            sr.mat.kd = 0;
+            sr.mat.ka = 0;
+            sr.mat.ks = 0;
+            sr.mat.color = BACKGROUND_COLOR;
+            return sr;
         }
 
-        lightDir = normalize(uLight2.position - (sr.t * r.direction + r.origin));
-        shadowRay.direction = lightDir;
-        if(!shadowIntersectTest(shadowRay, uLight1.position))
+        int m = min(h.prim, uParticles.firstPrim);
+        sr.mat = uCompact ? unpackMaterial(uMaterialCodes[m]) : uMaterials[m];
+        if(h.prim == uPlane6.prim)
         {
-            reflectDir = 2*dot(lightDir, sr.normal)*sr.normal - lightDir;
-            specContrib = sr.mat.ks * pow(max(dot(-r.direction, reflectDir), 0), 5) * sr.mat.color;
-            L += (diffContrib + specContrib) * (uLight1.color * uLight1.intensity) * dot(sr.normal, lightDir);
+            sr.normal = uPlane6.normal;
+            if(uPlane6.checkered)
+            {
+                int x = int(floor(h.uv.x/2));
+                int z = int(floor(h.uv.y/2));
+                
+                if(x % 2 == 0)
+                {
+                    if(z % 2 == 0)
+                        sr.mat.color = vec3(0, 0, 0);
+                }else
+                {
+                    if(z % 2 == 1)
+                        sr.mat.color = vec3(0, 0, 0);
+                }
+            }
+            return sr;
         }
+
+        vec3 center;
+        if(h.prim >= uParticles.firstPrim)
+            center = particleCenter(h.prim - uParticles.firstPrim);
+        else
+            center = sceneSphere(h.prim).center;
+        sr.normal = normalize(r.origin - center + h.t * r.direction);
+        return sr;
+    }
+
+    // Light arriving from the light at lightPos. Every light is shadow tested against and
+    // weighted by uLight1.
+    vec3 lightContribution(shadeRec sr, ray r, vec3 lightPos)
+    {
+        ray shadowRay;
+        shadowRay.origin = sr.t * r.direction + r.origin;
+        vec3 lightDir = normalize(lightPos - shadowRay.origin);
+        shadowRay.direction = lightDir;
+        if(shadowIntersectTest(shadowRay, uLight1.position))
+            return vec3(0.0);
+
+        vec3 diffContrib = sr.mat.kd * sr.mat.color / PI;
+        vec3 reflectDir = 2*dot(lightDir, sr.normal)*sr.normal - lightDir;
+        vec3 specContrib = sr.mat.ks * pow(max(dot(-r.direction, reflectDir), 0), 5) * sr.mat.color;
+        return (diffContrib + specContrib) * (uLight1.color * uLight1.intensity) * dot(sr.normal, lightDir);
+    }
+
+    // Calculates the direct illumination component of a ray-object intersection
+    vec3 directIllum(shadeRec sr, ray r)
+    {
+        vec3 L = sr.mat.ka * sr.mat.color;
+        L += lightContribution(sr, r, uLight1.position);
+        L += lightContribution(sr, r, uLight2.position);
         return L;
     }
 
@@ -363,79 +696,725 @@ const char* basicFragSrc = GLSL(
         return wt;
     }
 
-    // Calculates the color of a pixel given that the primary ray hits an object in the scene
-    vec3 shade(shadeRec sr, ray r)
+    // Wang hash, the same as hashInt in tracer.h
+    uint hashInt(uint x)
+    {
+        x = (x ^ 61u) ^ (x >> 16);
+        x *= 9u;
+        x = x ^ (x >> 4);
+        x *= 0x27d4eb2du;
+        x = x ^ (x >> 15);
+        return x;
+    }
+
+    // Repeatable random number in [0, 1) for this pixel and an index
+    float pixelRandom(int index)
+    {
+        ivec2 p = ivec2(pixelCoord);
+        return float(hashInt(hashInt(uint(p.x + 1280 * p.y)) + uint(index))) / 4294967296.0;
+    }
+
+    uint reverseBits(uint x)
+    {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Second dimension of the Sobol sequence, the first is reverseBits(index)
+    uint sobolSecond(uint index)
+    {
+        uint result = 0u;
+        for(uint v = 1u << 31; index != 0u; index >>= 1)
+        {
+            if((index & 1u) != 0u)
+                result ^= v;
+            v ^= v >> 1;
+        }
+        return result;
+    }
+
+    // Hash based Owen scrambling, owenScramble in sampler.h
+    uint owenScramble(uint x, uint seed)
+    {
+        x = reverseBits(x);
+        x ^= x * 0x3d20adeau;
+        x += seed;
+        x *= (seed >> 16) | 1u;
+        x ^= x * 0x05526c56u;
+        x ^= x * 0x53a22864u;
+        return reverseBits(x);
+    }
+
+    // Component c of the 2D sample dim of this pixel's sample sampleIndex, sampleComponent in sampler.h
+    float sampleComponent(int dim, int c, int sampleIndex)
+    {
+        ivec2 p = ivec2(pixelCoord);
+        if(uSampler == 1)
+        {
+            uint seed = hashInt(hashInt(uint(p.x + 1280 * p.y)) ^ (uint(dim + 1) * 0x9e3779b9u));
+            uint index = owenScramble(uint(sampleIndex), seed);
+            uint bits = c == 0 ? reverseBits(index) : sobolSecond(index);
+            return float(owenScramble(bits, hashInt(seed + 1u + uint(c))) >> 8) / 16777216.0;
+        }
+        if(uSampler == 2)
+        {
+            uint offset = hashInt(uint(2 * dim + c + 1));
+            ivec2 b = (p + ivec2(int(offset & 63u), int((offset >> 8) & 63u))) & 63;
+            float v = texelFetch(uBlueNoise, b, 0).r + float(sampleIndex) * 0.618034;
+            return v - floor(v);
+        }
+        return pixelRandom(0x40000000 + 6 * sampleIndex + 2 * dim + c);
+    }
+
+    vec2 sample2D(int dim, int sampleIndex)
+    {
+        return vec2(sampleComponent(dim, 0, sampleIndex), sampleComponent(dim, 1, sampleIndex));
+    }
+
+    // Maps the unit square onto the unit disk, concentricDisk in sampler.h
+    vec2 concentricDisk(vec2 u)
+    {
+        vec2 ab = 2.0 * u - 1.0;
+        if(ab.x == 0.0 && ab.y == 0.0)
+            return vec2(0.0);
+
+        float r;
+        float phi;
+        if(abs(ab.x) > abs(ab.y))
+        {
+            r = ab.x;
+            phi = (PI / 4.0) * (ab.y / ab.x);
+        }else
+        {
+            r = ab.y;
+            phi = PI / 2.0 - (PI / 4.0) * (ab.x / ab.y);
+        }
+        return r * vec2(cos(phi), sin(phi));
+    }
+
+    // Construct ray with the position of the camera and a point on the viewplane, in pixels
+    ray primaryRay(vec2 pixel)
+    {
+        ray r;
+        r.origin = vec3(0, 0, 2);
+        r.direction = vec3(pixel.x / 1280.0 / 0.75 - (0.5 / .75), pixel.y / 960.0 - 0.5, 1.0) - r.origin;
+        return r;
+    }
+
+    // Primary ray of a sample of this pixel, cameraRay in tracer.h
+    ray cameraRay(int sampleIndex)
+    {
+        vec2 pixel = pixelCoord;
+        if(uJitter)
+            pixel = floor(pixelCoord) + sample2D(SAMPLE_PIXEL, sampleIndex);
+        ray r = primaryRay(pixel);
+        if(uLensRadius > 0.0)
+        {
+            vec3 offset = vec3(concentricDisk(sample2D(SAMPLE_LENS, sampleIndex)) * uLensRadius, 0.0);
+            r.origin += offset;
+            r.direction -= offset / uFocusDistance;
+        }
+        return r;
+    }
+
+    // directIllum with a single shadow ray: u picks one light with probability
+    // proportional to its intensity, and its light is divided by that probability
+    vec3 sampleDirectIllum(shadeRec sr, ray r, float u)
+    {
+        vec3 L = sr.mat.ka * sr.mat.color;
+        float total = uLight1.intensity + uLight2.intensity;
+        if(total <= 0.0)
+            return L;
+
+        float p1 = uLight1.intensity / total;
+        if(p1 > 0.0 && u < p1)
+            return L + lightContribution(sr, r, uLight1.position) / p1;
+        float p2 = uLight2.intensity / total;
+        if(p2 > 0.0)
+            return L + lightContribution(sr, r, uLight2.position) / p2;
+        return L;
+    }
+
+    // Direct light at the primary hit of a sample
+    vec3 primaryDirectIllum(shadeRec sr, ray r, int sampleIndex)
+    {
+        if(!uLightSampling)
+            return directIllum(sr, r);
+        return sampleDirectIllum(sr, r, sampleComponent(SAMPLE_LIGHT, 0, sampleIndex));
+    }
+
+    float luminance(vec3 c)
+    {
+        return dot(c, vec3(0.2126, 0.7152, 0.0722));
+    }
+
+    // Whether the standard error of the mean luminance is below the threshold, relative to
+    // that luminance, sampleErrorBelow in sampler.h
+    bool sampleErrorBelow(int n, int batch, vec2 moments)
+    {
+        int batches = n / batch;
+        if(n < ADAPTIVE_MIN_SAMPLES || (batches & (batches - 1)) != 0)
+            return false;
+        float varianceOfMean = moments.y / (float(n - 1) * float(n));
+        float allowed = uAdaptiveThreshold * max(moments.x, ADAPTIVE_LUMINANCE_FLOOR);
+        return varianceOfMean <= allowed * allowed;
+    }
+
+    // Secondary rays waiting to be traced. Rays that don't fit are dropped.
+    const int RAY_STACK_SIZE = 8;
+    ray stackRay[RAY_STACK_SIZE];
+    vec3 stackWeight[RAY_STACK_SIZE];
+    int stackBounce[RAY_STACK_SIZE];
+    int stackSize = 0;
+
+    // Fraction of light reflected at a dielectric boundary, 1 under total internal reflection
+    float fresnel(shadeRec sr, ray r)
+    {
+        float cos_thetai = dot(sr.normal, -normalize(r.direction));
+        float eta = sr.mat.ior;
+
+        if(cos_thetai < 0.0)
+        {
+            cos_thetai = -cos_thetai;
+            eta = 1.0 / eta;
+        }
+
+        float temp = 1.0 - (1.0 - cos_thetai * cos_thetai) / (eta * eta);
+        if(temp < 0.0)
+            return 1.0;
+
+        float cos_thetat = sqrt(temp);
+        float r_parallel = (eta * cos_thetai - cos_thetat) / (eta * cos_thetai + cos_thetat);
+        float r_perpendicular = (cos_thetai - eta * cos_thetat) / (cos_thetai + eta * cos_thetat);
+        return 0.5 * (r_parallel * r_parallel + r_perpendicular * r_perpendicular);
+    }
+
+    // Adds one to a bounce's byte of a stats counter
+    void countBounce(inout uint counter, int bounce)
     {
-        vec3 L = directIllum(sr, r);
+        int shift = 8 * min(bounce, 3);
+        if(((counter >> shift) & 255u) < 255u)
+            counter += 1u << shift;
+    }
 
-        for(int i = 0; i < MAX_BOUNCE && sr.mat.matType != 0; i++)
+    // Queues a secondary ray unless its weight is too low to matter
+    void pushRay(ray r, vec3 weight, int bounce)
+    {
+        float maxWeight = max(weight.r, max(weight.g, weight.b));
+        if(maxWeight < THROUGHPUT_CUTOFF)
         {
-            ray secondary_ray;
-            shadeRec secondary_sr;
-            secondary_ray.origin = r.origin + r.direction * sr.t;            
-            if(sr.mat.matType == 1)
+            countBounce(statsCulled, bounce);
+            return;
+        }
+        if(ROULETTE_DEPTH >= 0 && bounce >= ROULETTE_DEPTH)
+        {
+            float survive = clamp(maxWeight, 0.05, 1.0);
+            if(pixelRandom(rayCount++) >= survive)
             {
-                secondary_ray.direction = 2*dot(-r.direction, sr.normal)*sr.normal + r.direction;
-                secondary_sr = intersectTest(secondary_ray);
-                vec3 fr = sr.mat.ks * vec3(1, 1, 1);
-                if(secondary_sr.t < MAX_DEPTH)
-                {
-                    //vec3 fr = 0.5f * vec3(1, 1, 1) / dot(secondary_ray.direction, sr.normal);
-                    //L += fr * directIllum(secondary_sr, secondary_ray) * dot(secondary_ray.direction, sr.normal);
-                    L += fr * directIllum(secondary_sr, secondary_ray);
-                }else
-                {
-                    L += fr * BACKGROUND_COLOR;
-                    return L;
-                }
+                countBounce(statsKilled, bounce);
+                return;
+            }
+            weight /= survive;
+        }
+        if(stackSize == RAY_STACK_SIZE)
+        {
+            statsOverflow++;
+            return;
+        }
+
+        stackRay[stackSize] = r;
+        stackWeight[stackSize] = weight;
+        stackBounce[stackSize] = bounce;
+        stackSize++;
+        statsPeakStack = max(statsPeakStack, stackSize);
+    }
+
+    // Queues the rays leaving a hit: a reflection off reflective materials, and both
+    // the Fresnel weighted reflection and the refraction off transmissive ones
+    void pushSecondaryRays(shadeRec sr, ray r, vec3 weight, int bounce)
+    {
+        if(sr.mat.matType == 0 || bounce >= MAX_BOUNCE)
+            return;
+
+        ray reflected;
+        reflected.origin = r.origin + r.direction * sr.t;
+        reflected.direction = 2*dot(-r.direction, sr.normal)*sr.normal + r.direction;
+        if(sr.mat.matType == 1)
+        {
+            pushRay(reflected, weight * sr.mat.ks, bounce);
+            return;
+        }
+
+        float kr = fresnel(sr, r);
+        pushRay(reflected, weight * kr, bounce);
+        if(!tir(sr, r))
+        {
+            ray refracted;
+            refracted.origin = reflected.origin;
+            refracted.direction = calcRefractedDirection(sr, r);
+            pushRay(refracted, weight * (1.0 - kr) * sr.mat.kt / (sr.mat.ior * sr.mat.ior), bounce);
+        }
+    }
+
+    // Adds the light arriving over the reflection and refraction rays of a hit to L.
+    // The rays form a tree that is walked depth first with a fixed size stack.
+    vec3 traceBounces(vec3 L, shadeRec sr, ray r)
+    {
+        pushSecondaryRays(sr, r, vec3(1, 1, 1), 0);
 
+        while(stackSize > 0)
+        {
+            stackSize--;
+            ray secondary_ray = stackRay[stackSize];
+            vec3 weight = stackWeight[stackSize];
+            int bounce = stackBounce[stackSize];
+
+            hit h = intersectTest(secondary_ray);
+            countBounce(statsTraced, bounce);
+            costBounces++;
+            testMotion(secondary_ray, h.t);
+            if(h.t < MAX_DEPTH)
+            {
+                shadeRec secondary_sr = surfaceAt(h, secondary_ray);
+                L += weight * directIllum(secondary_sr, secondary_ray);
+                pushSecondaryRays(secondary_sr, secondary_ray, weight, bounce + 1);
             }else
+                L += weight * BACKGROUND_COLOR;
+        }
+        return L;
+    }
+
+    // Calculates the color of a pixel sample given that the primary ray hits an object in the scene
+    vec3 shade(shadeRec sr, ray r, int sampleIndex)
+    {
+        return traceBounces(primaryDirectIllum(sr, r, sampleIndex), sr, r);
+    }
+
+    // Joint bilateral upsampling of the low resolution bounce light, upsampleBounce in
+    // tracer.h. Returns false if none of the 2x2 samples around the pixel is usable.
+    bool upsampleBounce(shadeRec sr, out vec3 light)
+    {
+        ivec2 size = textureSize(uBounceLight, 0);
+        vec2 f = pixelCoord / float(uBounceFactor) - 0.5;
+        ivec2 p0 = ivec2(floor(f));
+        vec2 frac = f - vec2(p0);
+
+        vec3 sum = vec3(0.0);
+        float wsum = 0.0;
+        for(int j = 0; j < 2; j++)
+        {
+            for(int i = 0; i < 2; i++)
+            {
+                ivec2 q = clamp(p0 + ivec2(i, j), ivec2(0), size - 1);
+                vec4 ql = texelFetch(uBounceLight, q, 0);
+                if(int(ql.a) != sr.mat.matType)
+                    continue;
+
+                vec4 qg = texelFetch(uBounceGeometry, q, 0);
+                vec3 dn = sr.normal - qg.xyz;
+                float dz = abs(sr.t - qg.w) / max(sr.t, 1e-3);
+                float e = dot(dn, dn) / (BOUNCE_SIGMA_NORMAL * BOUNCE_SIGMA_NORMAL) + dz / BOUNCE_SIGMA_DEPTH;
+                float w = (i == 1 ? frac.x : 1.0 - frac.x) * (j == 1 ? frac.y : 1.0 - frac.y) * exp(-e);
+                sum += w * ql.rgb;
+                wsum += w;
+            }
+        }
+        light = sum / max(wsum, BOUNCE_MIN_WEIGHT);
+        return wsum >= BOUNCE_MIN_WEIGHT;
+    }
+
+    // Blue to red ramp for t in [0, 1], the same as heatColor in image.h
+    vec3 heatColor(float t)
+    {
+        t = clamp(t, 0.0, 1.0);
+        return clamp(1.5 - abs(4.0 * t - vec3(3.0, 2.0, 1.0)), 0.0, 1.0);
+    }
+
+    // Traces one sample of this pixel, the primary hit of the first goes to the G-buffer
+    vec3 traceSample(int sampleIndex, bool first)
+    {
+        ray r = cameraRay(sampleIndex);
+        rayCount = sampleIndex << 16;
+
+        // Check if the ray hits any of the objects in the scene. Rasterized hits are those
+        // of the pixel center, tile lists those of the pinhole camera.
+        hit h;
+        if(uHybrid && !uJitter && uLensRadius <= 0.0)
+        {
+            vec4 primary = texelFetch(uPrimaryHits, ivec2(pixelCoord), 0);
+            h.t = primary.x;
+            h.prim = int(primary.y);
+            h.uv = primary.zw;
+        }else if(uTileLists && uLensRadius <= 0.0)
+            h = tileIntersect(r);
+        else
+            h = intersectTest(r);
+        testMotion(r, h.t);
+        shadeRec sr = surfaceAt(h, r);
+
+        // G-buffer for the denoiser
+        if(first)
+        {
+            outNormal = vec4(sr.normal, sr.t);
+            outAlbedo = vec4(sr.mat.color, 1.0);
+        }
+
+        vec3 bounce;
+        bool lowResBounce = uBouncePass != 0 && sr.t < MAX_DEPTH && ((uBounceMaterials >> sr.mat.matType) & 1) != 0;
+        if(lowResBounce && upsampleBounce(sr, bounce))
+            return primaryDirectIllum(sr, r, sampleIndex) + bounce;
+        if(sr.t < MAX_DEPTH)
+            return shade(sr, r, sampleIndex);
+        return BACKGROUND_COLOR;
+    }
+
+    // Traces the pixel at pixelCoord into the out* variables
+    void tracePixel()
+    {
+        // Compute invocations trace one pixel after another
+        statsTraced = 0u;
+        statsCulled = 0u;
+        statsKilled = 0u;
+        statsPeakStack = 0;
+        statsOverflow = 0;
+        rayCount = 0;
+        costTests = 0;
+        costShadowRays = 0;
+        costBounces = 0;
+        costNodes = 0;
+        stackSize = 0;
+        motionMask = 0u;
+
+        bool lowResPass = uBouncePass == 1;
+        if(lowResPass)
+        {
+            // Only the bounce light, tagged with the material type it was traced for. A low
+            // resolution sample aims at the center of the pixels it covers.
+            ray r = primaryRay(pixelCoord * float(uBounceFactor));
+            shadeRec sr = surfaceAt(intersectTest(r), r);
+            outNormal = vec4(sr.normal, sr.t);
+            outAlbedo = vec4(sr.mat.color, 1.0);
+            outColor = vec4(0.0, 0.0, 0.0, -1.0);
+            if(sr.t < MAX_DEPTH && ((uBounceMaterials >> sr.mat.matType) & 1) != 0)
+                outColor = vec4(traceBounces(vec3(0.0), sr, r), float(sr.mat.matType));
+        }else if(uAdaptive)
+        {
+            // The accumulation restarts with the first progressive frame
+            ivec2 p = ivec2(pixelCoord);
+            vec4 accum = vec4(0.0);
+            vec2 moments = vec2(0.0);
+            if(uSampleOffset > 0)
+            {
+                accum = texelFetch(uAccumColor, p, 0);
+                moments = texelFetch(uAccumMoments, p, 0).xy;
+            }
+            int n = int(accum.a);
+            if(n < uMaxSamples && !sampleErrorBelow(n, uSamples, moments))
             {
-                if(!tir(sr, r))
+                for(int s = 0; s < uSamples && n < uMaxSamples; s++)
                 {
-                    secondary_ray.direction = calcRefractedDirection(sr, r);
-                    secondary_sr = intersectTest(secondary_ray);
-                    vec3 ft = sr.mat.kt / (sr.mat.ior * sr.mat.ior) * vec3(1, 1, 1);                        
-                    if(secondary_sr.t < MAX_DEPTH)
-                    {
-
-                        L += ft * directIllum(secondary_sr, secondary_ray);
-                    }else
-                    {
-                        L += ft * BACKGROUND_COLOR;
-                        return L;
-                    }
-                }else
-                    return L;
+                    vec3 c = traceSample(n, s == 0);
+                    n++;
+                    accum.rgb += (c - accum.rgb) / float(n);
+                    float lum = luminance(c);
+                    float d = lum - moments.x;
+                    moments.x += d / float(n);
+                    moments.y += d * (lum - moments.x);
+                }
+            }else
+            {
+                // Converged, only the G-buffer needs the primary hit
+                ray r = primaryRay(pixelCoord);
+                shadeRec sr = surfaceAt(intersectTest(r), r);
+                outNormal = vec4(sr.normal, sr.t);
+                outAlbedo = vec4(sr.mat.color, 1.0);
+            }
+            outColor = vec4(accum.rgb, 1.0);
+            outAccum = vec4(accum.rgb, float(n));
+            outMoments = vec4(moments, 0.0, 0.0);
+        }else
+        {
+            vec3 color = vec3(0.0);
+            for(int s = 0; s < uSamples; s++)
+                color += traceSample(uSampleOffset + s, s == 0);
+            outColor = vec4(color / float(uSamples), 1.0);
+        }
+        outStats = uvec4(statsTraced, statsCulled, statsKilled, uint(statsPeakStack) | (uint(statsOverflow) << 8));
+        outCost = vec4(costTests, costShadowRays, costBounces, costNodes);
+        if(uHeatmap >= 0 && !lowResPass)
+            outColor = vec4(heatColor(outCost[uHeatmap] / uHeatmapScale), 1.0);
+    }
+);
+
+const std::string basicFragSrc = std::string(GLSL(
+    out vec4 outColor;
+    out vec4 outNormal;          // xyz = normal of the primary hit, w = its distance along the ray
+    out vec4 outAlbedo;
+    out uvec4 outStats;          // Ray tree counts, see shade()
+    out vec4 outCost;            // Work done for the pixel, one CostMetric of image.h per component
+    out vec4 outAccum;           // Adaptive accumulation: rgb = mean color, a = samples taken
+    out vec4 outMoments;         // x = mean luminance of the samples, y = sum of their squared deviations
+    out uvec4 outHistory;        // x = motionMask of the pixel, y = frame it was traced in
+
+    uniform bool uHistoryValid;
+    uniform usampler2D uHistory;       // outHistory of the frame before
+)) + tracerSrc + GLSL_SOURCE(
+    void main()
+    {
+        pixelCoord = gl_FragCoord.xy;
+
+        // A pixel the moving spheres left alone keeps what the frame target holds from the
+        // frame it was traced in, temporalPixelCurrent in temporal.h
+        if(uTemporal && uHistoryValid)
+        {
+            uvec2 history = texelFetch(uHistory, ivec2(pixelCoord), 0).xy;
+            int age = uFrame - int(history.y);
+            if(age > 0 && age <= TEMPORAL_LOOKAHEAD && (history.x & 1u) == 0u && (history.x & (1u << uint(age))) == 0u)
+                discard;
+        }
+        tracePixel();
+        outHistory = uvec4(motionMask, uint(uFrame), 0u, 0u);
+    }
+);
+
+// The same tracer as an OpenGL 4.3 compute shader writing the frame target through image
+// units 0 to 6, one per attachment. A fixed set of persistent threads pulls 2x2 pixel
+// batches off an atomic counter in the WorkQueue buffer until uTraceRect is used up, so
+// a lane whose paths end early picks up new pixels instead of idling until the deepest
+// bounce tree of its group is done, as it would in a fragment shader.
+const std::string traceCompSrc = std::string("#version 430 core\n") + GLSL_SOURCE(
+    layout(local_size_x = 64) in;
+
+    vec4 outColor;
+    vec4 outNormal;
+    vec4 outAlbedo;
+    uvec4 outStats;
+    vec4 outCost;
+    vec4 outAccum;
+    vec4 outMoments;
+) + tracerSrc + GLSL_SOURCE(
+    layout(std430, binding = 0) buffer WorkQueue
+    {
+        uint nextBatch;                // Reset to 0 before every dispatch
+    };
+    uniform ivec4 uTraceRect;          // x, y, width, height of the pixels to trace
+    uniform int uBatchLimit;           // Most batches one invocation takes before it retires
+    uniform float uBlendWeight;        // Weight of this frame in the progressive mean of the color, 1 replaces it
+
+    layout(rgba32f, binding = 0) uniform image2D uColorImage;
+    layout(rgba32f, binding = 1) writeonly uniform image2D uNormalImage;
+    layout(rgba8, binding = 2) writeonly uniform image2D uAlbedoImage;
+    layout(rgba32ui, binding = 3) writeonly uniform uimage2D uStatsImage;
+    layout(rgba32f, binding = 4) writeonly uniform image2D uCostImage;
+    layout(rgba32f, binding = 5) writeonly uniform image2D uAccumImage;
+    layout(rg32f, binding = 6) writeonly uniform image2D uMomentsImage;
 
+    // Traces pixel p of the frame target and stores its outputs
+    void traceToImages(ivec2 p)
+    {
+        pixelCoord = vec2(p) + 0.5;
+        tracePixel();
+
+        if(uBlendWeight < 1.0)
+            outColor = mix(imageLoad(uColorImage, p), outColor, uBlendWeight);
+        imageStore(uColorImage, p, outColor);
+        imageStore(uNormalImage, p, outNormal);
+
+        // The low resolution bounce pass only has the first two targets
+        if(uBouncePass != 1)
+        {
+            imageStore(uAlbedoImage, p, outAlbedo);
+            imageStore(uStatsImage, p, outStats);
+            imageStore(uCostImage, p, outCost);
+        }
+        if(uAdaptive)
+        {
+            imageStore(uAccumImage, p, outAccum);
+            imageStore(uMomentsImage, p, outMoments);
+        }
+    }
+
+    void main()
+    {
+        ivec2 quads = (uTraceRect.zw + 1) / 2;
+        uint numBatches = uint(quads.x * quads.y);
+        for(int n = 0; n < uBatchLimit; n++)
+        {
+            uint batch = atomicAdd(nextBatch, 1u);
+            if(batch >= numBatches)
+                break;
+
+            ivec2 quad = ivec2(int(batch) % quads.x, int(batch) / quads.x);
+            for(int i = 0; i < 4; i++)
+            {
+                ivec2 p = 2 * quad + ivec2(i & 1, i >> 1);
+                if(p.x < uTraceRect.z && p.y < uTraceRect.w)
+                    traceToImages(uTraceRect.xy + p);
             }
-            sr = secondary_sr;
-            r = secondary_ray;
         }
-        return L;
     }
+);
+
+// Primary visibility for the hybrid mode, see raster.h. Planes are drawn as full screen
+// quads, spheres and particles as quads over their screen bounds, one instance per particle.
+const char* rasterVertSrc = GLSL(
+    uniform int uKind;                 // 0 = plane, 1 = sphere, 2 = particles
+    uniform vec3 uCenter;
+    uniform float uRadius;
+    uniform int uPrim;                 // Primitive ID, of the first particle for particles
+    uniform samplerBuffer uParticleCenters;
+    uniform bool uCompact;             // Centers in unorm16, see particleCenter in basicFragSrc
+    uniform vec3 uParticleOrigin;
+    uniform vec3 uParticleStep;
+
+    flat out vec3 vCenter;
+    flat out int vPrim;
 
     void main()
     {
-        ray r;
-        //float z = sphereIntersect(gl_FragCoord.x / 800.0 / .75 - (0.5 / .75), gl_FragCoord.y / 600.0 - 0.5);
-        //r.origin = vec3(gl_FragCoord.x / 1280.0 / 0.75 - (0.5 / .75), gl_FragCoord.y / 960.0 - 0.5, 0.0);
+        // Corners of a triangle strip
+        vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+        vec2 lo = vec2(0.0);
+        vec2 hi = vec2(1.0);
+        vCenter = uCenter;
+        vPrim = uPrim;
+        if(uKind == 2)
+        {
+            vCenter = texelFetch(uParticleCenters, gl_InstanceID).xyz;
+            if(uCompact)
+                vCenter = uParticleOrigin + uParticleStep * round(vCenter * 65535.0);
+            vPrim = uPrim + gl_InstanceID;
+        }
 
-        // Construct ray with the position of the camera and a point on the viewplane
-        r.origin = vec3(0, 0, 2);
-        r.direction = vec3(gl_FragCoord.x / 1280.0 / 0.75 - (0.5 / .75), gl_FragCoord.y / 960.0 - 0.5, 1.0) - r.origin;
+        // The screen bounds of sphereScreenBounds, padded by a pixel
+        if(uKind != 0)
+        {
+            vec3 q = vCenter - vec3(0, 0, 2);
+            float zNear = -q.z - uRadius;
+            float zFar = -q.z + uRadius;
+            if(zFar <= 0.0)
+                hi = lo;
+            else if(zNear > 0.0001)
+            {
+                vec2 bmin = min((q.xy - uRadius) / zNear, (q.xy - uRadius) / zFar);
+                vec2 bmax = max((q.xy + uRadius) / zNear, (q.xy + uRadius) / zFar);
+                vec2 pad = 1.0 / vec2(1280.0, 960.0);
+                lo = clamp(vec2(0.75, 1.0) * bmin + 0.5 - pad, 0.0, 1.0);
+                hi = clamp(vec2(0.75, 1.0) * bmax + 0.5 + pad, 0.0, 1.0);
+            }
+        }
+        gl_Position = vec4(mix(lo, hi, corner) * 2.0 - 1.0, 0.0, 1.0);
+    }
+);
 
-        // Check if the ray hits any of the objects in the scene
-        shadeRec sr = intersectTest(r);
-        
-        if(sr.t < MAX_DEPTH)
+// Ray casts the object of the quad along the primary ray of the pixel and depth tests
+// the hit. The math is that of planeIntersect and sphereIntersect in basicFragSrc.
+const char* rasterFragSrc = GLSL(
+    out vec4 outHit;                   // t, primitive ID and uv of the hit struct in basicFragSrc
+
+    float MAX_DEPTH = 100000;
+    float MIN_T = 0.0001;
+
+    uniform int uKind;
+    uniform vec3 uPoint;               // Plane
+    uniform vec3 uNormal;
+    uniform float uRadius;             // Sphere
+
+    flat in vec3 vCenter;
+    flat in int vPrim;
+
+    void main()
+    {
+        vec3 origin = vec3(0, 0, 2);
+        vec3 direction = vec3(gl_FragCoord.x / 1280.0 / 0.75 - (0.5 / .75), gl_FragCoord.y / 960.0 - 0.5, 1.0) - origin;
+
+        float t = MAX_DEPTH;
+        vec2 uv = vec2(0, 0);
+        if(uKind == 0)
         {
-            // Ray hits an object
-            vec3 color = shade(sr, r);
-            outColor = vec4(color, 1.0f);            
+            t = dot(uPoint - origin, uNormal) / dot(direction, uNormal);
+            if(t > MIN_T)
+            {
+                vec3 hitPoint = origin + direction * t;
+                uv = hitPoint.xz;
+            }else
+                t = MAX_DEPTH;
         }else
         {
-            outColor = vec4(BACKGROUND_COLOR, 1.0f);
-        }                
+            vec3 tmp = origin - vCenter;
+            float a = dot(direction, direction);
+            float b = 2.0 * dot(tmp, direction);
+            float c = dot(tmp, tmp) - uRadius * uRadius;
+            float disc = b * b - 4.0 * a * c;
+            if(disc >= 0.0)
+            {
+                float e = sqrt(disc);
+                float denom = 2.0 * a;
+                t = (-b - e) / denom;
+                if(t <= MIN_T)
+                {
+                    t = (-b + e) / denom;
+                    if(t <= MIN_T)
+                        t = MAX_DEPTH;
+                }
+            }
+        }
+        if(t >= MAX_DEPTH)
+            discard;
+
+        outHit = vec4(t, float(vPrim), uv);
+        gl_FragDepth = t / MAX_DEPTH;
+    }
+);
+
+// One iteration of the edge-avoiding a-trous wavelet filter, see denoise.h
+const char* atrousFragSrc = GLSL(
+    out vec4 outColor;
+
+    uniform sampler2D uColor;
+    uniform sampler2D uNormalDepth;
+    uniform sampler2D uAlbedo;
+    uniform int uStepWidth;
+    uniform float uSigmaColor;
+    uniform float uSigmaNormal;
+    uniform float uSigmaDepth;
+    uniform float uSigmaAlbedo;
+
+    float kernel[5] = float[](1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+
+    void main()
+    {
+        ivec2 size = textureSize(uColor, 0);
+        ivec2 p = ivec2(gl_FragCoord.xy);
+        vec3 pc = texelFetch(uColor, p, 0).rgb;
+        vec4 pnd = texelFetch(uNormalDepth, p, 0);
+        vec3 pa = texelFetch(uAlbedo, p, 0).rgb;
+
+        vec3 sum = vec3(0.0);
+        float wsum = 0.0;
+        for(int j = 0; j < 5; j++)
+        {
+            for(int i = 0; i < 5; i++)
+            {
+                ivec2 q = clamp(p + ivec2(i - 2, j - 2) * uStepWidth, ivec2(0), size - 1);
+                vec3 qc = texelFetch(uColor, q, 0).rgb;
+                vec4 qnd = texelFetch(uNormalDepth, q, 0);
+                vec3 qa = texelFetch(uAlbedo, q, 0).rgb;
+
+                vec3 dc = pc - qc;
+                vec3 dn = pnd.xyz - qnd.xyz;
+                vec3 da = pa - qa;
+                float dz = abs(pnd.w - qnd.w) / max(pnd.w, 1e-3);
+                float e = dot(dc, dc) / (uSigmaColor * uSigmaColor) + dot(dn, dn) / (uSigmaNormal * uSigmaNormal)
+                        + dz / uSigmaDepth + dot(da, da) / (uSigmaAlbedo * uSigmaAlbedo);
+                float w = kernel[i] * kernel[j] * exp(-e);
+                sum += w * qc;
+                wsum += w;
+            }
+        }
+        outColor = vec4(sum / wsum, 1.0);
     }
 );
@@ -0,0 +1,166 @@
+#ifndef SHADOWMAP_H
+#define SHADOWMAP_H
+
+#include <stdio.h>
+#include <vector>
+#include "scene.h"
+#include "vec.h"
+
+// Cube shadow maps of the static part of a scene: the planes, the spheres that are not
+// dynamic and the particles. Each texel holds the distance from the light to the first
+// static surface in its direction, so a shadow test of the static scene is a lookup and
+// only the dynamic spheres still take a traced ray. The maps are cast from the lights by
+// updateShadowMaps in tracer.h and kept until a light or a static object changes.
+
+static const float SHADOW_NORMAL_OFFSET = 1.5f;     // Texels the lookup point moves off the surface
+static const float SHADOW_DEPTH_BIAS = 1.0f;        // Texels of depth a surface may lie behind its texel
+
+// Faces +x, -x, +y, -y, +z, -z of size x size texels
+struct ShadowCubeMap
+{
+    Vec3 light;
+    std::vector<float> depth;
+};
+
+// What the maps were cast from, to tell when they are out of date
+struct ShadowMapScene
+{
+    std::vector<Vec3> lights;
+    std::vector<Sphere> spheres;         // The static ones
+    std::vector<Plane> planes;
+    size_t numParticles;
+    float particleRadius;
+};
+
+struct ShadowMapStats
+{
+    int builds;                  // Maps cast, one per light
+    double buildMs;              // Of the last update that cast any
+
+    ShadowMapStats() : builds(0), buildMs(0) {}
+};
+
+struct ShadowMaps
+{
+    int size;                    // Texels along a face edge
+    std::vector<ShadowCubeMap> maps;
+    ShadowMapScene built;
+    ShadowMapStats stats;
+    std::vector<char> stale;     // Per light, kept so that a frame with nothing to cast does not allocate
+
+    ShadowMaps() : size(512) {}
+};
+
+// Face and texel of direction d, and the texel back to a direction, with the same layout:
+// the major axis picks the face, the other two axes in cyclic order span it
+inline int shadowTexel(const ShadowMaps& shadows, const Vec3& d)
+{
+    int axis = 0;
+    if(fabsf(d[1]) > fabsf(d[axis]))
+        axis = 1;
+    if(fabsf(d[2]) > fabsf(d[axis]))
+        axis = 2;
+    float major = fabsf(d[axis]);
+    int face = 2 * axis + (d[axis] < 0.0f ? 1 : 0);
+    if(major <= 0.0f)
+        return 0;
+    int n = shadows.size;
+    int s = (int)((d[(axis + 1) % 3] / major * 0.5f + 0.5f) * n);
+    int t = (int)((d[(axis + 2) % 3] / major * 0.5f + 0.5f) * n);
+    s = std::max(0, std::min(s, n - 1));
+    t = std::max(0, std::min(t, n - 1));
+    return (face * n + t) * n + s;
+}
+
+inline Vec3 shadowTexelDirection(const ShadowMaps& shadows, int face, int s, int t)
+{
+    int axis = face / 2;
+    Vec3 d;
+    d[axis] = face & 1 ? -1.0f : 1.0f;
+    d[(axis + 1) % 3] = (s + 0.5f) / shadows.size * 2.0f - 1.0f;
+    d[(axis + 2) % 3] = (t + 0.5f) / shadows.size * 2.0f - 1.0f;
+    return normalize(d);
+}
+
+// Whether the static scene blocks the shadow ray from p toward light i, which basicFragSrc
+// tests out to distance tMax rather than to the light. Occluders between p and the light
+// come from the texel toward p, and ones past the light, if the ray reaches that far,
+// from the texel facing away from p. n is the surface normal at p.
+inline bool shadowMapOccluded(const ShadowMaps& shadows, int i, const Vec3& p, const Vec3& n, float tMax)
+{
+    const ShadowCubeMap& map = shadows.maps[i];
+    Vec3 toLight = map.light - p;
+    float texel = norm(toLight) * 2.0f / shadows.size;
+    Vec3 offset = dot(n, toLight) < 0.0f ? -n : n;
+    Vec3 fromLight = p + offset * (SHADOW_NORMAL_OFFSET * texel) - map.light;
+    float dist = norm(fromLight);
+
+    float occluder = map.depth[shadowTexel(shadows, fromLight)];
+    if(occluder < dist - SHADOW_DEPTH_BIAS * texel && dist - occluder < tMax)
+        return true;
+    if(tMax <= dist)
+        return false;
+    return map.depth[shadowTexel(shadows, -fromLight)] < tMax - dist;
+}
+
+// Whether the maps were cast from the lights and static objects of scene, light by light
+// in stale. Returns true if all of them are current.
+inline bool shadowMapsCurrent(const ShadowMaps& shadows, const Scene& scene, std::vector<char>& stale)
+{
+    const ShadowMapScene& b = shadows.built;
+    bool geometry = b.planes.size() == scene.planes.size() && b.numParticles == scene.particles.size() &&
+                    b.particleRadius == scene.particleRadius;
+    for(size_t i = 0; i < scene.planes.size() && geometry; i++)
+    {
+        geometry = norm2(b.planes[i].point - scene.planes[i].point) == 0.0f &&
+                   norm2(b.planes[i].normal - scene.planes[i].normal) == 0.0f;
+    }
+    size_t s = 0;
+    for(size_t i = 0; i < scene.spheres.size() && geometry; i++)
+    {
+        if(scene.spheres[i].dynamic)
+            continue;
+        geometry = s < b.spheres.size() && norm2(b.spheres[s].center - scene.spheres[i].center) == 0.0f &&
+                   b.spheres[s].radius == scene.spheres[i].radius;
+        s++;
+    }
+    geometry = geometry && s == b.spheres.size();
+
+    bool current = true;
+    stale.assign(scene.lights.size(), 0);
+    for(size_t i = 0; i < scene.lights.size(); i++)
+    {
+        stale[i] = !geometry || i >= b.lights.size() || norm2(b.lights[i] - scene.lights[i].position) != 0.0f;
+        current = current && !stale[i];
+    }
+    return current && b.lights.size() == scene.lights.size();
+}
+
+inline void recordShadowMapScene(ShadowMaps& shadows, const Scene& scene)
+{
+    ShadowMapScene& b = shadows.built;
+    b.lights.clear();
+    for(size_t i = 0; i < scene.lights.size(); i++)
+        b.lights.push_back(scene.lights[i].position);
+    b.spheres.clear();
+    for(size_t i = 0; i < scene.spheres.size(); i++)
+    {
+        if(!scene.spheres[i].dynamic)
+            b.spheres.push_back(scene.spheres[i]);
+    }
+    b.planes = scene.planes;
+    b.numParticles = scene.particles.size();
+    b.particleRadius = scene.particleRadius;
+}
+
+inline void printShadowMapStats(const ShadowMaps& shadows)
+{
+    size_t bytes = 0;
+    for(size_t i = 0; i < shadows.maps.size(); i++)
+        bytes += shadows.maps[i].depth.size() * sizeof(float);
+    printf("shadow maps: %d lights, %dx%d faces, %.1f MB, %d cast, last update %.2f ms\n",
+           (int)shadows.maps.size(), shadows.size, shadows.size, bytes / (1024.0 * 1024.0),
+           shadows.stats.builds, shadows.stats.buildMs);
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "scene.h"
+
+// Hand-off of the animated scene from a simulation thread to the render thread. Frame n
+// is posed into slot n % 2 while the renderer still draws frame n - 1 out of the other
+// slot, so a frame takes as long as the slower of the two rather than both. A snapshot
+// is never written once published: the simulation only reuses a slot after the renderer
+// has moved on to the next frame, which it tells through a release store of the frame
+// it holds. Both sides spin on the frame counters and never take a lock.
+
+struct SceneSnapshot
+{
+    int frame;
+    std::vector<Sphere> spheres;     // Posed by animateSpheres
+};
+
+struct SnapshotBuffer
+{
+    SceneSnapshot slots[2];
+    std::atomic<int> published;      // Last frame the simulation finished
+    std::atomic<int> acquired;       // Frame the renderer holds
+    std::atomic<bool> quit;
+
+    int simulationStalls;            // Times the simulation waited for the renderer, its thread only
+    int renderStalls;                // Times the renderer waited for the simulation, its thread only
+
+    SnapshotBuffer(int firstFrame = 0)
+        : published(firstFrame - 1), acquired(firstFrame - 1), quit(false), simulationStalls(0), renderStalls(0)
+    {
+    }
+};
+
+// Slot to pose frame into, once the renderer no longer holds the frame before last that
+// used it. NULL if the buffer was shut down meanwhile.
+inline SceneSnapshot *beginSnapshot(SnapshotBuffer& buffer, int frame)
+{
+    if(buffer.acquired.load(std::memory_order_acquire) < frame - 1)
+    {
+        buffer.simulationStalls++;
+        while(buffer.acquired.load(std::memory_order_acquire) < frame - 1)
+        {
+            if(buffer.quit.load(std::memory_order_relaxed))
+                return NULL;
+            std::this_thread::yield();
+        }
+    }
+    SceneSnapshot *snapshot = &buffer.slots[frame & 1];
+    snapshot->frame = frame;
+    return snapshot;
+}
+
+inline void publishSnapshot(SnapshotBuffer& buffer, const SceneSnapshot& snapshot)
+{
+    buffer.published.store(snapshot.frame, std::memory_order_release);
+}
+
+// The frame after the one the renderer held, which stays valid until the next call.
+// Releases the previous one to the simulation.
+inline const SceneSnapshot& acquireSnapshot(SnapshotBuffer& buffer)
+{
+    int frame = buffer.acquired.load(std::memory_order_relaxed) + 1;
+    if(buffer.published.load(std::memory_order_acquire) < frame)
+    {
+        buffer.renderStalls++;
+        while(buffer.published.load(std::memory_order_acquire) < frame)
+            std::this_thread::yield();
+    }
+    buffer.acquired.store(frame, std::memory_order_release);
+    return buffer.slots[frame & 1];
+}
+
+// Poses frames firstFrame, firstFrame + 1, ... of the animation of spheres into buffer
+// until it is shut down
+inline void runSimulation(SnapshotBuffer& buffer, std::vector<Sphere> spheres, int firstFrame)
+{
+    for(int frame = firstFrame;; frame++)
+    {
+        SceneSnapshot *snapshot = beginSnapshot(buffer, frame);
+        if(!snapshot)
+            return;
+        snapshot->spheres = spheres;
+        animateSpheres(snapshot->spheres, frame);
+        publishSnapshot(buffer, *snapshot);
+    }
+}
+
+// Moves the dynamic spheres of scene to where snapshot has them, leaving the others to
+// whatever edits the renderer made
+inline void applySnapshot(Scene& scene, const SceneSnapshot& snapshot)
+{
+    for(size_t i = 0; i < scene.spheres.size() && i < snapshot.spheres.size(); i++)
+    {
+        if(scene.spheres[i].dynamic)
+            scene.spheres[i].center = snapshot.spheres[i].center;
+    }
+}
+
+inline void printSnapshotStats(const SnapshotBuffer& buffer)
+{
+    printf("scene snapshots: up to frame %d, renderer waited %d times, simulation waited %d times\n",
+           buffer.acquired.load(), buffer.renderStalls, buffer.simulationStalls);
+}
+
+#endif
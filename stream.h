@@ -0,0 +1,617 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "bvh.h"
+#include "ray.h"
+
+// Out of core particles for ACCEL_STREAM. writeTreeletFile cuts the BVH of the particles into
+// treelets, subtrees of at most TREELET_MAX_PARTICLES spheres stored together with their
+// centers, under a top level tree that stays in memory. The file is memory mapped and a
+// TreeletCache copies the treelets rays reach into a fixed number of slots, evicting the
+// least recently used one, so the particles never take more memory than the cache cap.
+// Particles are numbered in the order of the file, which is the BVH leaf order.
+
+static const uint32_t TREELET_FILE_MAGIC = 0x544c5254;      // "TRLT"
+static const uint32_t TREELET_FILE_VERSION = 1;
+static const int TREELET_MAX_PARTICLES = 1024;
+static const int TREELET_DEFERRED = 64;                     // Missed treelets a ray puts off
+
+struct TreeletFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numParticles;
+    uint32_t numTreelets;
+    uint32_t numTopNodes;
+    float radius;
+};
+
+// Where a treelet is in the file. Its nodes come first, then the centers of particles
+// firstParticle onwards, which the leaves index from 0.
+struct TreeletInfo
+{
+    uint64_t offset;
+    uint32_t numNodes;
+    uint32_t firstParticle;
+    uint32_t numParticles;
+    uint32_t padding;
+};
+
+// Last node of the subtree at node n, and the particles [begin, end) under it. buildBVH
+// lays the nodes out depth first and the leaves cover contiguous index ranges in order.
+inline int bvhSubtreeRange(const BVH& bvh, int n, int& begin, int& end)
+{
+    int first = n;
+    while(bvh.nodes[first].count == 0)
+        first++;
+    int last = n;
+    while(bvh.nodes[last].count == 0)
+        last = bvh.nodes[last].first;
+    begin = bvh.nodes[first].first;
+    end = bvh.nodes[last].first + bvh.nodes[last].count;
+    return last;
+}
+
+// Copies node n into the top level tree, or makes its subtree a treelet once it is small
+// enough. Top level leaves have the treelet index in first and its particle count in count.
+inline int cutTreelets(const BVH& bvh, int n, std::vector<BVHNode>& top, std::vector<int>& roots)
+{
+    int begin, end;
+    bvhSubtreeRange(bvh, n, begin, end);
+    int topIndex = (int)top.size();
+    top.push_back(bvh.nodes[n]);
+    if(end - begin <= TREELET_MAX_PARTICLES)
+    {
+        top[topIndex].first = (int)roots.size();
+        top[topIndex].count = end - begin;
+        roots.push_back(n);
+        return topIndex;
+    }
+    cutTreelets(bvh, n + 1, top, roots);
+    int right = cutTreelets(bvh, bvh.nodes[n].first, top, roots);
+    top[topIndex].first = right;
+    top[topIndex].count = 0;
+    return topIndex;
+}
+
+inline uint64_t alignTreelet(uint64_t offset)
+{
+    return (offset + 15) & ~(uint64_t)15;
+}
+
+// Builds the BVH of the particles and writes it to path as treelets. Returns false if
+// the file could not be written.
+inline bool writeTreeletFile(const char *path, const std::vector<Vec3>& centers, float radius)
+{
+    BVH bvh;
+    buildBVH(bvh, centers, radius);
+    std::vector<BVHNode> top;
+    std::vector<int> roots;
+    if(!bvh.nodes.empty())
+        cutTreelets(bvh, 0, top, roots);
+
+    TreeletFileHeader header;
+    header.magic = TREELET_FILE_MAGIC;
+    header.version = TREELET_FILE_VERSION;
+    header.numParticles = (uint32_t)centers.size();
+    header.numTreelets = (uint32_t)roots.size();
+    header.numTopNodes = (uint32_t)top.size();
+    header.radius = radius;
+
+    std::vector<TreeletInfo> infos(roots.size());
+    uint64_t offset = alignTreelet(sizeof(header) + top.size() * sizeof(BVHNode) + infos.size() * sizeof(TreeletInfo));
+    for(size_t t = 0; t < roots.size(); t++)
+    {
+        int begin, end;
+        int last = bvhSubtreeRange(bvh, roots[t], begin, end);
+        infos[t].offset = offset;
+        infos[t].numNodes = (uint32_t)(last + 1 - roots[t]);
+        infos[t].firstParticle = (uint32_t)begin;
+        infos[t].numParticles = (uint32_t)(end - begin);
+        infos[t].padding = 0;
+        offset = alignTreelet(offset + infos[t].numNodes * sizeof(BVHNode) + infos[t].numParticles * sizeof(Vec3));
+    }
+
+    FILE *f = fopen(path, "wb");
+    if(!f)
+    {
+        fprintf(stderr, "Could not open %s for writing\n", path);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    if(!top.empty())
+        ok = ok && fwrite(&top[0], sizeof(BVHNode), top.size(), f) == top.size();
+    if(!infos.empty())
+        ok = ok && fwrite(&infos[0], sizeof(TreeletInfo), infos.size(), f) == infos.size();
+
+    // Node links and leaf ranges become relative to the treelet
+    std::vector<BVHNode> nodes;
+    std::vector<Vec3> treeletCenters;
+    const char zeros[16] = { 0 };
+    uint64_t written = sizeof(header) + top.size() * sizeof(BVHNode) + infos.size() * sizeof(TreeletInfo);
+    for(size_t t = 0; t < roots.size() && ok; t++)
+    {
+        const TreeletInfo& info = infos[t];
+        ok = fwrite(zeros, 1, (size_t)(info.offset - written), f) == info.offset - written;
+        nodes.assign(bvh.nodes.begin() + roots[t], bvh.nodes.begin() + roots[t] + info.numNodes);
+        for(size_t i = 0; i < nodes.size(); i++)
+            nodes[i].first -= nodes[i].count > 0 ? (int)info.firstParticle : roots[t];
+        treeletCenters.resize(info.numParticles);
+        for(uint32_t i = 0; i < info.numParticles; i++)
+            treeletCenters[i] = centers[bvh.indices[info.firstParticle + i]];
+
+        ok = ok && fwrite(&nodes[0], sizeof(BVHNode), nodes.size(), f) == nodes.size() &&
+             fwrite(&treeletCenters[0], sizeof(Vec3), treeletCenters.size(), f) == treeletCenters.size();
+        written = info.offset + nodes.size() * sizeof(BVHNode) + treeletCenters.size() * sizeof(Vec3);
+    }
+    if(fclose(f) != 0)
+        ok = false;
+    if(!ok)
+        fprintf(stderr, "Could not write %s\n", path);
+    return ok;
+}
+
+struct TreeletCacheStats
+{
+    long long hits;
+    long long misses;            // Treelets copied in from the file
+    long long evictions;
+    long long waits;             // Misses that found every slot pinned
+    long long bytesRead;
+    int peakSlots;               // Most slots in use at once
+
+    TreeletCacheStats() : hits(0), misses(0), evictions(0), waits(0), bytesRead(0), peakSlots(0) {}
+};
+
+// Treelets resident in the slots of one block of at most the cap, in a least recently used
+// list. A treelet is pinned while rays traverse it, only unpinned ones get evicted.
+struct TreeletCache
+{
+    TreeletFileHeader header;
+    std::vector<BVHNode> top;
+    std::vector<TreeletInfo> treelets;
+    std::vector<int> topLeaf;            // Top level node of each treelet, for its bounds
+    int fd;
+    const char *mapped;
+    size_t mappedSize;
+
+    size_t slotBytes;                    // Of the largest treelet
+    int numSlots;
+    std::vector<char> slotData;
+    std::vector<int> slotTreelet;        // -1 for a free slot
+    std::vector<int> slotPins;
+    std::vector<char> slotLoading;       // Being copied in, readers wait for it
+    std::vector<int> lruPrev;            // Occupied slots, most recently used at lruHead
+    std::vector<int> lruNext;
+    int lruHead;
+    int lruTail;
+    std::vector<int> freeSlots;
+    std::vector<int> residentSlot;       // Slot of each treelet, -1 if not resident
+
+    std::mutex mutex;
+    std::condition_variable slotChanged;
+    TreeletCacheStats stats;
+
+    TreeletCache() : fd(-1), mapped(NULL), mappedSize(0), slotBytes(0), numSlots(0), lruHead(-1), lruTail(-1) {}
+    ~TreeletCache();
+};
+
+inline void closeTreeletFile(TreeletCache& cache)
+{
+#ifndef _WIN32
+    if(cache.mapped)
+        munmap((void *)cache.mapped, cache.mappedSize);
+    if(cache.fd >= 0)
+        close(cache.fd);
+#endif
+    cache.mapped = NULL;
+    cache.fd = -1;
+}
+
+inline TreeletCache::~TreeletCache()
+{
+    closeTreeletFile(*this);
+}
+
+// Maps the treelet file at path and sets up as many slots as fit in capBytes, at least one.
+// Returns false if the file can't be read or is not a treelet file.
+inline bool openTreeletFile(TreeletCache& cache, const char *path, size_t capBytes)
+{
+#ifndef _WIN32
+    closeTreeletFile(cache);
+    cache.fd = open(path, O_RDONLY);
+    if(cache.fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(cache.fd, &st) != 0 || (size_t)st.st_size < sizeof(TreeletFileHeader))
+    {
+        closeTreeletFile(cache);
+        return false;
+    }
+    cache.mappedSize = (size_t)st.st_size;
+    void *mapped = mmap(NULL, cache.mappedSize, PROT_READ, MAP_PRIVATE, cache.fd, 0);
+    if(mapped == MAP_FAILED)
+    {
+        closeTreeletFile(cache);
+        return false;
+    }
+    cache.mapped = (const char *)mapped;
+
+    memcpy(&cache.header, cache.mapped, sizeof(cache.header));
+    const TreeletFileHeader& h = cache.header;
+    size_t tableEnd = sizeof(h) + (size_t)h.numTopNodes * sizeof(BVHNode) + (size_t)h.numTreelets * sizeof(TreeletInfo);
+    if(h.magic != TREELET_FILE_MAGIC || h.version != TREELET_FILE_VERSION || tableEnd > cache.mappedSize)
+    {
+        closeTreeletFile(cache);
+        return false;
+    }
+    cache.top.resize(h.numTopNodes);
+    cache.treelets.resize(h.numTreelets);
+    if(h.numTopNodes > 0)
+        memcpy(&cache.top[0], cache.mapped + sizeof(h), h.numTopNodes * sizeof(BVHNode));
+    if(h.numTreelets > 0)
+        memcpy(&cache.treelets[0], cache.mapped + sizeof(h) + h.numTopNodes * sizeof(BVHNode), h.numTreelets * sizeof(TreeletInfo));
+
+    cache.slotBytes = 0;
+    for(size_t t = 0; t < cache.treelets.size(); t++)
+    {
+        const TreeletInfo& info = cache.treelets[t];
+        size_t bytes = info.numNodes * sizeof(BVHNode) + info.numParticles * sizeof(Vec3);
+        if(info.offset + bytes > cache.mappedSize)
+        {
+            closeTreeletFile(cache);
+            return false;
+        }
+        cache.slotBytes = std::max(cache.slotBytes, bytes);
+    }
+    cache.topLeaf.assign(h.numTreelets, 0);
+    for(size_t n = 0; n < cache.top.size(); n++)
+    {
+        if(cache.top[n].count > 0)
+            cache.topLeaf[cache.top[n].first] = (int)n;
+    }
+
+    cache.numSlots = (int)std::max<size_t>(1, std::min<size_t>(h.numTreelets, capBytes / std::max<size_t>(1, cache.slotBytes)));
+    cache.slotData.assign(cache.numSlots * cache.slotBytes, 0);
+    cache.slotTreelet.assign(cache.numSlots, -1);
+    cache.slotPins.assign(cache.numSlots, 0);
+    cache.slotLoading.assign(cache.numSlots, 0);
+    cache.lruPrev.assign(cache.numSlots, -1);
+    cache.lruNext.assign(cache.numSlots, -1);
+    cache.lruHead = cache.lruTail = -1;
+    cache.freeSlots.clear();
+    for(int s = cache.numSlots - 1; s >= 0; s--)
+        cache.freeSlots.push_back(s);
+    cache.residentSlot.assign(h.numTreelets, -1);
+    cache.stats = TreeletCacheStats();
+    return true;
+#else
+    (void)cache;
+    (void)path;
+    (void)capBytes;
+    fprintf(stderr, "Streaming particles is not supported on this platform\n");
+    return false;
+#endif
+}
+
+inline void unlinkSlot(TreeletCache& cache, int s)
+{
+    int prev = cache.lruPrev[s];
+    int next = cache.lruNext[s];
+    if(prev >= 0)
+        cache.lruNext[prev] = next;
+    else
+        cache.lruHead = next;
+    if(next >= 0)
+        cache.lruPrev[next] = prev;
+    else
+        cache.lruTail = prev;
+    cache.lruPrev[s] = cache.lruNext[s] = -1;
+}
+
+inline void linkSlotAtHead(TreeletCache& cache, int s)
+{
+    cache.lruPrev[s] = -1;
+    cache.lruNext[s] = cache.lruHead;
+    if(cache.lruHead >= 0)
+        cache.lruPrev[cache.lruHead] = s;
+    cache.lruHead = s;
+    if(cache.lruTail < 0)
+        cache.lruTail = s;
+}
+
+inline const BVHNode *slotNodes(const TreeletCache& cache, int s)
+{
+    return (const BVHNode *)&cache.slotData[s * cache.slotBytes];
+}
+
+inline const Vec3 *slotCenters(const TreeletCache& cache, int s)
+{
+    return (const Vec3 *)&cache.slotData[s * cache.slotBytes + cache.treelets[cache.slotTreelet[s]].numNodes * sizeof(BVHNode)];
+}
+
+// Pins treelet t and returns its slot. If it is not resident, returns -1 when onlyResident
+// is set, and otherwise takes a free slot or evicts the least recently used unpinned one and
+// copies the treelet in from the mapped file, waiting when every slot is pinned.
+inline int acquireTreelet(TreeletCache& cache, int t, bool onlyResident)
+{
+    std::unique_lock<std::mutex> lock(cache.mutex);
+    for(;;)
+    {
+        int s = cache.residentSlot[t];
+        if(s >= 0)
+        {
+            while(cache.slotLoading[s])
+                cache.slotChanged.wait(lock);
+            cache.slotPins[s]++;
+            cache.stats.hits++;
+            unlinkSlot(cache, s);
+            linkSlotAtHead(cache, s);
+            return s;
+        }
+        if(onlyResident)
+            return -1;
+
+        if(!cache.freeSlots.empty())
+        {
+            s = cache.freeSlots.back();
+            cache.freeSlots.pop_back();
+        }else
+        {
+            for(s = cache.lruTail; s >= 0 && cache.slotPins[s] > 0; s = cache.lruPrev[s])
+                ;
+            if(s < 0)
+            {
+                // Another thread may bring t in while this one waits
+                cache.stats.waits++;
+                cache.slotChanged.wait(lock);
+                continue;
+            }
+            cache.residentSlot[cache.slotTreelet[s]] = -1;
+            unlinkSlot(cache, s);
+            cache.stats.evictions++;
+        }
+
+        const TreeletInfo& info = cache.treelets[t];
+        size_t bytes = info.numNodes * sizeof(BVHNode) + info.numParticles * sizeof(Vec3);
+        cache.slotTreelet[s] = t;
+        cache.slotPins[s] = 1;
+        cache.slotLoading[s] = 1;
+        cache.residentSlot[t] = s;
+        linkSlotAtHead(cache, s);
+        cache.stats.misses++;
+        cache.stats.bytesRead += bytes;
+        cache.stats.peakSlots = std::max(cache.stats.peakSlots, cache.numSlots - (int)cache.freeSlots.size());
+
+        // Copy outside the lock, then let the mapping drop the pages so that they don't
+        // stay resident next to the copy
+        lock.unlock();
+        memcpy(&cache.slotData[s * cache.slotBytes], cache.mapped + info.offset, bytes);
+#ifndef _WIN32
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t begin = info.offset & ~(page - 1);
+        madvise((void *)(cache.mapped + begin), info.offset + bytes - begin, MADV_DONTNEED);
+#endif
+        lock.lock();
+        cache.slotLoading[s] = 0;
+        cache.slotChanged.notify_all();
+        return s;
+    }
+}
+
+inline void releaseTreelet(TreeletCache& cache, int s)
+{
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if(--cache.slotPins[s] == 0)
+        cache.slotChanged.notify_all();
+}
+
+// Closest particle hit of the treelet in slot s before tHit
+inline bool treeletIntersect(const TreeletCache& cache, int s, const Ray& r, const Vec3& invDir, bool anyHit,
+                             float& tHit, int& index, TraversalCost *cost)
+{
+    int local = -1;
+    if(!bvhTraverse(slotNodes(cache, s), NULL, slotCenters(cache, s), cache.header.radius, r, invDir,
+                    anyHit, tHit, local, cost))
+        return false;
+    index = (int)cache.treelets[cache.slotTreelet[s]].firstParticle + local;
+    return true;
+}
+
+// Closest particle hit before tMax, like bvhIntersect. Treelets that are not resident are
+// put off until the resident ones have been traversed, and skipped if a closer hit culls
+// them by then, so a ray only waits on the file for treelets it still needs.
+inline bool streamIntersect(TreeletCache& cache, const Ray& r, float tMax, bool anyHit, float& tHit, int& index,
+                            TraversalCost *cost = NULL)
+{
+    tHit = tMax;
+    index = -1;
+    if(cache.top.empty())
+        return false;
+
+    Vec3 invDir = safeInverse(r.direction);
+    int stack[BVH_MAX_DEPTH];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    int deferred[TREELET_DEFERRED];
+    int numDeferred = 0;
+    while(stackSize > 0)
+    {
+        int nodeIndex = stack[--stackSize];
+        const BVHNode& node = cache.top[nodeIndex];
+        if(cost)
+            cost->nodeVisits++;
+        float t0 = MIN_T;
+        float t1 = tHit;
+        if(!clipRayToBox(r, invDir, node.bmin, node.bmax, t0, t1))
+            continue;
+
+        if(node.count == 0)
+        {
+            stack[stackSize++] = node.first;
+            stack[stackSize++] = nodeIndex + 1;
+            continue;
+        }
+        int s = acquireTreelet(cache, node.first, numDeferred < TREELET_DEFERRED);
+        if(s < 0)
+        {
+            deferred[numDeferred++] = node.first;
+            continue;
+        }
+        bool hit = treeletIntersect(cache, s, r, invDir, anyHit, tHit, index, cost);
+        releaseTreelet(cache, s);
+        if(hit && anyHit)
+            return true;
+    }
+
+    for(int k = 0; k < numDeferred; k++)
+    {
+        const BVHNode& node = cache.top[cache.topLeaf[deferred[k]]];
+        float t0 = MIN_T;
+        float t1 = tHit;
+        if(!clipRayToBox(r, invDir, node.bmin, node.bmax, t0, t1))
+            continue;
+        int s = acquireTreelet(cache, deferred[k], false);
+        bool hit = treeletIntersect(cache, s, r, invDir, anyHit, tHit, index, cost);
+        releaseTreelet(cache, s);
+        if(hit && anyHit)
+            return true;
+    }
+    return index >= 0;
+}
+
+// A ray of a batch that reaches a treelet
+struct TreeletRay
+{
+    int treelet;
+    int ray;
+};
+
+inline bool treeletRayLess(const TreeletRay& a, const TreeletRay& b)
+{
+    return a.treelet < b.treelet || (a.treelet == b.treelet && a.ray < b.ray);
+}
+
+// Closest particle hits of a batch of rays. The top level tree is traversed for every ray
+// first, then each treelet reached is fetched once for all of its rays, the resident ones
+// before those that miss in the cache. tHit and index hold the bound of each ray on the
+// way in and its closest hit on the way out, index -1 for none. queue is scratch space.
+inline void streamIntersectBatch(TreeletCache& cache, const Ray *rays, int count, float *tHit, int *index,
+                                 std::vector<TreeletRay>& queue, TraversalCost *cost = NULL)
+{
+    queue.clear();
+    if(cache.top.empty())
+        return;
+    for(int i = 0; i < count; i++)
+    {
+        const Ray& r = rays[i];
+        Vec3 invDir = safeInverse(r.direction);
+        int stack[BVH_MAX_DEPTH];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while(stackSize > 0)
+        {
+            int nodeIndex = stack[--stackSize];
+            const BVHNode& node = cache.top[nodeIndex];
+            if(cost)
+                cost->nodeVisits++;
+            float t0 = MIN_T;
+            float t1 = tHit[i];
+            if(!clipRayToBox(r, invDir, node.bmin, node.bmax, t0, t1))
+                continue;
+            if(node.count > 0)
+            {
+                TreeletRay entry = { node.first, i };
+                queue.push_back(entry);
+            }else
+            {
+                stack[stackSize++] = node.first;
+                stack[stackSize++] = nodeIndex + 1;
+            }
+        }
+    }
+    std::sort(queue.begin(), queue.end(), treeletRayLess);
+
+    // Pass 0 takes the resident treelets, pass 1 loads the rest unless the hits found so far
+    // cull all of their rays. Groups that are done get treelet -1.
+    for(int pass = 0; pass < 2; pass++)
+    {
+        for(size_t begin = 0, end; begin < queue.size(); begin = end)
+        {
+            int t = queue[begin].treelet;
+            for(end = begin + 1; end < queue.size() && queue[end].treelet == queue[begin].treelet; end++)
+                ;
+            if(t < 0)
+                continue;
+            const BVHNode& bounds = cache.top[cache.topLeaf[t]];
+            bool needed = false;
+            for(size_t k = begin; k < end && !needed; k++)
+            {
+                const Ray& r = rays[queue[k].ray];
+                float t0 = MIN_T;
+                float t1 = tHit[queue[k].ray];
+                needed = clipRayToBox(r, safeInverse(r.direction), bounds.bmin, bounds.bmax, t0, t1);
+            }
+            int s = needed ? acquireTreelet(cache, t, pass == 0) : -1;
+            if(s < 0 && needed)
+                continue;
+            for(size_t k = begin; k < end; k++)
+            {
+                int i = queue[k].ray;
+                Vec3 invDir = safeInverse(rays[i].direction);
+                float t0 = MIN_T;
+                float t1 = tHit[i];
+                if(s >= 0 && clipRayToBox(rays[i], invDir, bounds.bmin, bounds.bmax, t0, t1))
+                    treeletIntersect(cache, s, rays[i], invDir, false, tHit[i], index[i], cost);
+                queue[k].treelet = -1;
+            }
+            if(s >= 0)
+                releaseTreelet(cache, s);
+        }
+    }
+}
+
+// Particle center of stream particle i, from the treelet holding it
+inline Vec3 streamParticleCenter(TreeletCache& cache, int i)
+{
+    int lo = 0;
+    int hi = (int)cache.treelets.size() - 1;
+    while(lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if((int)cache.treelets[mid].firstParticle <= i)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    int s = acquireTreelet(cache, lo, false);
+    Vec3 center = slotCenters(cache, s)[i - cache.treelets[lo].firstParticle];
+    releaseTreelet(cache, s);
+    return center;
+}
+
+inline void printTreeletCacheStats(const TreeletCache& cache)
+{
+    const TreeletCacheStats& s = cache.stats;
+    long long lookups = s.hits + s.misses;
+    printf("treelet cache: %lld hits, %lld misses (%.2f%%), %lld evictions, %lld waits, %.1f MB read, "
+           "%d of %d slots used (%.1f MB cap)\n",
+           s.hits, s.misses, lookups > 0 ? 100.0 * s.misses / lookups : 0.0, s.evictions, s.waits,
+           s.bytesRead / (1024.0 * 1024.0), s.peakSlots, cache.numSlots,
+           cache.numSlots * cache.slotBytes / (1024.0 * 1024.0));
+}
+
+#endif
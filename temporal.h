@@ -0,0 +1,151 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+#include "image.h"
+#include "ray.h"
+#include "scene.h"
+
+// Reuse of the pixels of earlier animation frames. The camera never moves, so a pixel
+// traces the same ray tree frame after frame until a moving object enters or leaves one
+// of its rays. While a pixel is traced, every ray of its tree, shadow rays included, is
+// tested against the moving spheres where they are in that frame and in each of the next
+// TEMPORAL_LOOKAHEAD frames. A tree that passes none of them where they were when it was
+// traced, nor where they are in a later frame, is the tree of that later frame as well,
+// so the pixel is copied out of the history there instead of being traced again. Only
+// the pixels whose rays the spheres cross get traced, and the reused ones are exact.
+// Tracing the pixels is renderTemporal in tracer.h.
+
+static const int TEMPORAL_LOOKAHEAD = 31;       // Later frames a traced pixel is tested for
+static const float TEMPORAL_MARGIN = 1e-3f;     // Relative growth of the spheres, to stay clear of rounding
+static const float TEMPORAL_ROUNDING = 2e-3f;   // Further growth per unit of distance from the ray origin
+
+// The moving spheres of the frames a pixel traced in frame may be reused in. A sphere
+// moves if it is anywhere else in one of those frames than in frame.
+struct MotionBounds
+{
+    int frame;
+    std::vector<Vec3> centers;   // A moving sphere at a frame offset
+    std::vector<float> radii;
+    std::vector<int> offsets;    // Frames after frame, 0 to TEMPORAL_LOOKAHEAD
+    Vec3 boundCenter;            // Sphere around all of them, tested first
+    float boundRadius;
+    std::vector<Sphere> posed;   // Scratch, the spheres posed at every offset in turn
+    std::vector<Sphere> pose;
+
+    MotionBounds() : frame(0), boundRadius(0.0f) {}
+};
+
+struct TemporalHistory
+{
+    Image radiance;              // Every pixel as last traced, before denoising
+    GBuffer gbuffer;             // Their primary hits, when the frames are denoised
+    std::vector<uint32_t> motion;    // Bit k set if a ray of the pixel's tree passed a moving sphere k frames after it was traced
+    std::vector<int> frame;      // Frame the pixel was traced in
+    bool valid;                  // Whether the pixels hold a frame at all
+
+    TemporalHistory() : valid(false) {}
+};
+
+// Whether the part of r up to tMax comes within radius of c. Far from the origin the
+// quadratic of sphereHitT loses the radius against the distance squared and reports hits
+// well outside the sphere, so the radius grows with the distance.
+inline bool segmentNearSphere(const Vec3& c, float radius, const Ray& r, float tMax)
+{
+    Vec3 oc = c - r.origin;
+    float t = std::max(0.0f, std::min(dot(oc, r.direction) / dot(r.direction, r.direction), tMax));
+    float reach = radius + TEMPORAL_ROUNDING * (norm(oc) + radius);
+    return norm2(oc - r.direction * t) <= reach * reach;
+}
+
+// Poses spheres, as built, at frame and the frames after it for bounds
+inline void updateMotionBounds(MotionBounds& bounds, const std::vector<Sphere>& spheres, int frame)
+{
+    size_t n = spheres.size();
+    bounds.frame = frame;
+    bounds.centers.clear();
+    bounds.radii.clear();
+    bounds.offsets.clear();
+    bounds.posed.resize(n * (TEMPORAL_LOOKAHEAD + 1));
+    for(int k = 0; k <= TEMPORAL_LOOKAHEAD; k++)
+    {
+        bounds.pose = spheres;
+        animateSpheres(bounds.pose, frame + k);
+        std::copy(bounds.pose.begin(), bounds.pose.end(), bounds.posed.begin() + k * n);
+    }
+
+    Vec3 lo(1e30f), hi(-1e30f);
+    for(size_t i = 0; i < n; i++)
+    {
+        const Sphere& s0 = bounds.posed[i];
+        bool moves = false;
+        for(int k = 1; k <= TEMPORAL_LOOKAHEAD && !moves; k++)
+        {
+            const Sphere& s = bounds.posed[k * n + i];
+            moves = norm2(s.center - s0.center) != 0.0f || s.radius != s0.radius;
+        }
+        if(!moves)
+            continue;
+        for(int k = 0; k <= TEMPORAL_LOOKAHEAD; k++)
+        {
+            const Sphere& s = bounds.posed[k * n + i];
+            float radius = s.radius * (1.0f + TEMPORAL_MARGIN) + TEMPORAL_MARGIN;
+            bounds.centers.push_back(s.center);
+            bounds.radii.push_back(radius);
+            bounds.offsets.push_back(k);
+            for(int j = 0; j < 3; j++)
+            {
+                lo[j] = std::min(lo[j], s.center[j] - radius);
+                hi[j] = std::max(hi[j], s.center[j] + radius);
+            }
+        }
+    }
+    bounds.boundCenter = (lo + hi) * 0.5f;
+    bounds.boundRadius = bounds.centers.empty() ? 0.0f : norm(hi - lo) * 0.5f;
+}
+
+// Bit k set for each frame offset k at which a moving sphere comes near the part of r up
+// to tMax
+inline uint32_t motionMask(const MotionBounds& bounds, const Ray& r, float tMax)
+{
+    if(bounds.centers.empty() || !segmentNearSphere(bounds.boundCenter, bounds.boundRadius, r, tMax))
+        return 0;
+    uint32_t mask = 0;
+    for(size_t i = 0; i < bounds.centers.size(); i++)
+    {
+        uint32_t bit = 1u << bounds.offsets[i];
+        if(!(mask & bit) && segmentNearSphere(bounds.centers[i], bounds.radii[i], r, tMax))
+            mask |= bit;
+    }
+    return mask;
+}
+
+// Sizes the history for width x height frames and forgets what it held
+inline void resetTemporalHistory(TemporalHistory& history, int width, int height, bool gbuffer)
+{
+    if(history.radiance.width != width || history.radiance.height != height)
+    {
+        history.radiance = Image(width, height);
+        history.motion.assign(width * height, 0);
+        history.frame.assign(width * height, 0);
+    }
+    if(gbuffer && (history.gbuffer.width != width || history.gbuffer.height != height))
+        history.gbuffer = GBuffer(width, height);
+    history.valid = false;
+}
+
+// Whether pixel p of the history is what frame would trace: its rays missed the moving
+// spheres both in the frame it was traced in and in this one
+inline bool temporalPixelCurrent(const TemporalHistory& history, int p, int frame)
+{
+    if(!history.valid)
+        return false;
+    int age = frame - history.frame[p];
+    uint32_t motion = history.motion[p];
+    return age > 0 && age <= TEMPORAL_LOOKAHEAD && !(motion & 1u) && !(motion & (1u << age));
+}
+
+#endif
@@ -0,0 +1,302 @@
+// Checks of the invariants the CPU tracer promises, without OpenGL. Build and run with
+//   g++ -std=c++11 -O2 tests.cpp -o tests -lpthread && ./tests
+// which prints every failed check and exits with an error if there was one.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "framecache.h"
+#include "scene.h"
+#include "shaders.h"
+#include "temporal.h"
+#include "tracer.h"
+
+static int g_failures = 0;
+
+#define CHECK(cond, ...) \
+    do { \
+        if(!(cond)) \
+        { \
+            printf("  %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            g_failures++; \
+        } \
+    } while(0)
+
+// Uniform in [0, 1), the same sequence on every run
+inline float testRandom(uint32_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+// Half the rays through the image, the other half from inside the particle cloud in
+// random directions
+inline Ray testRay(int i, uint32_t& state)
+{
+    if(i % 2 == 0)
+        return primaryRay(testRandom(state), testRandom(state));
+    Ray r;
+    r.origin = Vec3(testRandom(state) * 2.0f - 1.0f, testRandom(state) * 2.0f - 1.0f, testRandom(state) * 2.0f - 2.0f);
+    r.direction = Vec3(testRandom(state) - 0.5f, testRandom(state) - 0.5f, testRandom(state) - 0.5f);
+    return r;
+}
+
+// The grid and the BVH, plain and compact, find the closest hit and the shadow hits that
+// testing every particle finds
+void testTraversal()
+{
+    const int numRays = 20000;
+    Scene scene = makeParticleScene(4000, 0.03f, ACCEL_NONE);
+    Scene compact = scene;
+    compactScene(compact);
+    const Scene *bases[] = { &scene, &scene, &compact };
+    const int accels[] = { ACCEL_GRID, ACCEL_BVH, ACCEL_BVH };
+    const char *names[] = { "grid", "bvh", "compact bvh" };
+    for(int a = 0; a < 3; a++)
+    {
+        Tracer reference;
+        initTracer(reference, *bases[a], 1);
+        Scene accelScene = *bases[a];
+        accelScene.accel = accels[a];
+        Tracer tracer;
+        initTracer(tracer, accelScene, 1);
+
+        uint32_t state = 12345;
+        int particleHits = 0, misses = 0, shadowMisses = 0;
+        for(int i = 0; i < numRays; i++)
+        {
+            Ray r = testRay(i, state);
+            Hit expected = intersectTest(reference, r);
+            Hit hit = intersectTest(tracer, r);
+            if(expected.prim >= particlePrimitive(scene, 0))
+                particleHits++;
+            if(hit.t != expected.t || hit.prim != expected.prim)
+                misses++;
+            const Vec3& light = scene.lights[i % scene.lights.size()].position;
+            if(shadowIntersectTest(tracer, r, light) != shadowIntersectTest(reference, r, light))
+                shadowMisses++;
+        }
+        CHECK(particleHits >= numRays / 10, "%s: only %d of %d rays hit a particle", names[a], particleHits, numRays);
+        CHECK(misses == 0, "%s: %d of %d closest hits differ from testing every particle", names[a], misses, numRays);
+        CHECK(shadowMisses == 0, "%s: %d of %d shadow rays differ from testing every particle", names[a], shadowMisses, numRays);
+    }
+}
+
+// Renders scene at a quarter of the resolution on one thread
+inline Image testRender(const Scene& scene)
+{
+    Tracer tracer;
+    initTracer(tracer, scene, 1);
+    Image img(IMAGE_WIDTH / 4, IMAGE_HEIGHT / 4);
+    renderImage(tracer, img, 1);
+    return img;
+}
+
+// Scenes shipped to the workers come back as they were sent: every byte of the encoding,
+// and the image they render
+void testSceneRoundTrip()
+{
+    Scene sampled = makeDefaultScene();
+    sampled.samplesPerPixel = 4;
+    sampled.sampler = SAMPLER_BLUE_NOISE;
+    sampled.lensRadius = 0.05f;
+    sampled.focusDistance = 1.5f;
+    sampled.lightSampling = true;
+    sampled.maxBounce = 3;
+    sampled.rouletteDepth = 1;
+    Scene particles = makeParticleScene(2000, 0.03f, ACCEL_GRID);
+    Scene compact = makeParticleScene(2000, 0.03f, ACCEL_BVH);
+    compactScene(compact);
+    const Scene *scenes[] = { &sampled, &particles, &compact };
+    const char *names[] = { "default", "particles", "compact" };
+    for(int i = 0; i < 3; i++)
+    {
+        ByteWriter w;
+        writeScene(w, *scenes[i]);
+        ByteReader r(&w.data[0], w.data.size());
+        Scene read;
+        bool ok = readScene(r, read);
+        CHECK(ok && r.p == r.end, "%s: the scene does not read back to the end of its encoding", names[i]);
+        ByteWriter again;
+        writeScene(again, read);
+        CHECK(again.data == w.data, "%s: the scene read back encodes differently", names[i]);
+        CHECK(testRender(read).data == testRender(*scenes[i]).data, "%s: the scene read back renders differently", names[i]);
+
+        ByteReader truncated(&w.data[0], w.data.size() - 1);
+        CHECK(!readScene(truncated, read), "%s: a truncated scene reads back", names[i]);
+    }
+}
+
+typedef void (*SceneChange)(Scene&);
+typedef void (*SettingsChange)(FrameCacheSettings&);
+
+// Every scene field and setting the renderer applies changes the key of a frame, and the
+// settings it ignores leave the key alone
+void testFrameCacheKey()
+{
+    Scene scene = makeParticleScene(500, 0.03f, ACCEL_GRID);
+    FrameCacheSettings settings;
+    settings.width = IMAGE_WIDTH;
+    settings.height = IMAGE_HEIGHT;
+    settings.shaderSource = tracerSrc;
+    settings.hybrid = false;
+    settings.tileLists = false;
+    settings.bounceFactor = 1;
+    settings.bounceMaterials = BOUNCE_DEFAULT_MATERIALS;
+    settings.irradianceError = 0.0f;
+    settings.shadowMapSize = 0;
+    settings.heatmap = -1;
+    settings.heatmapScale = 1.0f;
+    uint64_t key = frameCacheKey(scene, settings);
+    Scene copy = scene;
+    CHECK(frameCacheKey(copy, settings) == key, "the key of a copied scene differs");
+
+    struct
+    {
+        const char *name;
+        SceneChange change;
+    } const sceneChanges[] = {
+        { "maxBounce", [](Scene& s) { s.maxBounce++; } },
+        { "throughputCutoff", [](Scene& s) { s.throughputCutoff *= 2.0f; } },
+        { "rouletteDepth", [](Scene& s) { s.rouletteDepth++; } },
+        { "light position", [](Scene& s) { s.lights[0].position[0] += 0.1f; } },
+        { "light color", [](Scene& s) { s.lights[0].color[1] *= 0.5f; } },
+        { "light intensity", [](Scene& s) { s.lights[0].intensity *= 2.0f; } },
+        { "light count", [](Scene& s) { s.lights.pop_back(); } },
+        { "sphere center", [](Scene& s) { s.spheres[0].center[2] += 0.1f; } },
+        { "sphere radius", [](Scene& s) { s.spheres[0].radius *= 1.1f; } },
+        { "sphere material", [](Scene& s) { s.spheres[0].mat.ks += 0.1f; } },
+        { "sphere dynamic", [](Scene& s) { s.spheres[0].dynamic = !s.spheres[0].dynamic; } },
+        { "plane normal", [](Scene& s) { s.planes[0].normal[0] += 0.1f; } },
+        { "plane checkered", [](Scene& s) { s.planes[0].checkered = !s.planes[0].checkered; } },
+        { "particle", [](Scene& s) { s.particles[0][1] += 0.01f; } },
+        { "particle count", [](Scene& s) { s.particles.pop_back(); } },
+        { "particleRadius", [](Scene& s) { s.particleRadius *= 1.1f; } },
+        { "particle material", [](Scene& s) { s.particleMat.matType = (s.particleMat.matType + 1) % 3; } },
+        { "accel", [](Scene& s) { s.accel = ACCEL_BVH; } },
+        { "samplesPerPixel", [](Scene& s) { s.samplesPerPixel++; } },
+        { "sampler", [](Scene& s) { s.sampler = SAMPLER_BLUE_NOISE; } },
+        { "lensRadius", [](Scene& s) { s.lensRadius += 0.05f; } },
+        { "focusDistance", [](Scene& s) { s.focusDistance += 0.5f; } },
+        { "lightSampling", [](Scene& s) { s.lightSampling = !s.lightSampling; } },
+        { "adaptiveThreshold", [](Scene& s) { s.adaptiveThreshold += 0.05f; } },
+        { "maxSamples", [](Scene& s) { s.maxSamples++; } },
+        { "compact", [](Scene& s) { s.accel = ACCEL_BVH; compactScene(s); } },
+        { "animation frame", [](Scene& s) { animateScene(s, 3); } },
+    };
+    for(size_t i = 0; i < sizeof(sceneChanges) / sizeof(sceneChanges[0]); i++)
+    {
+        Scene changed = scene;
+        sceneChanges[i].change(changed);
+        CHECK(frameCacheKey(changed, settings) != key, "changing the %s keeps the key", sceneChanges[i].name);
+    }
+
+    struct
+    {
+        const char *name;
+        SettingsChange change;
+        bool applied;
+    } const settingsChanges[] = {
+        { "width", [](FrameCacheSettings& s) { s.width /= 2; }, true },
+        { "height", [](FrameCacheSettings& s) { s.height /= 2; }, true },
+        { "shaderSource", [](FrameCacheSettings& s) { s.shaderSource = basicVertSrc; }, true },
+        { "hybrid", [](FrameCacheSettings& s) { s.hybrid = true; }, true },
+        { "tileLists", [](FrameCacheSettings& s) { s.tileLists = true; }, true },
+        { "bounceFactor", [](FrameCacheSettings& s) { s.bounceFactor = 2; }, true },
+        { "bounceMaterials", [](FrameCacheSettings& s) { s.bounceFactor = 2; s.bounceMaterials ^= 1; }, true },
+        { "irradianceError", [](FrameCacheSettings& s) { s.irradianceError = 0.3f; }, true },
+        { "shadowMapSize", [](FrameCacheSettings& s) { s.shadowMapSize = 512; }, true },
+        { "heatmap", [](FrameCacheSettings& s) { s.heatmap = 0; }, true },
+        { "heatmapScale", [](FrameCacheSettings& s) { s.heatmap = 0; s.heatmapScale = 2.0f; }, true },
+        { "bounceMaterials at full resolution", [](FrameCacheSettings& s) { s.bounceMaterials ^= 1; }, false },
+        { "heatmapScale without a heatmap", [](FrameCacheSettings& s) { s.heatmapScale = 2.0f; }, false },
+    };
+    for(size_t i = 0; i < sizeof(settingsChanges) / sizeof(settingsChanges[0]); i++)
+    {
+        FrameCacheSettings changed = settings;
+        settingsChanges[i].change(changed);
+        // The heatmap and bounce settings that only apply together are compared
+        // against the key with the first of the pair changed alone
+        FrameCacheSettings base = settings;
+        if(changed.bounceFactor != base.bounceFactor && changed.bounceMaterials != base.bounceMaterials)
+            base.bounceFactor = changed.bounceFactor;
+        if(changed.heatmap != base.heatmap && changed.heatmapScale != base.heatmapScale)
+            base.heatmap = changed.heatmap;
+        bool keyChanged = frameCacheKey(scene, changed) != frameCacheKey(scene, base);
+        if(settingsChanges[i].applied)
+            CHECK(keyChanged, "changing the %s keeps the key", settingsChanges[i].name);
+        else
+            CHECK(!keyChanged, "changing the %s, which the renderer ignores, changes the key", settingsChanges[i].name);
+    }
+}
+
+// Frames reusing the pixels of the frames before are the frames traced in full, pixel for
+// pixel and with their G-buffers, across a run of frames and a jump past the lookahead
+void testTemporal()
+{
+    const int frames[] = { 0, 1, 2, 3, 4, 6, 9, 10, 11, 11 + TEMPORAL_LOOKAHEAD + 1, 11 + TEMPORAL_LOOKAHEAD + 2 };
+    const int width = IMAGE_WIDTH / 4, height = IMAGE_HEIGHT / 4;
+    Scene bounced = makeDefaultScene();
+    bounced.maxBounce = 3;
+    Scene particles = makeParticleScene(2000, 0.03f, ACCEL_GRID);
+    const Scene *scenes[] = { &bounced, &particles };
+    const char *names[] = { "default", "particles" };
+    for(int i = 0; i < 2; i++)
+    {
+        Scene frameScene = *scenes[i];
+        Tracer tracer;
+        initTracer(tracer, frameScene, 1);
+        TemporalHistory history;
+        MotionBounds motion;
+        long long reused = 0;
+        for(size_t f = 0; f < sizeof(frames) / sizeof(frames[0]); f++)
+        {
+            frameScene.spheres = scenes[i]->spheres;
+            animateScene(frameScene, frames[f]);
+
+            Image expected(width, height);
+            GBuffer expectedGBuffer(width, height);
+            tracer.motion = NULL;
+            renderImage(tracer, expected, 1, &expectedGBuffer);
+
+            Image img(width, height);
+            TraceStats stats;
+            tracer.motion = &motion;
+            updateMotionBounds(motion, scenes[i]->spheres, frames[f]);
+            renderTemporal(tracer, history, frames[f], img, 1, true, &stats);
+            reused += stats.pixelsReused;
+
+            CHECK(img.data == expected.data, "%s: frame %d differs from the frame traced in full", names[i], frames[f]);
+            CHECK(history.gbuffer.depth == expectedGBuffer.depth && history.gbuffer.normal[0] == expectedGBuffer.normal[0] &&
+                  history.gbuffer.albedo[0] == expectedGBuffer.albedo[0],
+                  "%s: the G-buffer of frame %d differs from the frame traced in full", names[i], frames[f]);
+        }
+        CHECK(reused > 0, "%s: no pixel was reused", names[i]);
+    }
+}
+
+int main()
+{
+    struct Test
+    {
+        const char *name;
+        void (*run)();
+    };
+    const Test tests[] = {
+        { "traversal", testTraversal },
+        { "scene round trip", testSceneRoundTrip },
+        { "frame cache key", testFrameCacheKey },
+        { "temporal", testTemporal },
+    };
+    for(size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        int failures = g_failures;
+        tests[i].run();
+        printf("%-18s %s\n", tests[i].name, g_failures == failures ? "ok" : "FAILED");
+    }
+    return g_failures == 0 ? 0 : 1;
+}
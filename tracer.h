@@ -0,0 +1,1366 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "alloc.h"
+#include "bvh.h"
+#include "compact.h"
+#include "grid.h"
+#include "image.h"
+#include "irradiance.h"
+#include "ray.h"
+#include "sampler.h"
+#include "scene.h"
+#include "scheduler.h"
+#include "shadowmap.h"
+#include "stream.h"
+#include "temporal.h"
+
+// CPU port of basicFragSrc. Function names follow the shader so the two can be read side by side.
+
+static const int IMAGE_WIDTH = 1280;
+static const int IMAGE_HEIGHT = 960;
+static const Vec3 BACKGROUND_COLOR(0.1f, 0.1f, 0.2f);
+
+// Closest hit of a ray. Only what is needed to tell hits apart is kept while
+// intersecting, the normal and material are looked up once the hit gets shaded.
+struct Hit
+{
+    float t;
+    int prim;                // Primitive ID, see scene.h, -1 for a miss
+    float u, v;              // World x and z of plane hits, for the checker pattern
+};
+
+static_assert(sizeof(Hit) == 16, "Hit should stay at 16 bytes");
+
+// The primary hit of every pixel of a frame, see rasterizePrimaryHits. Sized once per
+// render slot and overwritten each frame.
+struct HitBuffer
+{
+    int width;
+    int height;
+    std::vector<Hit> data;
+
+    HitBuffer() : width(0), height(0) {}
+    HitBuffer(int w, int h) : width(w), height(h), data(w * h) {}
+
+    Hit& at(int x, int y)
+    {
+        return data[y * width + x];
+    }
+
+    const Hit& at(int x, int y) const
+    {
+        return data[y * width + x];
+    }
+};
+
+// A hit expanded for shading by surfaceAt
+struct ShadeRec
+{
+    Vec3 normal;
+    float t;
+    Material mat;
+};
+
+static const int MAX_STATS_BOUNCES = 32;
+static const int RAY_STACK_SIZE = 8;
+
+// Per bounce counts of secondary rays in the ray trees, plus how deep the ray stack got
+struct TraceStats
+{
+    long long traced[MAX_STATS_BOUNCES];
+    long long culled[MAX_STATS_BOUNCES];     // Weight below Scene::throughputCutoff
+    long long roulette[MAX_STATS_BOUNCES];   // Killed by Russian roulette
+    long long peakStack[RAY_STACK_SIZE + 1]; // Number of pixels by deepest ray stack
+    long long overflow;                      // Rays dropped because the stack was full
+    long long allocations;                   // Heap allocations made inside the trace loops
+    long long intersections;                 // Ray-primitive tests, the cost metrics of CostBuffer
+    long long shadowRays;
+    long long nodeVisits;                    // Grid cells or BVH nodes
+    long long irradianceLookups;             // Primary hits shaded from the irradiance cache
+    long long irradianceMisses;              // Of those, the ones no record covered, gathered on the spot
+    long long pixelsReused;                  // Copied from an earlier frame by renderTemporal
+    uint32_t motionMask;                     // Of the pixel being traced, see Tracer::motion
+    ScheduleStats schedule;                  // Of the CPU tile scheduler
+
+    TraceStats()
+    {
+        for(int i = 0; i < MAX_STATS_BOUNCES; i++)
+            traced[i] = culled[i] = roulette[i] = 0;
+        for(int i = 0; i <= RAY_STACK_SIZE; i++)
+            peakStack[i] = 0;
+        overflow = 0;
+        allocations = 0;
+        intersections = shadowRays = nodeVisits = 0;
+        irradianceLookups = irradianceMisses = 0;
+        pixelsReused = 0;
+        motionMask = 0;
+    }
+
+    void add(const TraceStats& other)
+    {
+        for(int i = 0; i < MAX_STATS_BOUNCES; i++)
+        {
+            traced[i] += other.traced[i];
+            culled[i] += other.culled[i];
+            roulette[i] += other.roulette[i];
+        }
+        for(int i = 0; i <= RAY_STACK_SIZE; i++)
+            peakStack[i] += other.peakStack[i];
+        overflow += other.overflow;
+        allocations += other.allocations;
+        intersections += other.intersections;
+        shadowRays += other.shadowRays;
+        nodeVisits += other.nodeVisits;
+        irradianceLookups += other.irradianceLookups;
+        irradianceMisses += other.irradianceMisses;
+        pixelsReused += other.pixelsReused;
+        schedule.add(other.schedule);
+    }
+
+    long long totalTraced() const
+    {
+        long long n = 0;
+        for(int i = 0; i < MAX_STATS_BOUNCES; i++)
+            n += traced[i];
+        return n;
+    }
+};
+
+inline void printTraceStats(const TraceStats& stats, int maxBounce)
+{
+    long long skipped = 0;
+    printf("bounce      traced      culled    roulette\n");
+    for(int i = 0; i < maxBounce && i < MAX_STATS_BOUNCES; i++)
+    {
+        printf("%6d %11lld %11lld %11lld\n", i + 1, stats.traced[i], stats.culled[i], stats.roulette[i]);
+        skipped += stats.culled[i] + stats.roulette[i];
+    }
+    printf("rays saved: at least %lld, stack overflows: %lld, heap allocations while tracing: %lld\n",
+           skipped, stats.overflow, stats.allocations);
+    printf("intersection tests: %lld, shadow rays: %lld, node visits: %lld\n",
+           stats.intersections, stats.shadowRays, stats.nodeVisits);
+    printf("peak stack depth:");
+    for(int i = 0; i <= RAY_STACK_SIZE; i++)
+        printf(" %d:%lld", i, stats.peakStack[i]);
+    printf("\n");
+    if(stats.irradianceLookups > 0)
+        printf("irradiance lookups: %lld, gathered on the spot: %lld (%.2f%%)\n", stats.irradianceLookups,
+               stats.irradianceMisses, 100.0 * stats.irradianceMisses / stats.irradianceLookups);
+    const ScheduleStats& s = stats.schedule;
+    if(s.tiles > 0)
+        printf("tiles: %lld, steals: %lld, failed steals: %lld, idle: %.2f ms of %.2f ms (%.1f%%)\n",
+               s.tiles, s.steals, s.failedSteals, s.idleMs, s.busyMs + s.idleMs,
+               100.0 * s.idleMs / std::max(1e-9, s.busyMs + s.idleMs));
+}
+
+// Repeatable random number in [0, 1) for a pixel and an index
+inline float pixelRandom(int x, int y, int index)
+{
+    return hashInt(hashInt((uint32_t)(x + IMAGE_WIDTH * y)) + (uint32_t)index) * (1.0f / 4294967296.0f);
+}
+
+// Spheres and particles that may be seen through each tile of the screen, by primitive
+// ID in intersectTest order. Laid out like UniformGrid, see buildScreenTiles in raster.h.
+static const int SCREEN_TILE_SIZE = 16;
+
+struct ScreenTiles
+{
+    int tileSize;
+    int tilesX;
+    int tilesY;
+    std::vector<int> tileStart;          // tilesX * tilesY + 1 offsets into prims
+    std::vector<int> prims;
+    std::vector<int> counts;             // Build scratch, kept so rebuilds don't allocate
+
+    ScreenTiles() : tileSize(0), tilesX(0), tilesY(0) {}
+};
+
+// Light over the reflection and refraction rays, traced at 1 / factor of the resolution
+// for the material types in materialMask and upsampled by upsampleBounce. The primary
+// hit of each sample is kept for the edge-stopping weights.
+struct BounceBuffer
+{
+    int factor;
+    int width;
+    int height;
+    int materialMask;        // Bit 1 << matType for each type traced at low resolution
+    std::vector<Vec3> light;
+    std::vector<Vec3> normal;
+    std::vector<float> depth;
+    std::vector<int> matType;                // -1 where the light wasn't traced
+
+    BounceBuffer() : factor(1), width(0), height(0), materialMask(0) {}
+    BounceBuffer(int fullWidth, int fullHeight, int f, int mask)
+        : factor(f), width((fullWidth + f - 1) / f), height((fullHeight + f - 1) / f), materialMask(mask),
+          light(width * height), normal(width * height), depth(width * height), matType(width * height) {}
+};
+
+// Reflective and transmissive bounces, opaque materials have none
+static const int BOUNCE_DEFAULT_MATERIALS = (1 << 1) | (1 << 2);
+static const float BOUNCE_SIGMA_NORMAL = 0.3f;
+static const float BOUNCE_SIGMA_DEPTH = 0.05f;
+static const float BOUNCE_MIN_WEIGHT = 1e-4f;
+
+// A scene together with the acceleration structure built for its particles
+struct Tracer
+{
+    const Scene *scene;
+    UniformGrid grid;
+    BVH bvh;
+    CompactBVH compactBVH;               // Replaces bvh in compact scenes
+    std::vector<Material> materials;     // Indexed by materialIndex
+    std::vector<PackedMaterial> packedMaterials; // Replaces materials in compact scenes
+    const HitBuffer *primaryHits;        // Rasterized primary visibility, NULL to trace the primary rays
+    const ScreenTiles *screenTiles;      // Per tile object lists for primary rays, NULL to test everything
+    const BounceBuffer *bounces;         // Low resolution bounce light, NULL to trace it for every pixel
+    TilePool *pool;                      // Workers of the CPU renders, NULL to start numThreads per call
+    TreeletCache *treelets;              // Particles of ACCEL_STREAM, which leaves Scene::particles empty
+    const IrradianceCache *irradiance;   // Diffuse interreflection at primary hits, NULL for the flat ambient term
+    const ShadowMaps *shadows;           // Shadows of the static objects, NULL to trace every shadow ray in full
+    const MotionBounds *motion;          // Moving spheres the rays are tested against into TraceStats::motionMask, NULL for none
+};
+
+// Builds the acceleration structures on pool if given, which becomes tracer.pool
+inline void initTracer(Tracer& tracer, const Scene& scene, int numThreads, TilePool *pool = NULL)
+{
+    tracer.scene = &scene;
+    tracer.primaryHits = NULL;
+    tracer.screenTiles = NULL;
+    tracer.bounces = NULL;
+    tracer.pool = pool;
+    tracer.treelets = NULL;
+    tracer.irradiance = NULL;
+    tracer.shadows = NULL;
+    tracer.motion = NULL;
+    tracer.grid = UniformGrid();
+    tracer.bvh = BVH();
+    tracer.compactBVH = CompactBVH();
+    buildMaterialTable(scene, tracer.materials);
+    if(scene.compact)
+    {
+        packMaterialTable(tracer.materials, tracer.packedMaterials);
+        tracer.materials.clear();
+    }
+    if(scene.sampler == SAMPLER_BLUE_NOISE)
+        blueNoiseTile();
+    if(scene.accel == ACCEL_GRID)
+        buildGrid(tracer.grid, scene.particles, scene.particleRadius, numThreads, pool);
+    else if(scene.accel == ACCEL_BVH)
+    {
+        buildBVH(tracer.bvh, scene.particles, scene.particleRadius);
+        if(scene.compact)
+        {
+            buildCompactBVH(tracer.compactBVH, tracer.bvh, scene);
+            tracer.bvh = BVH();
+        }
+    }
+}
+
+inline Hit planeIntersect(const Plane& p, int prim, const Ray& r)
+{
+    Hit ret;
+    float t = dot(p.point - r.origin, p.normal) / dot(r.direction, p.normal);
+    if(t > MIN_T)
+    {
+        Vec3 hitPoint = r.origin + r.direction * t;
+        ret.t = t;
+        ret.prim = prim;
+        ret.u = hitPoint[0];
+        ret.v = hitPoint[2];
+    }else
+        ret.t = MAX_DEPTH;
+
+    return ret;
+}
+
+inline Hit sphereIntersect(const Vec3& center, float radius, int prim, const Ray& r)
+{
+    Hit ret;
+    ret.t = sphereHitT(center, radius, r);
+    ret.prim = prim;
+    ret.u = ret.v = 0.0f;
+    return ret;
+}
+
+// Closest particle hit before tMax, through the scene's acceleration structure
+inline bool particleIntersect(const Tracer& tracer, const Ray& r, float tMax, bool anyHit, float& tHit, int& index,
+                              TraceStats *stats = NULL)
+{
+    const Scene& scene = *tracer.scene;
+    if(scene.particles.empty() && !tracer.treelets)
+        return false;
+
+    if(scene.accel == ACCEL_GRID || scene.accel == ACCEL_BVH || tracer.treelets)
+    {
+        TraversalCost cost;
+        TraversalCost *costPtr = stats ? &cost : NULL;
+        bool hit = tracer.treelets ? streamIntersect(*tracer.treelets, r, tMax, anyHit, tHit, index, costPtr)
+                 : scene.accel == ACCEL_GRID
+                 ? gridIntersect(tracer.grid, scene.particles, scene.particleRadius, r, tMax, anyHit, tHit, index, costPtr)
+                 : scene.compact
+                 ? compactBVHIntersect(tracer.compactBVH, scene.particleRadius, r, tMax, anyHit, tHit, index, costPtr)
+                 : bvhIntersect(tracer.bvh, scene.particles, scene.particleRadius, r, tMax, anyHit, tHit, index, costPtr);
+        if(stats)
+        {
+            stats->nodeVisits += cost.nodeVisits;
+            stats->intersections += cost.primitiveTests;
+        }
+        return hit;
+    }
+
+    tHit = tMax;
+    index = -1;
+    for(size_t i = 0; i < scene.particles.size(); i++)
+    {
+        if(stats)
+            stats->intersections++;
+        float t = sphereHitT(scene.particles[i], scene.particleRadius, r);
+        if(t < tHit)
+        {
+            tHit = t;
+            index = (int)i;
+            if(anyHit)
+                return true;
+        }
+    }
+    return index >= 0;
+}
+
+// Closest hit among the planes and spheres
+inline Hit objectIntersect(const Tracer& tracer, const Ray& r, TraceStats *stats = NULL)
+{
+    const Scene& scene = *tracer.scene;
+    Hit ret;
+    ret.t = MAX_DEPTH;
+    ret.prim = -1;
+    ret.u = ret.v = 0.0f;
+    if(stats)
+        stats->intersections += scene.planes.size() + scene.spheres.size();
+
+    for(size_t i = 0; i < scene.planes.size(); i++)
+    {
+        Hit tmp = planeIntersect(scene.planes[i], (int)i, r);
+        if(tmp.t < ret.t)
+            ret = tmp;
+    }
+
+    for(size_t i = 0; i < scene.spheres.size(); i++)
+    {
+        const Sphere& s = scene.spheres[i];
+        Hit tmp = sphereIntersect(s.center, s.radius, spherePrimitive(scene, (int)i), r);
+        if(tmp.t < ret.t)
+            ret = tmp;
+    }
+    return ret;
+}
+
+// Closest hit in the scene. stats, if given, counts the intersection tests.
+inline Hit intersectTest(const Tracer& tracer, const Ray& r, TraceStats *stats = NULL)
+{
+    const Scene& scene = *tracer.scene;
+    Hit ret = objectIntersect(tracer, r, stats);
+    float t;
+    int index;
+    if(particleIntersect(tracer, r, ret.t, false, t, index, stats))
+    {
+        ret.t = t;
+        ret.prim = particlePrimitive(scene, index);
+        ret.u = ret.v = 0.0f;
+    }
+
+    return ret;
+}
+
+// Closest hit of the primary ray through pixel (x, y). Only the planes and the objects
+// listed for the pixel's screen tile are tested, secondary rays use intersectTest.
+inline Hit screenTileIntersect(const Tracer& tracer, const Ray& r, int x, int y, TraceStats *stats = NULL)
+{
+    const Scene& scene = *tracer.scene;
+    const ScreenTiles& tiles = *tracer.screenTiles;
+    Hit ret;
+    ret.t = MAX_DEPTH;
+    ret.prim = -1;
+    ret.u = ret.v = 0.0f;
+
+    for(size_t i = 0; i < scene.planes.size(); i++)
+    {
+        Hit tmp = planeIntersect(scene.planes[i], (int)i, r);
+        if(tmp.t < ret.t)
+            ret = tmp;
+    }
+
+    int tile = x / tiles.tileSize + tiles.tilesX * (y / tiles.tileSize);
+    int first = tiles.tileStart[tile];
+    int last = tiles.tileStart[tile + 1];
+    int firstParticle = particlePrimitive(scene, 0);
+    int numPlanes = (int)scene.planes.size();
+    for(int k = first; k < last; k++)
+    {
+        int prim = tiles.prims[k];
+        float t = prim < firstParticle
+                ? sphereHitT(scene.spheres[prim - numPlanes].center, scene.spheres[prim - numPlanes].radius, r)
+                : sphereHitT(scene.particles[prim - firstParticle], scene.particleRadius, r);
+        if(t < ret.t)
+        {
+            ret.t = t;
+            ret.prim = prim;
+            ret.u = ret.v = 0.0f;
+        }
+    }
+    if(stats)
+        stats->intersections += scene.planes.size() + (last - first);
+    return ret;
+}
+
+// Expands a hit for shading: fetches the material from the table, works out the
+// normal and applies the checker pattern. Misses get the background color.
+inline ShadeRec surfaceAt(const Tracer& tracer, const Hit& hit, const Ray& r)
+{
+    const Scene& scene = *tracer.scene;
+    ShadeRec sr;
+    sr.t = hit.t;
+    if(hit.prim < 0)
+    {
+        sr.normal = Vec3(0, 0, 0);
+        sr.mat = makeMaterial(0, 0, 0, 0, 1, BACKGROUND_COLOR, 0);
+        return sr;
+    }
+
+    int material = materialIndex(scene, hit.prim);
+    sr.mat = scene.compact ? unpackMaterial(tracer.packedMaterials[material]) : tracer.materials[material];
+    int numPlanes = (int)scene.planes.size();
+    if(hit.prim < numPlanes)
+    {
+        const Plane& p = scene.planes[hit.prim];
+        sr.normal = p.normal;
+        if(p.checkered)
+        {
+            int x = (int)floorf(hit.u / 2);
+            int z = (int)floorf(hit.v / 2);
+
+            // x & 1 rather than x % 2, which is negative for negative x in C++
+            if((x & 1) == (z & 1))
+                sr.mat.color = Vec3(0, 0, 0);
+        }
+        return sr;
+    }
+
+    int firstParticle = particlePrimitive(scene, 0);
+    Vec3 center = hit.prim < firstParticle ? scene.spheres[hit.prim - numPlanes].center
+                : tracer.treelets ? streamParticleCenter(*tracer.treelets, hit.prim - firstParticle)
+                : scene.particles[hit.prim - firstParticle];
+    sr.normal = normalize(r.origin - center + r.direction * hit.t);
+    return sr;
+}
+
+inline bool shadowIntersectTest(const Tracer& tracer, const Ray& r, const Vec3& lightPos, TraceStats *stats = NULL)
+{
+    const Scene& scene = *tracer.scene;
+    float t_max = dot(lightPos - r.origin, r.direction);
+    if(stats)
+        stats->shadowRays++;
+    if(tracer.motion && stats)
+        stats->motionMask |= motionMask(*tracer.motion, r, t_max);
+
+    for(size_t i = 0; i < scene.planes.size(); i++)
+    {
+        if(stats)
+            stats->intersections++;
+        if(planeIntersect(scene.planes[i], (int)i, r).t < t_max)
+            return true;
+    }
+
+    for(size_t i = 0; i < scene.spheres.size(); i++)
+    {
+        if(stats)
+            stats->intersections++;
+        if(sphereHitT(scene.spheres[i].center, scene.spheres[i].radius, r) < t_max)
+            return true;
+    }
+
+    float t;
+    int index;
+    return particleIntersect(tracer, r, t_max, true, t, index, stats);
+}
+
+// shadowIntersectTest with the static objects looked up in tracer.shadows, the shadow
+// maps of light i, and only the dynamic spheres traced. normal is that of the surface
+// the shadow ray leaves.
+inline bool shadowMapTest(const Tracer& tracer, const Ray& r, size_t i, const Vec3& normal, const Vec3& lightPos,
+                          TraceStats *stats = NULL)
+{
+    const Scene& scene = *tracer.scene;
+    float t_max = dot(lightPos - r.origin, r.direction);
+    if(stats)
+        stats->shadowRays++;
+    if(tracer.motion && stats)
+        stats->motionMask |= motionMask(*tracer.motion, r, t_max);
+    if(shadowMapOccluded(*tracer.shadows, (int)i, r.origin, normal, t_max))
+        return true;
+
+    for(size_t k = 0; k < scene.spheres.size(); k++)
+    {
+        if(!scene.spheres[k].dynamic)
+            continue;
+        if(stats)
+            stats->intersections++;
+        if(sphereHitT(scene.spheres[k].center, scene.spheres[k].radius, r) < t_max)
+            return true;
+    }
+    return false;
+}
+
+// Light arriving from light i at a hit. As in basicFragSrc, every light is shadow
+// tested against and weighted by the first light.
+inline Vec3 lightContribution(const Tracer& tracer, const ShadeRec& sr, const Ray& r, size_t i, TraceStats *stats)
+{
+    const Scene& scene = *tracer.scene;
+    const Light& light1 = scene.lights[0];
+    Ray shadowRay;
+    shadowRay.origin = r.direction * sr.t + r.origin;
+    Vec3 lightDir = normalize(scene.lights[i].position - shadowRay.origin);
+    shadowRay.direction = lightDir;
+    bool blocked = tracer.shadows ? shadowMapTest(tracer, shadowRay, i, sr.normal, light1.position, stats)
+                                  : shadowIntersectTest(tracer, shadowRay, light1.position, stats);
+    if(blocked)
+        return Vec3(0, 0, 0);
+
+    Vec3 diffContrib = sr.mat.color * (sr.mat.kd / (float)PI);
+    Vec3 reflectDir = sr.normal * (2 * dot(lightDir, sr.normal)) - lightDir;
+    Vec3 specContrib = sr.mat.color * (sr.mat.ks * powf(std::max(dot(-r.direction, reflectDir), 0.0f), 5));
+    return mult(diffContrib + specContrib, light1.color * light1.intensity) * dot(sr.normal, lightDir);
+}
+
+// Calculates the direct illumination component of a ray-object intersection. ambient, if
+// given, replaces the ka term.
+inline Vec3 directIllum(const Tracer& tracer, const ShadeRec& sr, const Ray& r, TraceStats *stats = NULL,
+                        const Vec3 *ambient = NULL)
+{
+    const Scene& scene = *tracer.scene;
+    Vec3 L = ambient ? *ambient : sr.mat.color * sr.mat.ka;
+    for(size_t i = 0; i < scene.lights.size(); i++)
+        L += lightContribution(tracer, sr, r, i, stats);
+    return L;
+}
+
+// directIllum with a single shadow ray: u picks one light with probability proportional
+// to its intensity, and its light is divided by that probability
+inline Vec3 sampleDirectIllum(const Tracer& tracer, const ShadeRec& sr, const Ray& r, float u, TraceStats *stats = NULL,
+                              const Vec3 *ambient = NULL)
+{
+    const Scene& scene = *tracer.scene;
+    Vec3 L = ambient ? *ambient : sr.mat.color * sr.mat.ka;
+    float total = 0.0f;
+    for(size_t i = 0; i < scene.lights.size(); i++)
+        total += scene.lights[i].intensity;
+    if(total <= 0.0f)
+        return L;
+
+    float cdf = 0.0f;
+    for(size_t i = 0; i < scene.lights.size(); i++)
+    {
+        float p = scene.lights[i].intensity / total;
+        cdf += p;
+        if(p > 0.0f && (u < cdf || i + 1 == scene.lights.size()))
+            return L + lightContribution(tracer, sr, r, i, stats) / p;
+    }
+    return L;
+}
+
+// Tests for total internal reflection
+inline bool tir(const ShadeRec& sr, const Ray& r)
+{
+    float cos_thetai = dot(sr.normal, -r.direction);
+    float eta = sr.mat.ior;
+
+    if(cos_thetai < 0.0f)
+        eta = 1.0f / eta;
+
+    return (1.0f - (1.0f - cos_thetai * cos_thetai) / (eta * eta) < 0.0f);
+}
+
+// Returns the direction of a ray that crosses from one medium to another
+inline Vec3 calcRefractedDirection(const ShadeRec& sr, const Ray& r)
+{
+    Vec3 n = sr.normal;
+    float cos_thetai = dot(n, -r.direction);
+    float eta = sr.mat.ior;
+
+    if(cos_thetai < 0.0f)
+    {
+        cos_thetai = -cos_thetai;
+        n = -n;
+        eta = 1.0f / eta;
+    }
+
+    float temp = 1.0f - (1.0f - cos_thetai * cos_thetai) / (eta * eta);
+    float cos_theta2 = sqrtf(temp);
+    return r.direction / eta - n * (cos_theta2 - cos_thetai / eta);
+}
+
+// Fraction of light reflected at a dielectric boundary, 1 under total internal reflection
+inline float fresnel(const ShadeRec& sr, const Ray& r)
+{
+    float cos_thetai = dot(sr.normal, -normalize(r.direction));
+    float eta = sr.mat.ior;
+
+    if(cos_thetai < 0.0f)
+    {
+        cos_thetai = -cos_thetai;
+        eta = 1.0f / eta;
+    }
+
+    float temp = 1.0f - (1.0f - cos_thetai * cos_thetai) / (eta * eta);
+    if(temp < 0.0f)
+        return 1.0f;
+
+    float cos_thetat = sqrtf(temp);
+    float r_parallel = (eta * cos_thetai - cos_thetat) / (eta * cos_thetai + cos_thetat);
+    float r_perpendicular = (cos_thetai - eta * cos_thetat) / (cos_thetai + eta * cos_thetat);
+    return 0.5f * (r_parallel * r_parallel + r_perpendicular * r_perpendicular);
+}
+
+// Secondary rays of one pixel waiting to be traced. Rays that don't fit are dropped.
+// Bounded like the stack of basicFragSrc, so it lives on the tracing thread's stack and
+// the rays and their hits, which are passed by value, never touch the heap or an arena.
+struct RayStack
+{
+    Ray ray[RAY_STACK_SIZE];
+    Vec3 weight[RAY_STACK_SIZE];
+    int bounce[RAY_STACK_SIZE];
+    int size;
+    int peak;
+    int rayCount;            // Seeds Russian roulette
+    int x, y;
+};
+
+// Queues a secondary ray unless its weight is too low to matter
+inline void pushRay(const Scene& scene, RayStack& stack, const Ray& r, Vec3 weight, int bounce, TraceStats *stats)
+{
+    int statsBounce = std::min(bounce, MAX_STATS_BOUNCES - 1);
+    float maxWeight = std::max(weight[0], std::max(weight[1], weight[2]));
+    if(maxWeight < scene.throughputCutoff)
+    {
+        if(stats)
+            stats->culled[statsBounce]++;
+        return;
+    }
+    if(scene.rouletteDepth >= 0 && bounce >= scene.rouletteDepth)
+    {
+        float survive = std::min(std::max(maxWeight, 0.05f), 1.0f);
+        if(pixelRandom(stack.x, stack.y, stack.rayCount++) >= survive)
+        {
+            if(stats)
+                stats->roulette[statsBounce]++;
+            return;
+        }
+        weight /= survive;
+    }
+    if(stack.size == RAY_STACK_SIZE)
+    {
+        if(stats)
+            stats->overflow++;
+        return;
+    }
+
+    stack.ray[stack.size] = r;
+    stack.weight[stack.size] = weight;
+    stack.bounce[stack.size] = bounce;
+    stack.size++;
+    stack.peak = std::max(stack.peak, stack.size);
+}
+
+// Queues the rays leaving a hit: a reflection off reflective materials, and both
+// the Fresnel weighted reflection and the refraction off transmissive ones
+inline void pushSecondaryRays(const Scene& scene, RayStack& stack, const ShadeRec& sr, const Ray& r,
+                              const Vec3& weight, int bounce, TraceStats *stats)
+{
+    if(sr.mat.matType == 0 || bounce >= scene.maxBounce)
+        return;
+
+    Ray reflected;
+    reflected.origin = r.origin + r.direction * sr.t;
+    reflected.direction = sr.normal * (2 * dot(-r.direction, sr.normal)) + r.direction;
+    if(sr.mat.matType == 1)
+    {
+        pushRay(scene, stack, reflected, weight * sr.mat.ks, bounce, stats);
+        return;
+    }
+
+    float kr = fresnel(sr, r);
+    pushRay(scene, stack, reflected, weight * kr, bounce, stats);
+    if(!tir(sr, r))
+    {
+        Ray refracted;
+        refracted.origin = reflected.origin;
+        refracted.direction = calcRefractedDirection(sr, r);
+        pushRay(scene, stack, refracted, weight * ((1.0f - kr) * sr.mat.kt / (sr.mat.ior * sr.mat.ior)), bounce, stats);
+    }
+}
+
+// Adds the light arriving over the reflection and refraction rays of a hit to L. The rays
+// form a tree that is walked depth first with a fixed size stack. The pixel and its sample
+// index seed Russian roulette; stats, if given, counts the secondary rays.
+inline Vec3 traceBounces(const Tracer& tracer, const ShadeRec& sr, const Ray& r, Vec3 L, int x, int y, int sample,
+                         TraceStats *stats)
+{
+    const Scene& scene = *tracer.scene;
+    RayStack stack;
+    stack.size = stack.peak = 0;
+    stack.rayCount = sample << 16;
+    stack.x = x;
+    stack.y = y;
+
+    pushSecondaryRays(scene, stack, sr, r, Vec3(1, 1, 1), 0, stats);
+
+    while(stack.size > 0)
+    {
+        stack.size--;
+        const Ray secondary_ray = stack.ray[stack.size];
+        const Vec3 weight = stack.weight[stack.size];
+        const int bounce = stack.bounce[stack.size];
+
+        Hit hit = intersectTest(tracer, secondary_ray, stats);
+        if(stats)
+            stats->traced[std::min(bounce, MAX_STATS_BOUNCES - 1)]++;
+        if(tracer.motion && stats)
+            stats->motionMask |= motionMask(*tracer.motion, secondary_ray, hit.t);
+        if(hit.t < MAX_DEPTH)
+        {
+            ShadeRec secondary_sr = surfaceAt(tracer, hit, secondary_ray);
+            L += mult(weight, directIllum(tracer, secondary_sr, secondary_ray, stats));
+            pushSecondaryRays(scene, stack, secondary_sr, secondary_ray, weight, bounce + 1, stats);
+        }else
+            L += mult(weight, BACKGROUND_COLOR);
+    }
+
+    if(stats)
+        stats->peakStack[stack.peak]++;
+    return L;
+}
+
+// Irradiance gathered over the hemisphere above p in IRRADIANCE_THETA_STRATA x
+// IRRADIANCE_PHI_STRATA cosine weighted strata, one ray each jittered by seed, with one
+// diffuse bounce: the hits are lit by directIllum. The gradients are those of Ward and
+// Heckbert in the cosine weighted form, and the radius is the harmonic mean distance to
+// the hits, cut down where the translational gradient says the light changes faster.
+inline IrradianceRecord gatherIrradiance(const Tracer& tracer, const Vec3& p, const Vec3& n, uint32_t seed,
+                                         TraceStats *stats = NULL)
+{
+    const int M = IRRADIANCE_THETA_STRATA;
+    const int N = IRRADIANCE_PHI_STRATA;
+    Vec3 tu = normalize(cross(fabsf(n[0]) > 0.5f ? Vec3(0, 1, 0) : Vec3(1, 0, 0), n));
+    Vec3 tv = cross(n, tu);
+    Vec3 L[M][N];
+    float dist[M][N];
+    float invDistSum = 0.0f;
+
+    IrradianceRecord rec;
+    rec.position = p;
+    rec.normal = n;
+    for(int j = 0; j < M; j++)
+    {
+        for(int k = 0; k < N; k++)
+        {
+            uint32_t cell = (uint32_t)(j * N + k);
+            float s1 = hashInt(hashInt(seed) + 2 * cell) * (1.0f / 4294967296.0f);
+            float s2 = hashInt(hashInt(seed) + 2 * cell + 1) * (1.0f / 4294967296.0f);
+            float sinTheta = sqrtf((j + s1) / M);
+            float cosTheta = sqrtf(std::max(0.0f, 1.0f - sinTheta * sinTheta));
+            float phi = (float)(2 * PI) * (k + s2) / N;
+            Ray ray;
+            ray.origin = p;
+            ray.direction = tu * (cosf(phi) * sinTheta) + tv * (sinf(phi) * sinTheta) + n * cosTheta;
+            Hit hit = intersectTest(tracer, ray, stats);
+            L[j][k] = BACKGROUND_COLOR;
+            dist[j][k] = MAX_DEPTH;
+            if(hit.t < MAX_DEPTH)
+            {
+                L[j][k] = directIllum(tracer, surfaceAt(tracer, hit, ray), ray, stats);
+                dist[j][k] = hit.t;
+            }
+            invDistSum += 1.0f / dist[j][k];
+
+            // -tan(theta) L along the tangent a quarter turn from phi
+            Vec3 rotDir = tv * cosf(phi) - tu * sinf(phi);
+            float tanTheta = sinTheta / std::max(cosTheta, 1e-3f);
+            for(int c = 0; c < 3; c++)
+            {
+                rec.irradiance[c] += L[j][k][c];
+                rec.rotGradient[c] -= rotDir * (tanTheta * L[j][k][c]);
+            }
+        }
+    }
+    float scale = (float)PI / (M * N);
+    for(int c = 0; c < 3; c++)
+    {
+        rec.irradiance[c] *= scale;
+        rec.rotGradient[c] *= scale;
+    }
+
+    // Change of the light crossing the borders between neighboring strata as p moves
+    for(int k = 0; k < N; k++)
+    {
+        float phi = (float)(2 * PI) * k / N;
+        Vec3 uk = tu * cosf(phi) + tv * sinf(phi);
+        Vec3 vk = tv * cosf(phi) - tu * sinf(phi);
+        int prev = (k + N - 1) % N;
+        for(int j = 0; j < M; j++)
+        {
+            float cosLo = sqrtf(1.0f - (float)j / M);
+            float cosHi = sqrtf(1.0f - (float)(j + 1) / M);
+            float sinMid = sqrtf((j + 0.5f) / M);
+            float cosMid = sqrtf(1.0f - (j + 0.5f) / M);
+            float wPhi = cosMid * (cosLo - cosHi) / (sinMid * std::min(dist[j][k], dist[j][prev]));
+            float wTheta = 0.0f;
+            if(j > 0)
+                wTheta = (float)(2 * PI) / N * sqrtf((float)j / M) * (cosLo * cosLo) / std::min(dist[j][k], dist[j - 1][k]);
+            for(int c = 0; c < 3; c++)
+            {
+                rec.transGradient[c] += vk * (wPhi * (L[j][k][c] - L[j][prev][c]));
+                if(j > 0)
+                    rec.transGradient[c] += uk * (wTheta * (L[j][k][c] - L[j - 1][k][c]));
+            }
+        }
+    }
+
+    rec.radius = (M * N) / invDistSum;
+    Vec3 gradient = rec.transGradient[0] * 0.2126f + rec.transGradient[1] * 0.7152f + rec.transGradient[2] * 0.0722f;
+    float change = norm(gradient);
+    if(change > 0.0f)
+        rec.radius = std::min(rec.radius, luminance(rec.irradiance) / change);
+    return rec;
+}
+
+// Diffuse light reflected at a primary hit off the rest of the scene, from the cache. Hits
+// between the records of fillIrradianceCache, like those on the far side of a small sphere
+// from its nearest record, take the records within twice the tolerance before the light
+// gets gathered for the pixel alone.
+inline Vec3 indirectDiffuse(const Tracer& tracer, const ShadeRec& sr, const Ray& r, int x, int y, TraceStats *stats)
+{
+    const IrradianceCache& cache = *tracer.irradiance;
+    Vec3 p = r.origin + r.direction * sr.t;
+    Vec3 irradiance;
+    if(stats)
+        stats->irradianceLookups++;
+    if(!lookupIrradiance(cache, p, sr.normal, irradiance) &&
+       !lookupIrradiance(cache, p, sr.normal, irradiance, IRRADIANCE_RELAXED))
+    {
+        if(stats)
+            stats->irradianceMisses++;
+        irradiance = gatherIrradiance(tracer, p, sr.normal, (uint32_t)(x + IMAGE_WIDTH * y), stats).irradiance;
+    }
+    return mult(sr.mat.color, irradiance) * (sr.mat.kd / (float)PI);
+}
+
+// Direct light at the primary hit of a pixel sample, with one light picked by the
+// sampler if the scene asks for light sampling. With an irradiance cache, the light
+// off the other surfaces stands in for the ambient term of diffuse materials.
+inline Vec3 primaryDirectIllum(const Tracer& tracer, const ShadeRec& sr, const Ray& r, int x, int y, int sample,
+                               TraceStats *stats)
+{
+    const Scene& scene = *tracer.scene;
+    Vec3 ambient = sr.mat.color * sr.mat.ka;
+    if(tracer.irradiance && sr.mat.kd > 0.0f)
+        ambient = indirectDiffuse(tracer, sr, r, x, y, stats);
+    if(!scene.lightSampling)
+        return directIllum(tracer, sr, r, stats, &ambient);
+    float u = sampleComponent(scene.sampler, x, y, IMAGE_WIDTH, sample, SAMPLE_LIGHT, 0);
+    return sampleDirectIllum(tracer, sr, r, u, stats, &ambient);
+}
+
+// Calculates the color of a pixel sample given that the primary ray hits an object in the scene
+inline Vec3 shade(const Tracer& tracer, const ShadeRec& sr, const Ray& r, int x, int y, int sample, TraceStats *stats)
+{
+    return traceBounces(tracer, sr, r, primaryDirectIllum(tracer, sr, r, x, y, sample, stats), x, y, sample, stats);
+}
+
+// Joint bilateral upsampling of the bounce light at full resolution pixel (x, y) with
+// primary hit sr. The 2x2 low resolution samples around the pixel are weighted
+// bilinearly, and down across depth and normal edges like the a-trous filter. Samples
+// of another material type don't count. Returns false if no sample is usable.
+inline bool upsampleBounce(const BounceBuffer& bounces, int x, int y, const ShadeRec& sr, Vec3& light)
+{
+    float fx = (x + 0.5f) / bounces.factor - 0.5f;
+    float fy = (y + 0.5f) / bounces.factor - 0.5f;
+    int x0 = (int)floorf(fx);
+    int y0 = (int)floorf(fy);
+    float tx = fx - x0;
+    float ty = fy - y0;
+
+    Vec3 sum(0, 0, 0);
+    float wsum = 0.0f;
+    for(int j = 0; j < 2; j++)
+    {
+        int qy = std::max(0, std::min(y0 + j, bounces.height - 1));
+        for(int i = 0; i < 2; i++)
+        {
+            int qx = std::max(0, std::min(x0 + i, bounces.width - 1));
+            int q = qy * bounces.width + qx;
+            if(bounces.matType[q] != sr.mat.matType)
+                continue;
+
+            Vec3 dn = sr.normal - bounces.normal[q];
+            float dz = fabsf(sr.t - bounces.depth[q]) / std::max(sr.t, 1e-3f);
+            float e = dot(dn, dn) / (BOUNCE_SIGMA_NORMAL * BOUNCE_SIGMA_NORMAL) + dz / BOUNCE_SIGMA_DEPTH;
+            float w = (i ? tx : 1.0f - tx) * (j ? ty : 1.0f - ty) * expf(-e);
+            sum += bounces.light[q] * w;
+            wsum += w;
+        }
+    }
+    if(wsum < BOUNCE_MIN_WEIGHT)
+        return false;
+    light = sum / wsum;
+    return true;
+}
+
+// Construct ray with the position of the camera and a point on the viewplane.
+// u and v run from 0 to 1 across the image, gl_FragCoord.xy / vec2(1280, 960) in basicFragSrc.
+inline Ray primaryRay(float u, float v)
+{
+    Ray r;
+    r.origin = Vec3(0, 0, 2);
+    r.direction = Vec3(u / 0.75f - (0.5f / 0.75f), v - 0.5f, 1.0f) - r.origin;
+    return r;
+}
+
+// Whether the primary rays of a scene's pixels leave the pixel centers
+inline bool jitterPixels(const Scene& scene)
+{
+    return scene.samplesPerPixel > 1 || (scene.adaptiveThreshold > 0.0f && scene.maxSamples > 1);
+}
+
+// Primary ray of a pixel sample. Jittered samples spread over the pixel, and with a lens
+// the ray leaves from a point on the aperture toward the plane at focusDistance.
+inline Ray cameraRay(const Scene& scene, int x, int y, int width, int height, int sample, bool jitter)
+{
+    Vec2 p(0.5f, 0.5f);
+    if(jitter)
+        p = sample2D(scene.sampler, x, y, IMAGE_WIDTH, sample, SAMPLE_PIXEL);
+    Ray r = primaryRay((x + p[0]) / width, (y + p[1]) / height);
+    if(scene.lensRadius > 0.0f)
+    {
+        // The direction keeps its unit z, like the pinhole ray
+        Vec2 d = concentricDisk(sample2D(scene.sampler, x, y, IMAGE_WIDTH, sample, SAMPLE_LENS)) * scene.lensRadius;
+        Vec3 offset(d[0], d[1], 0.0f);
+        r.origin += offset;
+        r.direction -= offset / scene.focusDistance;
+    }
+    return r;
+}
+
+// Traces one sample of pixel (x, y). The primary hit goes to gbuffer if there is one.
+inline Vec3 traceSample(const Tracer& tracer, int x, int y, int width, int height, int sample, bool jitter,
+                        GBuffer *gbuffer, TraceStats *stats)
+{
+    const Scene& scene = *tracer.scene;
+    Ray r = cameraRay(scene, x, y, width, height, sample, jitter);
+
+    // Check if the ray hits any of the objects in the scene. Rasterized hits are those of
+    // the pixel center, tile lists those of the pinhole camera.
+    Hit hit;
+    if(tracer.primaryHits && !jitter && scene.lensRadius <= 0.0f)
+        hit = tracer.primaryHits->at(x, y);
+    else if(tracer.screenTiles && scene.lensRadius <= 0.0f)
+        hit = screenTileIntersect(tracer, r, x, y, stats);
+    else
+        hit = intersectTest(tracer, r, stats);
+    if(tracer.motion && stats)
+        stats->motionMask |= motionMask(*tracer.motion, r, hit.t);
+    ShadeRec sr = surfaceAt(tracer, hit, r);
+    if(gbuffer)
+        gbuffer->set(x, y, sr.normal, sr.t, sr.mat.color);
+
+    Vec3 bounce;
+    if(sr.t < MAX_DEPTH && tracer.bounces && (tracer.bounces->materialMask & (1 << sr.mat.matType))
+       && upsampleBounce(*tracer.bounces, x, y, sr, bounce))
+        return primaryDirectIllum(tracer, sr, r, x, y, sample, stats) + bounce;
+    if(sr.t < MAX_DEPTH)
+        return shade(tracer, sr, r, x, y, sample, stats);
+    if(stats)
+        stats->peakStack[0]++;
+    return BACKGROUND_COLOR;
+}
+
+// Averages the samples of pixel (x, y), a single one through its center unless the scene
+// asks for more. Under adaptive sampling the pixel takes batches of samplesPerPixel until
+// sampleErrorBelow or maxSamples stops it. The first primary hit goes to gbuffer, the work
+// done for the pixel to cost and the number of samples to samples, if there are ones.
+inline Vec3 tracePixel(const Tracer& tracer, int x, int y, int width, int height, GBuffer *gbuffer = NULL,
+                       TraceStats *stats = NULL, CostBuffer *cost = NULL, SampleMap *samples = NULL)
+{
+    TraceStats localStats;
+    if(cost && !stats)
+        stats = &localStats;
+    long long before[COST_METRICS];
+    if(cost)
+    {
+        before[COST_INTERSECTIONS] = stats->intersections;
+        before[COST_SHADOW_RAYS] = stats->shadowRays;
+        before[COST_BOUNCES] = stats->totalTraced();
+        before[COST_NODE_VISITS] = stats->nodeVisits;
+    }
+
+    const Scene& scene = *tracer.scene;
+    int batch = std::max(1, scene.samplesPerPixel);
+    bool adaptive = scene.adaptiveThreshold > 0.0f;
+    int maxSamples = adaptive ? std::max(batch, scene.maxSamples) : batch;
+    bool jitter = jitterPixels(scene);
+    Vec3 color(0, 0, 0);
+    SampleMoments moments;
+    int n = 0;
+    while(n < maxSamples)
+    {
+        for(int s = 0; s < batch && n < maxSamples; s++, n++)
+        {
+            Vec3 c = traceSample(tracer, x, y, width, height, n, jitter, n == 0 ? gbuffer : NULL, stats);
+            color += c;
+            if(adaptive)
+                addSample(moments, luminance(c));
+        }
+        if(!adaptive || sampleErrorBelow(moments, batch, scene.adaptiveThreshold))
+            break;
+    }
+    color = color / (float)n;
+    if(samples)
+        samples->at(x, y) = (float)n;
+
+    if(cost)
+    {
+        float *c = cost->at(x, y);
+        c[COST_INTERSECTIONS] = (float)(stats->intersections - before[COST_INTERSECTIONS]);
+        c[COST_SHADOW_RAYS] = (float)(stats->shadowRays - before[COST_SHADOW_RAYS]);
+        c[COST_BOUNCES] = (float)(stats->totalTraced() - before[COST_BOUNCES]);
+        c[COST_NODE_VISITS] = (float)(stats->nodeVisits - before[COST_NODE_VISITS]);
+    }
+    return color;
+}
+
+// Adds the counters a tile gathered on a worker to the frame's
+inline void addTileStats(TraceStats *stats, std::mutex& statsMutex, TraceStats& tileStats, long long allocationsBefore)
+{
+    tileStats.allocations = threadAllocCounters().allocations - allocationsBefore;
+    std::lock_guard<std::mutex> lock(statsMutex);
+    stats->add(tileStats);
+}
+
+// tracer.pool, or numThreads workers in local for the length of one render
+inline TilePool& renderPool(const Tracer& tracer, int numThreads, std::unique_ptr<TilePool>& local)
+{
+    return poolOrLocal(tracer.pool, numThreads, local);
+}
+
+// Primary hits through the pixel centers for ACCEL_STREAM. The particle tests of a tile go
+// through one streamIntersectBatch, so a treelet that misses in the cache is read once for
+// all of the tile's rays that reach it instead of once per ray.
+inline void streamPrimaryHits(const Tracer& tracer, HitBuffer& hits, int numThreads, TraceStats *stats = NULL)
+{
+    std::unique_ptr<TilePool> localPool;
+    TilePool& pool = renderPool(tracer, numThreads, localPool);
+    std::mutex statsMutex;
+    auto traceTile = [&](const ImageTile& tile)
+    {
+        // Sized once per worker, a tile only grows it past 32 treelets per ray
+        static thread_local std::vector<TreeletRay> queue;
+        if(queue.capacity() == 0)
+            queue.reserve(CPU_TILE_SIZE * CPU_TILE_SIZE * 32);
+        Ray rays[CPU_TILE_SIZE * CPU_TILE_SIZE];
+        float tHit[CPU_TILE_SIZE * CPU_TILE_SIZE];
+        int index[CPU_TILE_SIZE * CPU_TILE_SIZE];
+        TraceStats tileStats;
+        long long allocations = threadAllocCounters().allocations;
+        int count = 0;
+        for(int y = tile.y0; y < tile.y1; y++)
+        {
+            for(int x = tile.x0; x < tile.x1; x++, count++)
+            {
+                rays[count] = primaryRay((x + 0.5f) / hits.width, (y + 0.5f) / hits.height);
+                hits.at(x, y) = objectIntersect(tracer, rays[count], &tileStats);
+                tHit[count] = hits.at(x, y).t;
+                index[count] = -1;
+            }
+        }
+
+        TraversalCost cost;
+        streamIntersectBatch(*tracer.treelets, rays, count, tHit, index, queue, &cost);
+        tileStats.nodeVisits += cost.nodeVisits;
+        tileStats.intersections += cost.primitiveTests;
+        count = 0;
+        for(int y = tile.y0; y < tile.y1; y++)
+        {
+            for(int x = tile.x0; x < tile.x1; x++, count++)
+            {
+                if(index[count] < 0)
+                    continue;
+                Hit& hit = hits.at(x, y);
+                hit.t = tHit[count];
+                hit.prim = particlePrimitive(*tracer.scene, index[count]);
+                hit.u = hit.v = 0.0f;
+            }
+        }
+        if(stats)
+            addTileStats(stats, statsMutex, tileStats, allocations);
+    };
+    runTiles(pool, 0, 0, hits.width, hits.height, CPU_TILE_SIZE, traceTile, stats ? &stats->schedule : NULL);
+}
+
+// Renders the whole frame in CPU_TILE_SIZE tiles on the workers of tracer.pool, or on
+// numThreads workers started for this frame. Ray and hit records live on the stack of
+// each worker, so the tile loops themselves never touch the heap.
+inline void renderImage(const Tracer& tracer, Image& img, int numThreads, GBuffer *gbuffer = NULL, TraceStats *stats = NULL,
+                        CostBuffer *cost = NULL, SampleMap *samples = NULL)
+{
+    std::unique_ptr<TilePool> localPool;
+    TilePool& pool = renderPool(tracer, numThreads, localPool);
+    std::mutex statsMutex;
+    auto traceTile = [&](const ImageTile& tile)
+    {
+        TraceStats tileStats;
+        long long allocations = threadAllocCounters().allocations;
+        for(int y = tile.y0; y < tile.y1; y++)
+        {
+            for(int x = tile.x0; x < tile.x1; x++)
+                img.set(x, y, tracePixel(tracer, x, y, img.width, img.height, gbuffer, &tileStats, cost, samples));
+        }
+        if(stats)
+            addTileStats(stats, statsMutex, tileStats, allocations);
+    };
+    runTiles(pool, 0, 0, img.width, img.height, CPU_TILE_SIZE, traceTile, stats ? &stats->schedule : NULL);
+}
+
+// renderImage of frame of an animation that traces only the pixels the history cannot
+// answer, see temporal.h. tracer.motion must hold the moving spheres from frame on. The
+// traced pixels go to the history as well as to img, and gbuffer is the history's.
+inline void renderTemporal(const Tracer& tracer, TemporalHistory& history, int frame, Image& img, int numThreads,
+                           bool gbuffer, TraceStats *stats = NULL)
+{
+    if(history.radiance.width != img.width || history.radiance.height != img.height ||
+       (gbuffer && history.gbuffer.width != img.width))
+        resetTemporalHistory(history, img.width, img.height, gbuffer);
+    std::unique_ptr<TilePool> localPool;
+    TilePool& pool = renderPool(tracer, numThreads, localPool);
+    std::mutex statsMutex;
+    auto traceTile = [&](const ImageTile& tile)
+    {
+        TraceStats tileStats;
+        long long allocations = threadAllocCounters().allocations;
+        for(int y = tile.y0; y < tile.y1; y++)
+        {
+            for(int x = tile.x0; x < tile.x1; x++)
+            {
+                int p = y * img.width + x;
+                if(temporalPixelCurrent(history, p, frame))
+                {
+                    tileStats.pixelsReused++;
+                    continue;
+                }
+                tileStats.motionMask = 0;
+                history.radiance.set(x, y, tracePixel(tracer, x, y, img.width, img.height,
+                                                      gbuffer ? &history.gbuffer : NULL, &tileStats));
+                history.motion[p] = tileStats.motionMask;
+                history.frame[p] = frame;
+            }
+        }
+        if(stats)
+            addTileStats(stats, statsMutex, tileStats, allocations);
+    };
+    runTiles(pool, 0, 0, img.width, img.height, CPU_TILE_SIZE, traceTile, stats ? &stats->schedule : NULL);
+    history.valid = true;
+    img.data = history.radiance.data;
+}
+
+// Traces the low resolution bounce light. Every sample shoots its own primary ray through
+// the center of the full resolution pixels it covers.
+inline void renderBounces(const Tracer& tracer, BounceBuffer& bounces, int fullWidth, int fullHeight, int numThreads,
+                          TraceStats *stats = NULL)
+{
+    std::unique_ptr<TilePool> localPool;
+    TilePool& pool = renderPool(tracer, numThreads, localPool);
+    std::mutex statsMutex;
+    auto traceTile = [&](const ImageTile& tile)
+    {
+        TraceStats tileStats;
+        long long allocations = threadAllocCounters().allocations;
+        for(int y = tile.y0; y < tile.y1; y++)
+        {
+            for(int x = tile.x0; x < tile.x1; x++)
+            {
+                int i = y * bounces.width + x;
+                Ray r = primaryRay((x + 0.5f) * bounces.factor / fullWidth, (y + 0.5f) * bounces.factor / fullHeight);
+                ShadeRec sr = surfaceAt(tracer, intersectTest(tracer, r, &tileStats), r);
+                bounces.normal[i] = sr.normal;
+                bounces.depth[i] = sr.t;
+                bounces.matType[i] = -1;
+                bounces.light[i] = Vec3(0, 0, 0);
+                if(sr.t < MAX_DEPTH && (bounces.materialMask & (1 << sr.mat.matType)))
+                {
+                    bounces.matType[i] = sr.mat.matType;
+                    bounces.light[i] = traceBounces(tracer, sr, r, Vec3(0, 0, 0), x, y, 0, &tileStats);
+                }
+            }
+        }
+        if(stats)
+            addTileStats(stats, statsMutex, tileStats, allocations);
+    };
+    runTiles(pool, 0, 0, bounces.width, bounces.height, CPU_TILE_SIZE, traceTile, stats ? &stats->schedule : NULL);
+}
+
+// Distance along r to the first plane, static sphere or particle, MAX_DEPTH if none
+inline float staticIntersect(const Tracer& tracer, const Ray& r)
+{
+    const Scene& scene = *tracer.scene;
+    float tMin = MAX_DEPTH;
+    for(size_t i = 0; i < scene.planes.size(); i++)
+        tMin = std::min(tMin, planeIntersect(scene.planes[i], (int)i, r).t);
+    for(size_t i = 0; i < scene.spheres.size(); i++)
+    {
+        if(!scene.spheres[i].dynamic)
+            tMin = std::min(tMin, sphereHitT(scene.spheres[i].center, scene.spheres[i].radius, r));
+    }
+    float t;
+    int index;
+    if(particleIntersect(tracer, r, tMin, false, t, index))
+        tMin = t;
+    return tMin;
+}
+
+// Casts the shadow maps of the lights that moved since the maps were last cast, or of all
+// of them once a static object changed. The texels of each map are cast on the workers,
+// a map a (6 * size) x size image of its faces stacked.
+inline void updateShadowMaps(const Tracer& tracer, ShadowMaps& shadows, int numThreads)
+{
+    const Scene& scene = *tracer.scene;
+    if(shadowMapsCurrent(shadows, scene, shadows.stale))
+        return;
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    std::unique_ptr<TilePool> localPool;
+    TilePool& pool = renderPool(tracer, numThreads, localPool);
+    shadows.maps.resize(scene.lights.size());
+    for(size_t i = 0; i < scene.lights.size(); i++)
+    {
+        if(!shadows.stale[i])
+            continue;
+        ShadowCubeMap& map = shadows.maps[i];
+        map.light = scene.lights[i].position;
+        map.depth.resize(6 * shadows.size * shadows.size);
+        auto castTile = [&](const ImageTile& tile)
+        {
+            for(int y = tile.y0; y < tile.y1; y++)
+            {
+                int face = y / shadows.size;
+                int t = y % shadows.size;
+                for(int s = tile.x0; s < tile.x1; s++)
+                {
+                    Ray r;
+                    r.origin = map.light;
+                    r.direction = shadowTexelDirection(shadows, face, s, t);
+                    map.depth[y * shadows.size + s] = staticIntersect(tracer, r);
+                }
+            }
+        };
+        runTiles(pool, 0, 0, shadows.size, 6 * shadows.size, CPU_TILE_SIZE, castTile);
+        shadows.stats.builds++;
+    }
+    recordShadowMapScene(shadows, scene);
+    shadows.stats.buildMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+inline bool irradianceCandidateLess(const IrradianceCandidate& a, const IrradianceCandidate& b)
+{
+    return a.pixel < b.pixel;
+}
+
+// Adds records to the cache until the primary hits through the pixel centers are covered.
+// Each pass gathers at the hits on a grid of IRRADIANCE_STRIDES pixels that the records
+// so far miss, coarse to fine, so that records spread out where the light changes slowly.
+// The records of a pass go in in pixel order once it is done, so the cache does not depend
+// on the thread count. Records already in the cache are kept, see invalidateIrradiance.
+inline void fillIrradianceCache(const Tracer& tracer, IrradianceCache& cache, int width, int height, int numThreads,
+                                TraceStats *stats = NULL)
+{
+    std::unique_ptr<TilePool> localPool;
+    TilePool& pool = renderPool(tracer, numThreads, localPool);
+    const int numStrides = sizeof(IRRADIANCE_STRIDES) / sizeof(IRRADIANCE_STRIDES[0]);
+    int finest = IRRADIANCE_STRIDES[numStrides - 1];
+    std::vector<IrradianceCandidate>& candidates = cache.candidates;
+    reserveIrradiance(cache, 0, ((width + finest - 1) / finest) * ((height + finest - 1) / finest));
+    cache.stats.added = 0;
+    std::mutex mutex;
+    for(int pass = 0; pass < numStrides; pass++)
+    {
+        int stride = IRRADIANCE_STRIDES[pass];
+        candidates.clear();
+        auto fillTile = [&](const ImageTile& tile)
+        {
+            TraceStats tileStats;
+            long long allocations = threadAllocCounters().allocations;
+            for(int y = (tile.y0 + stride - 1) / stride * stride; y < tile.y1; y += stride)
+            {
+                for(int x = (tile.x0 + stride - 1) / stride * stride; x < tile.x1; x += stride)
+                {
+                    Ray r = primaryRay((x + 0.5f) / width, (y + 0.5f) / height);
+                    Hit hit = tracer.primaryHits ? tracer.primaryHits->at(x, y) : intersectTest(tracer, r, &tileStats);
+                    if(hit.t >= MAX_DEPTH)
+                        continue;
+                    ShadeRec sr = surfaceAt(tracer, hit, r);
+                    Vec3 p = r.origin + r.direction * sr.t;
+                    Vec3 irradiance;
+                    if(sr.mat.kd <= 0.0f || lookupIrradiance(cache, p, sr.normal, irradiance))
+                        continue;
+
+                    // The radius is bounded on screen, a pixel spans this much at the hit
+                    IrradianceCandidate candidate;
+                    candidate.pixel = y * width + x;
+                    candidate.record = gatherIrradiance(tracer, p, sr.normal, (uint32_t)(x + IMAGE_WIDTH * y), &tileStats);
+                    float pixel = sr.t * norm(r.direction) / height;
+                    float& radius = candidate.record.radius;
+                    radius = std::max(IRRADIANCE_MIN_PIXELS * pixel / cache.error,
+                                      std::min(radius, IRRADIANCE_MAX_PIXELS * pixel / cache.error));
+                    std::lock_guard<std::mutex> lock(mutex);
+                    candidates.push_back(candidate);
+                }
+            }
+            if(stats)
+                addTileStats(stats, mutex, tileStats, allocations);
+        };
+        runTiles(pool, 0, 0, width, height, CPU_TILE_SIZE, fillTile, stats ? &stats->schedule : NULL);
+
+        std::sort(candidates.begin(), candidates.end(), irradianceCandidateLess);
+        reserveIrradiance(cache, cache.records.size() + candidates.size());
+        for(size_t i = 0; i < candidates.size(); i++)
+            addIrradianceRecord(cache, candidates[i].record);
+        cache.stats.added += (long long)candidates.size();
+    }
+}
+
+// Renders the w x h tile at (x0, y0) of a width x height image into rgb,
+// packed row by row bottom to top like Image::data
+inline void renderTile(const Tracer& tracer, int x0, int y0, int w, int h, int width, int height, float *rgb, int numThreads)
+{
+    std::unique_ptr<TilePool> localPool;
+    TilePool& pool = renderPool(tracer, numThreads, localPool);
+    auto traceTile = [&](const ImageTile& tile)
+    {
+        for(int y = tile.y0; y < tile.y1; y++)
+        {
+            for(int x = tile.x0; x < tile.x1; x++)
+            {
+                Vec3 c = tracePixel(tracer, x, y, width, height);
+                float *p = rgb + 3 * ((y - y0) * w + x - x0);
+                p[0] = c[0];
+                p[1] = c[1];
+                p[2] = c[2];
+            }
+        }
+    };
+    runTiles(pool, x0, y0, w, h, CPU_TILE_SIZE, traceTile);
+}
+
+#endif
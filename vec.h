@@ -154,6 +154,16 @@ inline float dot(const Vec<n>& a, const Vec<n>& b)
 	return r;
 }
 
+// Component-wise product, like vec3 * vec3 in GLSL
+template<int n>
+inline Vec<n> mult(const Vec<n>& a, const Vec<n>& b)
+{
+	Vec<n> r;
+	for (int i = 0; i < n; i++)
+		r[i] = a[i] * b[i];
+	return r;
+}
+
 template<int n>
 inline float norm2(const Vec<n>& v)
 {